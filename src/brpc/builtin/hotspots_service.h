@@ -50,6 +50,11 @@ public:
                     ::brpc::HotspotsResponse* response,
                     ::google::protobuf::Closure* done);
 
+    void offcpu(::google::protobuf::RpcController* cntl_base,
+                const ::brpc::HotspotsRequest* request,
+                ::brpc::HotspotsResponse* response,
+                ::google::protobuf::Closure* done);
+
     void cpu_non_responsive(::google::protobuf::RpcController* cntl_base,
                             const ::brpc::HotspotsRequest* request,
                             ::brpc::HotspotsResponse* response,
@@ -70,6 +75,11 @@ public:
                                    ::brpc::HotspotsResponse* response,
                                    ::google::protobuf::Closure* done);
 
+    void offcpu_non_responsive(::google::protobuf::RpcController* cntl_base,
+                               const ::brpc::HotspotsRequest* request,
+                               ::brpc::HotspotsResponse* response,
+                               ::google::protobuf::Closure* done);
+
     void GetTabInfo(brpc::TabInfoList*) const;
 };
 
@@ -34,6 +34,7 @@
 #include "brpc/builtin/pprof_service.h"
 #include "brpc/builtin/common.h"
 #include "brpc/details/tcmalloc_extension.h"
+#include "brpc/details/continuous_profiler.h"
 #include "bthread/bthread.h"                // bthread_usleep
 #include "butil/fd_guard.h"
 
@@ -53,6 +54,8 @@ void ContentionProfilerStop();
 
 namespace brpc {
 
+DECLARE_int32(continuous_profiling_window_s);
+
 static int ReadSeconds(Controller* cntl) {
     int seconds = 0;
     const std::string* param =
@@ -136,7 +139,10 @@ void PProfService::profile(
         cntl->SetFailed(EPERM, "Fail to create directory=`%s'",dir.value().c_str());
         return;
     }
+    // Both use SIGPROF.
+    SuspendContinuousProfiler();
     if (!ProfilerStart(prof_name)) {
+        ResumeContinuousProfiler();
         cntl->SetFailed(EAGAIN, "Another profiler is running, try again later");
         return;
     }
@@ -144,6 +150,7 @@ void PProfService::profile(
         PLOG(WARNING) << "Profiling has been interrupted";
     }
     ProfilerStop();
+    ResumeContinuousProfiler();
 
     butil::fd_guard fd(open(prof_name, O_RDONLY));
     if (fd < 0) {
@@ -270,6 +277,31 @@ void PProfService::growth(
     cntl->response_attachment().append(obj);    
 }
 
+void PProfService::continuous(
+    ::google::protobuf::RpcController* controller_base,
+    const ::brpc::ProfileRequest* /*request*/,
+    ::brpc::ProfileResponse* /*response*/,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller* cntl = static_cast<Controller*>(controller_base);
+    cntl->http_response().set_content_type("text/plain");
+    int seconds = ReadSeconds(cntl);
+    if (cntl->Failed()) {
+        return;
+    }
+    if (seconds <= 0) {
+        seconds = FLAGS_continuous_profiling_window_s;
+    }
+    // Samples are already collected, not sleeping like profile().
+    std::string error;
+    if (DumpContinuousProfile(seconds, &cntl->response_attachment(),
+                              &error) != 0) {
+        cntl->SetFailed(ENOMETHOD, "%s", error.c_str());
+        return;
+    }
+    cntl->http_response().set_content_type("application/octet-stream");
+}
+
 typedef std::map<uintptr_t, std::string> SymbolMap;
 struct LibInfo {
     uintptr_t start_addr;
@@ -54,6 +54,11 @@ public:
                  const ::brpc::ProfileRequest* request,
                  ::brpc::ProfileResponse* response,
                  ::google::protobuf::Closure* done);
+
+    void continuous(::google::protobuf::RpcController* controller,
+                    const ::brpc::ProfileRequest* request,
+                    ::brpc::ProfileResponse* response,
+                    ::google::protobuf::Closure* done);
 };
 
 } // namespace brpc
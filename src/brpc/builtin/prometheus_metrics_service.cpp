@@ -16,14 +16,22 @@
 // under the License.
 
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <vector>
 #include <iomanip>
 #include <map>
+#include <limits>
+#include <google/protobuf/io/coded_stream.h>
 #include "brpc/controller.h"                // Controller
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/common.h"
+#include "butil/string_splitter.h"
+#include "butil/containers/flat_map.h"
+#include "butil/fast_rand.h"
+#include "butil/scoped_lock.h"
 #include "bvar/bvar.h"
 
 namespace bvar {
@@ -53,10 +61,18 @@ public:
     }
 
     bool dump(const std::string& name, const butil::StringPiece& desc) override;
+    bool dump_mvar(const std::string& name,
+                   const butil::StringPiece& labels,
+                   const butil::StringPiece& desc) override;
 
 private:
     DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
 
+    // Return true iff name ends with "_latency_histogram" which is output
+    // by LatencyRecorder using histograms.
+    bool DumpLatencyHistogram(const butil::StringPiece& name,
+                              const butil::StringPiece& desc);
+
     // Return true iff name ends with suffix output by LatencyRecorder.
     bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
                                    const butil::StringPiece& desc);
@@ -79,6 +95,9 @@ private:
     butil::IOBufBuilder* _os;
     const std::string _server_prefix;
     std::map<std::string, SummaryItems> _m;
+    // Name of last dumped multi-dimensional variable, values of a variable
+    // are dumped consecutively and share one HELP/TYPE header.
+    std::string _last_mvar_name;
 };
 
 bool PrometheusMetricsDumper::dump(const std::string& name,
@@ -87,6 +106,9 @@ bool PrometheusMetricsDumper::dump(const std::string& name,
         // there is no necessary to monitor string in prometheus
         return true;
     }
+    if (DumpLatencyHistogram(name, desc)) {
+        return true;
+    }
     if (DumpLatencyRecorderSuffix(name, desc)) {
         // Has encountered name with suffix exposed by LatencyRecorder,
         // Leave it to DumpLatencyRecorderSuffix to output Summary.
@@ -98,6 +120,21 @@ bool PrometheusMetricsDumper::dump(const std::string& name,
     return true;
 }
 
+bool PrometheusMetricsDumper::dump_mvar(const std::string& name,
+                                        const butil::StringPiece& labels,
+                                        const butil::StringPiece& desc) {
+    if (!desc.empty() && desc[0] == '"') {
+        return true;
+    }
+    if (name != _last_mvar_name) {
+        *_os << "# HELP " << name << '\n'
+             << "# TYPE " << name << " gauge" << '\n';
+        _last_mvar_name = name;
+    }
+    *_os << name << '{' << labels << "} " << desc << '\n';
+    return true;
+}
+
 const PrometheusMetricsDumper::SummaryItems*
 PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
                                                       const butil::StringPiece& desc) {
@@ -141,6 +178,52 @@ PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece&
     return NULL;
 }
 
+bool PrometheusMetricsDumper::DumpLatencyHistogram(
+    const butil::StringPiece& name,
+    const butil::StringPiece& desc) {
+    if (!name.ends_with("_latency_histogram")) {
+        return false;
+    }
+    // desc is "count=N sum=S upper_bound:count ..." where only non-empty
+    // buckets are listed. All buckets are output so that histograms from
+    // different instances have the same `le' and can be aggregated.
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    std::vector<uint64_t> counts(bvar::detail::HistogramBuckets::NUM_BUCKETS, 0);
+    for (butil::StringSplitter sp(desc.data(), desc.data() + desc.size(), ' ');
+         sp; ++sp) {
+        const butil::StringPiece item(sp.field(), sp.length());
+        if (item.starts_with("count=")) {
+            count = strtoull(item.data() + 6, NULL, 10);
+        } else if (item.starts_with("sum=")) {
+            sum = strtoull(item.data() + 4, NULL, 10);
+        } else {
+            char* endptr = NULL;
+            const uint64_t upper = strtoull(item.data(), &endptr, 10);
+            if (endptr == item.data() || *endptr != ':' ||
+                upper > std::numeric_limits<uint32_t>::max()) {
+                return false;
+            }
+            const size_t index =
+                bvar::detail::HistogramBuckets::index_of((uint32_t)upper);
+            counts[index] += strtoull(endptr + 1, NULL, 10);
+        }
+    }
+    *_os << "# HELP " << name << '\n'
+         << "# TYPE " << name << " histogram\n";
+    uint64_t accumulated = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        accumulated += counts[i];
+        *_os << name << "_bucket{le=\""
+             << bvar::detail::HistogramBuckets::upper_bound(i) << "\"} "
+             << accumulated << '\n';
+    }
+    *_os << name << "_bucket{le=\"+Inf\"} " << count << '\n'
+         << name << "_sum " << sum << '\n'
+         << name << "_count " << count << '\n';
+    return true;
+}
+
 bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
     const butil::StringPiece& name,
     const butil::StringPiece& desc) {
@@ -199,8 +282,184 @@ int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
     if (ndump < 0) {
         return -1;
     }
+    if (bvar::MVariable::dump_exposed(&dumper, NULL) < 0) {
+        return -1;
+    }
     os.move_to(*output);
     return 0;
 }
 
+// Last value of a variable and version of the scrape changing it.
+struct TrackedValue {
+    double value;
+    uint64_t version;     // 0 for new variables
+    uint64_t last_seen;
+};
+
+typedef butil::FlatMap<std::string, TrackedValue> TrackedValueMap;
+
+// Values of variables in last scrape. Scrapes are serialized.
+struct MetricsTracker {
+    pthread_mutex_t mutex;
+    // Tokens are `epoch << 32 | version', tokens from other processes
+    // (most likely) have different epochs and are treated as unknown.
+    uint64_t epoch;
+    uint64_t version;
+    TrackedValueMap values;
+
+    MetricsTracker() : epoch(0), version(0) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+};
+
+static pthread_once_t s_metrics_tracker_once = PTHREAD_ONCE_INIT;
+static MetricsTracker* s_metrics_tracker = NULL;
+
+static void InitMetricsTracker() {
+    s_metrics_tracker = new MetricsTracker;
+    s_metrics_tracker->epoch = (butil::fast_rand() & 0xFFFFFFFF) | 1;
+    CHECK_EQ(0, s_metrics_tracker->values.init(1024));
+}
+
+// Write numeric bvars as MetricFamily of prometheus protobuf format:
+//   message MetricFamily {
+//     optional string name = 1;
+//     optional MetricType type = 3;   // GAUGE = 1
+//     repeated Metric metric = 4;
+//   }
+//   message Metric { optional Gauge gauge = 2; }
+//   message Gauge { optional double value = 1; }
+// Each MetricFamily is prefixed with its length as varint.
+class PrometheusPbDumper : public bvar::NumericDumper {
+public:
+    PrometheusPbDumper(google::protobuf::io::CodedOutputStream* out,
+                       uint64_t since_version,
+                       MetricsTracker* tracker)
+        : _out(out)
+        , _since_version(since_version)
+        , _tracker(tracker)
+        , _nseen(0) {}
+
+    bool dump(const std::string& name, double value) override {
+        TrackedValue& t = _tracker->values[name];
+        if (t.version == 0 || t.value != value) {
+            t.value = value;
+            t.version = _tracker->version;
+        }
+        t.last_seen = _tracker->version;
+        ++_nseen;
+        if (t.version > _since_version) {
+            WriteGauge(name, value);
+        }
+        return true;
+    }
+
+    size_t nseen() const { return _nseen; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PrometheusPbDumper);
+
+    void WriteGauge(const std::string& name, double value) {
+        using google::protobuf::io::CodedOutputStream;
+        // tag + fixed64
+        const uint32_t gauge_size = 1 + 8;
+        // tag + length + gauge
+        const uint32_t metric_size = 1 + 1 + gauge_size;
+        const uint32_t family_size =
+            1 + CodedOutputStream::VarintSize32(name.size()) + name.size()
+            + 2                           // type
+            + 1 + 1 + metric_size;        // metric
+        _out->WriteVarint32(family_size);
+        _out->WriteTag(0x0a);             // name, length-delimited
+        _out->WriteVarint32(name.size());
+        _out->WriteString(name);
+        _out->WriteTag(0x18);             // type, varint
+        _out->WriteVarint32(1);           // GAUGE
+        _out->WriteTag(0x22);             // metric, length-delimited
+        _out->WriteVarint32(metric_size);
+        _out->WriteTag(0x12);             // gauge, length-delimited
+        _out->WriteVarint32(gauge_size);
+        _out->WriteTag(0x09);             // value, fixed64
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        _out->WriteLittleEndian64(bits);
+    }
+
+    google::protobuf::io::CodedOutputStream* _out;
+    const uint64_t _since_version;
+    MetricsTracker* _tracker;
+    size_t _nseen;
+};
+
+int DumpPrometheusMetricsPbToIOBuf(uint64_t since_token,
+                                   butil::IOBuf* output,
+                                   uint64_t* token) {
+    pthread_once(&s_metrics_tracker_once, InitMetricsTracker);
+    MetricsTracker* tracker = s_metrics_tracker;
+    BAIDU_SCOPED_LOCK(tracker->mutex);
+    uint64_t since_version = 0;
+    if ((since_token >> 32) == tracker->epoch &&
+        (since_token & 0xFFFFFFFF) <= tracker->version) {
+        since_version = (since_token & 0xFFFFFFFF);
+    }
+    ++tracker->version;
+    size_t nseen = 0;
+    {
+        butil::IOBufAsZeroCopyOutputStream zc_stream(output);
+        google::protobuf::io::CodedOutputStream coded_stream(&zc_stream);
+        PrometheusPbDumper dumper(&coded_stream, since_version, tracker);
+        if (bvar::Variable::dump_exposed_numeric(&dumper, NULL) < 0) {
+            return -1;
+        }
+        nseen = dumper.nseen();
+        if (coded_stream.HadError()) {
+            return -1;
+        }
+    }
+    if (tracker->values.size() > nseen) {
+        // Forget removed variables.
+        std::vector<std::string> removed;
+        for (TrackedValueMap::const_iterator it = tracker->values.begin();
+             it != tracker->values.end(); ++it) {
+            if (it->second.last_seen != tracker->version) {
+                removed.push_back(it->first);
+            }
+        }
+        for (size_t i = 0; i < removed.size(); ++i) {
+            tracker->values.erase(removed[i]);
+        }
+    }
+    if (token) {
+        *token = (tracker->epoch << 32) | tracker->version;
+    }
+    return 0;
+}
+
+void PrometheusMetricsPbService::default_method(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::MetricsRequest*,
+    ::brpc::MetricsResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    uint64_t since_token = 0;
+    const std::string* since =
+        cntl->http_request().uri().GetQuery("since");
+    if (since) {
+        since_token = strtoull(since->c_str(), NULL, 10);
+    }
+    uint64_t token = 0;
+    if (DumpPrometheusMetricsPbToIOBuf(
+            since_token, &cntl->response_attachment(), &token) != 0) {
+        cntl->SetFailed("Fail to dump metrics");
+        return;
+    }
+    cntl->http_response().set_content_type(
+        "application/vnd.google.protobuf; "
+        "proto=io.prometheus.client.MetricFamily; encoding=delimited");
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" PRIu64, token);
+    cntl->http_response().SetHeader("X-Metrics-Token", buf);
+}
+
 } // namespace brpc
@@ -33,6 +33,28 @@ public:
 
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output);
 
+// Serve numeric bvars in prometheus protobuf format(length-delimited
+// io.prometheus.client.MetricFamily) without formatting values into strings.
+// Scrapes are incremental: the response carries a token in header
+// "X-Metrics-Token", passing it back as query `since' returns only variables
+// whose values changed after that scrape. Removed variables are not reported
+// by incremental scrapes.
+class PrometheusMetricsPbService : public brpc_metrics_pb {
+public:
+    void default_method(::google::protobuf::RpcController* cntl_base,
+                        const ::brpc::MetricsRequest* request,
+                        ::brpc::MetricsResponse* response,
+                        ::google::protobuf::Closure* done) override;
+};
+
+// Dump numeric bvars changed after the scrape identified by `since_token'
+// into `output', all of them if `since_token' is 0 or unknown to this
+// process. Token of this scrape is put into `token'.
+// Returns 0 on success, -1 otherwise.
+int DumpPrometheusMetricsPbToIOBuf(uint64_t since_token,
+                                   butil::IOBuf* output,
+                                   uint64_t* token);
+
 } // namepace brpc
 
 #endif  // BRPC_PROMETHEUS_METRICS_SERVICE_H
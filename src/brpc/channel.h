@@ -147,6 +147,8 @@ private:
 class Channel : public ChannelBase {
 friend class Controller;
 friend class SelectiveChannel;
+friend class MemcacheClusterChannel;
+friend class RedisClusterChannel;
 public:
     Channel(ProfilerLinker = ProfilerLinker());
     ~Channel();
@@ -79,6 +79,10 @@ BAIDU_REGISTER_ERRNO(brpc::EITP, "Bad Itp response");
 
 DECLARE_bool(log_as_json);
 
+namespace bthread {
+DECLARE_bool(bthread_enable_cpu_accounting);
+}
+
 namespace brpc {
 
 DEFINE_bool(graceful_quit_on_sigterm, false,
@@ -247,6 +251,11 @@ void Controller::ResetPods() {
     _timeout_id = 0;
     _begin_time_us = 0;
     _end_time_us = 0;
+    _accounting_tid = INVALID_BTHREAD;
+    _begin_cpu_clock_ns = 0;
+    _begin_alloc_bytes = 0;
+    _cpu_time_ns = -1;
+    _alloc_bytes = -1;
     _tos = 0;
     _preferred_index = -1;
     _request_compress_type = COMPRESS_TYPE_NONE;
@@ -958,6 +967,55 @@ void Controller::SubmitSpan() {
     _span = NULL;
 }
 
+void Controller::BeginCpuAccounting() {
+    if (!bthread::FLAGS_bthread_enable_cpu_accounting) {
+        return;
+    }
+    const bthread_t tid = bthread_self();
+    if (tid != INVALID_BTHREAD &&
+        bthread_get_cpu_usage(&_begin_cpu_clock_ns, &_begin_alloc_bytes) == 0) {
+        _accounting_tid = tid;
+    }
+}
+
+void Controller::EndCpuAccounting() {
+    if (_accounting_tid == INVALID_BTHREAD || _cpu_time_ns >= 0) {
+        return;
+    }
+    int64_t cpu_clock_ns = 0;
+    int64_t alloc_bytes = 0;
+    if (_accounting_tid == bthread_self() &&
+        bthread_get_cpu_usage(&cpu_clock_ns, &alloc_bytes) == 0) {
+        _cpu_time_ns = cpu_clock_ns - _begin_cpu_clock_ns;
+        _alloc_bytes = alloc_bytes - _begin_alloc_bytes;
+    }
+    _accounting_tid = INVALID_BTHREAD;
+}
+
+int64_t Controller::cpu_time_ns() const {
+    if (_cpu_time_ns >= 0 || _accounting_tid == INVALID_BTHREAD ||
+        _accounting_tid != bthread_self()) {
+        return _cpu_time_ns;
+    }
+    int64_t cpu_clock_ns = 0;
+    if (bthread_get_cpu_usage(&cpu_clock_ns, NULL) != 0) {
+        return -1;
+    }
+    return cpu_clock_ns - _begin_cpu_clock_ns;
+}
+
+int64_t Controller::allocated_bytes() const {
+    if (_alloc_bytes >= 0 || _accounting_tid == INVALID_BTHREAD ||
+        _accounting_tid != bthread_self()) {
+        return _alloc_bytes;
+    }
+    int64_t alloc_bytes = 0;
+    if (bthread_get_cpu_usage(NULL, &alloc_bytes) != 0) {
+        return -1;
+    }
+    return alloc_bytes - _begin_alloc_bytes;
+}
+
 void Controller::HandleSendFailed() {
     if (!FailedInline()) {
         SetFailed("Must be SetFailed() before calling HandleSendFailed()");
@@ -1312,6 +1370,14 @@ void Controller::HandleStreamConnection(Socket *host_socket) {
         CHECK(!has_remote_stream());
         return;
     }
+    if (has_flag(FLAGS_GRPC_STREAMING)) {
+        // Connected when the request was sent, and may be closed already
+        // if the call does not have streaming responses.
+        if (FailedInline()) {
+            Stream::SetFailed(_request_stream);
+        }
+        return;
+    }
     SocketUniquePtr ptr;
     if (!FailedInline()) {
         if (Socket::Address(_request_stream, &ptr) != 0) {
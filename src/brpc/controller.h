@@ -113,6 +113,7 @@ friend class ParallelChannel;
 friend class ParallelChannelDone;
 friend class ControllerPrivateAccessor;
 friend class ServerPrivateAccessor;
+friend class ConcurrencyRemover;
 friend class SelectiveChannel;
 friend class ThriftStub;
 friend class schan::Sender;
@@ -143,6 +144,8 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_ENABLED_CIRCUIT_BREAKER = (1 << 17);
     static const uint32_t FLAGS_ALWAYS_PRINT_PRIMITIVE_FIELDS = (1 << 18);
     static const uint32_t FLAGS_HEALTH_CHECK_CALL = (1 << 19);
+    // The request stream is carried by the http2 stream of a gRPC call.
+    static const uint32_t FLAGS_GRPC_STREAMING = (1 << 20);
 
 public:
     struct Inheritable {
@@ -206,6 +209,17 @@ public:
         return _end_time_us - _begin_time_us;
     }
 
+    // [Server-side] CPU time in nanoseconds and bytes allocated(tcmalloc
+    // only) by the bthread processing this request, since the request was
+    // received until the response was sent, or until now if the response
+    // is not sent yet.
+    // Returns -1 when -bthread_enable_cpu_accounting was off at receiving,
+    // or the caller(or the response sender) is not the bthread which
+    // received the request, since costs of other bthreads can't be
+    // attributed to this RPC.
+    int64_t cpu_time_ns() const;
+    int64_t allocated_bytes() const;
+
     // Response of the RPC call (passed to CallMethod)
     google::protobuf::Message* response() const { return _response; }
 
@@ -677,6 +691,11 @@ private:
         _end_time_us = end_time_us;
     }
 
+    // Start/stop attributing CPU and allocations of current bthread to
+    // this RPC. Called at receiving request and sending response.
+    void BeginCpuAccounting();
+    void EndCpuAccounting();
+
     static void RunDoneInBackupThread(void*);
     void DoneInBackupThread();
 
@@ -744,6 +763,13 @@ private:
     // Begin/End time of a single RPC call (since Epoch in microseconds)
     int64_t _begin_time_us;
     int64_t _end_time_us;
+    // CPU clock and allocated bytes of _accounting_tid at receiving the
+    // request, and costs until the response was sent(-1 if unknown).
+    bthread_t _accounting_tid;
+    int64_t _begin_cpu_clock_ns;
+    int64_t _begin_alloc_bytes;
+    int64_t _cpu_time_ns;
+    int64_t _alloc_bytes;
     short _tos;    // Type of service.
     // The index of parse function which `InputMessenger' will use
     int _preferred_index;
@@ -0,0 +1,82 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_COROUTINE_H
+#define BRPC_COROUTINE_H
+
+#include "bthread/coroutine.h"
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+#include <google/protobuf/stubs/callback.h>     // google::protobuf::Closure
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+
+namespace brpc {
+
+// A `done' for asynchronous RPC which can be co_await-ed in a bthread::Task
+// to wait for the completion of the RPC without blocking the bthread.
+// Example:
+//   bthread::Task<void> call_echo(EchoService_Stub* stub) {
+//       brpc::Controller cntl;
+//       EchoRequest request;
+//       EchoResponse response;
+//       brpc::AwaitableDone done;
+//       stub->Echo(&cntl, &request, &response, &done);
+//       co_await done;
+//       if (cntl.Failed()) { ... }
+//   }
+// NOTE: The object is not deleted in Run(), it's usually on the coroutine
+// frame. Each object can only be awaited once.
+class AwaitableDone : public google::protobuf::Closure {
+public:
+    AwaitableDone() : _state(STATE_INIT) {}
+
+    void Run() override {
+        if (_state.exchange(STATE_RAN, butil::memory_order_acq_rel) ==
+            STATE_SUSPENDED) {
+            bthread::detail::resume_in_bthread(_handle);
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return _state.load(butil::memory_order_acquire) == STATE_RAN;
+    }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        _handle = h;
+        int expected = STATE_INIT;
+        // Fails if Run() was called after await_ready(), just continue.
+        return _state.compare_exchange_strong(
+            expected, STATE_SUSPENDED, butil::memory_order_acq_rel);
+    }
+    void await_resume() const noexcept {}
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AwaitableDone);
+
+    enum State { STATE_INIT, STATE_SUSPENDED, STATE_RAN };
+
+    butil::atomic<int> _state;
+    std::coroutine_handle<> _handle;
+};
+
+} // namespace brpc
+
+#endif  // BTHREAD_HAS_COROUTINE
+
+#endif  // BRPC_COROUTINE_H
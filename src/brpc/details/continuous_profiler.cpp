@@ -0,0 +1,630 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <signal.h>
+#include <sys/time.h>                        // setitimer
+#include <unistd.h>                          // readlink
+#include <dlfcn.h>                           // dladdr
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>                        // PRId64
+#include <limits.h>                          // PATH_MAX
+#include <string.h>
+#include <stdlib.h>                          // free
+#include <cxxabi.h>                          // __cxa_demangle
+#include <deque>
+#include <limits>
+#include <map>
+#include <set>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/build_config.h"              // OS_LINUX
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/synchronization/lock.h"
+#include "butil/time.h"
+#include "butil/third_party/symbolize/symbolize.h"
+#include "bthread/task_meta.h"               // LocalStorage
+#include "bthread/task_group.h"              // TaskGroup
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/continuous_profiler.h"
+#if defined(OS_LINUX)
+#include <ucontext.h>
+#endif
+
+namespace bthread {
+extern thread_local bthread::LocalStorage tls_bls;
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+}
+
+namespace brpc {
+
+static bool validate_enable_continuous_profiling(const char*, bool);
+static bool validate_continuous_profiling_hz(const char*, int32_t val) {
+    return val > 0 && val <= 1000;
+}
+
+DEFINE_bool(enable_continuous_profiling, false,
+            "Sample CPU of this process continuously at a low rate, "
+            "profiles are downloadable from /pprof/continuous");
+BRPC_VALIDATE_GFLAG(enable_continuous_profiling,
+                    validate_enable_continuous_profiling);
+DEFINE_int32(continuous_profiling_hz, 19,
+             "Samples per CPU second of the continuous profiler. A prime "
+             "number avoids sampling in lockstep with periodic tasks");
+BRPC_VALIDATE_GFLAG(continuous_profiling_hz, validate_continuous_profiling_hz);
+DEFINE_int32(continuous_profiling_window_s, 60,
+             "Samples of the continuous profiler are aggregated in windows "
+             "of so many seconds");
+BRPC_VALIDATE_GFLAG(continuous_profiling_window_s, PositiveInteger);
+DEFINE_int32(continuous_profiling_max_windows, 10,
+             "Max number of windows kept by the continuous profiler");
+BRPC_VALIDATE_GFLAG(continuous_profiling_max_windows, PositiveInteger);
+
+static const int MAX_STACK_DEPTH = 64;
+// Must be power of 2.
+static const size_t SAMPLE_RING_SIZE = 1024;
+static const int64_t COLLECT_INTERVAL_US = 100000;
+// Same limit as gperftools, a larger distance between adjacent frames
+// is treated as a corrupted frame pointer.
+static const uintptr_t MAX_FRAME_SIZE = 100000;
+
+// ---- Sampling ----
+
+enum CpuSampleState {
+    SAMPLE_EMPTY = 0,
+    SAMPLE_WRITING = 1,
+    SAMPLE_READY = 2,
+};
+
+// Written by the signal handler and consumed by the collecting thread.
+struct CpuSample {
+    butil::atomic<int> state;
+    int depth;
+    const char* label;
+    // Interrupted pc followed by return addresses minus 1.
+    void* pcs[MAX_STACK_DEPTH];
+};
+
+static CpuSample g_samples[SAMPLE_RING_SIZE];
+static butil::atomic<uint64_t> g_sample_index(0);
+static butil::atomic<int64_t> g_ndropped(0);
+static butil::atomic<bool> g_sampling(false);
+
+#if defined(OS_LINUX)
+// Walk the stack with frame pointers, which is async-signal-safe unlike
+// backtrace(). The frame pointer may hold arbitrary values if the
+// interrupted function does not maintain it, so only frames above the
+// stack pointer, below the top of the stack and close to each other are
+// followed.
+static bool InStack(const bthread::ContextualStack* stk, uintptr_t sp,
+                    uintptr_t* stack_top) {
+    if (stk == NULL || stk->storage.bottom == NULL) {
+        return false;
+    }
+    // Stacks grow downwards from `bottom'.
+    const uintptr_t top = (uintptr_t)stk->storage.bottom;
+    if (sp >= top || top - sp > (uintptr_t)stk->storage.stacksize) {
+        return false;
+    }
+    *stack_top = top;
+    return true;
+}
+
+// Find the highest address of the stack containing `sp', which is either
+// the stack of current bthread or the pthread stack of a bthread worker.
+// Other pthreads are unknown since pthread_getattr_np() is not
+// async-signal-safe.
+static bool GetStackTop(uintptr_t sp, uintptr_t* stack_top) {
+    const bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL) {
+        return false;
+    }
+    // Current task may be changed before jumping to its stack, check both.
+    const bthread::TaskMeta* m = g->current_task();
+    return (m != NULL && InStack(m->stack, sp, stack_top)) ||
+        InStack(g->main_stack(), sp, stack_top);
+}
+
+static int GetStackTrace(void* ucontext, void** pcs, int max_depth) {
+    const ucontext_t* uc = (const ucontext_t*)ucontext;
+#if defined(__x86_64__)
+    const uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+    const uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+    uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    const uintptr_t pc = uc->uc_mcontext.pc;
+    const uintptr_t sp = uc->uc_mcontext.sp;
+    uintptr_t fp = uc->uc_mcontext.regs[29];
+#else
+    return 0;
+#endif
+    int depth = 0;
+    pcs[depth++] = (void*)pc;
+    uintptr_t stack_top = 0;
+    if (!GetStackTop(sp, &stack_top)) {
+        return depth;
+    }
+    uintptr_t lower = sp;
+    while (depth < max_depth) {
+        if (fp < lower || fp - lower > MAX_FRAME_SIZE ||
+            fp > stack_top - 2 * sizeof(uintptr_t) ||
+            (fp & (sizeof(void*) - 1)) != 0) {
+            break;
+        }
+        const uintptr_t* frame = (const uintptr_t*)fp;
+        const uintptr_t ret = frame[1];
+        if (ret == 0) {
+            break;
+        }
+        // Subtract by one so that the address is inside the call
+        // instruction, the return address may be in the next function
+        // when the callee is noreturn.
+        pcs[depth++] = (void*)(ret - 1);
+        lower = fp + 1;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+static void ProfileSignalHandler(int, siginfo_t*, void* ucontext) {
+    if (!g_sampling.load(butil::memory_order_relaxed)) {
+        return;
+    }
+    const int saved_errno = errno;
+    const uint64_t index =
+        g_sample_index.fetch_add(1, butil::memory_order_relaxed);
+    CpuSample& s = g_samples[index & (SAMPLE_RING_SIZE - 1)];
+    int expected = SAMPLE_EMPTY;
+    if (s.state.compare_exchange_strong(expected, SAMPLE_WRITING,
+                                        butil::memory_order_acquire)) {
+        s.label = bthread::tls_bls.profiling_label;
+        s.depth = GetStackTrace(ucontext, s.pcs, MAX_STACK_DEPTH);
+        s.state.store(SAMPLE_READY, butil::memory_order_release);
+    } else {
+        // The collecting thread is too slow.
+        g_ndropped.fetch_add(1, butil::memory_order_relaxed);
+    }
+    errno = saved_errno;
+}
+#endif  // OS_LINUX
+
+// Protecting g_nsuspended and g_armed_hz.
+static butil::Mutex* g_timer_mutex = NULL;
+static int g_nsuspended = 0;
+// Frequency of the armed timer, 0 if the timer is not armed.
+static int g_armed_hz = 0;
+
+// Arm or disarm the timer according to the flags, g_timer_mutex must be
+// locked.
+static void UpdateTimer() {
+#if defined(OS_LINUX)
+    const int hz = (FLAGS_enable_continuous_profiling && g_nsuspended == 0)
+        ? FLAGS_continuous_profiling_hz : 0;
+    if (hz == g_armed_hz) {
+        return;
+    }
+    if (hz > 0 && g_armed_hz == 0) {
+        // Install the handler every time since it may be replaced by
+        // the gperftools cpu profiler during suspension.
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = ProfileSignalHandler;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) != 0) {
+            PLOG(ERROR) << "Fail to install handler of SIGPROF";
+            return;
+        }
+    }
+    const int64_t interval_us = (hz > 0 ? 1000000L / hz : 0);
+    itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000L;
+    timer.it_interval.tv_usec = interval_us % 1000000L;
+    timer.it_value = timer.it_interval;
+    // The handler is never uninstalled since SIGPROF may still be delivered
+    // after disarming, which terminates the process by default.
+    if (hz == 0) {
+        g_sampling.store(false, butil::memory_order_relaxed);
+    }
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        PLOG(ERROR) << "Fail to set ITIMER_PROF";
+        return;
+    }
+    if (hz > 0) {
+        g_sampling.store(true, butil::memory_order_relaxed);
+    }
+    g_armed_hz = hz;
+#endif  // OS_LINUX
+}
+
+void SuspendContinuousProfiler() {
+    if (g_timer_mutex == NULL) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(*g_timer_mutex);
+    ++g_nsuspended;
+    UpdateTimer();
+}
+
+void ResumeContinuousProfiler() {
+    if (g_timer_mutex == NULL) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(*g_timer_mutex);
+    if (g_nsuspended > 0) {
+        --g_nsuspended;
+    }
+    // The timer is armed again by the collecting thread.
+}
+
+// ---- Aggregating ----
+
+struct ProfileWindow {
+    ProfileWindow() : start_us(0), end_us(0), nsample(0), ndropped(0) {}
+
+    // Realtime of the beginning and the end, end_us is 0 for the window
+    // being filled.
+    int64_t start_us;
+    int64_t end_us;
+    int64_t nsample;
+    int64_t ndropped;
+    // Key is the label, a '\0' and the raw pcs.
+    std::map<std::string, int64_t> stacks;
+};
+
+// Protecting g_windows.
+static butil::Mutex* g_profile_mutex = NULL;
+static std::deque<ProfileWindow>* g_windows = NULL;
+static pthread_once_t g_collect_thread_once = PTHREAD_ONCE_INIT;
+static butil::atomic<bool> g_collect_started(false);
+
+// Move ready samples into the current window. g_profile_mutex must be locked.
+static void CollectSamples(int64_t now_us) {
+    const bool enabled = FLAGS_enable_continuous_profiling;
+    if (g_windows->empty() ||
+        (enabled && now_us - g_windows->back().start_us >=
+         FLAGS_continuous_profiling_window_s * 1000000L)) {
+        if (!g_windows->empty()) {
+            g_windows->back().end_us = now_us;
+        }
+        g_windows->push_back(ProfileWindow());
+        g_windows->back().start_us = now_us;
+        while (g_windows->size() >
+               (size_t)FLAGS_continuous_profiling_max_windows) {
+            g_windows->pop_front();
+        }
+    }
+    ProfileWindow& w = g_windows->back();
+    std::string key;
+    for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+        CpuSample& s = g_samples[i];
+        if (s.state.load(butil::memory_order_acquire) != SAMPLE_READY) {
+            continue;
+        }
+        key.clear();
+        if (s.label) {
+            key.append(s.label);
+        }
+        key.push_back('\0');
+        key.append((const char*)s.pcs, s.depth * sizeof(void*));
+        s.state.store(SAMPLE_EMPTY, butil::memory_order_release);
+        ++w.stacks[key];
+        ++w.nsample;
+    }
+    w.ndropped += g_ndropped.exchange(0, butil::memory_order_relaxed);
+}
+
+static void* CollectThread(void*) {
+    while (true) {
+        {
+            BAIDU_SCOPED_LOCK(*g_timer_mutex);
+            UpdateTimer();
+        }
+        {
+            BAIDU_SCOPED_LOCK(*g_profile_mutex);
+            CollectSamples(butil::gettimeofday_us());
+        }
+        usleep(COLLECT_INTERVAL_US);
+    }
+    return NULL;
+}
+
+static void StartCollectThread() {
+    g_timer_mutex = new butil::Mutex;
+    g_profile_mutex = new butil::Mutex;
+    g_windows = new std::deque<ProfileWindow>;
+    pthread_t th;
+    const int rc = pthread_create(&th, NULL, CollectThread, NULL);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create thread for continuous profiling, "
+                   << berror(rc);
+        return;
+    }
+    pthread_detach(th);
+    g_collect_started.store(true, butil::memory_order_release);
+}
+
+static bool validate_enable_continuous_profiling(const char*, bool val) {
+    if (val) {
+#if defined(OS_LINUX)
+        pthread_once(&g_collect_thread_once, StartCollectThread);
+#else
+        LOG(ERROR) << "Continuous profiling is only supported on linux";
+        return false;
+#endif
+    }
+    return true;
+}
+
+// ---- Labels ----
+
+const char* InternProfilingLabel(const butil::StringPiece& name) {
+    static butil::Mutex* s_mutex = new butil::Mutex;
+    static std::set<std::string>* s_labels = new std::set<std::string>;
+    BAIDU_SCOPED_LOCK(*s_mutex);
+    return s_labels->insert(name.as_string()).first->c_str();
+}
+
+void SetProfilingLabel(const char* label) {
+    bthread::tls_bls.profiling_label = label;
+}
+
+const char* GetProfilingLabel() {
+    return bthread::tls_bls.profiling_label;
+}
+
+// ---- pprof encoding ----
+// Field numbers are from github.com/google/pprof/blob/main/proto/profile.proto
+
+static void AppendVarint(std::string* out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out->push_back((char)v);
+}
+
+static void AppendVarint(std::string* out, int field, uint64_t v) {
+    AppendVarint(out, ((uint64_t)field << 3) | 0);
+    AppendVarint(out, v);
+}
+
+static void AppendBytes(std::string* out, int field, const std::string& s) {
+    AppendVarint(out, ((uint64_t)field << 3) | 2);
+    AppendVarint(out, s.size());
+    out->append(s);
+}
+
+static void AppendPacked(std::string* out, int field,
+                         const std::vector<uint64_t>& values) {
+    std::string packed;
+    for (size_t i = 0; i < values.size(); ++i) {
+        AppendVarint(&packed, values[i]);
+    }
+    AppendBytes(out, field, packed);
+}
+
+// dladdr() is tried first: it knows the load bias of PIE executables which
+// google::Symbolize gets wrong, but it only sees exported symbols. Static
+// functions fall back to Symbolize() which reads the full symbol table.
+static std::string SymbolizeAddress(uintptr_t pc) {
+    char buf[1024];
+    Dl_info info;
+    if (dladdr((void*)pc, &info) != 0 && info.dli_sname != NULL) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+        if (demangled != NULL) {
+            std::string name(demangled);
+            free(demangled);
+            return name;
+        }
+        return info.dli_sname;
+    }
+#if defined(USE_SYMBOLIZE)
+    if (google::Symbolize((void*)pc, buf, sizeof(buf))) {
+        return buf;
+    }
+#endif
+    snprintf(buf, sizeof(buf), "0x%lx", (unsigned long)pc);
+    return buf;
+}
+
+class PProfBuilder {
+public:
+    PProfBuilder() {
+        _strings.push_back(std::string());
+        _string_ids[std::string()] = 0;
+    }
+
+    int64_t StringId(const std::string& s) {
+        std::map<std::string, int64_t>::iterator it = _string_ids.find(s);
+        if (it != _string_ids.end()) {
+            return it->second;
+        }
+        const int64_t id = _strings.size();
+        _strings.push_back(s);
+        _string_ids[s] = id;
+        return id;
+    }
+
+    uint64_t FunctionId(const std::string& name) {
+        std::map<std::string, uint64_t>::iterator it = _function_ids.find(name);
+        if (it != _function_ids.end()) {
+            return it->second;
+        }
+        const uint64_t id = _function_ids.size() + 1;
+        _function_ids[name] = id;
+        // Function { id = 1; name = 2; system_name = 3; }
+        std::string fn;
+        AppendVarint(&fn, 1, id);
+        AppendVarint(&fn, 2, StringId(name));
+        AppendVarint(&fn, 3, StringId(name));
+        AppendBytes(&_body, 5, fn);
+        return id;
+    }
+
+    // `address' is 0 for the synthetic location of labels.
+    uint64_t LocationId(uintptr_t address, const std::string& name) {
+        const LocationKey key(address, address ? std::string() : name);
+        std::map<LocationKey, uint64_t>::iterator it = _location_ids.find(key);
+        if (it != _location_ids.end()) {
+            return it->second;
+        }
+        const uint64_t id = _location_ids.size() + 1;
+        _location_ids[key] = id;
+        const uint64_t fn_id =
+            FunctionId(address ? SymbolizeAddress(address) : name);
+        // Location { id = 1; mapping_id = 2; address = 3; Line line = 4; }
+        // Line { function_id = 1; }
+        std::string line;
+        AppendVarint(&line, 1, fn_id);
+        std::string loc;
+        AppendVarint(&loc, 1, id);
+        AppendVarint(&loc, 2, 1);
+        AppendVarint(&loc, 3, address);
+        AppendBytes(&loc, 4, line);
+        AppendBytes(&_body, 4, loc);
+        return id;
+    }
+
+    void AddSample(const std::string& label, const void* const* pcs,
+                   int depth, int64_t count, int64_t period_ns) {
+        std::vector<uint64_t> location_ids;
+        location_ids.reserve(depth + 1);
+        for (int i = 0; i < depth; ++i) {
+            location_ids.push_back(LocationId((uintptr_t)pcs[i], std::string()));
+        }
+        if (!label.empty()) {
+            // As the root frame so that flame graphs are grouped by labels.
+            location_ids.push_back(LocationId(0, "[method] " + label));
+        }
+        // Sample { location_id = 1; value = 2; Label label = 3; }
+        // Label { key = 1; str = 2; }
+        std::string sample;
+        AppendPacked(&sample, 1, location_ids);
+        std::vector<uint64_t> values;
+        values.push_back(count);
+        values.push_back(count * period_ns);
+        AppendPacked(&sample, 2, values);
+        if (!label.empty()) {
+            std::string l;
+            AppendVarint(&l, 1, StringId("method"));
+            AppendVarint(&l, 2, StringId(label));
+            AppendBytes(&sample, 3, l);
+        }
+        AppendBytes(&_body, 2, sample);
+    }
+
+    void Finish(int64_t start_us, int64_t duration_us, int64_t period_ns,
+                const std::string& comment, std::string* out) {
+        // ValueType { type = 1; unit = 2; }
+        std::string vt;
+        AppendVarint(&vt, 1, StringId("samples"));
+        AppendVarint(&vt, 2, StringId("count"));
+        AppendBytes(out, 1, vt);
+        vt.clear();
+        AppendVarint(&vt, 1, StringId("cpu"));
+        AppendVarint(&vt, 2, StringId("nanoseconds"));
+        AppendBytes(out, 1, vt);
+        // Mapping { id = 1; memory_limit = 3; filename = 5;
+        //           has_functions = 7; }
+        char path[PATH_MAX];
+        const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        std::string mapping;
+        AppendVarint(&mapping, 1, 1);
+        AppendVarint(&mapping, 3, std::numeric_limits<uint64_t>::max());
+        AppendVarint(&mapping, 5, StringId(
+                std::string(path, len > 0 ? len : 0)));
+        AppendVarint(&mapping, 7, 1);
+        AppendBytes(out, 3, mapping);
+        out->append(_body);
+        const int64_t comment_id = StringId(comment);
+        for (size_t i = 0; i < _strings.size(); ++i) {
+            AppendBytes(out, 6, _strings[i]);
+        }
+        AppendVarint(out, 9, start_us * 1000);
+        AppendVarint(out, 10, duration_us * 1000);
+        AppendBytes(out, 11, vt);
+        AppendVarint(out, 12, period_ns);
+        AppendVarint(out, 13, comment_id);
+    }
+
+private:
+    typedef std::pair<uintptr_t, std::string> LocationKey;
+    std::vector<std::string> _strings;
+    std::map<std::string, int64_t> _string_ids;
+    std::map<std::string, uint64_t> _function_ids;
+    std::map<LocationKey, uint64_t> _location_ids;
+    // Samples, locations and functions.
+    std::string _body;
+};
+
+int DumpContinuousProfile(int seconds, butil::IOBuf* out, std::string* error) {
+    if (!g_collect_started.load(butil::memory_order_acquire)) {
+        *error = "Continuous profiling is not enabled, turn on "
+            "-enable_continuous_profiling";
+        return -1;
+    }
+    std::map<std::string, int64_t> stacks;
+    int64_t start_us = 0;
+    int64_t nsample = 0;
+    int64_t ndropped = 0;
+    const int64_t now_us = butil::gettimeofday_us();
+    {
+        BAIDU_SCOPED_LOCK(*g_profile_mutex);
+        CollectSamples(now_us);
+        const int64_t begin_us = now_us - seconds * 1000000L;
+        for (std::deque<ProfileWindow>::reverse_iterator
+                 it = g_windows->rbegin(); it != g_windows->rend(); ++it) {
+            if (it->end_us != 0 && it->end_us <= begin_us) {
+                break;
+            }
+            for (std::map<std::string, int64_t>::const_iterator
+                     sit = it->stacks.begin(); sit != it->stacks.end(); ++sit) {
+                stacks[sit->first] += sit->second;
+            }
+            start_us = it->start_us;
+            nsample += it->nsample;
+            ndropped += it->ndropped;
+        }
+    }
+    // Symbolize out of the lock.
+    const int64_t period_ns = 1000000000L / FLAGS_continuous_profiling_hz;
+    PProfBuilder builder;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = stacks.begin(); it != stacks.end(); ++it) {
+        const std::string& key = it->first;
+        const size_t label_len = strlen(key.c_str());
+        const int depth = (key.size() - label_len - 1) / sizeof(void*);
+        void* pcs[MAX_STACK_DEPTH];
+        memcpy(pcs, key.data() + label_len + 1, depth * sizeof(void*));
+        builder.AddSample(std::string(key.data(), label_len), pcs, depth,
+                          it->second, period_ns);
+    }
+    std::string buf;
+    builder.Finish(start_us, now_us - start_us, period_ns,
+                   butil::string_printf("%" PRId64 " samples, %" PRId64
+                                        " dropped", nsample, ndropped),
+                   &buf);
+    out->append(buf);
+    return 0;
+}
+
+} // namespace brpc
@@ -0,0 +1,55 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_CONTINUOUS_PROFILER_H
+#define BRPC_CONTINUOUS_PROFILER_H
+
+#include <string>
+#include "butil/iobuf.h"
+#include "butil/strings/string_piece.h"
+
+namespace brpc {
+
+// When -enable_continuous_profiling is on, CPU of the process is sampled by
+// SIGPROF at -continuous_profiling_hz. Stacks are walked with frame pointers
+// in the signal handler and aggregated by a background thread into windows
+// of -continuous_profiling_window_s seconds, recent windows are kept in
+// memory. Addresses are symbolized only when a profile is dumped.
+// Samples are tagged with the profiling label of the running bthread, which
+// is the method being processed for RPCs of protobuf services.
+
+// Put samples in the last `seconds' seconds into `out' as a pprof protobuf
+// (github.com/google/pprof/blob/main/proto/profile.proto, uncompressed).
+// Returns 0 on success, -1 otherwise and `error' is set.
+int DumpContinuousProfile(int seconds, butil::IOBuf* out, std::string* error);
+
+// Stop sampling temporarily, e.g. when the gperftools cpu profiler which
+// also uses SIGPROF is running. Calls can be nested.
+void SuspendContinuousProfiler();
+void ResumeContinuousProfiler();
+
+// Get a copy of `name' which is never freed, used as the profiling label.
+const char* InternProfilingLabel(const butil::StringPiece& name);
+
+// Set the profiling label of the calling bthread(or pthread), NULL to clear.
+// `label' is not copied, use a string returned by InternProfilingLabel().
+void SetProfilingLabel(const char* label);
+const char* GetProfilingLabel();
+
+} // namespace brpc
+
+#endif // BRPC_CONTINUOUS_PROFILER_H
@@ -116,6 +116,9 @@ public:
     }
 
     StreamId request_stream() { return _cntl->_request_stream; }
+    void set_grpc_streaming() {
+        _cntl->add_flag(Controller::FLAGS_GRPC_STREAMING);
+    }
     StreamId response_stream() { return _cntl->_response_stream; }
 
     void set_method(const google::protobuf::MethodDescriptor* method) 
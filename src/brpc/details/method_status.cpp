@@ -37,10 +37,13 @@ static int cast_cl(void* arg) {
 }
 
 MethodStatus::MethodStatus()
-    : _nconcurrency(0)
+    : _profiling_label(NULL)
+    , _nconcurrency(0)
     , _nconcurrency_bvar(cast_int, &_nconcurrency)
     , _eps_bvar(&_nerror_bvar)
     , _max_concurrency_bvar(cast_cl, &_cl)
+    , _cpu_time_us_second(&_cpu_time_us)
+    , _alloc_bytes_second(&_alloc_bytes)
 {
 }
 
@@ -60,6 +63,18 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
     if (_latency_rec.expose(prefix) != 0) {
         return -1;
     }
+    if (_cpu_time_us.expose_as(prefix, "cpu_time_us") != 0) {
+        return -1;
+    }
+    if (_cpu_time_us_second.expose_as(prefix, "cpu_time_us_second") != 0) {
+        return -1;
+    }
+    if (_alloc_bytes.expose_as(prefix, "alloc_bytes") != 0) {
+        return -1;
+    }
+    if (_alloc_bytes_second.expose_as(prefix, "alloc_bytes_second") != 0) {
+        return -1;
+    }
     if (_cl) {
         if (_max_concurrency_bvar.expose_as(prefix, "max_concurrency") != 0) {
             return -1;
@@ -143,6 +158,16 @@ void MethodStatus::Describe(
         OutputValue(os, "max_concurrency: ", _max_concurrency_bvar.name(),
                     MaxConcurrency(), options, false);
     }
+
+    // Costs, only shown when -bthread_enable_cpu_accounting was ever on.
+    if (_cpu_time_us.get_value() != 0) {
+        OutputValue(os, "cpu_time_us_second: ", _cpu_time_us_second.name(),
+                    _cpu_time_us_second.get_value(1), options, false);
+    }
+    if (_alloc_bytes.get_value() != 0) {
+        OutputValue(os, "alloc_bytes_second: ", _alloc_bytes_second.name(),
+                    _alloc_bytes_second.get_value(1), options, false);
+    }
 }
 
 void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
@@ -152,6 +177,14 @@ void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
 ConcurrencyRemover::~ConcurrencyRemover() {
     if (_status) {
         _status->OnResponded(_c->ErrorCode(), butil::cpuwide_time_us() - _received_us);
+        if (_status->_profiling_label &&
+            GetProfilingLabel() == _status->_profiling_label) {
+            SetProfilingLabel(NULL);
+        }
+        _c->EndCpuAccounting();
+        if (_c->_cpu_time_ns >= 0) {
+            _status->OnCpuAccounted(_c->_cpu_time_ns, _c->_alloc_bytes);
+        }
         _status = NULL;
     }
     ServerPrivateAccessor(_c->server()).RemoveConcurrency(_c);
@@ -23,6 +23,7 @@
 #include "bvar/bvar.h"                    // vars
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
+#include "brpc/details/continuous_profiler.h"
 
 
 namespace brpc {
@@ -48,6 +49,10 @@ public:
     // did the time keeping and the cost is better saved. 
     void OnResponded(int error_code, int64_t latency_us);
 
+    // Call this with CPU time and allocated bytes of a finished call, which
+    // are measured when -bthread_enable_cpu_accounting is on.
+    void OnCpuAccounted(int64_t cpu_time_ns, int64_t alloc_bytes);
+
     // Expose internal vars.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
@@ -60,12 +65,20 @@ public:
 
 private:
 friend class Server;
+friend class ConcurrencyRemover;
     DISALLOW_COPY_AND_ASSIGN(MethodStatus);
 
     // Note: SetConcurrencyLimiter() is not thread safe and can only be called 
     // before the server is started. 
     void SetConcurrencyLimiter(ConcurrencyLimiter* cl);
 
+    // Called before the server is started as well.
+    void InitProfilingLabel(const butil::StringPiece& label) {
+        _profiling_label = InternProfilingLabel(label);
+    }
+
+    // Attached to the processing bthread for the continuous profiler.
+    const char* _profiling_label;
     std::unique_ptr<ConcurrencyLimiter> _cl;
     butil::atomic<int> _nconcurrency;
     bvar::Adder<int64_t>  _nerror_bvar;
@@ -73,6 +86,10 @@ friend class Server;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
     bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    bvar::Adder<int64_t> _cpu_time_us;
+    bvar::PerSecond<bvar::Adder<int64_t>> _cpu_time_us_second;
+    bvar::Adder<int64_t> _alloc_bytes;
+    bvar::PerSecond<bvar::Adder<int64_t>> _alloc_bytes_second;
 };
 
 class ConcurrencyRemover {
@@ -92,6 +109,9 @@ private:
 inline bool MethodStatus::OnRequested(int* rejected_cc) {
     const int cc = _nconcurrency.fetch_add(1, butil::memory_order_relaxed) + 1;
     if (NULL == _cl || _cl->OnRequested(cc)) {
+        if (_profiling_label) {
+            SetProfilingLabel(_profiling_label);
+        }
         return true;
     } 
     if (rejected_cc) {
@@ -112,6 +132,14 @@ inline void MethodStatus::OnResponded(int error_code, int64_t latency) {
     }
 }
 
+inline void MethodStatus::OnCpuAccounted(int64_t cpu_time_ns,
+                                         int64_t alloc_bytes) {
+    _cpu_time_us << cpu_time_ns / 1000;
+    if (alloc_bytes > 0) {
+        _alloc_bytes << alloc_bytes;
+    }
+}
+
 } // namespace brpc
 
 #endif  //BRPC_METHOD_STATUS_H
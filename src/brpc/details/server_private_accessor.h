@@ -42,6 +42,8 @@ public:
 
     // Returns true if the `max_concurrency' limit is not reached.
     bool AddConcurrency(Controller* c) {
+        // Called at the beginning of processing in all protocols.
+        c->BeginCpuAccounting();
         if (_server->options().max_concurrency <= 0) {
             return true;
         }
@@ -41,6 +41,7 @@ namespace brpc {
 //   // 2 GET and 1 SET are sent to the server together.
 //   channel.CallMethod(&controller, &request, &response, NULL/*done*/);
 class MemcacheRequest : public ::google::protobuf::Message {
+friend class MemcacheClusterCall;
 public:
     MemcacheRequest();
     virtual ~MemcacheRequest();
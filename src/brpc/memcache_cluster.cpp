@@ -0,0 +1,455 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <map>
+#include <memory>
+#include "butil/string_printf.h"
+#include "butil/sys_byteorder.h"
+#include "butil/time.h"
+#include "bthread/countdown_event.h"
+#include "bthread/unstable.h"
+#include "brpc/log.h"
+#include "brpc/socket.h"
+#include "brpc/load_balancer.h"
+#include "brpc/memcache.h"
+#include "brpc/memcache_cluster.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/policy/memcache_binary_header.h"
+
+namespace brpc {
+
+class MemcacheClusterCall {
+public:
+    MemcacheClusterCall(MemcacheClusterChannel* channel, Controller* cntl,
+                        MemcacheResponse* response,
+                        google::protobuf::Closure* done)
+        : _channel(channel)
+        , _cntl(cntl)
+        , _response(response)
+        , _done(done)
+        , _nunresolved(0)
+        , _finished(false)
+        , _nref(1)
+        , _has_backup_timer(false)
+        , _failed(false)
+        , _error_code(0) {}
+
+    // Group operations in `request' by servers. Returns false on error.
+    bool Init(const MemcacheRequest& request);
+
+    void set_done(google::protobuf::Closure* done) { _done = done; }
+
+    // Send operations to each server in one sub call.
+    void Issue();
+
+private:
+    struct Operation {
+        // Hash of the key.
+        uint32_t code;
+        // The operation if it's a GET, which may be sent again as a backup
+        // request. Empty otherwise.
+        butil::IOBuf get;
+        // Number of unfinished sub calls containing the operation.
+        int nflight;
+        // Set when the result is filled or all sub calls failed.
+        bool resolved;
+        butil::IOBuf result;
+    };
+
+    struct SubCall {
+        MemcacheClusterCall* call;
+        // Indexes of operations in the request.
+        std::vector<size_t> ops;
+        Controller cntl;
+        MemcacheRequest request;
+        MemcacheResponse response;
+    };
+
+    // Create a sub call to the server owning keys hashed to `code'.
+    SubCall* NewSubCall(uint32_t code);
+    void IssueSubCalls(const std::vector<SubCall*>& list);
+    static void OnSubCallDone(SubCall* sc);
+    static void OnBackupTimer(void* arg);
+    static void* IssueBackupRequests(void* arg);
+    void Finish();
+    void Release();
+
+    MemcacheClusterChannel* _channel;
+    Controller* _cntl;
+    MemcacheResponse* _response;
+    google::protobuf::Closure* _done;
+    std::vector<Operation> _ops;
+    // Fields below are guarded by _mutex after Issue().
+    std::vector<std::unique_ptr<SubCall> > _calls;
+    int _nunresolved;
+    bool _finished;
+    // References held by Issue(), unfinished sub calls and the backup timer.
+    // Sub calls may still be running after done is run, e.g. a slow sub
+    // call whose GETs are answered by backup requests.
+    butil::atomic<int> _nref;
+    bool _has_backup_timer;
+    bthread_timer_t _backup_timer;
+    butil::Mutex _mutex;
+    bool _failed;
+    int _error_code;
+    std::string _error_text;
+};
+
+MemcacheClusterCall::SubCall* MemcacheClusterCall::NewSubCall(uint32_t code) {
+    SubCall* sc = new SubCall;
+    _calls.push_back(std::unique_ptr<SubCall>(sc));
+    sc->call = this;
+    // Route the sub call to the server by hash of its first key.
+    sc->cntl.set_request_code(code);
+    if (_cntl->timeout_ms() != UNSET_MAGIC_NUM) {
+        sc->cntl.set_timeout_ms(_cntl->timeout_ms());
+    }
+    if (_cntl->max_retry() != UNSET_MAGIC_NUM) {
+        sc->cntl.set_max_retry(_cntl->max_retry());
+    }
+    sc->cntl.set_log_id(_cntl->log_id());
+    return sc;
+}
+
+bool MemcacheClusterCall::Init(const MemcacheRequest& request) {
+    butil::IOBuf buf = request.raw_buffer();
+    std::map<SocketId, SubCall*> calls;
+    _ops.resize(request.pipelined_count());
+    for (size_t i = 0; !buf.empty(); ++i) {
+        char aux_buf[sizeof(policy::MemcacheRequestHeader)];
+        const policy::MemcacheRequestHeader* header =
+            (const policy::MemcacheRequestHeader*)buf.fetch(aux_buf, sizeof(aux_buf));
+        if (header == NULL || i >= _ops.size()) {
+            _cntl->SetFailed(EREQUEST, "Incomplete operation[%d]", (int)i);
+            return false;
+        }
+        const uint16_t key_length = butil::NetToHost16(header->key_length);
+        const uint32_t total_body_length =
+            butil::NetToHost32(header->total_body_length);
+        const uint8_t command = header->command;
+        const uint8_t extras_length = header->extras_length;
+        const size_t op_size = sizeof(*header) + total_body_length;
+        if (buf.size() < op_size ||
+            total_body_length < (uint32_t)extras_length + key_length) {
+            _cntl->SetFailed(EREQUEST, "Incomplete operation[%d]", (int)i);
+            return false;
+        }
+        if (key_length == 0) {
+            _cntl->SetFailed(EREQUEST, "Operation[%d] without key is not "
+                             "supported by MemcacheClusterChannel", (int)i);
+            return false;
+        }
+        butil::IOBuf op;
+        buf.cutn(&op, op_size);
+        std::string key;
+        op.copy_to(&key, key_length, sizeof(*header) + extras_length);
+
+        const uint32_t code = _channel->HashKey(key);
+        SocketId server_id = INVALID_SOCKET_ID;
+        const int rc = _channel->SelectServer(code, &server_id);
+        if (rc != 0) {
+            _cntl->SetFailed(rc, "Fail to select server for operation[%d]", (int)i);
+            return false;
+        }
+        SubCall*& sc = calls[server_id];
+        if (sc == NULL) {
+            sc = NewSubCall(code);
+        }
+        Operation& o = _ops[i];
+        o.code = code;
+        if (command == policy::MC_BINARY_GET) {
+            o.get = op;
+        }
+        o.nflight = 1;
+        o.resolved = false;
+        sc->request._buf.append(butil::IOBuf::Movable(op));
+        ++sc->request._pipelined_count;
+        sc->ops.push_back(i);
+    }
+    return true;
+}
+
+void MemcacheClusterCall::Issue() {
+    const int32_t backup_request_ms =
+        (_cntl->backup_request_ms() != UNSET_MAGIC_NUM ?
+         _cntl->backup_request_ms() : _channel->_backup_request_ms);
+    _nunresolved = _ops.size();
+    // Take out sub calls since backup requests may be added into _calls
+    // concurrently.
+    std::vector<SubCall*> list(_calls.size());
+    for (size_t i = 0; i < _calls.size(); ++i) {
+        list[i] = _calls[i].get();
+    }
+    _nref.fetch_add(list.size(), butil::memory_order_relaxed);
+    if (backup_request_ms >= 0) {
+        for (size_t i = 0; i < _ops.size(); ++i) {
+            if (!_ops[i].get.empty()) {
+                _nref.fetch_add(1, butil::memory_order_relaxed);
+                if (bthread_timer_add(
+                        &_backup_timer,
+                        butil::milliseconds_from_now(backup_request_ms),
+                        OnBackupTimer, this) == 0) {
+                    _has_backup_timer = true;
+                } else {
+                    _nref.fetch_sub(1, butil::memory_order_relaxed);
+                }
+                break;
+            }
+        }
+    }
+    IssueSubCalls(list);
+    Release();
+}
+
+void MemcacheClusterCall::IssueSubCalls(const std::vector<SubCall*>& list) {
+    for (size_t i = 0; i < list.size(); ++i) {
+        SubCall* sc = list[i];
+        _channel->_channel.CallMethod(NULL, &sc->cntl, &sc->request, &sc->response,
+                                      brpc::NewCallback(OnSubCallDone, sc));
+    }
+}
+
+void MemcacheClusterCall::OnBackupTimer(void* arg) {
+    // Don't issue RPC in the TimerThread.
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, IssueBackupRequests, arg) != 0) {
+        IssueBackupRequests(arg);
+    }
+}
+
+void* MemcacheClusterCall::IssueBackupRequests(void* arg) {
+    MemcacheClusterCall* call = static_cast<MemcacheClusterCall*>(arg);
+    std::vector<SubCall*> list;
+    {
+        BAIDU_SCOPED_LOCK(call->_mutex);
+        for (size_t i = 0; !call->_finished && i < call->_ops.size(); ++i) {
+            Operation& o = call->_ops[i];
+            if (o.get.empty() || o.resolved) {
+                continue;
+            }
+            // Only the server owning the key is able to answer the GET, send
+            // the GET to it again through another connection, which is not
+            // blocked by the slow sub call.
+            SubCall* sc = call->NewSubCall(o.code);
+            sc->cntl.set_connection_type(CONNECTION_TYPE_POOLED);
+            sc->request._buf.append(o.get);
+            ++sc->request._pipelined_count;
+            sc->ops.push_back(i);
+            ++o.nflight;
+            list.push_back(sc);
+        }
+        call->_nref.fetch_add(list.size(), butil::memory_order_relaxed);
+    }
+    call->IssueSubCalls(list);
+    // Reference of the timer.
+    call->Release();
+    return NULL;
+}
+
+void MemcacheClusterCall::OnSubCallDone(SubCall* sc) {
+    MemcacheClusterCall* call = sc->call;
+    bool finish = false;
+    {
+        BAIDU_SCOPED_LOCK(call->_mutex);
+        int error_code = 0;
+        std::string error_text;
+        if (sc->cntl.Failed()) {
+            error_code = sc->cntl.ErrorCode();
+            error_text = butil::string_printf(
+                "[%s] %s", butil::endpoint2str(sc->cntl.remote_side()).c_str(),
+                sc->cntl.ErrorText().c_str());
+        }
+        // Results are converted to host byte order by the protocol.
+        butil::IOBuf& buf = sc->response.raw_buffer();
+        for (size_t i = 0; i < sc->ops.size(); ++i) {
+            Operation& o = call->_ops[sc->ops[i]];
+            --o.nflight;
+            butil::IOBuf result;
+            if (error_code == 0) {
+                policy::MemcacheResponseHeader header;
+                if (buf.copy_to(&header, sizeof(header)) != sizeof(header) ||
+                    buf.size() < sizeof(header) + header.total_body_length) {
+                    error_code = ERESPONSE;
+                    error_text = "Incomplete response";
+                } else {
+                    buf.cutn(&result, sizeof(header) + header.total_body_length);
+                }
+            }
+            if (o.resolved) {
+                continue;
+            }
+            if (error_code == 0) {
+                // The first result wins.
+                o.result.swap(result);
+            } else if (o.nflight > 0) {
+                // Wait for the backup request or the original one.
+                continue;
+            } else if (!call->_failed) {
+                call->_failed = true;
+                call->_error_code = error_code;
+                call->_error_text = error_text;
+            }
+            o.resolved = true;
+            --call->_nunresolved;
+        }
+        if (call->_nunresolved == 0 && !call->_finished) {
+            call->_finished = true;
+            finish = true;
+        }
+    }
+    if (finish) {
+        call->Finish();
+    }
+    call->Release();
+}
+
+void MemcacheClusterCall::Finish() {
+    if (_has_backup_timer && bthread_timer_del(_backup_timer) == 0) {
+        // The timer will never run, release its reference. Not the last one
+        // since the caller holds another.
+        Release();
+    }
+    if (_failed) {
+        _cntl->SetFailed(_error_code, "%s", _error_text.c_str());
+    } else {
+        butil::IOBuf& buf = _response->raw_buffer();
+        for (size_t i = 0; i < _ops.size(); ++i) {
+            buf.append(butil::IOBuf::Movable(_ops[i].result));
+        }
+    }
+    _done->Run();
+}
+
+void MemcacheClusterCall::Release() {
+    if (_nref.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+MemcacheClusterChannel::MemcacheClusterChannel()
+    : _md5(false)
+    , _backup_request_ms(-1) {}
+
+MemcacheClusterChannel::~MemcacheClusterChannel() {}
+
+int MemcacheClusterChannel::Init(const char* naming_service_url,
+                                 const char* load_balancer_name,
+                                 const ChannelOptions* options) {
+    const butil::StringPiece lb_name(load_balancer_name ? load_balancer_name : "");
+    if (lb_name == "c_murmurhash") {
+        _md5 = false;
+    } else if (lb_name == "c_md5" || lb_name == "c_ketama") {
+        _md5 = true;
+    } else {
+        LOG(ERROR) << "Load balancer=`" << lb_name
+                   << "' is not consistent hashing";
+        return -1;
+    }
+    ChannelOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    opt.protocol = PROTOCOL_MEMCACHE;
+    // Set for each sub call.
+    _backup_request_ms = opt.backup_request_ms;
+    opt.backup_request_ms = -1;
+    if (_channel.Init(naming_service_url, load_balancer_name, &opt) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t MemcacheClusterChannel::HashKey(const butil::StringPiece& key) const {
+    return (_md5 ? policy::MD5Hash32(key.data(), key.size())
+            : policy::MurmurHash32(key.data(), key.size()));
+}
+
+int MemcacheClusterChannel::SelectServer(uint32_t code, SocketId* id) {
+    SocketUniquePtr ptr;
+    LoadBalancer::SelectIn sel_in = { 0, false, true, code, NULL };
+    LoadBalancer::SelectOut sel_out(&ptr);
+    const int rc = _channel._lb->SelectServer(sel_in, &sel_out);
+    if (rc != 0) {
+        return rc;
+    }
+    *id = ptr->id();
+    return 0;
+}
+
+static void SignalEvent(bthread::CountdownEvent* event) {
+    event->signal();
+}
+
+void MemcacheClusterChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* /*method*/,
+    google::protobuf::RpcController* controller_base,
+    const google::protobuf::Message* request_base,
+    google::protobuf::Message* response_base,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(controller_base);
+    if (request_base == NULL ||
+        request_base->GetDescriptor() != MemcacheRequest::descriptor() ||
+        response_base == NULL ||
+        response_base->GetDescriptor() != MemcacheResponse::descriptor()) {
+        cntl->SetFailed(EINVAL, "Request and response must be "
+                        "MemcacheRequest and MemcacheResponse");
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    const MemcacheRequest* request =
+        static_cast<const MemcacheRequest*>(request_base);
+    if (request->pipelined_count() == 0) {
+        cntl->SetFailed(EREQUEST, "Request is empty");
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    MemcacheClusterCall* call = new MemcacheClusterCall(
+        this, cntl, static_cast<MemcacheResponse*>(response_base), done);
+    if (!call->Init(*request)) {
+        delete call;
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    bthread::CountdownEvent event;
+    if (done == NULL) {
+        call->set_done(brpc::NewCallback(SignalEvent, &event));
+    }
+    call->Issue();
+    if (done == NULL) {
+        event.wait();
+    }
+}
+
+void MemcacheClusterChannel::Describe(std::ostream& os,
+                                      const DescribeOptions& options) const {
+    os << "MemcacheCluster[";
+    _channel.Describe(os, options);
+    os << ']';
+}
+
+int MemcacheClusterChannel::CheckHealth() {
+    return _channel.CheckHealth();
+}
+
+} // namespace brpc
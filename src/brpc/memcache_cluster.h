@@ -0,0 +1,97 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#ifndef BRPC_MEMCACHE_CLUSTER_H
+#define BRPC_MEMCACHE_CLUSTER_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include "brpc/channel.h"
+
+namespace brpc {
+
+class MemcacheClusterCall;
+
+// Access memcached servers partitioned by consistent hashing like a single
+// memcached. Operations in a MemcacheRequest are grouped by the servers
+// owning their keys, operations to a same server are pipelined in one sub
+// call and sub calls to different servers are issued concurrently. Results
+// are put in MemcacheResponse in the same order of the operations, so that
+// they're popped as if the request was sent to one server.
+// Operations without keys(Flush, Version) are not supported.
+// ChannelOptions.backup_request_ms(or Controller.set_backup_request_ms())
+// applies to GETs: each GET not answered within the time is sent again to
+// the server owning the key through another connection, and the first
+// reply wins. Other servers are never tried since they don't own the key.
+// Example:
+//   brpc::MemcacheClusterChannel channel;
+//   channel.Init("list://10.0.0.1:11211,10.0.0.2:11211", "c_murmurhash", NULL);
+//   brpc::MemcacheRequest request;
+//   request.Get("key1");
+//   request.Get("key2");
+//   brpc::MemcacheResponse response;
+//   brpc::Controller cntl;
+//   channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+//   response.PopGet(&value1, &flags1, &cas1);
+//   response.PopGet(&value2, &flags2, &cas2);
+class MemcacheClusterChannel : public ChannelBase {
+friend class MemcacheClusterCall;
+public:
+    MemcacheClusterChannel();
+    ~MemcacheClusterChannel();
+
+    // Connect to servers in `naming_service_url' which are selected by
+    // the consistent hashing `load_balancer_name': c_murmurhash, c_md5 or
+    // c_ketama. Keys are hashed by the same function that the load balancer
+    // uses, i.e. murmurhash3 for c_murmurhash and md5 for the others.
+    // `protocol' in `options' is always memcache.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const char* naming_service_url,
+             const char* load_balancer_name,
+             const ChannelOptions* options);
+
+    // Send `request' which must be a MemcacheRequest and fill `response'
+    // which must be a MemcacheResponse. `method' is ignored.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    void Describe(std::ostream& os, const DescribeOptions& options) const;
+
+    // Returns 0 if any server is accessible.
+    int CheckHealth();
+
+private:
+    // Hash of `key' as the request_code of the load balancer.
+    uint32_t HashKey(const butil::StringPiece& key) const;
+    // Get the server owning the key whose hash is `code'.
+    // Returns 0 on success, error code otherwise.
+    int SelectServer(uint32_t code, SocketId* id);
+
+    Channel _channel;
+    bool _md5;
+    int32_t _backup_request_ms;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_MEMCACHE_CLUSTER_H
@@ -19,7 +19,9 @@
 #include "brpc/policy/http2_rpc_protocol.h"
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/server.h"
+#include "brpc/stream_impl.h"
 #include "butil/base64.h"
+#include "butil/sys_byteorder.h"
 #include "brpc/log.h"
 
 namespace brpc {
@@ -324,6 +326,7 @@ inline H2Context::FrameHandler FindFrameHandler(H2FrameType type) {
 
 H2Context::H2Context(Socket* socket, const Server* server)
     : _socket(socket)
+    , _server(server)
     // Maximize the window size to make sending big request possible before
     // receving the remote settings.
     , _remote_window_left(H2Settings::MAX_WINDOW_SIZE)
@@ -332,7 +335,8 @@ H2Context::H2Context(Socket* socket, const Server* server)
     , _last_sent_stream_id(1)
     , _goaway_stream_id(-1)
     , _remote_settings_received(false)
-    , _deferred_window_update(0) {
+    , _deferred_window_update(0)
+    , _nbound_streams(0) {
     // Stop printing the field which is useless for remote settings.
     _remote_settings.connection_window_size = 0;
     // Maximize the window size to make sending big request possible before
@@ -519,7 +523,8 @@ ParseResult H2Context::Consume(
             }
             H2StreamContext* sctx = RemoveStream(h2_res.stream_id());
             if (sctx) {
-                if (is_server_side()) {
+                ResetBoundStream(sctx);
+                if (is_server_side() || sctx->_dispatched) {
                     delete sctx;
                     return MakeMessage(NULL);
                 } else {
@@ -636,23 +641,20 @@ H2ParseResult H2StreamContext::OnHeaders(
                               it2.bytes_left());
     }
     it.forward(pad_length);
+    if (frame_head.flags & H2_FLAGS_END_STREAM) {
+        // Delay calling OnEndStream() in OnContinuation() if the headers
+        // are not ended.
+        _stream_ended = true;
+    }
     if (frame_head.flags & H2_FLAGS_END_HEADERS) {
         if (it2.bytes_left() != 0) {
             LOG(ERROR) << "Incomplete header: payload_size=" << frame_head.payload_size
                 << ", stream_id=" << frame_head.stream_id;
             return MakeH2Error(H2_PROTOCOL_ERROR);
         }
-        if (frame_head.flags & H2_FLAGS_END_STREAM) {
-            return OnEndStream();
-        }
-        return MakeH2Message(NULL);
-    } else {
-        if (frame_head.flags & H2_FLAGS_END_STREAM) {
-            // Delay calling OnEndStream() in OnContinuation()
-            _stream_ended = true;
-        }
-        return MakeH2Message(NULL);
+        return OnEndHeaders();
     }
+    return MakeH2Message(NULL);
 }
 
 H2ParseResult H2Context::OnContinuation(
@@ -692,9 +694,25 @@ H2ParseResult H2StreamContext::OnContinuation(
                 << ", stream_id=" << frame_head.stream_id;
             return MakeH2Error(H2_PROTOCOL_ERROR);
         }
-        if (_stream_ended) {
-            return OnEndStream();
+        return OnEndHeaders();
+    }
+    return MakeH2Message(NULL);
+}
+
+H2ParseResult H2StreamContext::OnEndHeaders() {
+    if (_conn_ctx->is_server_side()) {
+        if (!_grpc_streaming) {
+            _grpc_streaming = _conn_ctx->IsGrpcStreamingRequest(header());
         }
+    } else if (_grpc_streaming && !_dispatched && !_stream_ended) {
+        // Headers of the response to a gRPC streaming call(not in
+        // Trailers-Only form), the RPC is completed by the headers and
+        // messages are delivered to the request stream.
+        std::unique_lock<butil::Mutex> mu(_conn_ctx->_stream_mutex);
+        return MakeH2Message(DispatchGrpcStream());
+    }
+    if (_stream_ended) {
+        return OnEndStream();
     }
     return MakeH2Message(NULL);
 }
@@ -735,6 +753,9 @@ H2ParseResult H2StreamContext::OnData(
     butil::IOBuf data;
     it.append_and_forward(&data, frag_size);
     it.forward(pad_length);
+    if (_grpc_streaming) {
+        return OnGrpcStreamData(data, frame_head);
+    }
     for (size_t i = 0; i < data.backing_block_num(); ++i) {
         const butil::StringPiece blk = data.backing_block(i);
         if (OnBody(blk.data(), blk.size()) != 0) {
@@ -776,6 +797,112 @@ H2ParseResult H2StreamContext::OnData(
     return MakeH2Message(NULL);
 }
 
+// Cut a length-prefixed message of gRPC from `buf' into `msg'.
+// Returns false if the message is not complete.
+static bool CutGrpcMessage(butil::IOBuf* buf, butil::IOBuf* msg) {
+    char prefix[5];
+    if (buf->copy_to(prefix, sizeof(prefix)) != sizeof(prefix)) {
+        return false;
+    }
+    const size_t size = sizeof(prefix) + butil::NetToHost32(*(uint32_t*)(prefix + 1));
+    if (buf->size() < size) {
+        return false;
+    }
+    msg->clear();
+    buf->cutn(msg, size);
+    return true;
+}
+
+H2ParseResult H2StreamContext::OnGrpcStreamData(
+    butil::IOBuf& data, const H2FrameHead& frame_head) {
+    // Messages are delivered to the user who may consume them slowly, only
+    // the stream-level window waits for consumption, otherwise a slow
+    // stream blocks other streams in the connection.
+    _conn_ctx->DeferWindowUpdate(frame_head.payload_size);
+    const int64_t unconsumed = _unconsumed.fetch_add(
+        frame_head.payload_size, butil::memory_order_relaxed) + frame_head.payload_size;
+    if (unconsumed + _deferred_window_update.load(butil::memory_order_relaxed)
+        > _conn_ctx->local_settings().stream_window_size) {
+        LOG(ERROR) << "Fail to satisfy the stream-level flow control policy";
+        return MakeH2Error(H2_FLOW_CONTROL_ERROR, frame_head.stream_id);
+    }
+    std::unique_lock<butil::Mutex> mu(_conn_ctx->_stream_mutex);
+    _grpc_buf.append(butil::IOBuf::Movable(data));
+    // Padding is consumed right now.
+    OnConsumed(frame_head.payload_size - data.size());
+    if (frame_head.flags & H2_FLAGS_END_STREAM) {
+        _stream_ended = true;
+    }
+    if (_bound_stream != INVALID_STREAM_ID) {
+        DeliverGrpcMessages();
+    } else if (!_dispatched && _conn_ctx->is_server_side()) {
+        return MakeH2Message(DispatchGrpcStream());
+    }
+    // Otherwise messages are delivered after the stream is bound.
+    return MakeH2Message(NULL);
+}
+
+H2StreamContext* H2StreamContext::DispatchGrpcStream() {
+    butil::IOBuf first_msg;
+    if (_conn_ctx->is_server_side() &&
+        !CutGrpcMessage(&_grpc_buf, &first_msg) && !_stream_ended) {
+        // The request is dispatched with the first message.
+        return NULL;
+    }
+    // The first message is consumed by the RPC rather than the stream.
+    OnConsumed(first_msg.size());
+    H2StreamContext* msg = new H2StreamContext(false);
+    msg->Init(_conn_ctx, _stream_id);
+    msg->_grpc_streaming = true;
+    msg->_dispatched = true;
+    msg->_correlation_id = _correlation_id;
+    msg->_parsed_length = _parsed_length;
+    msg->header().Swap(header());
+    msg->body().swap(first_msg);
+    msg->OnMessageComplete();
+    _dispatched = true;
+    return msg;
+}
+
+void H2StreamContext::DeliverGrpcMessages() {
+    SocketUniquePtr ptr;
+    if (Socket::Address(_bound_stream, &ptr) != 0) {
+        // The stream is being closed.
+        return;
+    }
+    Stream* s = (Stream*)ptr->conn();
+    butil::IOBuf msg;
+    while (CutGrpcMessage(&_grpc_buf, &msg)) {
+        butil::IOBuf* m = new butil::IOBuf;
+        m->swap(msg);
+        s->OnH2Message(m);
+    }
+    if (_stream_ended && !_end_delivered) {
+        _end_delivered = true;
+        s->OnH2Message(NULL);
+    }
+}
+
+void H2StreamContext::OnConsumed(int64_t size) {
+    if (size <= 0) {
+        return;
+    }
+    _unconsumed.fetch_sub(size, butil::memory_order_relaxed);
+    const int64_t acc = _deferred_window_update.fetch_add(size, butil::memory_order_relaxed) + size;
+    if (acc >= _conn_ctx->local_settings().stream_window_size / 2) {
+        const int64_t stream_wu =
+            _deferred_window_update.exchange(0, butil::memory_order_relaxed);
+        if (stream_wu > 0) {
+            char winbuf[FRAME_HEAD_SIZE + 4];
+            SerializeFrameHead(winbuf, 4, H2_FRAME_WINDOW_UPDATE, 0, stream_id());
+            SaveUint32(winbuf + FRAME_HEAD_SIZE, stream_wu);
+            if (WriteAck(_conn_ctx->_socket, winbuf, sizeof(winbuf)) != 0) {
+                LOG(WARNING) << "Fail to send WINDOW_UPDATE to " << *_conn_ctx->_socket;
+            }
+        }
+    }
+}
+
 H2ParseResult H2Context::OnResetStream(
     butil::IOBufBytesIterator& it, const H2FrameHead& frame_head) {
     if (frame_head.payload_size != 4) {
@@ -810,7 +937,8 @@ H2ParseResult H2StreamContext::OnResetStream(
         LOG(ERROR) << "Fail to find stream_id=" << stream_id();
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
-    if (_conn_ctx->is_client_side()) {
+    _conn_ctx->ResetBoundStream(sctx);
+    if (_conn_ctx->is_client_side() && !sctx->_dispatched) {
         sctx->header().set_status_code(H2ErrorToStatusCode(h2_error));
         return MakeH2Message(sctx);
     } else {
@@ -832,17 +960,40 @@ H2ParseResult H2StreamContext::OnEndStream() {
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
 #endif
+    if (_grpc_streaming && (_dispatched || _conn_ctx->is_server_side())) {
+        // The context stays until the bound stream is closed.
+        std::unique_lock<butil::Mutex> mu(_conn_ctx->_stream_mutex);
+        if (_bound_stream != INVALID_STREAM_ID) {
+            DeliverGrpcMessages();
+        } else if (!_dispatched) {
+            return MakeH2Message(DispatchGrpcStream());
+        }
+        return MakeH2Message(NULL);
+    }
     H2StreamContext* sctx = _conn_ctx->RemoveStream(stream_id());
     if (sctx == NULL) {
         RPC_VLOG << "Fail to find stream_id=" << stream_id();
         return MakeH2Message(NULL);
     }
     CHECK_EQ(sctx, this);
+    // Response of a call with streaming requests only(or in Trailers-Only
+    // form), which finishes the call as well as the request stream.
+    _conn_ctx->ResetBoundStream(sctx);
 
     OnMessageComplete();
     return MakeH2Message(sctx);
 }
 
+static void UpdateBoundStreamWindows(const std::vector<StreamId>& ids,
+                                     int64_t size) {
+    for (size_t i = 0; i < ids.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(ids[i], &ptr) == 0) {
+            ((Stream*)ptr->conn())->OnH2WindowUpdate(size);
+        }
+    }
+}
+
 H2ParseResult H2Context::OnSettings(
     butil::IOBufBytesIterator& it, const H2FrameHead& frame_head) {
     // SETTINGS frames always apply to a connection, never a single stream.
@@ -895,13 +1046,20 @@ H2ParseResult H2Context::OnSettings(
         // be changed using WINDOW_UPDATE frames.
         // https://tools.ietf.org/html/rfc7540#section-6.9.2
         // TODO(gejun): Has race conditions with AppendAndDestroySelf
-        std::unique_lock<butil::Mutex> mu(_stream_mutex);
-        for (StreamMap::const_iterator it = _pending_streams.begin();
-             it != _pending_streams.end(); ++it) {
-            if (!AddWindowSize(&it->second->_remote_window_left, window_diff)) {
-                return MakeH2Error(H2_FLOW_CONTROL_ERROR);
+        std::vector<StreamId> bound_streams;
+        {
+            std::unique_lock<butil::Mutex> mu(_stream_mutex);
+            for (StreamMap::const_iterator it = _pending_streams.begin();
+                 it != _pending_streams.end(); ++it) {
+                if (!AddWindowSize(&it->second->_remote_window_left, window_diff)) {
+                    return MakeH2Error(H2_FLOW_CONTROL_ERROR);
+                }
+                if (it->second->_bound_stream != INVALID_STREAM_ID) {
+                    bound_streams.push_back(it->second->_bound_stream);
+                }
             }
         }
+        UpdateBoundStreamWindows(bound_streams, window_diff);
     }
     // Respond with ack
     char headbuf[FRAME_HEAD_SIZE];
@@ -980,12 +1138,21 @@ H2ParseResult H2Context::OnGoAway(
 
         std::vector<H2StreamContext*> goaway_streams;
         RemoveGoAwayStreams(last_stream_id, &goaway_streams);
-        if (goaway_streams.empty()) {
-            return MakeH2Message(NULL);
-        }
+        size_t nresponse = 0;
         for (size_t i = 0; i < goaway_streams.size(); ++i) {
             H2StreamContext* sctx = goaway_streams[i];
+            ResetBoundStream(sctx);
+            if (sctx->_dispatched) {
+                // The RPC was already completed.
+                delete sctx;
+                continue;
+            }
             sctx->header().set_status_code(HTTP_STATUS_SERVICE_UNAVAILABLE);
+            goaway_streams[nresponse++] = sctx;
+        }
+        goaway_streams.resize(nresponse);
+        if (goaway_streams.empty()) {
+            return MakeH2Message(NULL);
         }
         for (size_t i = 1; i < goaway_streams.size(); ++i) {
             bthread_t th;
@@ -1014,27 +1181,89 @@ H2ParseResult H2Context::OnWindowUpdate(
         LOG(ERROR) << "Invalid window_size_increment=" << inc;
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
+    std::vector<StreamId> bound_streams;
     if (frame_head.stream_id == 0) {
         if (!AddWindowSize(&_remote_window_left, inc)) {
             LOG(ERROR) << "Invalid connection-level window_size_increment=" << inc;
             return MakeH2Error(H2_FLOW_CONTROL_ERROR);
         }
-        return MakeH2Message(NULL);
-    } else {
-        H2StreamContext* sctx = FindStream(frame_head.stream_id);
-        if (sctx == NULL) {
-            RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
+        if (_nbound_streams.load(butil::memory_order_relaxed) == 0) {
             return MakeH2Message(NULL);
         }
-        if (!AddWindowSize(&sctx->_remote_window_left, inc)) {
-            LOG(ERROR) << "Invalid stream-level window_size_increment=" << inc
-                << " to remote_window_left=" << sctx->_remote_window_left.load(butil::memory_order_relaxed);
-            return MakeH2Error(H2_FLOW_CONTROL_ERROR);
+        // Bound streams may wait for the connection-level window.
+        {
+            std::unique_lock<butil::Mutex> mu(_stream_mutex);
+            for (StreamMap::const_iterator it = _pending_streams.begin();
+                 it != _pending_streams.end(); ++it) {
+                if (it->second->_bound_stream != INVALID_STREAM_ID) {
+                    bound_streams.push_back(it->second->_bound_stream);
+                }
+            }
         }
+        UpdateBoundStreamWindows(bound_streams, 0);
+        return MakeH2Message(NULL);
+    } else {
+        {
+            // Locked to be atomic with BindStream()
+            std::unique_lock<butil::Mutex> mu(_stream_mutex);
+            H2StreamContext** psctx = _pending_streams.seek(frame_head.stream_id);
+            if (psctx == NULL) {
+                RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
+                return MakeH2Message(NULL);
+            }
+            H2StreamContext* sctx = *psctx;
+            if (!AddWindowSize(&sctx->_remote_window_left, inc)) {
+                LOG(ERROR) << "Invalid stream-level window_size_increment=" << inc
+                    << " to remote_window_left=" << sctx->_remote_window_left.load(butil::memory_order_relaxed);
+                return MakeH2Error(H2_FLOW_CONTROL_ERROR);
+            }
+            if (sctx->_bound_stream != INVALID_STREAM_ID) {
+                bound_streams.push_back(sctx->_bound_stream);
+            }
+        }
+        UpdateBoundStreamWindows(bound_streams, inc);
         return MakeH2Message(NULL);
     }
 }
 
+int H2Context::BindStream(int stream_id, Stream* s) {
+    std::unique_lock<butil::Mutex> mu(_stream_mutex);
+    H2StreamContext** psctx = _pending_streams.seek(stream_id);
+    if (psctx == NULL) {
+        return -1;
+    }
+    H2StreamContext* sctx = *psctx;
+    // Streams of gRPC can't be reused, say by retried RPC.
+    if (sctx->_bound_stream != INVALID_STREAM_ID ||
+        s->OnH2Bound(sctx->_remote_window_left.load(
+                butil::memory_order_relaxed)) != 0) {
+        return -1;
+    }
+    sctx->_bound_stream = s->id();
+    _nbound_streams.fetch_add(1, butil::memory_order_relaxed);
+    sctx->DeliverGrpcMessages();
+    return 0;
+}
+
+void H2Context::ReleaseStreamWindow(int stream_id, int64_t size) {
+    std::unique_lock<butil::Mutex> mu(_stream_mutex);
+    H2StreamContext** psctx = _pending_streams.seek(stream_id);
+    if (psctx != NULL) {
+        (*psctx)->OnConsumed(size);
+    }
+}
+
+void H2Context::ResetBoundStream(H2StreamContext* sctx) {
+    // sctx was removed, reading _bound_stream without lock is safe.
+    if (sctx->_bound_stream == INVALID_STREAM_ID) {
+        return;
+    }
+    SocketUniquePtr ptr;
+    if (Socket::Address(sctx->_bound_stream, &ptr) == 0) {
+        ((Stream*)ptr->conn())->OnH2Reset();
+    }
+}
+
 void H2Context::Describe(std::ostream& os, const DescribeOptions& opt) const {
     if (opt.verbose) {
         os << '\n';
@@ -1135,6 +1364,27 @@ ParseResult ParseH2Message(butil::IOBuf *source, Socket *socket,
     }
 }
 
+// Defined in http_rpc_protocol.cpp
+const Server::MethodProperty*
+FindMethodPropertyByURI(const std::string& uri_path, const Server* server,
+                        std::string* unresolved_path);
+
+bool H2Context::IsGrpcStreamingRequest(const HttpHeader& h) const {
+    if (_server == NULL || _server->options().http_master_service) {
+        return false;
+    }
+    bool is_grpc_ct = false;
+    ParseContentType(h.content_type(), &is_grpc_ct);
+    if (!is_grpc_ct) {
+        return false;
+    }
+    std::string unresolved_path;
+    const Server::MethodProperty* mp =
+        FindMethodPropertyByURI(h.uri().path(), _server, &unresolved_path);
+    return (mp != NULL && mp->method != NULL &&
+            (mp->method->client_streaming() || mp->method->server_streaming()));
+}
+
 void H2Context::AddAbandonedStream(uint32_t stream_id) {
     std::unique_lock<butil::Mutex> mu(_abandoned_streams_mutex);
     _abandoned_streams.push_back(stream_id);
@@ -1166,9 +1416,14 @@ H2StreamContext::H2StreamContext(bool read_body_progressively)
 #endif
     , _stream_id(0)
     , _stream_ended(false)
+    , _grpc_streaming(false)
+    , _dispatched(false)
+    , _end_delivered(false)
     , _remote_window_left(0)
     , _deferred_window_update(0)
-    , _correlation_id(INVALID_BTHREAD_ID.value) {
+    , _unconsumed(0)
+    , _correlation_id(INVALID_BTHREAD_ID.value)
+    , _bound_stream(INVALID_STREAM_ID) {
     header().set_version(2, 0);
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << 1;
@@ -1183,6 +1438,9 @@ void H2StreamContext::Init(H2Context* conn_ctx, int stream_id) {
 }
 
 H2StreamContext::~H2StreamContext() {
+    if (_bound_stream != INVALID_STREAM_ID) {
+        _conn_ctx->_nbound_streams.fetch_sub(1, butil::memory_order_relaxed);
+    }
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << -1;
 #endif
@@ -1310,17 +1568,43 @@ int H2StreamContext::ConsumeHeaders(butil::IOBufBytesIterator& it) {
 
 const CommonStrings* get_common_strings();
 
+static void PackH2DataFrames(butil::IOBuf* out,
+                             const butil::IOBuf& data,
+                             bool end_stream,
+                             int stream_id,
+                             uint32_t max_frame_size) {
+    char headbuf[FRAME_HEAD_SIZE];
+    H2FrameHead data_head = {0, H2_FRAME_DATA, 0, stream_id};
+    butil::IOBufBytesIterator it(data);
+    while (it.bytes_left()) {
+        if (it.bytes_left() <= max_frame_size) {
+            data_head.payload_size = it.bytes_left();
+            if (end_stream) {
+                data_head.flags |= H2_FLAGS_END_STREAM;
+            }
+        } else {
+            data_head.payload_size = max_frame_size;
+        }
+        SerializeFrameHead(headbuf, data_head);
+        out->append(headbuf, FRAME_HEAD_SIZE);
+        it.append_and_forward(out, data_head.payload_size);
+    }
+}
+
+// END_STREAM is set on the last frame if `end_stream' is true, otherwise
+// the stream continues with messages of gRPC streaming calls.
 static void PackH2Message(butil::IOBuf* out,
                           butil::IOBuf& headers,
                           butil::IOBuf& trailer_headers,
                           const butil::IOBuf& data,
                           int stream_id,
-                          H2Context* conn_ctx) {
+                          H2Context* conn_ctx,
+                          bool end_stream) {
     const H2Settings& remote_settings = conn_ctx->remote_settings();
     char headbuf[FRAME_HEAD_SIZE];
     H2FrameHead headers_head = {
         (uint32_t)headers.size(), H2_FRAME_HEADERS, 0, stream_id};
-    if (data.empty() && trailer_headers.empty()) {
+    if (data.empty() && trailer_headers.empty() && end_stream) {
         headers_head.flags |= H2_FLAGS_END_STREAM;
     }
     if (headers_head.payload_size <= remote_settings.max_frame_size) {
@@ -1347,27 +1631,14 @@ static void PackH2Message(butil::IOBuf* out,
             headers.cutn(out, cont_head.payload_size);
         }
     }
-    if (!data.empty()) {
-        H2FrameHead data_head = {0, H2_FRAME_DATA, 0, stream_id};
-        butil::IOBufBytesIterator it(data);
-        while (it.bytes_left()) {
-            if (it.bytes_left() <= remote_settings.max_frame_size) {
-                data_head.payload_size = it.bytes_left();
-                if (trailer_headers.empty()) {
-                    data_head.flags |= H2_FLAGS_END_STREAM;
-                }
-            } else {
-                data_head.payload_size = remote_settings.max_frame_size;
-            }
-            SerializeFrameHead(headbuf, data_head);
-            out->append(headbuf, FRAME_HEAD_SIZE);
-            it.append_and_forward(out, data_head.payload_size);
-        }
-    }
+    PackH2DataFrames(out, data, trailer_headers.empty() && end_stream,
+                     stream_id, remote_settings.max_frame_size);
     if (!trailer_headers.empty()) {
         H2FrameHead headers_head = {
             (uint32_t)trailer_headers.size(), H2_FRAME_HEADERS, 0, stream_id};
-        headers_head.flags |= H2_FLAGS_END_STREAM;
+        if (end_stream) {
+            headers_head.flags |= H2_FLAGS_END_STREAM;
+        }
         headers_head.flags |= H2_FLAGS_END_HEADERS;
         SerializeFrameHead(headbuf, headers_head);
         out->append(headbuf, sizeof(headbuf));
@@ -1455,6 +1726,24 @@ H2UnsentRequest* H2UnsentRequest::New(Controller* c) {
         val->append(encoded_user_info);
     }
     msg->_sctx.reset(new H2StreamContext(c->is_response_read_progressively()));
+    const StreamId request_stream = ControllerPrivateAccessor(c).request_stream();
+    const google::protobuf::MethodDescriptor* method = c->method();
+    if (request_stream != INVALID_STREAM_ID && method != NULL &&
+        (method->client_streaming() || method->server_streaming())) {
+        bool is_grpc_ct = false;
+        ParseContentType(h.content_type(), &is_grpc_ct);
+        if (is_grpc_ct) {
+            // The request stream is carried by the http2 stream.
+            SocketUniquePtr stream_ptr;
+            if (Socket::Address(request_stream, &stream_ptr) == 0) {
+                ((Stream*)stream_ptr->conn())->MarkH2();
+            }
+            ControllerPrivateAccessor(c).set_grpc_streaming();
+            msg->_request_stream = request_stream;
+            msg->_end_stream = !method->client_streaming();
+            msg->_sctx->_grpc_streaming = method->server_streaming();
+        }
+    }
     return msg;
 }
 
@@ -1569,6 +1858,27 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     // After calling TryToInsertStream, the ownership of _sctx is transferred to ctx
     _sctx.release();
 
+    Stream* request_stream = NULL;
+    SocketUniquePtr stream_ptr;
+    if (_request_stream != INVALID_STREAM_ID) {
+        // Bind the request stream before the request is sent so that no
+        // response is missed.
+        if (Socket::Address(_request_stream, &stream_ptr) != 0) {
+            return butil::Status(EREQUEST, "Request stream=%" PRIu64 " was closed",
+                                 _request_stream);
+        }
+        request_stream = (Stream*)stream_ptr->conn();
+        if (request_stream->SetHostSocket(socket) != 0 ||
+            ctx->BindStream(_stream_id, request_stream) != 0) {
+            return butil::Status(EREQUEST, "Fail to bind request stream=%" PRIu64,
+                                 _request_stream);
+        }
+        if (_end_stream) {
+            // The request is the only message.
+            request_stream->OnH2LocalEnded();
+        }
+    }
+
     HPacker& hpacker = ctx->hpacker();
     butil::IOBufAppender appender;
     HPackOptions options;
@@ -1588,7 +1898,15 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     butil::IOBuf frag;
     appender.move_to(frag);
     butil::IOBuf dummy_buf;
-    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(), _stream_id, ctx);
+    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(),
+                  _stream_id, ctx, _end_stream);
+    if (request_stream != NULL) {
+        // Messages written by the stream are sent after this request.
+        StreamSettings settings;
+        settings.set_stream_id(_stream_id);
+        settings.set_writable(true);
+        request_stream->SetConnected(&settings);
+    }
     return butil::Status::OK();
 }
 
@@ -1640,7 +1958,9 @@ H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc)
     : _size(0)
     , _stream_id(stream_id)
     , _http_response(c->release_http_response())
-    , _is_grpc(is_grpc) {
+    , _is_grpc(is_grpc)
+    , _headers_only(false)
+    , _close_stream(false) {
     _data.swap(c->response_attachment());
     if (is_grpc) {
         _grpc_status = ErrorCodeToGrpcStatus(c->ErrorCode());
@@ -1730,6 +2050,11 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     appender.move_to(frag);
 
     butil::IOBuf trailer_frag;
+    if (_headers_only) {
+        // Messages and trailers are sent by the stream.
+        PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx, false);
+        return butil::Status::OK();
+    }
     if (_is_grpc) {
         HPacker::Header status_header("grpc-status",
                                       butil::string_printf("%d", _grpc_status));
@@ -1739,9 +2064,85 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
             hpacker.Encode(&appender, msg_header, options);
         }
         appender.move_to(trailer_frag);
+        if (_close_stream && _grpc_status != GRPC_OK) {
+            // Trailers-Only
+            frag.append(butil::IOBuf::Movable(trailer_frag));
+            _data.clear();
+        }
     }
 
-    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx);
+    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx, true);
+    if (_close_stream) {
+        bool remote_ended = true;
+        {
+            std::unique_lock<butil::Mutex> mu(ctx->_stream_mutex);
+            H2StreamContext** psctx = ctx->_pending_streams.seek(_stream_id);
+            if (psctx != NULL) {
+                remote_ended = (*psctx)->_stream_ended;
+            }
+        }
+        if (!remote_ended) {
+            // Stop the client from sending more messages.
+            char rstbuf[FRAME_HEAD_SIZE + 4];
+            SerializeFrameHead(rstbuf, 4, H2_FRAME_RST_STREAM, 0, _stream_id);
+            SaveUint32(rstbuf + FRAME_HEAD_SIZE, H2_NO_ERROR);
+            out->append(rstbuf, sizeof(rstbuf));
+        }
+        ctx->AddAbandonedStream(_stream_id);
+    }
+    return butil::Status::OK();
+}
+
+butil::Status
+H2UnsentStreamData::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
+    std::unique_ptr<H2UnsentStreamData> destroy_self(this);
+    if (socket == NULL) {
+        return butil::Status::OK();
+    }
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    if (ctx->FindStream(_stream_id) == NULL) {
+        // The http2 stream was closed, drop the data.
+        return butil::Status::OK();
+    }
+    const uint32_t max_frame_size = ctx->remote_settings().max_frame_size;
+    char headbuf[FRAME_HEAD_SIZE];
+    if (!_end_stream) {
+        PackH2DataFrames(out, _data, false, _stream_id, max_frame_size);
+    } else if (ctx->is_client_side()) {
+        if (_data.empty()) {
+            H2FrameHead data_head = {0, H2_FRAME_DATA, H2_FLAGS_END_STREAM, _stream_id};
+            SerializeFrameHead(headbuf, data_head);
+            out->append(headbuf, FRAME_HEAD_SIZE);
+        } else {
+            PackH2DataFrames(out, _data, true, _stream_id, max_frame_size);
+        }
+    } else {
+        // Server ends the call with trailers.
+        PackH2DataFrames(out, _data, false, _stream_id, max_frame_size);
+        HPacker& hpacker = ctx->hpacker();
+        butil::IOBufAppender appender;
+        HPackOptions options;
+        options.encode_name = FLAGS_h2_hpack_encode_name;
+        options.encode_value = FLAGS_h2_hpack_encode_value;
+        HPacker::Header status_header("grpc-status",
+                                      butil::string_printf("%d", GRPC_OK));
+        hpacker.Encode(&appender, status_header, options);
+        butil::IOBuf trailer_frag;
+        appender.move_to(trailer_frag);
+        H2FrameHead headers_head = {
+            (uint32_t)trailer_frag.size(), H2_FRAME_HEADERS,
+            H2_FLAGS_END_STREAM | H2_FLAGS_END_HEADERS, _stream_id};
+        SerializeFrameHead(headbuf, headers_head);
+        out->append(headbuf, FRAME_HEAD_SIZE);
+        out->append(butil::IOBuf::Movable(trailer_frag));
+    }
+    const int64_t conn_wu = ctx->ReleaseDeferredWindowUpdate();
+    if (conn_wu > 0) {
+        char winbuf[FRAME_HEAD_SIZE + 4];
+        SerializeFrameHead(winbuf, 4, H2_FRAME_WINDOW_UPDATE, 0, 0);
+        SaveUint32(winbuf + FRAME_HEAD_SIZE, conn_wu);
+        out->append(winbuf, sizeof(winbuf));
+    }
     return butil::Status::OK();
 }
 
@@ -1806,6 +2207,62 @@ void PackH2Request(butil::IOBuf*,
     }
 }
 
+int BindH2Stream(Socket* host, int h2_stream_id, Stream* stream) {
+    H2Context* ctx = static_cast<H2Context*>(host->parsing_context());
+    if (ctx == NULL) {
+        return -1;
+    }
+    return ctx->BindStream(h2_stream_id, stream);
+}
+
+int64_t ConsumeH2ConnectionWindow(Socket* host, int64_t size) {
+    H2Context* ctx = static_cast<H2Context*>(host->parsing_context());
+    if (ctx == NULL) {
+        return 0;
+    }
+    int64_t left = ctx->_remote_window_left.load(butil::memory_order_relaxed);
+    while (left > 0) {
+        const int64_t n = std::min(left, size);
+        if (ctx->_remote_window_left.compare_exchange_weak(
+                left, left - n, butil::memory_order_relaxed)) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+void ReleaseH2StreamWindow(Socket* host, int h2_stream_id, int64_t size) {
+    H2Context* ctx = static_cast<H2Context*>(host->parsing_context());
+    if (ctx != NULL) {
+        ctx->ReleaseStreamWindow(h2_stream_id, size);
+    }
+}
+
+int WriteH2StreamData(Socket* host, int h2_stream_id,
+                      butil::IOBuf* data, bool end_stream) {
+    SocketMessagePtr<H2UnsentStreamData> msg(
+        new H2UnsentStreamData(h2_stream_id, data, end_stream));
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    return host->Write(msg, &wopt);
+}
+
+void CloseH2Stream(Socket* host, int h2_stream_id, bool reset) {
+    H2Context* ctx = static_cast<H2Context*>(host->parsing_context());
+    if (ctx == NULL) {
+        return;
+    }
+    if (reset) {
+        char rstbuf[FRAME_HEAD_SIZE + 4];
+        SerializeFrameHead(rstbuf, 4, H2_FRAME_RST_STREAM, 0, h2_stream_id);
+        SaveUint32(rstbuf + FRAME_HEAD_SIZE, H2_CANCEL);
+        if (WriteAck(host, rstbuf, sizeof(rstbuf)) != 0) {
+            RPC_VLOG << "Fail to send RST_STREAM to " << *host;
+        }
+    }
+    ctx->AddAbandonedStream(h2_stream_id);
+}
+
 static bool IsH2SocketValid(Socket* s) {
     H2Context* c = static_cast<H2Context*>(s->parsing_context());
     return (c == NULL || !c->RunOutStreams());
@@ -24,6 +24,7 @@
 #include "brpc/protocol.h"
 #include "brpc/details/hpack.h"
 #include "brpc/stream_creator.h"
+#include "brpc/stream.h"
 #include "brpc/controller.h"
 
 #ifndef NDEBUG
@@ -31,6 +32,9 @@
 #endif
 
 namespace brpc {
+
+class Stream;
+
 namespace policy {
 
 class H2StreamContext;
@@ -169,6 +173,8 @@ private:
         : _nref(1)
         , _size(0)
         , _stream_id(0)
+        , _request_stream(INVALID_STREAM_ID)
+        , _end_stream(true)
         , _cntl(c) {
 #ifndef NDEBUG
         get_h2_bvars()->h2_unsent_request_count << 1;
@@ -187,6 +193,11 @@ private:
     butil::atomic<int> _nref;
     uint32_t _size;
     int _stream_id;
+    // Not INVALID_STREAM_ID for gRPC streaming calls, the stream is bound to
+    // the http2 stream after the request is packed.
+    StreamId _request_stream;
+    // False if messages follow the request.
+    bool _end_stream;
     mutable butil::Mutex _mutex;
     Controller* _cntl;
     std::unique_ptr<H2StreamContext> _sctx;
@@ -197,6 +208,14 @@ class H2UnsentResponse : public SocketMessage {
 public:
     static H2UnsentResponse* New(Controller* c, int stream_id, bool is_grpc);
     void Destroy();
+    // Following methods are for responses of gRPC streaming calls.
+    // Send the headers only, messages and trailers are written by the
+    // accepted Stream.
+    void set_headers_only() { _headers_only = true; }
+    // The stream was not accepted. The call is finished by this response,
+    // which is sent in Trailers-Only form if the call failed, and the http2
+    // stream is reset if the client is still writing.
+    void set_close_stream() { _close_stream = true; }
     void Print(std::ostream& os) const;
     // @SocketMessage
     butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*) override;
@@ -220,11 +239,31 @@ private:
     std::unique_ptr<HttpHeader> _http_response;
     butil::IOBuf _data;
     bool _is_grpc;
+    bool _headers_only;
+    bool _close_stream;
     GrpcStatus _grpc_status;
     std::string _grpc_message;
     HPacker::Header _list[0];
 };
 
+// DATA frames of a Stream carried by a http2 stream. END_STREAM is sent
+// along with the last frame at client-side and with trailers at server-side.
+class H2UnsentStreamData : public SocketMessage {
+public:
+    H2UnsentStreamData(int stream_id, butil::IOBuf* data, bool end_stream)
+        : _stream_id(stream_id), _end_stream(end_stream) {
+        _data.swap(*data);
+    }
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*) override;
+    size_t EstimatedByteSize() override { return _data.size(); }
+
+private:
+    int _stream_id;
+    bool _end_stream;
+    butil::IOBuf _data;
+};
+
 // Used in http_rpc_protocol.cpp
 class H2StreamContext : public HttpContext {
 public:
@@ -236,7 +275,9 @@ public:
     // does not need to complete.
     // Returns 0 on success, -1 otherwise.
     int ConsumeHeaders(butil::IOBufBytesIterator& it);
+    H2ParseResult OnEndHeaders();
     H2ParseResult OnEndStream();
+    H2ParseResult OnGrpcStreamData(butil::IOBuf& data, const H2FrameHead&);
 
     H2ParseResult OnData(butil::IOBufBytesIterator&, const H2FrameHead&,
                        uint32_t frag_size, uint8_t pad_length);
@@ -260,6 +301,18 @@ public:
 
     bool ConsumeWindowSize(int64_t size);
 
+    // True if DATA frames are messages of a gRPC streaming call, which
+    // are delivered to the bound Stream except the first request message.
+    // Dispatched messages(request at server-side, headers of response at
+    // client-side) are split from this context which stays until the Stream
+    // is closed.
+    bool is_grpc_streaming() const { return _grpc_streaming; }
+
+    // Methods below are called with _conn_ctx->_stream_mutex held.
+    H2StreamContext* DispatchGrpcStream();
+    void DeliverGrpcMessages();
+    void OnConsumed(int64_t size);
+
 #if defined(BRPC_H2_STREAM_STATE)
     H2StreamState state() const { return _state; }
     void SetState(H2StreamState state);
@@ -272,10 +325,18 @@ friend class H2Context;
 #endif
     int _stream_id;
     bool _stream_ended;
+    bool _grpc_streaming;
+    bool _dispatched;
+    bool _end_delivered;
     butil::atomic<int64_t> _remote_window_left;
     butil::atomic<int64_t> _deferred_window_update;
+    // Received bytes not consumed by the bound Stream yet.
+    butil::atomic<int64_t> _unconsumed;
     uint64_t _correlation_id;
     butil::IOBuf _remaining_header_fragment;
+    // Guarded by _conn_ctx->_stream_mutex
+    StreamId _bound_stream;
+    butil::IOBuf _grpc_buf;
 };
 
 StreamCreator* get_h2_global_stream_creator();
@@ -306,6 +367,22 @@ void SerializeFrameHead(void* out_buf,
                         uint32_t payload_size, H2FrameType type,
                         uint8_t flags, uint32_t stream_id);
 
+// Following functions are used by brpc::Stream carried by a http2 stream of
+// `host', namely a gRPC streaming call.
+// Bind `stream' to the http2 stream, messages received before are delivered
+// to `stream'. Returns 0 on success, -1 if the http2 stream does not exist.
+int BindH2Stream(Socket* host, int h2_stream_id, Stream* stream);
+// Take at most `size' bytes from the remote connection-level window.
+// Returns bytes taken.
+int64_t ConsumeH2ConnectionWindow(Socket* host, int64_t size);
+// `size' bytes received were consumed by the Stream.
+void ReleaseH2StreamWindow(Socket* host, int h2_stream_id, int64_t size);
+// Send `data' in DATA frames and end the http2 stream if `end_stream' is true.
+int WriteH2StreamData(Socket* host, int h2_stream_id,
+                      butil::IOBuf* data, bool end_stream);
+// Remove the http2 stream, reset it first if `reset' is true.
+void CloseH2Stream(Socket* host, int h2_stream_id, bool reset);
+
 size_t SerializeH2Settings(const H2Settings& in, void* out);
 
 const size_t FRAME_HEAD_SIZE = 9;
@@ -351,11 +428,17 @@ public:
     void DeferWindowUpdate(int64_t);
     int64_t ReleaseDeferredWindowUpdate();
 
+    int BindStream(int stream_id, Stream* s);
+    void ReleaseStreamWindow(int stream_id, int64_t size);
+
 private:
 friend class H2StreamContext;
 friend class H2UnsentRequest;
 friend class H2UnsentResponse;
+friend class H2UnsentStreamData;
 friend void InitFrameHandlers();
+friend int64_t ConsumeH2ConnectionWindow(Socket* host, int64_t size);
+friend void CloseH2Stream(Socket* host, int h2_stream_id, bool reset);
 
     ParseResult ConsumeFrameHead(butil::IOBufBytesIterator&, H2FrameHead*);
 
@@ -375,10 +458,13 @@ friend void InitFrameHandlers();
 
     H2StreamContext* FindStream(int stream_id);
     void ClearAbandonedStreamsImpl();
+    bool IsGrpcStreamingRequest(const HttpHeader& h) const;
+    void ResetBoundStream(H2StreamContext* sctx);
 
     // True if the connection is established by client, otherwise it's
     // accepted by server.
     Socket* _socket;
+    const Server* _server;
     butil::atomic<int64_t> _remote_window_left;
     H2ConnectionState _conn_state;
     int _last_received_stream_id;
@@ -395,6 +481,8 @@ friend void InitFrameHandlers();
     mutable butil::Mutex _stream_mutex;
     StreamMap _pending_streams;
     butil::atomic<int64_t> _deferred_window_update;
+    // Number of streams bound to brpc::Stream
+    butil::atomic<int> _nbound_streams;
 };
 
 inline int H2Context::AllocateClientStreamId() {
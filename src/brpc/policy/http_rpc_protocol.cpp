@@ -16,6 +16,7 @@
 // under the License.
 
 
+#include <ctype.h>                                  // isxdigit
 #include <google/protobuf/descriptor.h>             // MethodDescriptor
 #include <gflags/gflags.h>
 #include <json2pb/pb_to_json.h>                    // ProtoMessageToJson
@@ -34,6 +35,7 @@
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/span.h"
 #include "brpc/socket.h"                       // Socket
+#include "brpc/stream_impl.h"
 #include "brpc/http_status_code.h"             // HTTP_STATUS_*
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/builtin/index_service.h"        // IndexService
@@ -74,6 +76,12 @@ DEFINE_bool(pb_enum_as_number, false,
 
 DEFINE_string(request_id_header, "x-request-id", "The http header to mark a session");
 
+DEFINE_bool(http_propagate_w3c_trace_context, true,
+            "Send W3C traceparent/tracestate headers in http/h2 requests "
+            "traced by rpcz");
+DEFINE_bool(http_propagate_b3_trace_context, false,
+            "Send the B3 single header in http/h2 requests traced by rpcz");
+
 // Read user address from the header specified by -http_header_of_user_ip
 static bool GetUserAddressFromHeaderImpl(const HttpHeader& headers,
                                          butil::EndPoint* user_addr) {
@@ -144,6 +152,14 @@ CommonStrings::CommonStrings()
     , GRPC_STATUS("grpc-status")
     , GRPC_MESSAGE("grpc-message")
     , GRPC_TIMEOUT("grpc-timeout")
+    , TRACEPARENT("traceparent")
+    , TRACESTATE("tracestate")
+    , B3("b3")
+    , B3_TRACE_ID("x-b3-traceid")
+    , B3_SPAN_ID("x-b3-spanid")
+    , B3_PARENT_SPAN_ID("x-b3-parentspanid")
+    , B3_SAMPLED("x-b3-sampled")
+    , B3_FLAGS("x-b3-flags")
 {}
 
 static CommonStrings* common = NULL;
@@ -158,6 +174,171 @@ int InitCommonStrings() {
 static const int ALLOW_UNUSED force_creation_of_common = InitCommonStrings();
 const CommonStrings* get_common_strings() { return common; }
 
+// Parse 16 or 32 hexadecimal digits into a 64 or 128-bit id.
+static bool ParseHexId(const butil::StringPiece& s,
+                       uint64_t* high, uint64_t* low) {
+    if (s.size() != 16 && s.size() != 32) {
+        return false;
+    }
+    uint64_t v[2] = { 0, 0 };
+    const size_t nhigh = s.size() - 16;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const char c = s[i];
+        int d = 0;
+        if (c >= '0' && c <= '9') {
+            d = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            d = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            d = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        uint64_t& x = v[i < nhigh ? 0 : 1];
+        x = (x << 4) | d;
+    }
+    if (high) {
+        *high = v[0];
+    } else if (v[0]) {
+        return false;
+    }
+    *low = v[1];
+    return v[0] || v[1];
+}
+
+// traceparent: version "-" trace-id "-" parent-id "-" trace-flags
+// e.g. 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01
+static bool ParseW3CTraceParent(const std::string& value,
+                                HttpTraceContext* ctx) {
+    butil::StringPiece fields[4];
+    size_t nfield = 0;
+    for (butil::StringSplitter sp(value.c_str(), '-'); sp; ++sp) {
+        if (nfield == arraysize(fields)) {
+            // Later versions may append fields.
+            break;
+        }
+        fields[nfield++].set(sp.field(), sp.length());
+    }
+    if (nfield != arraysize(fields) || fields[0].size() != 2 ||
+        fields[0] == "ff" || fields[2].size() != 16 ||
+        fields[3].size() != 2 || fields[1].size() != 32) {
+        return false;
+    }
+    uint64_t flags = 0;
+    uint64_t high = 0;
+    if (!ParseHexId(fields[1], &high, &ctx->trace_id) ||
+        !ParseHexId(fields[2], NULL, &ctx->span_id) ||
+        !isxdigit(fields[3][0]) || !isxdigit(fields[3][1])) {
+        return false;
+    }
+    ctx->trace_id_high = high;
+    flags = strtoul(fields[3].as_string().c_str(), NULL, 16);
+    ctx->sampled = (flags & 0x01) ? 1 : 0;
+    return true;
+}
+
+// b3: {TraceId}-{SpanId}-{SamplingState}-{ParentSpanId} where the last two
+// fields are optional, or only {SamplingState}.
+static bool ParseB3Single(const std::string& value, HttpTraceContext* ctx) {
+    butil::StringPiece fields[4];
+    size_t nfield = 0;
+    for (butil::StringSplitter sp(value.c_str(), '-'); sp; ++sp) {
+        if (nfield == arraysize(fields)) {
+            return false;
+        }
+        fields[nfield++].set(sp.field(), sp.length());
+    }
+    butil::StringPiece sampling;
+    if (nfield == 1) {
+        sampling = fields[0];
+    } else if (nfield >= 2) {
+        if (!ParseHexId(fields[0], &ctx->trace_id_high, &ctx->trace_id) ||
+            !ParseHexId(fields[1], NULL, &ctx->span_id)) {
+            return false;
+        }
+        if (nfield >= 3) {
+            sampling = fields[2];
+        }
+        if (nfield == 4 &&
+            !ParseHexId(fields[3], NULL, &ctx->parent_span_id)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    if (sampling == "1" || sampling == "d") {
+        ctx->sampled = 1;
+    } else if (sampling == "0") {
+        ctx->sampled = 0;
+    } else if (!sampling.empty()) {
+        return false;
+    }
+    return nfield >= 2 || ctx->sampled >= 0;
+}
+
+static bool ParseB3Multi(const HttpHeader& header, HttpTraceContext* ctx) {
+    const std::string* sampled = header.GetHeader(common->B3_SAMPLED);
+    const std::string* flags = header.GetHeader(common->B3_FLAGS);
+    if (flags && *flags == "1") {
+        ctx->sampled = 1;
+    } else if (sampled) {
+        if (*sampled == "1" || *sampled == "true") {
+            ctx->sampled = 1;
+        } else if (*sampled == "0" || *sampled == "false") {
+            ctx->sampled = 0;
+        }
+    }
+    const std::string* trace_id = header.GetHeader(common->B3_TRACE_ID);
+    const std::string* span_id = header.GetHeader(common->B3_SPAN_ID);
+    if (trace_id == NULL || span_id == NULL) {
+        return ctx->sampled >= 0;
+    }
+    if (!ParseHexId(*trace_id, &ctx->trace_id_high, &ctx->trace_id) ||
+        !ParseHexId(*span_id, NULL, &ctx->span_id)) {
+        ctx->trace_id_high = 0;
+        ctx->trace_id = 0;
+        ctx->span_id = 0;
+        return ctx->sampled >= 0;
+    }
+    const std::string* parent_span_id =
+        header.GetHeader(common->B3_PARENT_SPAN_ID);
+    if (parent_span_id &&
+        !ParseHexId(*parent_span_id, NULL, &ctx->parent_span_id)) {
+        ctx->parent_span_id = 0;
+    }
+    return true;
+}
+
+bool ParseHttpTraceContext(const HttpHeader& header, HttpTraceContext* ctx) {
+    const std::string* traceparent = header.GetHeader(common->TRACEPARENT);
+    if (traceparent) {
+        HttpTraceContext tmp;
+        if (ParseW3CTraceParent(*traceparent, &tmp)) {
+            const std::string* tracestate =
+                header.GetHeader(common->TRACESTATE);
+            if (tracestate) {
+                tmp.trace_state = *tracestate;
+            }
+            *ctx = tmp;
+            return true;
+        }
+    }
+    const std::string* b3 = header.GetHeader(common->B3);
+    if (b3) {
+        HttpTraceContext tmp;
+        if (ParseB3Single(*b3, &tmp)) {
+            *ctx = tmp;
+            return true;
+        }
+    }
+    HttpTraceContext tmp;
+    if (ParseB3Multi(header, &tmp)) {
+        *ctx = tmp;
+        return true;
+    }
+    return false;
+}
+
 HttpContentType ParseContentType(butil::StringPiece ct, bool* is_grpc_ct) {
     // According to http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.7
     //   media-type  = type "/" subtype *( ";" parameter )
@@ -262,9 +443,13 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     Socket* socket = imsg_guard->socket();
     uint64_t cid_value;
     const bool is_http2 = imsg_guard->header().is_http2();
+    // True if this is headers of the response to a gRPC streaming call,
+    // messages are delivered to the request stream.
+    bool grpc_streaming = false;
     if (is_http2) {
         H2StreamContext* h2_sctx = static_cast<H2StreamContext*>(msg);
         cid_value = h2_sctx->correlation_id();
+        grpc_streaming = h2_sctx->is_grpc_streaming();
     } else {
         cid_value = socket->correlation_id();
     }
@@ -399,6 +584,9 @@ void ProcessHttpResponse(InputMessageBase* msg) {
             }
             break;
         }
+        if (grpc_streaming) {
+            break;
+        }
         if (cntl->response() == NULL ||
             cntl->response()->GetDescriptor()->field_count() == 0) {
             // a http call, content is the "real response".
@@ -623,6 +811,32 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
                            "%llu", (unsigned long long)span->span_id()));
         hreq.SetHeader("x-bd-parent-span-id", butil::string_printf(
                            "%llu", (unsigned long long)span->parent_span_id()));
+        // The request is always sampled since it's traced.
+        if (FLAGS_http_propagate_w3c_trace_context) {
+            hreq.SetHeader(common->TRACEPARENT, butil::string_printf(
+                               "00-%016llx%016llx-%016llx-01",
+                               (unsigned long long)span->trace_id_high(),
+                               (unsigned long long)span->trace_id(),
+                               (unsigned long long)span->span_id()));
+            if (!span->trace_state().empty()) {
+                hreq.SetHeader(common->TRACESTATE, span->trace_state());
+            }
+        }
+        if (FLAGS_http_propagate_b3_trace_context) {
+            std::string b3;
+            if (span->trace_id_high()) {
+                butil::string_appendf(&b3, "%016llx",
+                    (unsigned long long)span->trace_id_high());
+            }
+            butil::string_appendf(&b3, "%016llx-%016llx-1",
+                                  (unsigned long long)span->trace_id(),
+                                  (unsigned long long)span->span_id());
+            if (span->parent_span_id()) {
+                butil::string_appendf(&b3, "-%016llx",
+                    (unsigned long long)span->parent_span_id());
+            }
+            hreq.SetHeader(common->B3, b3);
+        }
     }
 }
 
@@ -718,6 +932,7 @@ HttpResponseSender::~HttpResponseSender() {
     const google::protobuf::Message* res = _res.get();
     
     if (cntl->IsCloseConnection()) {
+        Stream::SetFailed(accessor.response_stream());
         socket->SetFailed();
         return;
     }
@@ -749,8 +964,10 @@ HttpResponseSender::~HttpResponseSender() {
         // ^ user did not fill the body yet.
         res->GetDescriptor()->field_count() > 0 &&
         // ^ a pb service
-        !cntl->Failed()) {
+        !cntl->Failed() &&
         // ^ pb response in failed RPC is undefined, no need to convert.
+        accessor.response_stream() == INVALID_STREAM_ID) {
+        // ^ messages of gRPC streaming calls are written by the stream.
         
         butil::IOBufAsZeroCopyOutputStream wrapper(&cntl->response_attachment());
         if (content_type == HTTP_CONTENT_PROTO) {
@@ -870,7 +1087,20 @@ HttpResponseSender::~HttpResponseSender() {
     Socket::WriteOptions wopt;
     wopt.ignore_eovercrowded = true;
     if (is_http2) {
-        if (is_grpc) {
+        // remote_stream_settings is only set for gRPC streaming calls, of
+        // which messages are written by the accepted stream after headers
+        // of the response.
+        const bool grpc_streaming = (accessor.remote_stream_settings() != NULL);
+        SocketUniquePtr stream_ptr;
+        if (grpc_streaming && accessor.response_stream() != INVALID_STREAM_ID) {
+            if (!cntl->Failed() &&
+                Socket::Address(accessor.response_stream(), &stream_ptr) == 0) {
+                cntl->response_attachment().clear();
+            } else {
+                Stream::SetFailed(accessor.response_stream());
+            }
+        }
+        if (is_grpc && stream_ptr == NULL) {
             // Append compressed and length before body
             AddGrpcPrefix(&cntl->response_attachment(), grpc_compressed);
         }
@@ -881,6 +1111,11 @@ HttpResponseSender::~HttpResponseSender() {
             errno = EINVAL;
             rc = -1;
         } else {
+            if (stream_ptr != NULL) {
+                h2_response->set_headers_only();
+            } else if (grpc_streaming) {
+                h2_response->set_close_stream();
+            }
             if (FLAGS_http_verbose) {
                 LOG(INFO) << '\n' << *h2_response;
             }
@@ -889,6 +1124,16 @@ HttpResponseSender::~HttpResponseSender() {
             }
             rc = socket->Write(h2_response, &wopt);
         }
+        if (stream_ptr != NULL) {
+            Stream* s = (Stream*)stream_ptr->conn();
+            if (rc != 0 || s->SetHostSocket(socket) != 0 ||
+                BindH2Stream(socket, _h2_stream_id, s) != 0) {
+                s->Close();
+            } else {
+                // Written messages follow the headers.
+                s->SetConnected();
+            }
+        }
     } else {
         butil::IOBuf* content = NULL;
         if (cntl->Failed() || !cntl->has_progressive_writer()) {
@@ -1233,6 +1478,14 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     }
 
     ControllerPrivateAccessor accessor(cntl);
+    if (is_http2 && static_cast<H2StreamContext*>(msg)->is_grpc_streaming()) {
+        // Messages after the first one are delivered to the stream accepted
+        // by the user, which is carried by the http2 stream.
+        StreamSettings* settings = new StreamSettings;
+        settings->set_stream_id(static_cast<H2StreamContext*>(msg)->stream_id());
+        settings->set_writable(true);
+        accessor.set_remote_stream_settings(settings);
+    }
     HttpHeader& req_header = cntl->http_request();
     imsg_guard->header().Swap(req_header);
     butil::IOBuf& req_body = imsg_guard->body();
@@ -1283,17 +1536,25 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     Span* span = NULL;
     const std::string& path = req_header.uri().path();
     const std::string* trace_id_str = req_header.GetHeader("x-bd-trace-id");
-    if (IsTraceable(trace_id_str)) {
-        uint64_t trace_id = 0;
+    // Trace context from W3C or B3 headers is used when the request is not
+    // from brpc. The request is traced iff upstream sampled it, if upstream
+    // made no decision, it's up to local rpcz.
+    HttpTraceContext trace_ctx;
+    if (trace_id_str == NULL) {
+        ParseHttpTraceContext(req_header, &trace_ctx);
+    }
+    if (trace_ctx.sampled != 0 &&
+        IsTraceable(trace_id_str != NULL || trace_ctx.sampled > 0)) {
+        uint64_t trace_id = trace_ctx.trace_id;
         if (trace_id_str) {
             trace_id = strtoull(trace_id_str->c_str(), NULL, 10);
         }
-        uint64_t span_id = 0;
+        uint64_t span_id = trace_ctx.span_id;
         const std::string* span_id_str = req_header.GetHeader("x-bd-span-id");
         if (span_id_str) {
             span_id = strtoull(span_id_str->c_str(), NULL, 10);
         }
-        uint64_t parent_span_id = 0;
+        uint64_t parent_span_id = trace_ctx.parent_span_id;
         const std::string* parent_span_id_str =
             req_header.GetHeader("x-bd-parent-span-id");
         if (parent_span_id_str) {
@@ -1301,6 +1562,10 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         }
         span = Span::CreateServerSpan(
             path, trace_id, span_id, parent_span_id, msg->base_real_us());
+        if (trace_id == trace_ctx.trace_id) {
+            span->set_trace_id_high(trace_ctx.trace_id_high);
+            span->set_trace_state(trace_ctx.trace_state);
+        }
         accessor.set_span(span);
         span->set_log_id(cntl->log_id());
         span->set_remote_side(user_addr);
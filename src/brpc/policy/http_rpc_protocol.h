@@ -75,6 +75,16 @@ struct CommonStrings {
     std::string GRPC_MESSAGE;
     std::string GRPC_TIMEOUT;
 
+    // Tracing-related headers
+    std::string TRACEPARENT;
+    std::string TRACESTATE;
+    std::string B3;
+    std::string B3_TRACE_ID;
+    std::string B3_SPAN_ID;
+    std::string B3_PARENT_SPAN_ID;
+    std::string B3_SAMPLED;
+    std::string B3_FLAGS;
+
     CommonStrings();
 };
 
@@ -137,6 +147,27 @@ bool ParseHttpServerAddress(butil::EndPoint* out, const char* server_addr_and_po
 const std::string& GetHttpMethodName(const google::protobuf::MethodDescriptor*,
                                      const Controller*);
 
+// Trace context propagated by W3C `traceparent'/`tracestate' or B3 headers.
+struct HttpTraceContext {
+    uint64_t trace_id_high;
+    uint64_t trace_id;
+    uint64_t span_id;
+    uint64_t parent_span_id;
+    // 1: sampled by upstream, 0: not sampled, -1: upstream did not decide.
+    int sampled;
+    std::string trace_state;
+
+    HttpTraceContext()
+        : trace_id_high(0), trace_id(0), span_id(0)
+        , parent_span_id(0), sampled(-1) {}
+};
+
+// Parse trace context from W3C headers or B3 headers(single or multiple) in
+// `header'. The span id of the caller becomes `span_id' as in the shared-span
+// model of rpcz.
+// Returns true if any of the headers is valid.
+bool ParseHttpTraceContext(const HttpHeader& header, HttpTraceContext* ctx);
+
 enum HttpContentType {
     HTTP_CONTENT_OTHERS = 0,
     HTTP_CONTENT_JSON = 1,
@@ -20,9 +20,13 @@
 #include <google/protobuf/descriptor.h>         // MethodDescriptor
 #include <google/protobuf/message.h>            // Message
 #include <gflags/gflags.h>
+#include <deque>
 #include "butil/logging.h"                       // LOG()
 #include "butil/time.h"
 #include "butil/iobuf.h"                         // butil::IOBuf
+#include "butil/hash.h"
+#include "bthread/mutex.h"
+#include "bthread/condition_variable.h"
 #include "brpc/controller.h"               // Controller
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/socket.h"                   // Socket
@@ -53,17 +57,51 @@ struct InputResponse : public InputMessageBase {
     }
 };
 
+class RedisConnContext;
+
+// Replies of commands parsed in one ParseRedisMessage(), some of which are
+// filled by commands running in shards.
+struct RedisReplyBatch {
+    RedisReplyBatch() : nunfinished(1), done(false) {}
+    ~RedisReplyBatch() {
+        for (size_t i = 0; i < parts.size(); ++i) {
+            delete parts[i];
+        }
+    }
+
+    SocketUniquePtr socket;
+    std::vector<butil::IOBuf*> parts;
+    // Commands in shards and the parsing bthread.
+    butil::atomic<int> nunfinished;
+    bool done;
+};
+
+struct RedisCommandTask {
+    RedisConnContext* ctx;
+    RedisCommandHandler* handler;
+    std::vector<std::string> args;
+    RedisReplyBatch* batch;
+    butil::IOBuf* reply;
+};
+
 // This class is as parsing_context in socket.
 class RedisConnContext : public Destroyable  {
 public:
     explicit RedisConnContext(const RedisService* rs)
         : redis_service(rs)
-        , batched_size(0) {}
+        , batched_size(0)
+        , ninflight(0) {}
 
     ~RedisConnContext();
     // @Destroyable
     void Destroy() override;
 
+    // Send replies of finished batches in order.
+    void OnBatchDone(RedisReplyBatch* batch);
+    // Wait for commands running in shards.
+    void WaitInflight();
+    void OnTaskDone();
+
     const RedisService* redis_service;
     // If user starts a transaction, transaction_handler indicates the
     // handler pointer that runs the transaction command.
@@ -73,6 +111,13 @@ public:
 
     RedisCommandParser parser;
     butil::Arena arena;
+
+    // Fields used when RedisService has shards.
+    bthread::Mutex inflight_mutex;
+    bthread::ConditionVariable inflight_cond;
+    int ninflight;
+    butil::Mutex batch_mutex;
+    std::deque<RedisReplyBatch*> batches;
 };
 
 int ConsumeCommand(RedisConnContext* ctx,
@@ -135,12 +180,210 @@ int ConsumeCommand(RedisConnContext* ctx,
 
 // ========== impl of RedisConnContext ==========
 
-RedisConnContext::~RedisConnContext() { }
+RedisConnContext::~RedisConnContext() {
+    // Batches hold the socket, no batches are left.
+    CHECK(batches.empty());
+}
 
 void RedisConnContext::Destroy() {
     delete this;
 }
 
+void RedisConnContext::OnBatchDone(RedisReplyBatch* batch) {
+    std::vector<RedisReplyBatch*> sent;
+    {
+        BAIDU_SCOPED_LOCK(batch_mutex);
+        batch->done = true;
+        while (!batches.empty() && batches.front()->done) {
+            RedisReplyBatch* b = batches.front();
+            batches.pop_front();
+            sent.push_back(b);
+            butil::IOBuf sendbuf;
+            for (size_t i = 0; i < b->parts.size(); ++i) {
+                sendbuf.append(butil::IOBuf::Movable(*b->parts[i]));
+            }
+            if (sendbuf.empty()) {
+                continue;
+            }
+            // Written inside the lock to keep the order of replies.
+            Socket::WriteOptions wopt;
+            wopt.ignore_eovercrowded = true;
+            LOG_IF(WARNING, b->socket->Write(&sendbuf, &wopt) != 0)
+                << "Fail to send redis reply";
+        }
+    }
+    // Batches hold the socket which owns this context, `this' may be
+    // destroyed after deleting the last batch.
+    for (size_t i = 0; i < sent.size(); ++i) {
+        delete sent[i];
+    }
+}
+
+void RedisConnContext::WaitInflight() {
+    std::unique_lock<bthread::Mutex> mu(inflight_mutex);
+    while (ninflight > 0) {
+        inflight_cond.wait(mu);
+    }
+}
+
+void RedisConnContext::OnTaskDone() {
+    std::unique_lock<bthread::Mutex> mu(inflight_mutex);
+    if (--ninflight == 0) {
+        inflight_cond.notify_all();
+    }
+}
+
+// ========== impl of RedisShards ==========
+
+RedisShards::~RedisShards() {
+    for (size_t i = 0; i < _queues.size(); ++i) {
+        bthread::execution_queue_stop(_queues[i]);
+    }
+    for (size_t i = 0; i < _queues.size(); ++i) {
+        bthread::execution_queue_join(_queues[i]);
+    }
+}
+
+int RedisShards::Init(int num_shards) {
+    _queues.resize(num_shards);
+    for (int i = 0; i < num_shards; ++i) {
+        if (bthread::execution_queue_start(&_queues[i], NULL, Consume, NULL) != 0) {
+            LOG(ERROR) << "Fail to start execution queue";
+            _queues.resize(i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int RedisShards::Execute(RedisCommandTask* task) {
+    const std::string& key = task->args[1];
+    const size_t index = butil::Hash(key) % _queues.size();
+    return bthread::execution_queue_execute(_queues[index], task);
+}
+
+static void RunCommandTask(RedisCommandTask* task) {
+    butil::Arena arena;
+    RedisReply output(&arena);
+    std::vector<butil::StringPiece> args(task->args.begin(), task->args.end());
+    if (task->handler->Run(args, &output, false) != REDIS_CMD_HANDLED) {
+        LOG(ERROR) << "Key-partitionable handler of `" << args[0]
+                   << "' must return REDIS_CMD_HANDLED";
+        output.Reset();
+        output.SetError("ERR invalid result of partitionable command");
+    }
+    butil::IOBufAppender appender;
+    output.SerializeTo(&appender);
+    appender.move_to(*task->reply);
+}
+
+int RedisShards::Consume(void*, bthread::TaskIterator<RedisCommandTask*>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    for (; iter; ++iter) {
+        std::unique_ptr<RedisCommandTask> task(*iter);
+        RunCommandTask(task.get());
+        RedisConnContext* ctx = task->ctx;
+        RedisReplyBatch* batch = task->batch;
+        ctx->OnTaskDone();
+        if (batch->nunfinished.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            ctx->OnBatchDone(batch);
+        }
+    }
+    return 0;
+}
+
+// Run `args' in shards if the handler is key-partitionable.
+// Returns true if the command is dispatched.
+static bool DispatchCommand(RedisConnContext* ctx,
+                            const std::vector<butil::StringPiece>& args,
+                            RedisReplyBatch* batch,
+                            butil::IOBufAppender* appender) {
+    if (ctx->transaction_handler || ctx->batched_size != 0 || args.size() < 2) {
+        return false;
+    }
+    RedisCommandHandler* ch = ctx->redis_service->FindCommandHandler(args[0]);
+    if (ch == NULL || !ch->IsKeyPartitionable()) {
+        return false;
+    }
+    // Replies of previous commands.
+    butil::IOBuf* prev = new butil::IOBuf;
+    appender->move_to(*prev);
+    batch->parts.push_back(prev);
+    RedisCommandTask* task = new RedisCommandTask;
+    task->ctx = ctx;
+    task->handler = ch;
+    task->args.reserve(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        task->args.push_back(args[i].as_string());
+    }
+    task->batch = batch;
+    task->reply = new butil::IOBuf;
+    batch->parts.push_back(task->reply);
+    {
+        BAIDU_SCOPED_LOCK(ctx->inflight_mutex);
+        ++ctx->ninflight;
+    }
+    batch->nunfinished.fetch_add(1, butil::memory_order_relaxed);
+    if (ctx->redis_service->shards()->Execute(task) != 0) {
+        // Run in place instead.
+        RunCommandTask(task);
+        delete task;
+        ctx->OnTaskDone();
+        batch->nunfinished.fetch_sub(1, butil::memory_order_relaxed);
+    }
+    return true;
+}
+
+// Parse and run commands in `source' with shards, see
+// RedisService::SetExecutionShards().
+static ParseResult ParseRedisCommandsWithShards(butil::IOBuf* source,
+                                                Socket* socket,
+                                                RedisConnContext* ctx) {
+    std::vector<butil::StringPiece> current_args;
+    ParseError err = ctx->parser.Consume(*source, &current_args, &ctx->arena);
+    if (err != PARSE_OK) {
+        return MakeParseError(err);
+    }
+    RedisReplyBatch* batch = new RedisReplyBatch;
+    socket->ReAddress(&batch->socket);
+    {
+        BAIDU_SCOPED_LOCK(ctx->batch_mutex);
+        ctx->batches.push_back(batch);
+    }
+    butil::IOBufAppender appender;
+    int rc = 0;
+    while (true) {
+        std::vector<butil::StringPiece> next_args;
+        err = ctx->parser.Consume(*source, &next_args, &ctx->arena);
+        const bool last = (err != PARSE_OK);
+        if (!DispatchCommand(ctx, current_args, batch, &appender)) {
+            // Other commands may access any keys.
+            ctx->WaitInflight();
+            rc = ConsumeCommand(ctx, current_args, last, &appender);
+            if (rc != 0) {
+                break;
+            }
+        }
+        if (last) {
+            break;
+        }
+        current_args.swap(next_args);
+    }
+    butil::IOBuf* rest = new butil::IOBuf;
+    appender.move_to(*rest);
+    batch->parts.push_back(rest);
+    ctx->arena.clear();
+    if (batch->nunfinished.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+        ctx->OnBatchDone(batch);
+    }
+    if (rc != 0) {
+        return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
+    }
+    return MakeParseError(err);
+}
+
 // ========== impl of RedisConnContext ==========
 
 ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
@@ -159,6 +402,9 @@ ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
             ctx = new RedisConnContext(rs);
             socket->reset_parsing_context(ctx);
         }
+        if (rs->shards() != NULL) {
+            return ParseRedisCommandsWithShards(source, socket, ctx);
+        }
         std::vector<butil::StringPiece> current_args;
         butil::IOBufAppender appender;
         ParseError err = PARSE_OK;
@@ -19,12 +19,36 @@
 #ifndef BRPC_POLICY_REDIS_PROTOCOL_H
 #define BRPC_POLICY_REDIS_PROTOCOL_H
 
+#include "bthread/execution_queue.h"
 #include "brpc/protocol.h"
 
 
 namespace brpc {
 namespace policy {
 
+struct RedisCommandTask;
+
+// ExecutionQueues running commands of key-partitionable handlers, see
+// RedisService::SetExecutionShards().
+class RedisShards {
+public:
+    RedisShards() {}
+    ~RedisShards();
+
+    int Init(int num_shards);
+
+    // Run `task' in the shard selected by the key.
+    // Returns 0 on success, -1 otherwise.
+    int Execute(RedisCommandTask* task);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisShards);
+
+    static int Consume(void* meta, bthread::TaskIterator<RedisCommandTask*>& iter);
+
+    std::vector<bthread::ExecutionQueueId<RedisCommandTask*> > _queues;
+};
+
 // Parse redis response.
 ParseResult ParseRedisMessage(butil::IOBuf* source, Socket *socket, bool read_eof,
                               const void *arg);
@@ -37,6 +37,7 @@
 #include <thrift/Thrift.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
 #include <thrift/TApplicationException.h>
 
 // _THRIFT_STDCXX_H_ is defined by thrift/stdcxx.h which was added since thrift 0.11.0
@@ -60,17 +61,98 @@ namespace policy {
 static const uint32_t MAX_THRIFT_METHOD_NAME_LENGTH = 256; // reasonably large
 static const uint32_t THRIFT_HEAD_VERSION_MASK = (uint32_t)0xffffff00;
 static const uint32_t THRIFT_HEAD_VERSION_1 = (uint32_t)0x80010000;
+static const uint8_t THRIFT_COMPACT_PROTOCOL_ID = 0x82;
+static const uint8_t THRIFT_COMPACT_VERSION = 1;
+static const uint8_t THRIFT_COMPACT_VERSION_MASK = 0x1f;
+static const int THRIFT_COMPACT_TYPE_SHIFT = 5;
+// Upper bound of bytes before the method name in both protocols.
+static const size_t MAX_THRIFT_MESSAGE_BEGIN_EXTRA = 12;
 struct thrift_head_t {
     uint32_t body_len;
 };
 
+typedef ::apache::thrift::transport::TMemoryBuffer ThriftMemoryBuffer;
+typedef ::apache::thrift::protocol::TBinaryProtocolT<ThriftMemoryBuffer>
+    ThriftBinaryProtocol;
+typedef ::apache::thrift::protocol::TCompactProtocolT<ThriftMemoryBuffer>
+    ThriftCompactProtocol;
+
+// Read a varint32 of TCompactProtocol from `p' which has `n' bytes.
+// Returns bytes read, 0 on error.
+static size_t ReadCompactVarint32(const uint8_t* p, size_t n, uint32_t* value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < n && i < 5; ++i) {
+        result |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if ((p[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static size_t WriteCompactVarint32(char* p, uint32_t value) {
+    size_t i = 0;
+    while (value >= 0x80) {
+        p[i++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    p[i++] = (char)value;
+    return i;
+}
+
 // A faster implementation of TProtocol::readMessageBegin without depending
 // on thrift stuff.
 static butil::Status
 ReadThriftMessageBegin(butil::IOBuf* body,
                        std::string* method_name,
                        ::apache::thrift::protocol::TMessageType* mtype,
-                       uint32_t* seq_id) {
+                       uint32_t* seq_id,
+                       ThriftProtocolType* protocol) {
+    uint8_t first_byte = 0;
+    if (body->copy_to(&first_byte, 1) != 1) {
+        return butil::Status(-1, "Fail to copy 1 byte from body");
+    }
+    if (first_byte == THRIFT_COMPACT_PROTOCOL_ID) {
+        // Compact protocol format:
+        // Protocol id + Version and type + Sequence Id + Length + Method
+        //      |               |                |          |        |
+        //      1       +       1       +    varint32 + varint32 +   >0
+        uint8_t buf[MAX_THRIFT_MESSAGE_BEGIN_EXTRA];
+        const size_t n = body->copy_to(buf, sizeof(buf));
+        if (n < 4) {
+            return butil::Status(-1, "Fail to copy message begin from body");
+        }
+        if ((buf[1] & THRIFT_COMPACT_VERSION_MASK) != THRIFT_COMPACT_VERSION) {
+            return butil::Status(-1, "Unknown version of compact protocol");
+        }
+        *mtype = (apache::thrift::protocol::TMessageType)
+            (buf[1] >> THRIFT_COMPACT_TYPE_SHIFT);
+        size_t pos = 2;
+        size_t k = ReadCompactVarint32(buf + pos, n - pos, seq_id);
+        if (k == 0) {
+            return butil::Status(-1, "Invalid seq_id");
+        }
+        pos += k;
+        uint32_t method_name_length = 0;
+        k = ReadCompactVarint32(buf + pos, n - pos, &method_name_length);
+        if (k == 0) {
+            return butil::Status(-1, "Invalid length of method_name");
+        }
+        pos += k;
+        if (method_name_length > MAX_THRIFT_METHOD_NAME_LENGTH) {
+            return butil::Status(-1, "method_name_length=%u is too long",
+                                 method_name_length);
+        }
+        body->pop_front(pos);
+        method_name->resize(method_name_length);
+        if (body->cutn(&(*method_name)[0], method_name_length)
+            != method_name_length) {
+            return butil::Status(-1, "Fail to cut %u bytes", method_name_length);
+        }
+        *protocol = THRIFT_PROTOCOL_COMPACT;
+        return butil::Status::OK();
+    }
     // Thrift protocol format:
     // Version + Message type + Length + Method + Sequence Id
     //   |             |          |        |          |
@@ -98,39 +180,73 @@ ReadThriftMessageBegin(butil::IOBuf* body,
     // suppress strict-aliasing warning
     uint32_t* p_seq_id = (uint32_t*)(buf + sizeof(version_and_len_buf) + method_name_length);
     *seq_id = ntohl(*p_seq_id);
+    *protocol = THRIFT_PROTOCOL_BINARY;
     return butil::Status::OK();
 }
 
-inline size_t ThriftMessageBeginSize(const std::string& method_name) {
-    return 12 + method_name.size();
-}
-
-static void
+// Write the message begin into `buf' which has at least
+// MAX_THRIFT_MESSAGE_BEGIN_EXTRA + method_name.size() bytes.
+// Returns bytes written.
+static size_t
 WriteThriftMessageBegin(char* buf,
                         const std::string& method_name,
                         ::apache::thrift::protocol::TMessageType mtype,
-                        uint32_t seq_id) {
+                        uint32_t seq_id,
+                        ThriftProtocolType protocol) {
     char* p = buf;
-    *(uint32_t*)p = htonl(THRIFT_HEAD_VERSION_1 | (((uint32_t)mtype) & 0x000000FF));
+    if (protocol == THRIFT_PROTOCOL_COMPACT) {
+        *p++ = (char)THRIFT_COMPACT_PROTOCOL_ID;
+        *p++ = (char)(THRIFT_COMPACT_VERSION |
+                      ((uint8_t)mtype << THRIFT_COMPACT_TYPE_SHIFT));
+        p += WriteCompactVarint32(p, seq_id);
+        p += WriteCompactVarint32(p, method_name.size());
+        memcpy(p, method_name.data(), method_name.size());
+        p += method_name.size();
+        return p - buf;
+    }
+    const uint32_t version = htonl(THRIFT_HEAD_VERSION_1 | (((uint32_t)mtype) & 0x000000FF));
+    memcpy(p, &version, 4);
     p += 4;
-    *(uint32_t*)p = htonl(method_name.size());
+    const uint32_t len = htonl(method_name.size());
+    memcpy(p, &len, 4);
     p += 4;
     memcpy(p, method_name.data(), method_name.size());
     p += method_name.size();
-    *p = htonl(seq_id);
+    const uint32_t net_seq_id = htonl(seq_id);
+    memcpy(p, &net_seq_id, 4);
+    p += 4;
+    return p - buf;
 }
 
-bool ReadThriftStruct(const butil::IOBuf& body,
-                      ThriftMessageBase* raw_msg,
-                      int16_t expected_fid) {
+// Append a frame of message begin and `body' which is already encoded.
+static void AppendThriftFrame(const std::string& method_name,
+                              ::apache::thrift::protocol::TMessageType mtype,
+                              uint32_t seq_id,
+                              ThriftProtocolType protocol,
+                              const butil::IOBuf& body,
+                              butil::IOBuf* out) {
+    char buf[sizeof(thrift_head_t) + MAX_THRIFT_MESSAGE_BEGIN_EXTRA +
+             method_name.size()];
+    const size_t mb_size = WriteThriftMessageBegin(
+        buf + sizeof(thrift_head_t), method_name, mtype, seq_id, protocol);
+    // suppress strict-aliasing warning
+    thrift_head_t* head = (thrift_head_t*)buf;
+    head->body_len = htonl(mb_size + body.size());
+    out->append(buf, sizeof(thrift_head_t) + mb_size);
+    out->append(body);
+}
+
+template <typename PROTOCOL>
+static bool ReadThriftStructT(const butil::IOBuf& body,
+                              ThriftMessageBase* raw_msg,
+                              int16_t expected_fid) {
     const size_t body_len  = body.size();
     uint8_t* thrift_buffer = (uint8_t*)malloc(body_len);
     body.copy_to(thrift_buffer, body_len);
     auto in_buffer =
-        THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>(
-            thrift_buffer, body_len,
-            ::apache::thrift::transport::TMemoryBuffer::TAKE_OWNERSHIP);
-    apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> iprot(in_buffer);
+        THRIFT_STDCXX::make_shared<ThriftMemoryBuffer>(
+            thrift_buffer, body_len, ThriftMemoryBuffer::TAKE_OWNERSHIP);
+    PROTOCOL iprot(in_buffer);
 
     // The following code was taken from thrift auto generate code
     std::string fname;
@@ -164,22 +280,102 @@ bool ReadThriftStruct(const butil::IOBuf& body,
     return success;
 }
 
-void ReadThriftException(const butil::IOBuf& body,
-                         ::apache::thrift::TApplicationException* x) {
+bool ReadThriftStruct(const butil::IOBuf& body,
+                      ThriftMessageBase* raw_msg,
+                      int16_t expected_fid,
+                      ThriftProtocolType protocol) {
+    if (protocol == THRIFT_PROTOCOL_COMPACT) {
+        return ReadThriftStructT<ThriftCompactProtocol>(body, raw_msg, expected_fid);
+    }
+    return ReadThriftStructT<ThriftBinaryProtocol>(body, raw_msg, expected_fid);
+}
+
+template <typename PROTOCOL>
+static void ReadThriftExceptionT(const butil::IOBuf& body,
+                                 ::apache::thrift::TApplicationException* x) {
     size_t body_len  = body.size();
     uint8_t* thrift_buffer = (uint8_t*)malloc(body_len);
     body.copy_to(thrift_buffer, body_len);
     auto in_buffer =
-        THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>(
-            thrift_buffer, body_len,
-            ::apache::thrift::transport::TMemoryBuffer::TAKE_OWNERSHIP);
-    apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> iprot(in_buffer);
+        THRIFT_STDCXX::make_shared<ThriftMemoryBuffer>(
+            thrift_buffer, body_len, ThriftMemoryBuffer::TAKE_OWNERSHIP);
+    PROTOCOL iprot(in_buffer);
 
     x->read(&iprot);
     iprot.readMessageEnd();
     iprot.getTransport()->readEnd();
 }
 
+static void ReadThriftException(const butil::IOBuf& body,
+                                ThriftProtocolType protocol,
+                                ::apache::thrift::TApplicationException* x) {
+    if (protocol == THRIFT_PROTOCOL_COMPACT) {
+        return ReadThriftExceptionT<ThriftCompactProtocol>(body, x);
+    }
+    return ReadThriftExceptionT<ThriftBinaryProtocol>(body, x);
+}
+
+// Serialize a message with `raw_msg' as the field `fid' of a struct named
+// `struct_name', or an exception with `error_text' when `raw_msg' is NULL,
+// and append the frame to `out'.
+template <typename PROTOCOL>
+static void WriteThriftMessageT(const std::string& method_name,
+                                ::apache::thrift::protocol::TMessageType mtype,
+                                uint32_t seq_id,
+                                const char* struct_name,
+                                const char* field_name,
+                                int16_t fid,
+                                const ThriftMessageBase* raw_msg,
+                                const std::string& error_text,
+                                butil::IOBuf* out) {
+    auto out_buffer = THRIFT_STDCXX::make_shared<ThriftMemoryBuffer>();
+    PROTOCOL oprot(out_buffer);
+    oprot.writeMessageBegin(method_name, mtype, seq_id);
+    if (raw_msg == NULL) {
+        ::apache::thrift::TApplicationException x(error_text);
+        x.write(&oprot);
+    } else {
+        uint32_t xfer = 0;
+        xfer += oprot.writeStructBegin(struct_name);
+        xfer += oprot.writeFieldBegin(field_name,
+                                      ::apache::thrift::protocol::T_STRUCT, fid);
+        xfer += raw_msg->Write(&oprot);
+        xfer += oprot.writeFieldEnd();
+        xfer += oprot.writeFieldStop();
+        xfer += oprot.writeStructEnd();
+    }
+    oprot.writeMessageEnd();
+    oprot.getTransport()->writeEnd();
+    oprot.getTransport()->flush();
+
+    uint8_t* buf;
+    uint32_t sz;
+    out_buffer->getBuffer(&buf, &sz);
+    const thrift_head_t head = { htonl(sz) };
+    out->append(&head, sizeof(head));
+    out->append(buf, sz);
+}
+
+static void WriteThriftMessage(ThriftProtocolType protocol,
+                               const std::string& method_name,
+                               ::apache::thrift::protocol::TMessageType mtype,
+                               uint32_t seq_id,
+                               const char* struct_name,
+                               const char* field_name,
+                               int16_t fid,
+                               const ThriftMessageBase* raw_msg,
+                               const std::string& error_text,
+                               butil::IOBuf* out) {
+    if (protocol == THRIFT_PROTOCOL_COMPACT) {
+        return WriteThriftMessageT<ThriftCompactProtocol>(
+            method_name, mtype, seq_id, struct_name, field_name, fid,
+            raw_msg, error_text, out);
+    }
+    return WriteThriftMessageT<ThriftBinaryProtocol>(
+        method_name, mtype, seq_id, struct_name, field_name, fid,
+        raw_msg, error_text, out);
+}
+
 // The continuation of request processing. Namely send response back to client.
 class ThriftClosure : public google::protobuf::Closure {
 public:
@@ -277,63 +473,30 @@ void ThriftClosure::DoRun() {
     const uint32_t seq_id = (uint32_t)_controller.log_id();
 
     butil::IOBuf write_buf;
+    // Responses are in the protocol of the request.
+    const ThriftProtocolType protocol = _request.protocol;
+    // An empty body is valid in any protocol.
+    if (!_controller.Failed() && !_response.raw_instance() &&
+        !_response.body.empty() && _response.protocol != protocol) {
+        _controller.SetFailed(EINTERNAL, "Protocol of response body does not "
+                              "match the request");
+    }
 
     // The following code was taken and modified from thrift auto generated code
     if (_controller.Failed()) {
-        auto out_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> oprot(out_buffer);
-        ::apache::thrift::TApplicationException x(_controller.ErrorText());
-        oprot.writeMessageBegin(
-            method_name, ::apache::thrift::protocol::T_EXCEPTION, seq_id);
-        x.write(&oprot);
-        oprot.writeMessageEnd();
-        oprot.getTransport()->writeEnd();
-        oprot.getTransport()->flush();
-
-        uint8_t* buf;
-        uint32_t sz;
-        out_buffer->getBuffer(&buf, &sz);
-        const thrift_head_t head = { htonl(sz) };
-        write_buf.append(&head, sizeof(head));
-        write_buf.append(buf, sz);
+        WriteThriftMessage(protocol, method_name,
+                           ::apache::thrift::protocol::T_EXCEPTION, seq_id,
+                           NULL, NULL, 0, NULL, _controller.ErrorText(),
+                           &write_buf);
     } else if (_response.raw_instance()) {
-        auto out_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> oprot(out_buffer);
-        oprot.writeMessageBegin(
-            method_name, ::apache::thrift::protocol::T_REPLY, seq_id);
-
-        uint32_t xfer = 0;
-        xfer += oprot.writeStructBegin("rpc_result"); // can be any valid name
-        xfer += oprot.writeFieldBegin("success",
-                                      ::apache::thrift::protocol::T_STRUCT,
-                                      THRIFT_RESPONSE_FID);
-        xfer += _response.raw_instance()->Write(&oprot);
-        xfer += oprot.writeFieldEnd();
-        xfer += oprot.writeFieldStop();
-        xfer += oprot.writeStructEnd();
-
-        oprot.writeMessageEnd();
-        oprot.getTransport()->writeEnd();
-        oprot.getTransport()->flush();
-
-        uint8_t* buf;
-        uint32_t sz;
-        out_buffer->getBuffer(&buf, &sz);
-        const thrift_head_t head = { htonl(sz) };
-        write_buf.append(&head, sizeof(head));
-        write_buf.append(buf, sz);
+        WriteThriftMessage(protocol, method_name,
+                           ::apache::thrift::protocol::T_REPLY, seq_id,
+                           "rpc_result"/*can be any valid name*/, "success",
+                           THRIFT_RESPONSE_FID, _response.raw_instance(),
+                           std::string(), &write_buf);
     } else {
-        const size_t mb_size = ThriftMessageBeginSize(method_name);
-        char buf[sizeof(thrift_head_t) + mb_size];
-        // suppress strict-aliasing warning
-        thrift_head_t* head = (thrift_head_t*)buf;
-        head->body_len = htonl(mb_size + _response.body.size());
-        WriteThriftMessageBegin(buf + sizeof(thrift_head_t), method_name,
-                                ::apache::thrift::protocol::T_REPLY, seq_id);
-        write_buf.append(buf, sizeof(buf));
-        write_buf.append(_response.body.movable());
+        AppendThriftFrame(method_name, ::apache::thrift::protocol::T_REPLY,
+                          seq_id, protocol, _response.body, &write_buf);
     }
     
     if (span) {
@@ -367,9 +530,13 @@ ParseResult ParseThriftMessage(butil::IOBuf* source,
 
     const uint32_t sz = ntohl(*(uint32_t*)(header_buf + sizeof(thrift_head_t)));
     uint32_t version = sz & THRIFT_HEAD_VERSION_MASK;
-    if (version != THRIFT_HEAD_VERSION_1) {
+    const uint8_t* p = (const uint8_t*)header_buf + sizeof(thrift_head_t);
+    const bool compact = (p[0] == THRIFT_COMPACT_PROTOCOL_ID &&
+                          (p[1] & THRIFT_COMPACT_VERSION_MASK) == THRIFT_COMPACT_VERSION);
+    if (version != THRIFT_HEAD_VERSION_1 && !compact) {
         RPC_VLOG << "version=" << version
-                 << " doesn't match THRIFT_VERSION=" << THRIFT_HEAD_VERSION_1;
+                 << " doesn't match THRIFT_VERSION=" << THRIFT_HEAD_VERSION_1
+                 << " and it's not compact protocol";
         return MakeParseError(PARSE_ERROR_TRY_OTHERS);
     }
     // suppress strict-aliasing warning
@@ -473,12 +640,21 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
     uint32_t seq_id;
     ::apache::thrift::protocol::TMessageType mtype;
     butil::Status st = ReadThriftMessageBegin(
-        &msg->payload, &cntl->_thrift_method_name, &mtype, &seq_id);
+        &msg->payload, &cntl->_thrift_method_name, &mtype, &seq_id,
+        &req->protocol);
     if (!st.ok()) {
         return cntl->SetFailed(EREQUEST, "%s", st.error_cstr());
     }
+    // "service:method" of TMultiplexedProtocol, replied with "method".
+    const size_t colon_pos = cntl->_thrift_method_name.find(':');
+    if (colon_pos != std::string::npos) {
+        req->service_name.assign(cntl->_thrift_method_name, 0, colon_pos);
+        cntl->_thrift_method_name.erase(0, colon_pos + 1);
+    }
     msg->payload.swap(req->body);
     req->field_id = THRIFT_REQUEST_FID;
+    // Reply in the protocol of the request unless the service says otherwise.
+    res->protocol = req->protocol;
     cntl->set_log_id(seq_id);    // Pass seq_id by log_id
 
     ThriftService* service = server->options().thrift_service;
@@ -584,15 +760,17 @@ void ProcessThriftResponse(InputMessageBase* msg_base) {
         std::string fname;
         ::apache::thrift::protocol::TMessageType mtype;
         uint32_t seq_id = 0; // unchecked
+        ThriftProtocolType protocol = THRIFT_PROTOCOL_BINARY;
         
-        butil::Status st = ReadThriftMessageBegin(&msg->payload, &fname, &mtype, &seq_id);
+        butil::Status st = ReadThriftMessageBegin(&msg->payload, &fname, &mtype,
+                                                  &seq_id, &protocol);
         if (!st.ok()) {
             cntl->SetFailed(ERESPONSE, "%s", st.error_cstr());
             break;
         }
         if (mtype == ::apache::thrift::protocol::T_EXCEPTION) {
             ::apache::thrift::TApplicationException x;
-            ReadThriftException(msg->payload, &x);
+            ReadThriftException(msg->payload, protocol, &x);
             // TODO: Convert exception type to brpc errors.
             cntl->SetFailed(x.what());
             break;
@@ -601,10 +779,15 @@ void ProcessThriftResponse(InputMessageBase* msg_base) {
             cntl->SetFailed(ERESPONSE, "message_type is not T_REPLY");
             break;
         }
-        if (fname != cntl->thrift_method_name()) {
+        // Servers of TMultiplexedProtocol reply without the service name.
+        const std::string& method_name = cntl->thrift_method_name();
+        const size_t colon_pos = method_name.find(':');
+        if (fname != method_name &&
+            (colon_pos == std::string::npos ||
+             method_name.compare(colon_pos + 1, std::string::npos, fname) != 0)) {
             cntl->SetFailed(ERESPONSE,
                             "response.method_name=%s does not match request.method_name=%s",
-                            fname.c_str(), cntl->thrift_method_name().c_str());
+                            fname.c_str(), method_name.c_str());
             break;
         }
 
@@ -615,13 +798,14 @@ void ProcessThriftResponse(InputMessageBase* msg_base) {
         if (response) {
             if (response->raw_instance()) {
                 if (!ReadThriftStruct(msg->payload, response->raw_instance(),
-                                      THRIFT_RESPONSE_FID)) {
+                                      THRIFT_RESPONSE_FID, protocol)) {
                     cntl->SetFailed(ERESPONSE, "Fail to read presult");
                     break;
                 }
             } else {
                 msg->payload.swap(response->body);
                 response->field_id = THRIFT_RESPONSE_FID;
+                response->protocol = protocol;
             }
         } // else just ignore the response.
     } while (false);
@@ -668,55 +852,28 @@ void SerializeThriftRequest(butil::IOBuf* request_buf, Controller* cntl,
 
     // xxx_pargs write
     if (req->raw_instance()) {
-        auto out_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> oprot(out_buffer);
-
-        oprot.writeMessageBegin(
-            method_name, ::apache::thrift::protocol::T_CALL, 0/*seq_id*/);
-
-        uint32_t xfer = 0;
-        char struct_begin_str[32 + method_name.size()];
+        // Named after the bare method as thrift generated code does, even
+        // if `method_name' is "service:method" of TMultiplexedProtocol.
+        const size_t colon_pos = method_name.find(':');
+        const size_t bare_pos =
+            (colon_pos == std::string::npos ? 0 : colon_pos + 1);
+        const size_t bare_len = method_name.size() - bare_pos;
+        char struct_begin_str[32 + bare_len];
         char* p = struct_begin_str;
         memcpy(p, "ThriftService_", 14);
         p += 14;
-        memcpy(p, method_name.data(), method_name.size());
-        p += method_name.size();
+        memcpy(p, method_name.data() + bare_pos, bare_len);
+        p += bare_len;
         memcpy(p, "_pargs", 6);
         p += 6;
         *p = '\0';
-        xfer += oprot.writeStructBegin(struct_begin_str);
-        xfer += oprot.writeFieldBegin("request", ::apache::thrift::protocol::T_STRUCT,
-                                      THRIFT_REQUEST_FID);
-
-        // request's write
-        xfer += req->raw_instance()->Write(&oprot);
-        
-        xfer += oprot.writeFieldEnd();
-        xfer += oprot.writeFieldStop();
-        xfer += oprot.writeStructEnd();
-
-        oprot.writeMessageEnd();
-        oprot.getTransport()->writeEnd();
-        oprot.getTransport()->flush();
-
-        uint8_t* buf;
-        uint32_t sz;
-        out_buffer->getBuffer(&buf, &sz);
-
-        const thrift_head_t head = { htonl(sz) };
-        request_buf->append(&head, sizeof(head));
-        request_buf->append(buf, sz);
+        WriteThriftMessage(req->protocol, method_name,
+                           ::apache::thrift::protocol::T_CALL, 0/*seq_id*/,
+                           struct_begin_str, "request", THRIFT_REQUEST_FID,
+                           req->raw_instance(), std::string(), request_buf);
     } else {
-        const size_t mb_size = ThriftMessageBeginSize(method_name);
-        char buf[sizeof(thrift_head_t) + mb_size];
-        // suppress strict-aliasing warning
-        thrift_head_t* head = (thrift_head_t*)buf;
-        head->body_len = htonl(mb_size + req->body.size());
-        WriteThriftMessageBegin(buf + sizeof(thrift_head_t), method_name,
-                                ::apache::thrift::protocol::T_CALL, 0/*seq_id*/);
-        request_buf->append(buf, sizeof(buf));
-        request_buf->append(req->body);
+        AppendThriftFrame(method_name, ::apache::thrift::protocol::T_CALL,
+                          0/*seq_id*/, req->protocol, req->body, request_buf);
     }
 }
 
@@ -22,6 +22,7 @@
 #include "butil/strings/string_util.h"          // StringToLowerASCII
 #include "brpc/redis.h"
 #include "brpc/redis_command.h"
+#include "brpc/policy/redis_protocol.h"
 
 namespace brpc {
 
@@ -436,6 +437,31 @@ std::ostream& operator<<(std::ostream& os, const RedisResponse& response) {
     return os;
 }
 
+RedisService::RedisService()
+    : _shards(NULL) {}
+
+RedisService::~RedisService() {
+    delete _shards;
+    _shards = NULL;
+}
+
+int RedisService::SetExecutionShards(int num_shards) {
+    if (_shards != NULL) {
+        LOG(ERROR) << "Execution shards were set";
+        return -1;
+    }
+    if (num_shards <= 0) {
+        return 0;
+    }
+    policy::RedisShards* shards = new policy::RedisShards;
+    if (shards->Init(num_shards) != 0) {
+        delete shards;
+        return -1;
+    }
+    _shards = shards;
+    return 0;
+}
+
 bool RedisService::AddCommandHandler(const std::string& name, RedisCommandHandler* handler) {
     std::string lcname = StringToLowerASCII(name);
     auto it = _command_map.find(lcname);
@@ -215,21 +215,41 @@ std::ostream& operator<<(std::ostream& os, const RedisResponse&);
 
 class RedisCommandHandler;
 
+namespace policy {
+class RedisShards;
+}
+
 // Container of CommandHandlers.
 // Assign an instance to ServerOption.redis_service to enable redis support. 
 class RedisService {
 public:
-    virtual ~RedisService() {}
+    RedisService();
+    virtual ~RedisService();
     
     // Call this function to register `handler` that can handle command `name`.
     bool AddCommandHandler(const std::string& name, RedisCommandHandler* handler);
 
+    // Run commands of key-partitionable handlers(see
+    // RedisCommandHandler::IsKeyPartitionable) in `num_shards' ExecutionQueues
+    // selected by hash of the key, so that pipelined commands from one
+    // connection run on multiple cores. Commands with a same key run in
+    // order, other commands wait for previous commands in shards to finish,
+    // and replies are always sent in the order of commands.
+    // Call this function before starting the server. By default all commands
+    // of a connection run one by one in the bthread parsing them.
+    // Returns 0 on success, -1 otherwise.
+    int SetExecutionShards(int num_shards);
+
     // This function should not be touched by user and used by brpc deverloper only.
     RedisCommandHandler* FindCommandHandler(const butil::StringPiece& name) const;
+    policy::RedisShards* shards() const { return _shards; }
 
 private:
+    DISALLOW_COPY_AND_ASSIGN(RedisService);
+
     typedef std::unordered_map<std::string, RedisCommandHandler*> CommandMap;
     CommandMap _command_map;
+    policy::RedisShards* _shards;
 };
 
 enum RedisCommandHandlerResult {
@@ -280,6 +300,12 @@ public:
     // 5) An ending marker(exec) is found in transaction_handler.Run(), user exeuctes all
     // the commands and return OK. This Transation is done.
     virtual RedisCommandHandler* NewTransactionHandler();
+
+    // Return true if Run() only accesses the key at args[1] and is
+    // thread-safe, so that commands of this handler can run concurrently when
+    // RedisService::SetExecutionShards() is called. Such handlers must
+    // return REDIS_CMD_HANDLED and are not used in transactions or batches.
+    virtual bool IsKeyPartitionable() const { return false; }
 };
 
 } // namespace brpc
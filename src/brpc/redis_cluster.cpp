@@ -0,0 +1,771 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <memory>
+#include "butil/string_splitter.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/countdown_event.h"
+#include "brpc/log.h"
+#include "brpc/redis.h"
+#include "brpc/redis_command.h"
+#include "brpc/redis_cluster.h"
+
+namespace brpc {
+
+// CRC16-CCITT(XMODEM) used by redis cluster.
+static const uint16_t s_crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static uint16_t CRC16(const char* buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc << 8) ^ s_crc16_table[((crc >> 8) ^ (uint8_t)buf[i]) & 0xFF];
+    }
+    return crc;
+}
+
+int RedisClusterKeySlot(const butil::StringPiece& key) {
+    butil::StringPiece hashed = key;
+    const size_t start = key.find('{');
+    if (start != butil::StringPiece::npos) {
+        const size_t end = key.find('}', start + 1);
+        if (end != butil::StringPiece::npos && end != start + 1) {
+            hashed = key.substr(start + 1, end - start - 1);
+        }
+    }
+    return CRC16(hashed.data(), hashed.size()) & (REDIS_CLUSTER_SLOTS - 1);
+}
+
+RedisClusterChannelOptions::RedisClusterChannelOptions()
+    : max_redirect(5) {
+    protocol = PROTOCOL_REDIS;
+}
+
+// How replies of a command split by keys are merged.
+enum RedisMergeType {
+    REDIS_MERGE_NONE = 0,   // not split
+    REDIS_MERGE_ARRAY,      // MGET
+    REDIS_MERGE_SUM,        // DEL EXISTS UNLINK TOUCH
+    REDIS_MERGE_STATUS,     // MSET
+};
+
+// Commands with keys at args[1..] which are split by keys.
+static RedisMergeType GetMergeType(const butil::StringPiece& name) {
+    if (name == "mget") {
+        return REDIS_MERGE_ARRAY;
+    } else if (name == "del" || name == "exists" ||
+               name == "unlink" || name == "touch") {
+        return REDIS_MERGE_SUM;
+    } else if (name == "mset") {
+        return REDIS_MERGE_STATUS;
+    }
+    return REDIS_MERGE_NONE;
+}
+
+// Serialize `r' in redis protocol. Unlike RedisReply::SerializeTo, nil is
+// serialized as well.
+static void SerializeReply(const RedisReply& r, butil::IOBufAppender* appender) {
+    switch (r.type()) {
+    case REDIS_REPLY_STATUS:
+        appender->push_back('+');
+        appender->append(r.data().data(), r.data().size());
+        appender->append("\r\n", 2);
+        return;
+    case REDIS_REPLY_ERROR:
+        appender->push_back('-');
+        appender->append(r.error_message(), strlen(r.error_message()));
+        appender->append("\r\n", 2);
+        return;
+    case REDIS_REPLY_INTEGER:
+        appender->push_back(':');
+        appender->append_decimal(r.integer());
+        appender->append("\r\n", 2);
+        return;
+    case REDIS_REPLY_STRING:
+        if (r.is_nil()) {
+            appender->append("$-1\r\n", 5);
+            return;
+        }
+        appender->push_back('$');
+        appender->append_decimal(r.data().size());
+        appender->append("\r\n", 2);
+        appender->append(r.data().data(), r.data().size());
+        appender->append("\r\n", 2);
+        return;
+    case REDIS_REPLY_ARRAY:
+        if (r.is_nil()) {
+            appender->append("*-1\r\n", 5);
+            return;
+        }
+        appender->push_back('*');
+        appender->append_decimal(r.size());
+        appender->append("\r\n", 2);
+        for (size_t i = 0; i < r.size(); ++i) {
+            SerializeReply(r[i], appender);
+        }
+        return;
+    case REDIS_REPLY_NIL:
+        appender->append("$-1\r\n", 5);
+        return;
+    }
+}
+
+static void AppendErrorReply(const butil::StringPiece& msg,
+                             butil::IOBufAppender* appender) {
+    appender->push_back('-');
+    appender->append(msg.data(), msg.size());
+    appender->append("\r\n", 2);
+}
+
+// Parse "MOVED <slot> <host:port>" or "ASK <slot> <host:port>".
+static bool ParseRedirect(const RedisReply& reply, bool* ask,
+                          int* slot, butil::EndPoint* node) {
+    if (!reply.is_error()) {
+        return false;
+    }
+    const char* msg = reply.error_message();
+    const char* p = NULL;
+    if (strncmp(msg, "MOVED ", 6) == 0) {
+        *ask = false;
+        p = msg + 6;
+    } else if (strncmp(msg, "ASK ", 4) == 0) {
+        *ask = true;
+        p = msg + 4;
+    } else {
+        return false;
+    }
+    char* endptr = NULL;
+    const long s = strtol(p, &endptr, 10);
+    if (endptr == p || *endptr != ' ' || s < 0 || s >= REDIS_CLUSTER_SLOTS) {
+        return false;
+    }
+    *slot = (int)s;
+    return butil::str2endpoint(endptr + 1, node) == 0;
+}
+
+// A command split from the request, sent to a node in one sub call.
+struct RedisSubCommand {
+    std::vector<butil::StringPiece> args;
+    int slot;                   // -1 for commands without keys.
+    int nredirect;
+    bool asking;                // send ASKING before the command
+    butil::EndPoint ask_node;
+    const RedisReply* reply;    // NULL before the reply arrives.
+};
+
+// A command in the request.
+struct RedisClusterCommand {
+    RedisMergeType merge_type;
+    size_t first_sub;
+    size_t nsub;
+    // Set when the command can't be sent.
+    const char* error;
+};
+
+class RedisClusterCall {
+public:
+    RedisClusterCall(RedisClusterChannel* channel, Controller* cntl,
+                     RedisResponse* response, google::protobuf::Closure* done)
+        : _channel(channel)
+        , _cntl(cntl)
+        , _response(response)
+        , _done(done)
+        , _nunfinished(0)
+        , _failed(false) {
+        const int32_t timeout_ms = (cntl->timeout_ms() != UNSET_MAGIC_NUM ?
+                                    cntl->timeout_ms() :
+                                    channel->_options.timeout_ms);
+        _deadline_us = (timeout_ms >= 0 ?
+                        butil::gettimeofday_us() + timeout_ms * 1000L : -1);
+    }
+
+    // Split commands in `request'. Returns false on error.
+    bool Init(const RedisRequest& request);
+
+    void set_done(google::protobuf::Closure* done) { _done = done; }
+
+    // Send all commands without replies, commands to a same node are sent
+    // in one sub call.
+    void IssueRound();
+
+    // Fill the response and run done.
+    void Finish();
+
+private:
+    struct SubCall {
+        RedisClusterCall* call;
+        butil::EndPoint node;
+        std::vector<size_t> subs;
+        Controller cntl;
+        RedisRequest request;
+        RedisResponse response;
+    };
+
+    static void OnSubCallDone(SubCall* sc);
+    void OnRoundDone();
+    void AddSubCommand(int slot, const butil::StringPiece* args, size_t n);
+
+    RedisClusterChannel* _channel;
+    Controller* _cntl;
+    RedisResponse* _response;
+    google::protobuf::Closure* _done;
+    // Rounds following redirections share the timeout of the whole call,
+    // -1 means no timeout.
+    int64_t _deadline_us;
+    butil::Arena _arena;
+    std::vector<RedisClusterCommand> _commands;
+    std::vector<RedisSubCommand> _subs;
+    butil::atomic<int> _nunfinished;
+    butil::Mutex _mutex;
+    // Replies of sub commands refer to responses of finished sub calls.
+    std::vector<std::unique_ptr<SubCall> > _finished_calls;
+    bool _failed;
+    int _error_code;
+    std::string _error_text;
+};
+
+void RedisClusterCall::AddSubCommand(int slot, const butil::StringPiece* args,
+                                     size_t n) {
+    RedisSubCommand sub;
+    sub.args.assign(args, args + n);
+    sub.slot = slot;
+    sub.nredirect = 0;
+    sub.asking = false;
+    sub.reply = NULL;
+    _subs.push_back(sub);
+}
+
+bool RedisClusterCall::Init(const RedisRequest& request) {
+    butil::IOBuf buf;
+    if (!request.SerializeTo(&buf)) {
+        _cntl->SetFailed(EREQUEST, "Fail to serialize RedisRequest");
+        return false;
+    }
+    RedisCommandParser parser;
+    std::vector<butil::StringPiece> args;
+    _commands.reserve(request.command_size());
+    for (int i = 0; i < request.command_size(); ++i) {
+        if (parser.Consume(buf, &args, &_arena) != PARSE_OK || args.empty()) {
+            _cntl->SetFailed(EREQUEST, "Fail to parse command[%d]", i);
+            return false;
+        }
+        RedisClusterCommand cmd;
+        cmd.merge_type = REDIS_MERGE_NONE;
+        cmd.first_sub = _subs.size();
+        cmd.nsub = 0;
+        cmd.error = NULL;
+        const butil::StringPiece& name = args[0];
+        if (name == "multi" || name == "exec" || name == "discard" ||
+            name == "watch" || name == "unwatch") {
+            cmd.error = "ERR transaction is not supported by RedisClusterChannel";
+        } else if (args.size() < 2) {
+            // No keys, sent to any node.
+            AddSubCommand(-1, &args[0], args.size());
+        } else {
+            const RedisMergeType type = GetMergeType(name);
+            // MSET has key-value pairs.
+            const size_t step = (type == REDIS_MERGE_STATUS ? 2 : 1);
+            if (type == REDIS_MERGE_NONE || args.size() == step + 1) {
+                AddSubCommand(RedisClusterKeySlot(args[1]), &args[0], args.size());
+            } else if ((args.size() - 1) % step != 0) {
+                cmd.error = "ERR wrong number of arguments";
+            } else {
+                cmd.merge_type = type;
+                butil::StringPiece sub_args[3] = { name };
+                for (size_t j = 1; j < args.size(); j += step) {
+                    for (size_t k = 0; k < step; ++k) {
+                        sub_args[k + 1] = args[j + k];
+                    }
+                    AddSubCommand(RedisClusterKeySlot(args[j]), sub_args, step + 1);
+                }
+            }
+        }
+        cmd.nsub = _subs.size() - cmd.first_sub;
+        _commands.push_back(cmd);
+    }
+    return true;
+}
+
+void RedisClusterCall::IssueRound() {
+    int64_t timeout_ms = -1;
+    if (_deadline_us >= 0) {
+        timeout_ms = std::max<int64_t>(
+            (_deadline_us - butil::gettimeofday_us() + 999) / 1000, 1);
+    }
+    std::map<butil::EndPoint, SubCall*> calls;
+    for (size_t i = 0; i < _subs.size(); ++i) {
+        RedisSubCommand& sub = _subs[i];
+        if (sub.reply != NULL) {
+            continue;
+        }
+        const butil::EndPoint node =
+            (sub.asking ? sub.ask_node : _channel->GetSlotNode(sub.slot));
+        SubCall*& sc = calls[node];
+        if (sc == NULL) {
+            sc = new SubCall;
+            sc->call = this;
+            sc->node = node;
+            sc->cntl.set_timeout_ms(timeout_ms);
+            sc->cntl.set_log_id(_cntl->log_id());
+        }
+        if (sub.asking) {
+            sc->request.AddCommand("ASKING");
+        }
+        sc->request.AddCommandByComponents(&sub.args[0], sub.args.size());
+        sc->subs.push_back(i);
+    }
+    std::vector<SubCall*> list;
+    list.reserve(calls.size());
+    for (std::map<butil::EndPoint, SubCall*>::iterator
+             it = calls.begin(); it != calls.end(); ++it) {
+        list.push_back(it->second);
+    }
+    _nunfinished.store(list.size(), butil::memory_order_relaxed);
+    // NOTE: this call may be destroyed after the last sub call is issued.
+    for (size_t i = 0; i < list.size(); ++i) {
+        SubCall* sc = list[i];
+        Channel* sub_channel = _channel->GetNodeChannel(sc->node);
+        if (sub_channel == NULL) {
+            sc->cntl.SetFailed(EHOSTDOWN, "Fail to create channel to %s",
+                               butil::endpoint2str(sc->node).c_str());
+            OnSubCallDone(sc);
+            continue;
+        }
+        sub_channel->CallMethod(NULL, &sc->cntl, &sc->request, &sc->response,
+                                brpc::NewCallback(OnSubCallDone, sc));
+    }
+}
+
+void RedisClusterCall::OnSubCallDone(SubCall* sc) {
+    RedisClusterCall* call = sc->call;
+    if (sc->cntl.Failed()) {
+        BAIDU_SCOPED_LOCK(call->_mutex);
+        if (!call->_failed) {
+            call->_failed = true;
+            call->_error_code = sc->cntl.ErrorCode();
+            call->_error_text = butil::string_printf(
+                "[%s] %s", butil::endpoint2str(sc->node).c_str(),
+                sc->cntl.ErrorText().c_str());
+        }
+    } else {
+        int index = 0;
+        for (size_t i = 0; i < sc->subs.size(); ++i) {
+            RedisSubCommand& sub = call->_subs[sc->subs[i]];
+            if (sub.asking) {
+                // Skip reply of ASKING
+                ++index;
+                sub.asking = false;
+            }
+            sub.reply = &sc->response.reply(index++);
+        }
+    }
+    {
+        BAIDU_SCOPED_LOCK(call->_mutex);
+        call->_finished_calls.push_back(std::unique_ptr<SubCall>(sc));
+    }
+    if (call->_nunfinished.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+        call->OnRoundDone();
+    }
+}
+
+void RedisClusterCall::OnRoundDone() {
+    if (_failed) {
+        // The cluster may be changed.
+        _channel->_refresh_needed.store(true, butil::memory_order_relaxed);
+        return Finish();
+    }
+    bool redirected = false;
+    for (size_t i = 0; i < _subs.size(); ++i) {
+        RedisSubCommand& sub = _subs[i];
+        bool ask = false;
+        int slot = -1;
+        butil::EndPoint node;
+        if (!ParseRedirect(*sub.reply, &ask, &slot, &node) ||
+            sub.nredirect >= _channel->_options.max_redirect) {
+            continue;
+        }
+        ++sub.nredirect;
+        if (ask) {
+            sub.asking = true;
+            sub.ask_node = node;
+        } else {
+            _channel->OnMoved(slot, node);
+        }
+        sub.reply = NULL;
+        redirected = true;
+    }
+    if (redirected) {
+        if (_deadline_us >= 0 && butil::gettimeofday_us() >= _deadline_us) {
+            _failed = true;
+            _error_code = ERPCTIMEDOUT;
+            _error_text = "Reached timeout before following redirections";
+            return Finish();
+        }
+        return IssueRound();
+    }
+    Finish();
+}
+
+void RedisClusterCall::Finish() {
+    if (_failed) {
+        _cntl->SetFailed(_error_code, "%s", _error_text.c_str());
+    } else {
+        butil::IOBufAppender appender;
+        for (size_t i = 0; i < _commands.size(); ++i) {
+            const RedisClusterCommand& cmd = _commands[i];
+            if (cmd.error != NULL) {
+                AppendErrorReply(cmd.error, &appender);
+                continue;
+            }
+            const RedisReply* error = NULL;
+            for (size_t j = 0; j < cmd.nsub; ++j) {
+                const RedisReply* r = _subs[cmd.first_sub + j].reply;
+                if (r->is_error()) {
+                    error = r;
+                    break;
+                }
+            }
+            if (cmd.merge_type == REDIS_MERGE_NONE || error != NULL) {
+                SerializeReply(error ? *error : *_subs[cmd.first_sub].reply,
+                               &appender);
+                continue;
+            }
+            switch (cmd.merge_type) {
+            case REDIS_MERGE_ARRAY:
+                appender.push_back('*');
+                appender.append_decimal(cmd.nsub);
+                appender.append("\r\n", 2);
+                for (size_t j = 0; j < cmd.nsub; ++j) {
+                    SerializeReply((*_subs[cmd.first_sub + j].reply)[0], &appender);
+                }
+                break;
+            case REDIS_MERGE_SUM: {
+                int64_t sum = 0;
+                for (size_t j = 0; j < cmd.nsub; ++j) {
+                    const RedisReply* r = _subs[cmd.first_sub + j].reply;
+                    sum += (r->is_integer() ? r->integer() : 0);
+                }
+                appender.push_back(':');
+                appender.append_decimal(sum);
+                appender.append("\r\n", 2);
+                break;
+            }
+            case REDIS_MERGE_STATUS:
+                appender.append("+OK\r\n", 5);
+                break;
+            case REDIS_MERGE_NONE:
+                break;
+            }
+        }
+        butil::IOBuf buf;
+        appender.move_to(buf);
+        if (!_commands.empty() &&
+            _response->ConsumePartialIOBuf(buf, _commands.size()) != PARSE_OK) {
+            _cntl->SetFailed(ERESPONSE, "Fail to merge replies");
+        }
+    }
+    google::protobuf::Closure* done = _done;
+    delete this;
+    done->Run();
+}
+
+RedisClusterChannel::RedisClusterChannel()
+    : _refresh_needed(false)
+    , _refreshing(false) {}
+
+RedisClusterChannel::~RedisClusterChannel() {
+    // Wait for the refreshing started by CallMethod().
+    while (_refreshing.load(butil::memory_order_acquire)) {
+        bthread_usleep(1000);
+    }
+    for (std::map<butil::EndPoint, Channel*>::iterator
+             it = _nodes.begin(); it != _nodes.end(); ++it) {
+        delete it->second;
+    }
+    _nodes.clear();
+}
+
+int RedisClusterChannel::Init(const char* seed_nodes,
+                              const RedisClusterChannelOptions* options) {
+    if (options) {
+        _options = *options;
+        _options.protocol = PROTOCOL_REDIS;
+    }
+    for (butil::StringSplitter sp(seed_nodes, ','); sp; ++sp) {
+        butil::StringPiece host(sp.field(), sp.length());
+        host.trim_spaces();
+        if (host.empty()) {
+            continue;
+        }
+        butil::EndPoint pt;
+        if (butil::str2endpoint(host.as_string().c_str(), &pt) != 0 &&
+            butil::hostname2endpoint(host.as_string().c_str(), &pt) != 0) {
+            LOG(ERROR) << "Invalid address=`" << host << '\'';
+            return -1;
+        }
+        _seeds.push_back(pt);
+    }
+    if (_seeds.empty()) {
+        LOG(ERROR) << "No seed nodes in `" << seed_nodes << '\'';
+        return -1;
+    }
+    return RefreshSlots();
+}
+
+size_t RedisClusterChannel::ResetSlots(SlotMap& m, const SlotMap& new_map) {
+    m = new_map;
+    return 1;
+}
+
+size_t RedisClusterChannel::SetSlot(SlotMap& m, const int& slot,
+                                    const butil::EndPoint& node) {
+    if (m.empty()) {
+        m.resize(REDIS_CLUSTER_SLOTS);
+    }
+    m[slot] = node;
+    return 1;
+}
+
+int RedisClusterChannel::FetchSlots(const butil::EndPoint& node, SlotMap* m) {
+    Channel* channel = GetNodeChannel(node);
+    if (channel == NULL) {
+        return -1;
+    }
+    RedisRequest request;
+    RedisResponse response;
+    Controller cntl;
+    request.AddCommand("CLUSTER SLOTS");
+    channel->CallMethod(NULL, &cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to get slots from " << node << ": "
+                     << cntl.ErrorText();
+        return -1;
+    }
+    const RedisReply& reply = response.reply(0);
+    if (!reply.is_array()) {
+        LOG(WARNING) << "Invalid reply of CLUSTER SLOTS from " << node
+                     << ": " << reply;
+        return -1;
+    }
+    m->assign(REDIS_CLUSTER_SLOTS, butil::EndPoint());
+    for (size_t i = 0; i < reply.size(); ++i) {
+        // [start, end, [ip, port, id], replicas...]
+        const RedisReply& range = reply[i];
+        if (range.size() < 3 || !range[0].is_integer() ||
+            !range[1].is_integer() || range[2].size() < 2 ||
+            !range[2][0].is_string() || !range[2][1].is_integer()) {
+            LOG(WARNING) << "Invalid slot range from " << node << ": " << range;
+            return -1;
+        }
+        const int64_t start = range[0].integer();
+        const int64_t end = range[1].integer();
+        butil::EndPoint owner = node;
+        // Empty ip stands for the node replying.
+        if (!range[2][0].data().empty() &&
+            butil::str2ip(range[2][0].c_str(), &owner.ip) != 0) {
+            LOG(WARNING) << "Invalid ip=" << range[2][0] << " from " << node;
+            return -1;
+        }
+        owner.port = range[2][1].integer();
+        for (int64_t s = std::max(start, (int64_t)0);
+             s <= end && s < REDIS_CLUSTER_SLOTS; ++s) {
+            (*m)[s] = owner;
+        }
+    }
+    return 0;
+}
+
+int RedisClusterChannel::RefreshSlots() {
+    SlotMap m;
+    for (size_t i = 0; i < _seeds.size(); ++i) {
+        if (FetchSlots(_seeds[i], &m) == 0) {
+            _slots.Modify(ResetSlots, m);
+            return 0;
+        }
+    }
+    // Try nodes known by the slot map.
+    std::vector<butil::EndPoint> nodes;
+    {
+        BAIDU_SCOPED_LOCK(_node_mutex);
+        for (std::map<butil::EndPoint, Channel*>::const_iterator
+                 it = _nodes.begin(); it != _nodes.end(); ++it) {
+            nodes.push_back(it->first);
+        }
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (FetchSlots(nodes[i], &m) == 0) {
+            _slots.Modify(ResetSlots, m);
+            return 0;
+        }
+    }
+    LOG(ERROR) << "Fail to get slots of the redis cluster";
+    return -1;
+}
+
+butil::EndPoint RedisClusterChannel::GetSlotNode(int slot) {
+    if (slot >= 0) {
+        butil::DoublyBufferedData<SlotMap>::ScopedPtr ptr;
+        if (_slots.Read(&ptr) == 0 && !ptr->empty()) {
+            const butil::EndPoint& node = (*ptr)[slot];
+            if (node.port != 0) {
+                return node;
+            }
+        }
+    }
+    // Unknown slots are sent to a seed node which replies MOVED if it's
+    // not the owner.
+    return _seeds[butil::fast_rand_less_than(_seeds.size())];
+}
+
+void RedisClusterChannel::OnMoved(int slot, const butil::EndPoint& node) {
+    _slots.Modify(SetSlot, slot, node);
+}
+
+Channel* RedisClusterChannel::GetNodeChannel(const butil::EndPoint& node) {
+    BAIDU_SCOPED_LOCK(_node_mutex);
+    Channel*& channel = _nodes[node];
+    if (channel == NULL) {
+        channel = new Channel;
+        if (channel->Init(node, &_options) != 0) {
+            LOG(ERROR) << "Fail to init channel to " << node;
+            delete channel;
+            channel = NULL;
+            _nodes.erase(node);
+            return NULL;
+        }
+    }
+    return channel;
+}
+
+static void SignalEvent(bthread::CountdownEvent* event) {
+    event->signal();
+}
+
+void* RedisClusterChannel::RunRefreshSlots(void* arg) {
+    RedisClusterChannel* c = static_cast<RedisClusterChannel*>(arg);
+    if (c->RefreshSlots() == 0) {
+        c->_refresh_needed.store(false, butil::memory_order_relaxed);
+    }
+    c->_refreshing.store(false, butil::memory_order_release);
+    return NULL;
+}
+
+void RedisClusterChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* /*method*/,
+    google::protobuf::RpcController* controller_base,
+    const google::protobuf::Message* request_base,
+    google::protobuf::Message* response_base,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(controller_base);
+    if (request_base == NULL ||
+        request_base->GetDescriptor() != RedisRequest::descriptor() ||
+        response_base == NULL ||
+        response_base->GetDescriptor() != RedisResponse::descriptor()) {
+        cntl->SetFailed(EINVAL, "Request and response must be "
+                        "RedisRequest and RedisResponse");
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    if (_refresh_needed.load(butil::memory_order_relaxed) &&
+        !_refreshing.exchange(true, butil::memory_order_acquire)) {
+        // Don't delay this call, which follows redirections of the stale
+        // slot map anyway.
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, RunRefreshSlots, this) != 0) {
+            RunRefreshSlots(this);
+        }
+    }
+    RedisClusterCall* call = new RedisClusterCall(
+        this, cntl, static_cast<RedisResponse*>(response_base), done);
+    if (!call->Init(*static_cast<const RedisRequest*>(request_base))) {
+        delete call;
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    bthread::CountdownEvent event;
+    if (done == NULL) {
+        call->set_done(brpc::NewCallback(SignalEvent, &event));
+    }
+    call->IssueRound();
+    if (done == NULL) {
+        event.wait();
+    }
+}
+
+void RedisClusterChannel::Describe(std::ostream& os,
+                                   const DescribeOptions&) const {
+    os << "RedisCluster[";
+    for (size_t i = 0; i < _seeds.size(); ++i) {
+        if (i != 0) {
+            os << ',';
+        }
+        os << _seeds[i];
+    }
+    os << ']';
+}
+
+int RedisClusterChannel::CheckHealth() {
+    BAIDU_SCOPED_LOCK(_node_mutex);
+    for (std::map<butil::EndPoint, Channel*>::iterator
+             it = _nodes.begin(); it != _nodes.end(); ++it) {
+        if (it->second->CheckHealth() == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+} // namespace brpc
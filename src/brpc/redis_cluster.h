@@ -0,0 +1,135 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_REDIS_CLUSTER_H
+#define BRPC_REDIS_CLUSTER_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <map>
+#include <string>
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/endpoint.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/channel.h"
+
+namespace brpc {
+
+// Number of hash slots in a redis cluster.
+static const int REDIS_CLUSTER_SLOTS = 16384;
+
+// Get the hash slot of `key' which is CRC16(key) % 16384. If the key
+// contains a non-empty hash tag "{...}", only the tag is hashed.
+int RedisClusterKeySlot(const butil::StringPiece& key);
+
+// For customizing RedisClusterChannel. `protocol' is always redis.
+struct RedisClusterChannelOptions : public ChannelOptions {
+    // Constructed with default values.
+    RedisClusterChannelOptions();
+
+    // Max times that a command is redirected by MOVED or ASK. The error
+    // reply is returned to the user when the limit is reached.
+    // Default: 5
+    int max_redirect;
+};
+
+class RedisClusterCall;
+
+// Access a redis cluster(https://redis.io/topics/cluster-spec) like a
+// single redis-server. Commands in a RedisRequest are routed to the nodes
+// owning their slots, commands to a same node are pipelined in one sub call
+// and sub calls to different nodes are issued concurrently. Replies are
+// put in RedisResponse in the same order of the commands.
+// Multi-key commands MGET, MSET, DEL, EXISTS, UNLINK and TOUCH are split by
+// keys so that keys don't need to be in a same slot. MOVED and ASK
+// redirections are followed and the slot map is updated on MOVED.
+// Transactions(MULTI/EXEC) and blocking commands are not supported.
+// Example:
+//   brpc::RedisClusterChannel channel;
+//   channel.Init("127.0.0.1:7000,127.0.0.1:7001", NULL);
+//   brpc::RedisRequest request;
+//   request.AddCommand("MGET key1 key2");
+//   brpc::RedisResponse response;
+//   brpc::Controller cntl;
+//   channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+//
+// NOTE: Asynchronous calls finish by running `done', brpc::Join() on
+// call_id() of the controller is not supported.
+class RedisClusterChannel : public ChannelBase {
+friend class RedisClusterCall;
+public:
+    RedisClusterChannel();
+    ~RedisClusterChannel();
+
+    // Initialize with comma-separated "host:port" of some nodes in the
+    // cluster. The slot map is fetched by CLUSTER SLOTS from the first
+    // responding node.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const char* seed_nodes, const RedisClusterChannelOptions* options);
+
+    // Send `request' which must be a RedisRequest and fill `response'
+    // which must be a RedisResponse. `method' is ignored.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    // Fetch the slot map from the cluster again.
+    // Returns 0 on success, -1 otherwise.
+    int RefreshSlots();
+
+    void Describe(std::ostream& os, const DescribeOptions& options) const;
+
+    // Returns 0 if any node is accessible.
+    int CheckHealth();
+
+private:
+    // slot -> node owning the slot, an unknown owner is an empty EndPoint.
+    typedef std::vector<butil::EndPoint> SlotMap;
+
+    static size_t ResetSlots(SlotMap& m, const SlotMap& new_map);
+    static size_t SetSlot(SlotMap& m, const int& slot,
+                          const butil::EndPoint& node);
+
+    // Get the node owning `slot', a seed node if it's unknown.
+    butil::EndPoint GetSlotNode(int slot);
+    void OnMoved(int slot, const butil::EndPoint& node);
+    // Get the channel to `node', created if it does not exist.
+    Channel* GetNodeChannel(const butil::EndPoint& node);
+    int FetchSlots(const butil::EndPoint& node, SlotMap* m);
+    // Run RefreshSlots() in a bthread started by CallMethod().
+    static void* RunRefreshSlots(void* arg);
+
+    RedisClusterChannelOptions _options;
+    std::vector<butil::EndPoint> _seeds;
+    butil::DoublyBufferedData<SlotMap> _slots;
+    mutable butil::Mutex _node_mutex;
+    std::map<butil::EndPoint, Channel*> _nodes;
+    // Set when a node failed, slots are refreshed in a bthread started by
+    // next CallMethod().
+    butil::atomic<bool> _refresh_needed;
+    butil::atomic<bool> _refreshing;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_REDIS_CLUSTER_H
@@ -140,7 +140,8 @@ ServerOptions::ServerOptions()
     , http_master_service(NULL)
     , health_reporter(NULL)
     , rtmp_service(NULL)
-    , redis_service(NULL) {
+    , redis_service(NULL)
+    , bthread_tag(BTHREAD_TAG_DEFAULT) {
     if (s_ncore > 0) {
         num_threads = s_ncore + 1;
     }
@@ -224,7 +225,7 @@ static void PrintEnabledProfilers(std::ostream& os, void*) {
             os << "heap(no TCMALLOC_SAMPLE_PARAMETER in env) ";
         }
     }
-    os << "contention";
+    os << "contention offcpu";
 }
 
 static bvar::PassiveStatus<std::string> s_lb_st(
@@ -495,6 +496,10 @@ int Server::AddBuiltinServices() {
         LOG(ERROR) << "Fail to add MetricsService";
         return -1;
     }
+    if (AddBuiltinService(new (std::nothrow) PrometheusMetricsPbService)) {
+        LOG(ERROR) << "Fail to add MetricsPbService";
+        return -1;
+    }
     if (FLAGS_enable_threads_service &&
         AddBuiltinService(new (std::nothrow) ThreadsService)) {
         LOG(ERROR) << "Fail to add ThreadsService";
@@ -555,7 +560,8 @@ Acceptor* Server::BuildAcceptor() {
         whitelist.insert(protocol);
     }
     const bool has_whitelist = !whitelist.empty();
-    Acceptor* acceptor = new (std::nothrow) Acceptor(_keytable_pool);
+    Acceptor* acceptor = new (std::nothrow) Acceptor(
+        _keytable_pool, _options.bthread_tag);
     if (NULL == acceptor) {
         LOG(ERROR) << "Fail to new Acceptor";
         return NULL;
@@ -737,6 +743,13 @@ int Server::StartInternal(const butil::ip_t& ip,
         return -1;
     }
 
+    if (_options.bthread_tag != BTHREAD_TAG_DEFAULT &&
+        bthread_getconcurrency_by_tag(_options.bthread_tag) <= 0) {
+        LOG(ERROR) << "Invalid bthread_tag=" << _options.bthread_tag
+                   << ", -task_group_ntags may be too small";
+        return -1;
+    }
+
     if (_options.http_master_service) {
         // Check requirements for http_master_service:
         //  has "default_method" & request/response have no fields
@@ -821,6 +834,7 @@ int Server::StartInternal(const butil::ip_t& ip,
             init_args[i].stop = false;
             bthread_attr_t tmp = BTHREAD_ATTR_NORMAL;
             tmp.keytable_pool = _keytable_pool;
+            tmp.tag = _options.bthread_tag;
             if (bthread_start_background(
                     &init_args[i].th, &tmp, BthreadInitEntry, &init_args[i]) != 0) {
                 break;
@@ -910,10 +924,26 @@ int Server::StartInternal(const butil::ip_t& ip,
         if (FLAGS_usercode_in_pthread) {
             _options.num_threads += FLAGS_usercode_backup_threads;
         }
-        if (_options.num_threads < BTHREAD_MIN_CONCURRENCY) {
-            _options.num_threads = BTHREAD_MIN_CONCURRENCY;
+        if (_options.bthread_tag != BTHREAD_TAG_DEFAULT) {
+            // Workers of the tag only grow. The tag may already have more
+            // workers than wanted, e.g. an even share of -bthread_concurrency
+            // or another server in the same tag, which is fine.
+            const int rc = (_options.num_threads <=
+                            bthread_getconcurrency_by_tag(_options.bthread_tag) ?
+                            0 : bthread_setconcurrency_by_tag(
+                                _options.num_threads, _options.bthread_tag));
+            if (rc != 0) {
+                LOG(ERROR) << "Fail to set concurrency of bthread_tag="
+                           << _options.bthread_tag << " to "
+                           << _options.num_threads << ": " << berror(rc);
+                return -1;
+            }
+        } else {
+            if (_options.num_threads < BTHREAD_MIN_CONCURRENCY) {
+                _options.num_threads = BTHREAD_MIN_CONCURRENCY;
+            }
+            bthread_setconcurrency(_options.num_threads);
         }
-        bthread_setconcurrency(_options.num_threads);
     }
 
     for (MethodMap::iterator it = _method_map.begin();
@@ -1214,6 +1244,9 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         mp.service = service;
         mp.method = md;
         mp.status = new MethodStatus;
+        if (!is_builtin_service) {
+            mp.status->InitProfilingLabel(md->full_name());
+        }
         _method_map[md->full_name()] = mp;
         if (is_idl_support && sd->name() != sd->full_name()/*has ns*/) {
             MethodProperty mp2 = mp;
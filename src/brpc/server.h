@@ -241,6 +241,13 @@ struct ServerOptions {
     // Default: NULL (disabled)
     RedisService* redis_service;
 
+    // Process requests(and call handlers of services) in bthread workers
+    // of this tag, which must be less than -task_group_ntags. Put services
+    // that should not starve each other in servers of different tags.
+    // If num_threads > 0, workers of the tag are added to num_threads.
+    // Default: BTHREAD_TAG_DEFAULT
+    bthread_tag_t bthread_tag;
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ServerOptions from being bloated in most cases.
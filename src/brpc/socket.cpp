@@ -419,6 +419,7 @@ Socket::Socket(Forbidden)
     , _shared_part(NULL)
     , _nevent(0)
     , _keytable_pool(NULL)
+    , _bthread_tag(BTHREAD_TAG_INVALID)
     , _fd(-1)
     , _tos(0)
     , _reset_fd_real_us(-1)
@@ -593,6 +594,7 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     CHECK(NULL == m->_shared_part.load(butil::memory_order_relaxed));
     m->_nevent.store(0, butil::memory_order_relaxed);
     m->_keytable_pool = options.keytable_pool;
+    m->_bthread_tag = options.bthread_tag;
     m->_tos = 0;
     m->_remote_side = options.remote_side;
     m->_on_edge_triggered_events = options.on_edge_triggered_events;
@@ -1956,6 +1958,7 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
 
         bthread_attr_t attr = thread_attr;
         attr.keytable_pool = p->_keytable_pool;
+        attr.tag = p->_bthread_tag;
         if (bthread_start_urgent(&tid, &attr, ProcessEvent, p) != 0) {
             LOG(FATAL) << "Fail to start ProcessEvent";
             ProcessEvent(p);
@@ -2416,6 +2419,7 @@ int Socket::GetPooledSocket(SocketUniquePtr* pooled_socket) {
         opt.on_edge_triggered_events = _on_edge_triggered_events;
         opt.initial_ssl_ctx = _ssl_ctx;
         opt.keytable_pool = _keytable_pool;
+        opt.bthread_tag = _bthread_tag;
         opt.app_connect = _app_connect;
         socket_pool = new SocketPool(opt);
         SocketPool* expected = NULL;
@@ -2512,6 +2516,7 @@ int Socket::GetShortSocket(SocketUniquePtr* short_socket) {
     opt.on_edge_triggered_events = _on_edge_triggered_events;
     opt.initial_ssl_ctx = _ssl_ctx;
     opt.keytable_pool = _keytable_pool;
+    opt.bthread_tag = _bthread_tag;
     opt.app_connect = _app_connect;
     if (get_client_side_messenger()->Create(opt, &id) != 0 ||
         Socket::Address(id, short_socket) != 0) {
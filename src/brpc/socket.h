@@ -189,6 +189,9 @@ struct SocketOptions {
     int health_check_interval_s;
     std::shared_ptr<SocketSSLContext> initial_ssl_ctx;
     bthread_keytable_pool_t* keytable_pool;
+    // Tag of bthreads processing input of the socket. BTHREAD_TAG_INVALID
+    // means the tag of the event dispatcher.
+    bthread_tag_t bthread_tag;
     SocketConnection* conn;
     std::shared_ptr<AppConnect> app_connect;
     // The created socket will set parsing_context with this value.
@@ -528,6 +531,8 @@ public:
 
     bthread_keytable_pool_t* keytable_pool() const { return _keytable_pool; }
 
+    bthread_tag_t bthread_tag() const { return _bthread_tag; }
+
 private:
     DISALLOW_COPY_AND_ASSIGN(Socket);
 
@@ -687,6 +692,9 @@ private:
     // May be set by Acceptor to share keytables between reading threads
     // on sockets created by the Acceptor.
     bthread_keytable_pool_t* _keytable_pool;
+
+    // Set by Acceptor to process input in workers of the tag of the server.
+    bthread_tag_t _bthread_tag;
     
     // [ Set in ResetFileDescriptor ] 
     butil::atomic<int> _fd;  // -1 when not connected.
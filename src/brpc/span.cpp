@@ -17,6 +17,10 @@
 
 
 #include <netinet/in.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <gflags/gflags.h>
 #include <leveldb/db.h>
 #include <leveldb/comparator.h>
@@ -29,9 +33,11 @@
 #include "butil/object_pool.h"
 #include "butil/fast_rand.h"
 #include "butil/file_util.h"
+#include "butil/memory/singleton_on_pthread_once.h"
 #include "brpc/shared_object.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
+#include "brpc/span_exporter.h"
 
 #define BRPC_SPAN_INFO_SEP "\1"
 
@@ -59,6 +65,17 @@ BRPC_VALIDATE_GFLAG(rpcz_keep_span_seconds, PositiveInteger);
 
 DEFINE_bool(rpcz_keep_span_db, false, "Don't remove DB of rpcz at program's exit");
 
+DEFINE_int32(rpcz_ring_buffer_mb, 0,
+             "Keep spans in an in-memory ring buffer of so many megabytes "
+             "instead of leveldb under -rpcz_database_dir, which makes rpcz "
+             "cheap enough to be always on. 0 means using leveldb");
+BRPC_VALIDATE_GFLAG(rpcz_ring_buffer_mb, NonNegativeInteger);
+
+DEFINE_int64(rpcz_slow_span_us, 500000,
+             "Spans lasting for so many microseconds or failed ones are kept "
+             "in a separate part of the ring buffer so that they're not "
+             "evicted by normal spans soon, and exported by default");
+
 struct IdGen {
     bool init;
     uint16_t seq;
@@ -127,12 +144,16 @@ Span* Span::CreateClientSpan(const std::string& full_method_name,
     Span* parent = (Span*)bthread::tls_bls.rpcz_parent_span;
     if (parent) {
         span->_trace_id = parent->trace_id();
+        span->_trace_id_high = parent->trace_id_high();
+        span->_trace_state = parent->trace_state();
         span->_parent_span_id = parent->span_id();
         span->_local_parent = parent;
         span->_next_client = parent->_next_client;
         parent->_next_client = span;
     } else {
         span->_trace_id = GenerateTraceId();
+        span->_trace_id_high = 0;
+        span->_trace_state.clear();
         span->_parent_span_id = 0;
         span->_local_parent = NULL;
     }
@@ -155,6 +176,8 @@ Span* Span::CreateServerSpan(
         return NULL;
     }
     span->_trace_id = (trace_id ? trace_id : GenerateTraceId());
+    span->_trace_id_high = 0;
+    span->_trace_state.clear();
     span->_span_id = (span_id ? span_id : GenerateSpanId());
     span->_parent_span_id = parent_span_id;
     span->_log_id = 0;
@@ -291,6 +314,36 @@ bool SpanInfoExtractor::PopAnnotation(
     return false;
 }
 
+int64_t GetStartRealTimeUs(const RpczSpan& span) {
+    return span.type() == SPAN_TYPE_SERVER ?
+        span.received_real_us() : span.start_send_real_us();
+}
+
+int64_t GetEndRealTimeUs(const RpczSpan& span) {
+    int64_t result = span.received_real_us();
+    result = std::max(result, span.start_parse_real_us());
+    result = std::max(result, span.start_callback_real_us());
+    result = std::max(result, span.start_send_real_us());
+    result = std::max(result, span.sent_real_us());
+    return result;
+}
+
+bool IsSlowOrFailedSpan(const RpczSpan& span) {
+    if (span.error_code() != 0) {
+        return true;
+    }
+    if (GetEndRealTimeUs(span) - GetStartRealTimeUs(span) >=
+        FLAGS_rpcz_slow_span_us) {
+        return true;
+    }
+    for (int i = 0; i < span.client_spans_size(); ++i) {
+        if (span.client_spans(i).error_code() != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool CanAnnotateSpan() {
     return bthread::tls_bls.rpcz_parent_span;
 }
@@ -312,7 +365,10 @@ public:
 
     SpanDB() : id_db(NULL), time_db(NULL) { }
     static SpanDB* Open();
-    leveldb::Status Index(const Span* span, std::string* value_buf);
+    leveldb::Status Index(const Span* span, const RpczSpan& value_proto,
+                          std::string* value_buf);
+    // Serialize `span' along with its client spans.
+    static void Serialize(const Span* span, RpczSpan* out);
     leveldb::Status RemoveSpansBefore(int64_t tm);
 
 private:
@@ -348,7 +404,11 @@ static pthread_mutex_t g_span_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 static bool g_span_ending = false;  // don't open span again if this var is true.
 // Can't use intrusive_ptr which has ctor/dtor issues.
 static SpanDB* g_span_db = NULL;
-bool has_span_db() { return !!g_span_db; }
+static bool UseSpanRing() { return FLAGS_rpcz_ring_buffer_mb > 0; }
+static size_t SpanRingSize();
+bool has_span_db() {
+    return !!g_span_db || (UseSpanRing() && SpanRingSize() != 0);
+}
 bvar::CollectorSpeedLimit g_span_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
 static bvar::DisplaySamplingRatio s_display_sampling_ratio(
     "rpcz_sampling_ratio", &g_span_sl);
@@ -426,6 +486,9 @@ void Span::Submit(Span* span, int64_t cpuwide_time_us) {
 
 static void Span2Proto(const Span* span, RpczSpan* out) {
     out->set_trace_id(span->trace_id());
+    if (span->trace_id_high()) {
+        out->set_trace_id_high(span->trace_id_high());
+    }
     out->set_span_id(span->span_id());
     out->set_parent_span_id(span->parent_span_id());
     out->set_log_id(span->log_id());
@@ -448,6 +511,33 @@ static void Span2Proto(const Span* span, RpczSpan* out) {
     out->set_error_code(span->error_code());
 }
 
+static void Span2Brief(const Span* span, BriefSpan* brief) {
+    const int64_t start_time = span->GetStartRealTimeUs();
+    brief->set_trace_id(span->trace_id());
+    brief->set_span_id(span->span_id());
+    brief->set_log_id(span->log_id());
+    brief->set_type(span->type());
+    brief->set_error_code(span->error_code());
+    brief->set_request_size(span->request_size());
+    brief->set_response_size(span->response_size());
+    brief->set_start_real_us(start_time);
+    brief->set_latency_us(span->GetEndRealTimeUs() - start_time);
+    brief->set_full_method_name(span->full_method_name());
+}
+
+void SpanDB::Serialize(const Span* span, RpczSpan* out) {
+    Span2Proto(span, out);
+    // client spans should be reversed.
+    size_t client_span_count = span->CountClientSpans();
+    for (size_t i = 0; i < client_span_count; ++i) {
+        out->add_client_spans();
+    }
+    size_t i = 0;
+    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
+        Span2Proto(p, out->mutable_client_spans(client_span_count - i - 1));
+    }
+}
+
 inline void ToBigEndian(uint64_t n, uint32_t* buf) {
     buf[0] = htonl(n >> 32);
     buf[1] = htonl(n & 0xFFFFFFFFUL);
@@ -509,7 +599,8 @@ SpanDB* SpanDB::Open() {
     return db;
 }
 
-leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
+leveldb::Status SpanDB::Index(const Span* span, const RpczSpan& value_proto,
+                              std::string* value_buf) {
     leveldb::WriteOptions options;
     options.sync = false;
 
@@ -521,16 +612,7 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
 
     const int64_t start_time = span->GetStartRealTimeUs();
     BriefSpan brief;
-    brief.set_trace_id(span->trace_id());
-    brief.set_span_id(span->span_id());
-    brief.set_log_id(span->log_id());
-    brief.set_type(span->type());
-    brief.set_error_code(span->error_code());
-    brief.set_request_size(span->request_size());
-    brief.set_response_size(span->response_size());
-    brief.set_start_real_us(start_time);
-    brief.set_latency_us(span->GetEndRealTimeUs() - start_time);
-    brief.set_full_method_name(span->full_method_name());
+    Span2Brief(span, &brief);
     if (!brief.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize BriefSpan"));
@@ -569,17 +651,6 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     ToBigEndian(span->trace_id(), key_data);
     ToBigEndian(span->span_id(), key_data + 2);
     leveldb::Slice key((char*)key_data, sizeof(key_data));
-    RpczSpan value_proto;
-    Span2Proto(span, &value_proto);
-    // client spans should be reversed.
-    size_t client_span_count = span->CountClientSpans();
-    for (size_t i = 0; i < client_span_count; ++i) {
-        value_proto.add_client_spans();
-    }
-    size_t i = 0;
-    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
-        Span2Proto(p, value_proto.mutable_client_spans(client_span_count - i - 1));
-    }
     if (!value_proto.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize RpczSpan"));
@@ -632,10 +703,214 @@ leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
     return rc;
 }
 
-// Write span into leveldb.
+// Spans kept in memory when -rpcz_ring_buffer_mb is positive. Spans are
+// serialized compactly and evicted in FIFO order when the memory budget is
+// used up or they're older than -rpcz_keep_span_seconds. Slow or failed
+// spans are put in a separate queue with 1/4 of the budget so that they
+// survive bursts of normal spans.
+// Spans are added by the dumping thread of bvar::Collector only, RPC
+// threads never touch the ring. Entries are shared and immutable, lookups
+// copy pointers to them under the lock and parse outside, to not block the
+// dumping thread.
+class SpanRing {
+public:
+    SpanRing() : _nevicted(0) {
+        _nbytes[0] = 0;
+        _nbytes[1] = 0;
+    }
+
+    void Add(const Span* span, const RpczSpan& proto);
+    int Find(uint64_t trace_id, uint64_t span_id, RpczSpan* out);
+    void Find(uint64_t trace_id, std::deque<RpczSpan>* out);
+    void List(int64_t before_this_time, size_t max_scan,
+              std::deque<BriefSpan>* out, SpanFilter* filter);
+    void Describe(std::ostream& os);
+    size_t size();
+
+private:
+    struct Entry {
+        uint64_t trace_id;
+        uint64_t span_id;
+        int64_t start_real_us;
+        std::string brief;  // serialized BriefSpan
+        std::string span;   // serialized RpczSpan
+    };
+    typedef std::shared_ptr<const Entry> EntryPtr;
+    typedef std::unordered_multimap<uint64_t, EntryPtr> TraceIndex;
+    static size_t MemoryOf(const Entry& e) {
+        return sizeof(Entry) + e.brief.size() + e.span.size();
+    }
+    // Newer spans are in front.
+    static bool StartsLater(const EntryPtr& e1, const EntryPtr& e2) {
+        return e1->start_real_us > e2->start_real_us;
+    }
+    void EvictLocked(int index, size_t max_bytes, int64_t expire_us);
+    void FindLocked(uint64_t trace_id, std::vector<EntryPtr>* out);
+
+    butil::Mutex _mutex;
+    // [0]: normal spans, [1]: slow or failed spans, in the order of being
+    // dumped, namely roughly the order of ending.
+    std::deque<EntryPtr> _q[2];
+    // trace_id -> spans of the trace in both queues.
+    TraceIndex _trace_index;
+    size_t _nbytes[2];
+    int64_t _nevicted;
+};
+
+void SpanRing::EvictLocked(int index, size_t max_bytes, int64_t expire_us) {
+    std::deque<EntryPtr>& q = _q[index];
+    while (!q.empty() && (_nbytes[index] > max_bytes ||
+                          q.front()->start_real_us < expire_us)) {
+        const EntryPtr& e = q.front();
+        std::pair<TraceIndex::iterator, TraceIndex::iterator> range =
+            _trace_index.equal_range(e->trace_id);
+        for (TraceIndex::iterator it = range.first; it != range.second; ++it) {
+            if (it->second == e) {
+                _trace_index.erase(it);
+                break;
+            }
+        }
+        _nbytes[index] -= MemoryOf(*e);
+        q.pop_front();
+        ++_nevicted;
+    }
+}
+
+void SpanRing::Add(const Span* span, const RpczSpan& proto) {
+    std::shared_ptr<Entry> e(new Entry);
+    e->trace_id = span->trace_id();
+    e->span_id = span->span_id();
+    e->start_real_us = span->GetStartRealTimeUs();
+    BriefSpan brief;
+    Span2Brief(span, &brief);
+    if (!brief.SerializeToString(&e->brief) ||
+        !proto.SerializeToString(&e->span)) {
+        LOG(ERROR) << "Fail to serialize span";
+        return;
+    }
+    const size_t budget = (size_t)FLAGS_rpcz_ring_buffer_mb * 1024 * 1024;
+    const int64_t expire_us = butil::gettimeofday_us() -
+        FLAGS_rpcz_keep_span_seconds * 1000000L;
+    const int index = IsSlowOrFailedSpan(proto) ? 1 : 0;
+    BAIDU_SCOPED_LOCK(_mutex);
+    _nbytes[index] += MemoryOf(*e);
+    _trace_index.insert(std::make_pair(e->trace_id, e));
+    _q[index].push_back(e);
+    EvictLocked(0, budget - budget / 4, expire_us);
+    EvictLocked(1, budget / 4, expire_us);
+}
+
+void SpanRing::FindLocked(uint64_t trace_id, std::vector<EntryPtr>* out) {
+    std::pair<TraceIndex::iterator, TraceIndex::iterator> range =
+        _trace_index.equal_range(trace_id);
+    for (TraceIndex::iterator it = range.first; it != range.second; ++it) {
+        out->push_back(it->second);
+    }
+}
+
+int SpanRing::Find(uint64_t trace_id, uint64_t span_id, RpczSpan* out) {
+    std::vector<EntryPtr> entries;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        FindLocked(trace_id, &entries);
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i]->span_id == span_id) {
+            if (!out->ParseFromString(entries[i]->span)) {
+                LOG(ERROR) << "Fail to parse from the value";
+                return -1;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void SpanRing::Find(uint64_t trace_id, std::deque<RpczSpan>* out) {
+    std::vector<EntryPtr> entries;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        FindLocked(trace_id, &entries);
+    }
+    std::sort(entries.begin(), entries.end(), StartsLater);
+    for (std::vector<EntryPtr>::const_reverse_iterator
+             it = entries.rbegin(); it != entries.rend(); ++it) {
+        out->push_back(RpczSpan());
+        if (!out->back().ParseFromString((*it)->span)) {
+            LOG(ERROR) << "Fail to parse from value";
+            out->pop_back();
+        }
+    }
+}
+
+void SpanRing::List(int64_t before_this_time, size_t max_scan,
+                    std::deque<BriefSpan>* out, SpanFilter* filter) {
+    std::vector<EntryPtr> entries;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        entries.reserve(_q[0].size() + _q[1].size());
+        for (int i = 0; i < 2; ++i) {
+            for (std::deque<EntryPtr>::const_iterator
+                     it = _q[i].begin(); it != _q[i].end(); ++it) {
+                if ((*it)->start_real_us <= before_this_time) {
+                    entries.push_back(*it);
+                }
+            }
+        }
+    }
+    // Spans are dumped after they end, sort them by starting time which is
+    // the order of the leveldb-based storage, from newest to oldest.
+    std::sort(entries.begin(), entries.end(), StartsLater);
+    BriefSpan brief;
+    size_t nscan = 0;
+    for (size_t i = 0; i < entries.size() && nscan < max_scan; ++i) {
+        brief.Clear();
+        if (brief.ParseFromString(entries[i]->brief)) {
+            if (NULL == filter || filter->Keep(brief)) {
+                out->push_back(brief);
+            }
+            ++nscan;
+        } else {
+            LOG(ERROR) << "Fail to parse from value";
+        }
+    }
+}
+
+void SpanRing::Describe(std::ostream& os) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    os << "[ memory ring buffer of " << FLAGS_rpcz_ring_buffer_mb << "MB ]\n"
+       << "spans: " << _q[0].size() << " (" << _nbytes[0] << " bytes)\n"
+       << "slow or failed spans: " << _q[1].size()
+       << " (" << _nbytes[1] << " bytes)\n"
+       << "evicted spans: " << _nevicted << '\n';
+}
+
+size_t SpanRing::size() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _q[0].size() + _q[1].size();
+}
+
+inline SpanRing* GetSpanRing() {
+    return butil::get_leaky_singleton<SpanRing>();
+}
+
+static size_t SpanRingSize() {
+    return GetSpanRing()->size();
+}
+
+// Write span into leveldb or the ring buffer.
 void Span::dump_and_destroy(size_t /*round*/) {
     StartIndexingIfNeeded();
-    
+
+    RpczSpan value_proto;
+    SpanDB::Serialize(this, &value_proto);
+    ExportSpanIfNeeded(value_proto);
+    if (UseSpanRing()) {
+        GetSpanRing()->Add(this, value_proto);
+        destroy();
+        return;
+    }
+
     std::string value_buf;
 
     butil::intrusive_ptr<SpanDB> db;
@@ -654,7 +929,7 @@ void Span::dump_and_destroy(size_t /*round*/) {
         db.reset(db2);
     }
 
-    leveldb::Status st = db->Index(this, &value_buf);
+    leveldb::Status st = db->Index(this, value_proto, &value_buf);
     destroy();
     if (!st.ok()) {
         LOG(WARNING) << st.ToString();
@@ -681,6 +956,9 @@ void Span::dump_and_destroy(size_t /*round*/) {
 }
 
 int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* response) {
+    if (UseSpanRing()) {
+        return GetSpanRing()->Find(trace_id, span_id, response);
+    }
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
         return -1;
@@ -703,6 +981,9 @@ int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* response) {
 
 void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
     out->clear();
+    if (UseSpanRing()) {
+        return GetSpanRing()->Find(trace_id, out);
+    }
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
         return;
@@ -735,6 +1016,9 @@ void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
 void ListSpans(int64_t starting_realtime, size_t max_scan,
                std::deque<BriefSpan>* out, SpanFilter* filter) {
     out->clear();
+    if (UseSpanRing()) {
+        return GetSpanRing()->List(starting_realtime, max_scan, out, filter);
+    }
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
         return;
@@ -772,6 +1056,9 @@ void ListSpans(int64_t starting_realtime, size_t max_scan,
 }
 
 void DescribeSpanDB(std::ostream& os) {
+    if (UseSpanRing()) {
+        return GetSpanRing()->Describe(os);
+    }
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
         return;
@@ -99,6 +99,12 @@ public:
     void set_response_size(int size) { _response_size = size; }
     void set_async(bool async) { _async = async; }
     
+    // High 64 bits of 128-bit trace ids from W3C/B3 headers, propagated to
+    // client spans so that the trace id is kept across the mesh.
+    void set_trace_id_high(uint64_t id) { _trace_id_high = id; }
+    // Vendor-specific W3C `tracestate', propagated as it is.
+    void set_trace_state(const std::string& s) { _trace_state = s; }
+
     void set_base_real_us(int64_t tm) { _base_real_us = tm; }
     void set_received_us(int64_t tm)
     { _received_real_us = tm + _base_real_us; }
@@ -117,6 +123,8 @@ public:
     }
 
     uint64_t trace_id() const { return _trace_id; }
+    uint64_t trace_id_high() const { return _trace_id_high; }
+    const std::string& trace_state() const { return _trace_state; }
     uint64_t parent_span_id() const { return _parent_span_id; }
     uint64_t span_id() const { return _span_id; }
     uint64_t log_id() const { return _log_id; }
@@ -152,6 +160,7 @@ private:
     }
 
     uint64_t _trace_id;
+    uint64_t _trace_id_high;
     uint64_t _span_id;
     uint64_t _parent_span_id;
     uint64_t _log_id;
@@ -171,6 +180,7 @@ private:
     int64_t _start_send_real_us;
     int64_t _sent_real_us;
     std::string _full_method_name;
+    std::string _trace_state;
     // Format: 
     //   time1_us \s annotation1 <SEP>
     //   time2_us \s annotation2 <SEP>
@@ -192,6 +202,16 @@ private:
     butil::StringSplitter _sp;
 };
 
+// Realtime in microseconds when the RPC of `span' started and ended, same
+// as Span::GetStartRealTimeUs() and Span::GetEndRealTimeUs().
+int64_t GetStartRealTimeUs(const RpczSpan& span);
+int64_t GetEndRealTimeUs(const RpczSpan& span);
+
+// True if the RPC of `span' or any of its client spans failed, or the span
+// lasted for at least -rpcz_slow_span_us. Such spans are kept longer than
+// others and exported by default.
+bool IsSlowOrFailedSpan(const RpczSpan& span);
+
 // These two functions can be used for composing TRACEPRINT as well as hiding
 // span implementations.
 bool CanAnnotateSpan();
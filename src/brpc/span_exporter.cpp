@@ -0,0 +1,333 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <fcntl.h>                           // open
+#include <unistd.h>                          // close
+#include <pthread.h>
+#include <limits>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/fd_guard.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/adaptive_protocol_type.h"     // ProtocolTypeToString
+#include "brpc/span.h"
+#include "brpc/span_exporter.h"
+
+
+namespace brpc {
+
+DEFINE_string(rpcz_export_file, "",
+              "Append spans collected by rpcz to this file in OTLP protobuf "
+              "format, empty means not exporting");
+DEFINE_bool(rpcz_export_all_spans, false,
+            "Export all collected spans rather than only the failed or slow "
+            "ones (see -rpcz_slow_span_us)");
+
+// Spans queued more than this are dropped.
+static const size_t MAX_PENDING_EXPORT_SPANS = 65536;
+static const int64_t EXPORT_INTERVAL_US = 1000000L;
+
+// ---- OTLP encoding ----
+// Only fields used by us are encoded, field numbers are from
+// opentelemetry/proto/trace/v1/trace.proto and common/v1/common.proto
+
+static void AppendVarint(std::string* out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out->push_back((char)v);
+}
+
+static void AppendTag(std::string* out, int field, int wire_type) {
+    AppendVarint(out, ((uint64_t)field << 3) | wire_type);
+}
+
+static void AppendBytes(std::string* out, int field,
+                        const void* data, size_t len) {
+    AppendTag(out, field, 2);
+    AppendVarint(out, len);
+    out->append((const char*)data, len);
+}
+
+static void AppendBytes(std::string* out, int field, const std::string& s) {
+    AppendBytes(out, field, s.data(), s.size());
+}
+
+static void AppendFixed64(std::string* out, int field, uint64_t v) {
+    AppendTag(out, field, 1);
+    for (int i = 0; i < 8; ++i) {
+        out->push_back((char)(v >> (i * 8)));
+    }
+}
+
+static void AppendId(std::string* out, int field,
+                     uint64_t id_high, uint64_t id, size_t len) {
+    // Ids are big-endian bytes. Trace ids take 16 bytes.
+    char buf[16] = {};
+    for (int i = 0; i < 8; ++i) {
+        buf[len - 1 - i] = (char)(id >> (i * 8));
+        if (len == 16) {
+            buf[7 - i] = (char)(id_high >> (i * 8));
+        }
+    }
+    AppendBytes(out, field, buf, len);
+}
+
+// KeyValue { string key = 1; AnyValue value = 2; }
+// AnyValue { string string_value = 1; int64 int_value = 3; }
+static void AppendAttribute(std::string* out, const char* key,
+                            const std::string& value) {
+    std::string any;
+    AppendBytes(&any, 1, value);
+    std::string kv;
+    AppendBytes(&kv, 1, key, strlen(key));
+    AppendBytes(&kv, 2, any);
+    AppendBytes(out, 9/*Span.attributes*/, kv);
+}
+
+static void AppendAttribute(std::string* out, const char* key, int64_t value) {
+    std::string any;
+    AppendTag(&any, 3, 0);
+    AppendVarint(&any, (uint64_t)value);
+    std::string kv;
+    AppendBytes(&kv, 1, key, strlen(key));
+    AppendBytes(&kv, 2, any);
+    AppendBytes(out, 9/*Span.attributes*/, kv);
+}
+
+static void AppendOTLPSpan(std::string* out, const RpczSpan& span) {
+    std::string s;
+    AppendId(&s, 1, span.trace_id_high(), span.trace_id(), 16);
+    AppendId(&s, 2, 0, span.span_id(), 8);
+    if (span.parent_span_id()) {
+        AppendId(&s, 4, 0, span.parent_span_id(), 8);
+    }
+    AppendBytes(&s, 5, span.full_method_name());
+    AppendTag(&s, 6, 0);
+    // SPAN_KIND_SERVER = 2, SPAN_KIND_CLIENT = 3
+    AppendVarint(&s, span.type() == SPAN_TYPE_SERVER ? 2 : 3);
+    AppendFixed64(&s, 7, GetStartRealTimeUs(span) * 1000L);
+    AppendFixed64(&s, 8, GetEndRealTimeUs(span) * 1000L);
+    AppendAttribute(&s, "rpc.system",
+                    ProtocolTypeToString(span.protocol()));
+    if (span.remote_ip()) {
+        butil::ip_t ip = butil::int2ip(span.remote_ip());
+        AppendAttribute(&s, "net.peer.ip", butil::ip2str(ip).c_str());
+        AppendAttribute(&s, "net.peer.port", (int64_t)span.remote_port());
+    }
+    if (span.log_id()) {
+        AppendAttribute(&s, "brpc.log_id", (int64_t)span.log_id());
+    }
+    AppendAttribute(&s, "brpc.request_size", (int64_t)span.request_size());
+    AppendAttribute(&s, "brpc.response_size", (int64_t)span.response_size());
+    // Event { fixed64 time_unix_nano = 1; string name = 2; }
+    SpanInfoExtractor extractor(span.info().c_str());
+    int64_t anno_time = 0;
+    std::string anno;
+    while (extractor.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                                   &anno_time, &anno)) {
+        std::string event;
+        AppendFixed64(&event, 1, anno_time * 1000L);
+        AppendBytes(&event, 2, anno);
+        AppendBytes(&s, 11, event);
+    }
+    // Status { string message = 2; StatusCode code = 3; }
+    std::string status;
+    if (span.error_code() != 0) {
+        const std::string msg = berror(span.error_code());
+        AppendBytes(&status, 2, msg);
+        AppendTag(&status, 3, 0);
+        AppendVarint(&status, 2/*STATUS_CODE_ERROR*/);
+        AppendAttribute(&s, "brpc.error_code", (int64_t)span.error_code());
+    } else {
+        AppendTag(&status, 3, 0);
+        AppendVarint(&status, 1/*STATUS_CODE_OK*/);
+    }
+    AppendBytes(&s, 15, status);
+    AppendBytes(out, 2/*ScopeSpans.spans*/, s);
+
+    for (int i = 0; i < span.client_spans_size(); ++i) {
+        AppendOTLPSpan(out, span.client_spans(i));
+    }
+}
+
+void SpansToOTLP(const std::deque<RpczSpan>& spans, butil::IOBuf* out) {
+    // TracesData { ResourceSpans resource_spans = 1; }
+    // ResourceSpans { ScopeSpans scope_spans = 2; }
+    // ScopeSpans { InstrumentationScope scope = 1; Span spans = 2; }
+    std::string scope_spans;
+    std::string scope;
+    AppendBytes(&scope, 1, "brpc", 4);
+    AppendBytes(&scope_spans, 1, scope);
+    for (size_t i = 0; i < spans.size(); ++i) {
+        AppendOTLPSpan(&scope_spans, spans[i]);
+    }
+    std::string resource_spans;
+    AppendBytes(&resource_spans, 2, scope_spans);
+    std::string traces_data;
+    AppendBytes(&traces_data, 1, resource_spans);
+    out->append(traces_data);
+}
+
+FileSpanExporter::FileSpanExporter(const std::string& path)
+    : _path(path)
+    , _fd(-1) {
+}
+
+FileSpanExporter::~FileSpanExporter() {
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+void FileSpanExporter::Export(const std::deque<RpczSpan>& spans) {
+    if (_fd < 0) {
+        _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0) {
+            PLOG_EVERY_SECOND(ERROR) << "Fail to open " << _path;
+            return;
+        }
+    }
+    butil::IOBuf data;
+    SpansToOTLP(spans, &data);
+    std::string len;
+    AppendVarint(&len, data.size());
+    butil::IOBuf buf;
+    buf.append(len);
+    buf.append(data);
+    while (!buf.empty()) {
+        if (buf.cut_into_file_descriptor(_fd) < 0 && errno != EINTR) {
+            PLOG_EVERY_SECOND(ERROR) << "Fail to write into " << _path;
+            ::close(_fd);
+            _fd = -1;
+            return;
+        }
+    }
+}
+
+// ---- Exporting thread ----
+
+static pthread_once_t g_export_thread_once = PTHREAD_ONCE_INIT;
+static butil::atomic<bool> g_export_started(false);
+// True iff SetSpanExporter() was called.
+static butil::atomic<bool> g_exporter_set(false);
+static butil::Mutex* g_pending_mutex = NULL;
+static std::deque<RpczSpan>* g_pending_spans = NULL;
+// Protecting following variables.
+static butil::Mutex* g_exporter_mutex = NULL;
+static SpanExporter* g_user_exporter = NULL;
+static FileSpanExporter* g_file_exporter = NULL;
+static std::string* g_file_exporter_path = NULL;
+
+// Returns the exporter in use, g_exporter_mutex must be locked.
+static SpanExporter* GetExporter() {
+    if (g_exporter_set.load(butil::memory_order_relaxed)) {
+        return g_user_exporter;
+    }
+    const std::string path = FLAGS_rpcz_export_file;
+    if (path.empty()) {
+        return NULL;
+    }
+    if (g_file_exporter == NULL || *g_file_exporter_path != path) {
+        delete g_file_exporter;
+        g_file_exporter = new FileSpanExporter(path);
+        *g_file_exporter_path = path;
+    }
+    return g_file_exporter;
+}
+
+static void* ExportThread(void*) {
+    std::deque<RpczSpan> spans;
+    while (true) {
+        usleep(EXPORT_INTERVAL_US);
+        {
+            BAIDU_SCOPED_LOCK(*g_pending_mutex);
+            spans.swap(*g_pending_spans);
+        }
+        if (spans.empty()) {
+            continue;
+        }
+        {
+            BAIDU_SCOPED_LOCK(*g_exporter_mutex);
+            SpanExporter* exporter = GetExporter();
+            if (exporter) {
+                exporter->Export(spans);
+            }
+        }
+        spans.clear();
+    }
+    return NULL;
+}
+
+static void InitExportGlobals() {
+    g_pending_mutex = new butil::Mutex;
+    g_pending_spans = new std::deque<RpczSpan>;
+    g_exporter_mutex = new butil::Mutex;
+    g_file_exporter_path = new std::string;
+}
+
+static void StartExportThread() {
+    InitExportGlobals();
+    pthread_t th;
+    const int rc = pthread_create(&th, NULL, ExportThread, NULL);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create thread for exporting spans, "
+                   << berror(rc);
+        return;
+    }
+    pthread_detach(th);
+    g_export_started.store(true, butil::memory_order_release);
+}
+
+void SetSpanExporter(SpanExporter* exporter) {
+    pthread_once(&g_export_thread_once, StartExportThread);
+    if (!g_export_started.load(butil::memory_order_acquire)) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(*g_exporter_mutex);
+    g_exporter_set.store(true, butil::memory_order_relaxed);
+    g_user_exporter = exporter;
+}
+
+void ExportSpanIfNeeded(const RpczSpan& span) {
+    if (!g_exporter_set.load(butil::memory_order_relaxed) &&
+        FLAGS_rpcz_export_file.empty()) {
+        return;
+    }
+    if (!g_export_started.load(butil::memory_order_acquire)) {
+        pthread_once(&g_export_thread_once, StartExportThread);
+        if (!g_export_started.load(butil::memory_order_acquire)) {
+            return;
+        }
+    }
+    if (!FLAGS_rpcz_export_all_spans && !IsSlowOrFailedSpan(span)) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(*g_pending_mutex);
+    if (g_pending_spans->size() >= MAX_PENDING_EXPORT_SPANS) {
+        LOG_EVERY_SECOND(WARNING) << "Too many spans to export, drop some";
+        return;
+    }
+    g_pending_spans->push_back(span);
+}
+
+} // namespace brpc
@@ -0,0 +1,73 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SPAN_EXPORTER_H
+#define BRPC_SPAN_EXPORTER_H
+
+#include <deque>
+#include "butil/iobuf.h"
+#include "brpc/span.pb.h"
+
+namespace brpc {
+
+// Receive spans collected by rpcz. Spans are exported in batches from a
+// background thread, so Export() can be slow without blocking RPCs.
+// Only spans kept by the tail-based sampling (failed ones and the ones
+// slower than -rpcz_slow_span_us) are exported unless -rpcz_export_all_spans
+// is on.
+class SpanExporter {
+public:
+    virtual ~SpanExporter() {}
+
+    // Export spans finished recently. Client spans issued inside a server
+    // span are in client_spans() of the server span.
+    virtual void Export(const std::deque<RpczSpan>& spans) = 0;
+};
+
+// Set the exporter receiving collected spans, replacing the one created
+// by -rpcz_export_file. NULL to stop exporting. The exporter is not owned
+// and must be valid until being replaced.
+void SetSpanExporter(SpanExporter* exporter);
+
+// Serialize `spans' as an opentelemetry.proto.trace.v1.TracesData which
+// can be sent to OTLP collectors (also accepted by Zipkin/Jaeger with their
+// OTLP receivers). 64-bit trace ids are left-padded with zeros to 128 bits
+// unless the high bits were propagated from upstream.
+void SpansToOTLP(const std::deque<RpczSpan>& spans, butil::IOBuf* out);
+
+// Export spans into a local file. Each batch is appended as a TracesData
+// prefixed with its length as a varint, which is the layout used by
+// google::protobuf::util::ParseDelimitedFromZeroCopyStream.
+class FileSpanExporter : public SpanExporter {
+public:
+    explicit FileSpanExporter(const std::string& path);
+    ~FileSpanExporter();
+    void Export(const std::deque<RpczSpan>& spans) override;
+private:
+    std::string _path;
+    int _fd;
+};
+
+// [Internal] Queue `span' for exporting if exporting is enabled and the
+// span is kept by the tail-based sampling. Called by the dumping thread of
+// rpcz.
+void ExportSpanIfNeeded(const RpczSpan& span);
+
+} // namespace brpc
+
+#endif // BRPC_SPAN_EXPORTER_H
@@ -22,6 +22,7 @@
 #include "butil/time.h"
 #include "butil/object_pool.h"
 #include "butil/unique_ptr.h"
+#include "butil/sys_byteorder.h"
 #include "bthread/unstable.h"
 #include "brpc/log.h"
 #include "brpc/socket.h"
@@ -29,6 +30,8 @@
 #include "brpc/input_messenger.h"
 #include "brpc/policy/streaming_rpc_protocol.h"
 #include "brpc/policy/baidu_rpc_protocol.h"
+#include "brpc/policy/http2_rpc_protocol.h"
+#include "brpc/policy/gzip_compress.h"
 #include "brpc/stream_impl.h"
 
 
@@ -37,6 +40,8 @@ namespace brpc {
 DECLARE_bool(usercode_in_pthread);
 
 const static butil::IOBuf *TIMEOUT_TASK = (butil::IOBuf*)-1L;
+// END_STREAM of the http2 stream carrying this stream
+const static butil::IOBuf *H2_END_TASK = (butil::IOBuf*)-2L;
 
 Stream::Stream() 
     : _host_socket(NULL)
@@ -45,6 +50,13 @@ Stream::Stream()
     , _closed(false)
     , _produced(0)
     , _remote_consumed(0)
+    , _pending_messages(0)
+    , _h2(false)
+    , _h2_bound(false)
+    , _h2_end_requested(false)
+    , _h2_local_ended(false)
+    , _h2_remote_ended(false)
+    , _h2_window(0)
     , _local_consumed(0)
     , _parse_rpc_response(false)
     , _pending_buf(NULL)
@@ -108,7 +120,14 @@ int Stream::Create(const StreamOptions &options,
 void Stream::BeforeRecycle(Socket *) {
     // No one holds reference now, so we don't need lock here
     bthread_id_list_reset(&_writable_wait_list, ECONNRESET);
-    if (_connected) {
+    if (_h2) {
+        if (_h2_bound) {
+            // Reset the http2 stream if any side did not end normally.
+            CHECK(_host_socket != NULL);
+            policy::CloseH2Stream(_host_socket, _remote_settings.stream_id(),
+                                  !(_h2_local_ended && _h2_remote_ended));
+        }
+    } else if (_connected) {
         // Send CLOSE frame
         RPC_VLOG << "Send close frame";
         CHECK(_host_socket != NULL);
@@ -140,6 +159,13 @@ ssize_t Stream::CutMessageIntoFileDescriptor(int /*fd*/,
         errno = EBADF;
         return -1;
     }
+    if (_h2) {
+        return CutMessageIntoH2Stream(data_list, size);
+    }
+    {
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        _pending_messages -= size;
+    }
     butil::IOBuf out;
     ssize_t len = 0;
     for (size_t i = 0; i < size; ++i) {
@@ -161,6 +187,164 @@ void Stream::WriteToHostSocket(butil::IOBuf* b) {
     BRPC_HANDLE_EOVERCROWDED(_host_socket->Write(b));
 }
 
+ssize_t Stream::CutMessageIntoH2Stream(butil::IOBuf** data_list,
+                                       size_t size) {
+    ssize_t len = 0;
+    {
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        for (size_t i = 0; i < size; ++i) {
+            // Messages are never compressed.
+            char prefix[5];
+            prefix[0] = 0;
+            *(uint32_t*)(prefix + 1) = butil::HostToNet32(data_list[i]->size());
+            _h2_unsent.append(prefix, sizeof(prefix));
+            len += data_list[i]->length();
+            _h2_unsent.append(butil::IOBuf::Movable(*data_list[i]));
+            if (_options.max_buf_size > 0) {
+                // The prefix is counted as well since _remote_consumed
+                // counts bytes sent to the http2 stream.
+                _produced += sizeof(prefix);
+            }
+        }
+        _pending_messages -= size;
+    }
+    FlushH2();
+    return len;
+}
+
+void Stream::FlushH2() {
+    bthread_id_list_t tmplist;
+    bthread_id_list_init(&tmplist, 0, 0);
+    std::unique_lock<bthread_mutex_t> lck(_congestion_control_mutex);
+    if (!_h2_bound) {
+        // Flushed after connected.
+        return;
+    }
+    butil::IOBuf data;
+    int64_t n = std::min((int64_t)_h2_unsent.size(), _h2_window);
+    if (n > 0) {
+        n = policy::ConsumeH2ConnectionWindow(_host_socket, n);
+    }
+    if (n > 0) {
+        _h2_unsent.cutn(&data, n);
+        _h2_window -= n;
+        if (_options.max_buf_size > 0) {
+            const bool was_full = _produced >= _remote_consumed + (size_t)_options.max_buf_size;
+            _remote_consumed += n;
+            const bool is_full = _produced >= _remote_consumed + (size_t)_options.max_buf_size;
+            if (was_full && !is_full) {
+                bthread_id_list_swap(&tmplist, &_writable_wait_list);
+            }
+        }
+    }
+    bool end_stream = false;
+    bool close = false;
+    if (_h2_end_requested && !_h2_local_ended &&
+        _pending_messages == 0 && _h2_unsent.empty()) {
+        end_stream = true;
+        _h2_local_ended = true;
+        close = _h2_remote_ended;
+    }
+    if (!data.empty() || end_stream) {
+        // Write inside the lock to keep the order of DATA frames.
+        if (policy::WriteH2StreamData(_host_socket, _remote_settings.stream_id(),
+                                      &data, end_stream) != 0) {
+            PLOG_IF(WARNING, errno != EPIPE) << "Fail to write into " << *_host_socket;
+            close = true;
+        }
+    }
+    lck.unlock();
+
+    // broadcast
+    bthread_id_list_reset(&tmplist, 0);
+    bthread_id_list_destroy(&tmplist);
+    if (close) {
+        Close();
+    }
+}
+
+int Stream::OnH2Bound(int64_t send_window) {
+    BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+    if (_h2_bound) {
+        return -1;
+    }
+    _h2 = true;
+    _h2_bound = true;
+    _h2_window = send_window;
+    _parse_rpc_response = false;
+    return 0;
+}
+
+void Stream::OnH2WindowUpdate(int64_t size) {
+    {
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        _h2_window += size;
+    }
+    FlushH2();
+}
+
+void Stream::OnH2LocalEnded() {
+    BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+    _h2_end_requested = true;
+    _h2_local_ended = true;
+}
+
+void Stream::OnH2Message(butil::IOBuf* msg) {
+    if (msg == NULL) {
+        msg = (butil::IOBuf*)H2_END_TASK;
+    }
+    if (bthread::execution_queue_execute(_consumer_queue, msg) != 0) {
+        if (msg != H2_END_TASK) {
+            delete msg;
+        }
+        Close();
+    }
+}
+
+void Stream::OnH2Reset() {
+    {
+        // Don't reset the http2 stream again in BeforeRecycle()
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        _h2_local_ended = true;
+        _h2_remote_ended = true;
+    }
+    Close();
+}
+
+int Stream::ShutdownH2() {
+    {
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        if (!_h2) {
+            return -1;
+        }
+        if (_h2_end_requested) {
+            return 0;
+        }
+        _h2_end_requested = true;
+    }
+    // Sent by FlushH2() if all written messages were cut, otherwise by
+    // FlushH2() in CutMessageIntoH2Stream() later.
+    FlushH2();
+    return 0;
+}
+
+bool Stream::ParseH2Message(butil::IOBuf* msg) {
+    char prefix[5];
+    if (msg->cutn(prefix, sizeof(prefix)) != sizeof(prefix)) {
+        return false;
+    }
+    if (prefix[0] == 0) {
+        return true;
+    }
+    // gzip is the only compression supported by gRPC of brpc.
+    butil::IOBuf uncompressed;
+    if (!policy::GzipDecompress(*msg, &uncompressed)) {
+        return false;
+    }
+    msg->swap(uncompressed);
+    return true;
+}
+
 ssize_t Stream::CutMessageIntoSSLChannel(SSL*, butil::IOBuf**, size_t) {
     CHECK(false) << "Stream does support SSL";
     errno = EINVAL;
@@ -240,6 +424,10 @@ void Stream::SetConnected(const StreamSettings* remote_settings) {
         // message which is the very RPC response
         StartIdleTimer();
     }
+    if (_h2) {
+        // StreamClose() may be called before connected.
+        FlushH2();
+    }
 }
 
 void Stream::TriggerOnConnectIfNeed() {
@@ -260,9 +448,15 @@ void Stream::TriggerOnConnectIfNeed() {
 }
 
 int Stream::AppendIfNotFull(const butil::IOBuf &data) {
-    if (_options.max_buf_size > 0) {
+    {
         std::unique_lock<bthread_mutex_t> lck(_congestion_control_mutex);
-        if (_produced >= _remote_consumed + (size_t)_options.max_buf_size) {
+        if (_h2_end_requested) {
+            // Half-closed by StreamClose()
+            errno = EINVAL;
+            return -1;
+        }
+        if (_options.max_buf_size > 0 &&
+            _produced >= _remote_consumed + (size_t)_options.max_buf_size) {
             const size_t saved_produced = _produced;
             const size_t saved_remote_consumed = _remote_consumed;
             lck.unlock();
@@ -273,7 +467,10 @@ int Stream::AppendIfNotFull(const butil::IOBuf &data) {
                      << " max_buf_size=" << _options.max_buf_size;
             return 1;
         }
-        _produced += data.length();
+        if (_options.max_buf_size > 0) {
+            _produced += data.length();
+        }
+        ++_pending_messages;
     }
     butil::IOBuf copied_data(data);
     const int rc = _fake_socket_weak_ref->Write(&copied_data);
@@ -281,7 +478,10 @@ int Stream::AppendIfNotFull(const butil::IOBuf &data) {
         // Stream may be closed by peer before
         LOG(WARNING) << "Fail to write to _fake_socket, " << berror();
         BAIDU_SCOPED_LOCK(_congestion_control_mutex);
-        _produced -= data.length();
+        if (_options.max_buf_size > 0) {
+            _produced -= data.length();
+        }
+        --_pending_messages;
         return -1;
     }
     return 0;
@@ -505,10 +705,24 @@ int Stream::Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
     DEFINE_SMALL_ARRAY(butil::IOBuf*, buf_list, s->_options.messages_in_batch, 256);
     MessageBatcher mb(buf_list, s->_options.messages_in_batch, s);
     bool has_timeout_task = false;
+    bool has_h2_end = false;
+    bool h2_error = false;
+    int64_t h2_consumed = 0;
     for (; iter; ++iter) {
         butil::IOBuf* t= *iter;
         if (t == TIMEOUT_TASK) {
             has_timeout_task = true;
+        } else if (t == H2_END_TASK) {
+            has_h2_end = true;
+        } else if (s->_h2) {
+            h2_consumed += t->size();
+            if (!h2_error && s->ParseH2Message(t)) {
+                mb.push(t);
+            } else {
+                LOG_IF(WARNING, !h2_error) << "Fail to parse gRPC message of stream=" << s->id();
+                h2_error = true;
+                delete t;
+            }
         } else {
             if (s->_parse_rpc_response) {
                 s->_parse_rpc_response = false;
@@ -528,6 +742,26 @@ int Stream::Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
         s->_local_consumed += mb.total_length();
         s->SendFeedback();
     }
+    if (h2_consumed > 0) {
+        policy::ReleaseH2StreamWindow(s->_host_socket,
+                                      s->_remote_settings.stream_id(),
+                                      h2_consumed);
+    }
+    if (h2_error) {
+        s->Close();
+    } else if (has_h2_end) {
+        bool close = false;
+        {
+            BAIDU_SCOPED_LOCK(s->_congestion_control_mutex);
+            s->_h2_remote_ended = true;
+            close = s->_h2_local_ended;
+        }
+        if (close) {
+            s->Close();
+        } else if (s->_options.handler != NULL) {
+            s->_options.handler->on_half_closed(s->id());
+        }
+    }
     s->StartIdleTimer();
     return 0;
 }
@@ -689,6 +923,13 @@ int StreamWait(StreamId stream_id, const timespec* due_time) {
 }
 
 int StreamClose(StreamId stream_id) {
+    SocketUniquePtr ptr;
+    if (Socket::Address(stream_id, &ptr) == 0 &&
+        ((Stream*)ptr->conn())->ShutdownH2() == 0) {
+        // Streams carried by http2 are half-closed, which are closed after
+        // the remote side ends as well.
+        return 0;
+    }
     return Stream::SetFailed(stream_id);
 }
 
@@ -740,6 +981,13 @@ int StreamAccept(StreamId* response_stream, Controller &cntl,
         LOG(ERROR) << "Fail to create stream";
         return -1;
     }
+    if (cntl.request_protocol() == PROTOCOL_HTTP) {
+        // Only gRPC streaming calls over http2 carry streams in http.
+        SocketUniquePtr ptr;
+        if (Socket::Address(stream_id, &ptr) == 0) {
+            ((Stream*)ptr->conn())->MarkH2();
+        }
+    }
     cntl._response_stream = stream_id;
     *response_stream = stream_id;
     return 0;
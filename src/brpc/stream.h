@@ -45,6 +45,11 @@ public:
                                      size_t size) = 0;
     virtual void on_idle_timeout(StreamId id) = 0;
     virtual void on_closed(StreamId id) = 0; 
+    // Called when the remote side finished writing while this side is still
+    // writable, which only happens to streams of gRPC streaming calls (see
+    // comments above StreamCreate). on_closed() is called after this side is
+    // closed as well.
+    virtual void on_half_closed(StreamId id) {}
 };
 
 struct StreamOptions {
@@ -81,12 +86,31 @@ struct StreamOptions {
 // when receiving the response with a stream from server-side. If |options| is
 // NULL, the stream will be created with default options
 // Return 0 on success, -1 otherwise
+//
+// gRPC streaming: When the RPC is a gRPC call(protocol is "h2:grpc") to a
+// method declared with `stream' request or response, the stream is carried
+// by the http2 stream of the RPC instead:
+//  - The stream is connected when the request is sent. For methods with
+//    streaming requests, the request is the first message and following
+//    messages are written by StreamWrite().
+//  - For methods with streaming responses, the RPC completes when headers
+//    of the response are received, messages of the response are delivered
+//    to the handler. Otherwise the RPC completes after the server finished
+//    the response as usual.
+//  - Flow control follows the http2 windows, max_buf_size limits data
+//    buffered at this side additionally.
+//  - StreamClose() ends this side only (half-close), the stream is closed
+//    after the remote side ends as well.
 int StreamCreate(StreamId* request_stream, Controller &cntl,
                  const StreamOptions* options);
 
 // [Called at the server side]
 // Accept the stream. If client didn't create a stream with the request 
 // (cntl.has_remote_stream() returns false), this method would fail.
+// Requests to gRPC streaming methods always have remote streams. After the
+// stream is accepted, the response of the RPC is not sent and messages are
+// written by StreamWrite(), StreamClose() finishes the call with OK status.
+// Otherwise the response is sent as the only message.
 // Return 0 on success, -1 otherwise.
 int StreamAccept(StreamId* response_stream, Controller &cntl,
                  const StreamOptions* options);
@@ -119,6 +143,8 @@ void StreamWait(StreamId stream_id, const timespec *due_time,
 //  - |StreamWait| wakes up immediately.
 //  - Both sides |on_closed| would be notifed after all the pending buffers have
 //    been received
+//  - For gRPC streaming, the remote side is notified with |on_half_closed|
+//    and this side can still receive messages until the remote side closes.
 // This function could be called multiple times without side-effects
 int StreamClose(StreamId stream_id);
 
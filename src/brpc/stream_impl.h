@@ -63,6 +63,28 @@ public:
     static int SetFailed(StreamId id);
     void Close();
 
+    // Following methods are called by the http2 protocol when this stream
+    // is carried by a http2 stream (gRPC streaming) instead of frames of
+    // streaming_rpc_protocol. _remote_settings.stream_id() is the http2
+    // stream id.
+    // Called before any operation of the user on this stream.
+    void MarkH2() { _h2 = true; }
+    bool is_h2() const { return _h2; }
+    // `send_window' is the initial window of the http2 stream.
+    // Returns -1 if this stream was bound before.
+    int OnH2Bound(int64_t send_window);
+    // Add `size'(may be negative) to the window of the http2 stream.
+    void OnH2WindowUpdate(int64_t size);
+    // END_STREAM was sent along with the first message.
+    void OnH2LocalEnded();
+    // Receive a gRPC message(with the 5-byte prefix), NULL means END_STREAM.
+    void OnH2Message(butil::IOBuf* msg);
+    // The http2 stream was reset by the remote side.
+    void OnH2Reset();
+    // End this side of the http2 stream after all written messages.
+    // Returns -1 if this stream is not carried by http2.
+    int ShutdownH2();
+
 private:
 friend void StreamWait(StreamId stream_id, const timespec *due_time,
                 void (*on_writable)(StreamId, void*, int), void *arg);
@@ -79,6 +101,9 @@ friend class MessageBatcher;
     void StopIdleTimer();
     void HandleRpcResponse(butil::IOBuf* response_buffer);
     void WriteToHostSocket(butil::IOBuf* b);
+    ssize_t CutMessageIntoH2Stream(butil::IOBuf** data_list, size_t size);
+    void FlushH2();
+    bool ParseH2Message(butil::IOBuf* msg);
 
     static int Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter);
     static int TriggerOnWritable(bthread_id_t id, void *data, int error_code);
@@ -115,6 +140,20 @@ friend class MessageBatcher;
     size_t _produced;
     size_t _remote_consumed;
     bthread_id_list_t _writable_wait_list;
+    // Messages written into _fake_socket but not cut yet.
+    size_t _pending_messages;
+
+    // Fields of streams carried by http2, guarded by _congestion_control_mutex
+    // except _h2 which is set before being used.
+    // _remote_consumed counts bytes sent to the http2 stream, which are
+    // cut from _h2_unsent when http2 windows allow.
+    bool _h2;
+    bool _h2_bound;
+    bool _h2_end_requested;
+    bool _h2_local_ended;
+    bool _h2_remote_ended;
+    int64_t _h2_window;
+    butil::IOBuf _h2_unsent;
 
     int64_t _local_consumed;
     StreamSettings _remote_settings;   
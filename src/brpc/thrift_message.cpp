@@ -37,6 +37,7 @@ ThriftFramedMessage::ThriftFramedMessage()
 
 void ThriftFramedMessage::SharedCtor() {
     field_id = THRIFT_INVALID_FID;
+    protocol = THRIFT_PROTOCOL_BINARY;
     _own_raw_instance = false;
     _raw_instance = nullptr;
 }
@@ -61,6 +62,8 @@ ThriftFramedMessage* ThriftFramedMessage::New() const {
 
 void ThriftFramedMessage::Clear() {
     body.clear();
+    protocol = THRIFT_PROTOCOL_BINARY;
+    service_name.clear();
     if (_own_raw_instance) {
         delete _raw_instance;
         _own_raw_instance = false;
@@ -127,6 +130,8 @@ void ThriftFramedMessage::Swap(ThriftFramedMessage* other) {
     if (other != this) {
         body.swap(other->body);
         std::swap(field_id, other->field_id);
+        std::swap(protocol, other->protocol);
+        service_name.swap(other->service_name);
         std::swap(_own_raw_instance, other->_own_raw_instance);
         std::swap(_raw_instance, other->_raw_instance);
     }
@@ -144,8 +149,20 @@ void ThriftStub::CallMethod(const char* method_name,
                             const ThriftFramedMessage* req,
                             ThriftFramedMessage* res,
                             ::google::protobuf::Closure* done) {
-    cntl->_thrift_method_name.assign(method_name);
+    SetMethodName(cntl, method_name);
     _channel->CallMethod(NULL, cntl, req, res, done);
 }
 
+void ThriftStub::SetMethodName(Controller* cntl, const char* method_name) const {
+    if (_service_name.empty()) {
+        cntl->_thrift_method_name.assign(method_name);
+    } else {
+        cntl->_thrift_method_name.reserve(_service_name.size() + 1 +
+                                          strlen(method_name));
+        cntl->_thrift_method_name.assign(_service_name);
+        cntl->_thrift_method_name.push_back(':');
+        cntl->_thrift_method_name.append(method_name);
+    }
+}
+
 } // namespace brpc
@@ -43,6 +43,12 @@ static const int16_t THRIFT_INVALID_FID = -1;
 static const int16_t THRIFT_REQUEST_FID = 1;
 static const int16_t THRIFT_RESPONSE_FID = 0;
 
+// Protocols encoding thrift messages inside frames.
+enum ThriftProtocolType {
+    THRIFT_PROTOCOL_BINARY = 0,     // TBinaryProtocol
+    THRIFT_PROTOCOL_COMPACT = 1,    // TCompactProtocol
+};
+
 // Problem: TBase is absent in thrift 0.9.3
 // Solution: Wrap native messages with templates into instances inheriting
 //   from ThriftMessageBase which can be stored and handled uniformly.
@@ -59,6 +65,12 @@ friend class ThriftStub;
 public:
     butil::IOBuf body; // ~= "{ raw_instance }"
     int16_t field_id;  // must be set when body is set.
+    // Protocol that `body' is encoded in or the raw instance is serialized
+    // with. Messages received are in the protocol used by the peer.
+    ThriftProtocolType protocol;
+    // Set to the service name of a TMultiplexedProtocol request whose
+    // method name is "service:method" on server-side, empty otherwise.
+    std::string service_name;
     
 private:
     bool _own_raw_instance;
@@ -109,7 +121,17 @@ private:
 
 class ThriftStub {
 public:
-    explicit ThriftStub(ChannelBase* channel) : _channel(channel) {}
+    explicit ThriftStub(ChannelBase* channel)
+        : _channel(channel), _protocol(THRIFT_PROTOCOL_BINARY) {}
+
+    // Prefix method names with "`service_name':" as TMultiplexedProtocol
+    // does, to call a service of a multiplexed thrift server.
+    void set_service_name(const std::string& service_name)
+    { _service_name = service_name; }
+
+    // Protocol of requests sent by the templated CallMethod().
+    // Default: THRIFT_PROTOCOL_BINARY
+    void set_protocol(ThriftProtocolType protocol) { _protocol = protocol; }
 
     template <typename REQUEST, typename RESPONSE>
     void CallMethod(const char* method_name,
@@ -118,6 +140,8 @@ public:
                     RESPONSE* raw_response,
                     ::google::protobuf::Closure* done);
 
+    // `req->body' is sent in `req->protocol' as it is, which is useful
+    // for proxies forwarding thrift messages without parsing them.
     void CallMethod(const char* method_name,
                     Controller* cntl,
                     const ThriftFramedMessage* req,
@@ -125,14 +149,19 @@ public:
                     ::google::protobuf::Closure* done);
 
 private:
+    void SetMethodName(Controller* cntl, const char* method_name) const;
+
     ChannelBase* _channel;
+    std::string _service_name;
+    ThriftProtocolType _protocol;
 };
 
 namespace policy {
 // Implemented in policy/thrift_protocol.cpp
 bool ReadThriftStruct(const butil::IOBuf& body,
                       ThriftMessageBase* raw_msg,
-                      int16_t expected_fid);
+                      int16_t expected_fid,
+                      ThriftProtocolType protocol = THRIFT_PROTOCOL_BINARY);
 }
 
 namespace details {
@@ -197,7 +226,7 @@ T* ThriftFramedMessage::Cast() {
     _own_raw_instance = true;
 
     if (!body.empty()) {
-        if (!policy::ReadThriftStruct(body, _raw_instance, field_id)) {
+        if (!policy::ReadThriftStruct(body, _raw_instance, field_id, protocol)) {
             LOG(ERROR) << "Fail to parse " << butil::class_name<T>();
         }
     }
@@ -210,12 +239,13 @@ void ThriftStub::CallMethod(const char* method_name,
                             const REQUEST* raw_request,
                             RESPONSE* raw_response,
                             ::google::protobuf::Closure* done) {
-    cntl->_thrift_method_name.assign(method_name);
+    SetMethodName(cntl, method_name);
 
     details::ThriftMessageWrapper<REQUEST>
         raw_request_wrapper(const_cast<REQUEST*>(raw_request));
     ThriftFramedMessage request;
     request._raw_instance = &raw_request_wrapper;
+    request.protocol = _protocol;
 
     if (done == NULL) {
         // response is guaranteed to be unused after a synchronous RPC, no
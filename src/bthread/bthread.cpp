@@ -93,6 +93,10 @@ inline TaskControl* get_or_new_task_control() {
         delete c;
         return NULL;
     }
+    if (c->concurrency() > FLAGS_bthread_concurrency) {
+        // Raised to have at least one worker per tag.
+        FLAGS_bthread_concurrency = c->concurrency();
+    }
     p->store(c, butil::memory_order_release);
     return c;
 }
@@ -111,7 +115,7 @@ static bool validate_bthread_min_concurrency(const char*, int32_t val) {
     BAIDU_SCOPED_LOCK(g_task_control_mutex);
     int concurrency = c->concurrency();
     if (val > concurrency) {
-        int added = c->add_workers(val - concurrency);
+        int added = c->add_workers(val - concurrency, BTHREAD_TAG_DEFAULT);
         return added == (val - concurrency);
     } else {
         return true;
@@ -129,22 +133,50 @@ start_from_non_worker(bthread_t* __restrict tid,
     if (NULL == c) {
         return ENOMEM;
     }
+    bthread_tag_t tag = BTHREAD_TAG_DEFAULT;
+    if (attr != NULL && attr->tag != BTHREAD_TAG_INVALID) {
+        if (attr->tag < 0 || attr->tag >= c->ntags()) {
+            return EINVAL;
+        }
+        tag = attr->tag;
+    }
     if (attr != NULL && (attr->flags & BTHREAD_NOSIGNAL)) {
         // Remember the TaskGroup to insert NOSIGNAL tasks for 2 reasons:
         // 1. NOSIGNAL is often for creating many bthreads in batch,
         //    inserting into the same TaskGroup maximizes the batch.
         // 2. bthread_flush() needs to know which TaskGroup to flush.
         TaskGroup* g = tls_task_group_nosignal;
-        if (NULL == g) {
-            g = c->choose_one_group();
+        if (NULL == g || g->tag() != tag) {
+            if (g) {
+                g->flush_nosignal_tasks_remote();
+            }
+            g = c->choose_one_group(tag);
             tls_task_group_nosignal = g;
         }
         return g->start_background<true>(tid, attr, fn, arg);
     }
-    return c->choose_one_group()->start_background<true>(
+    return c->choose_one_group(tag)->start_background<true>(
         tid, attr, fn, arg);
 }
 
+// Start a bthread in another tag from a worker.
+inline int start_in_other_tag(bthread_t* __restrict tid,
+                              const bthread_attr_t* __restrict attr,
+                              void * (*fn)(void*),
+                              void* __restrict arg) {
+    // bthread_flush() in the worker only flushes its own TaskGroup, signal
+    // the task right now.
+    bthread_attr_t using_attr = *attr;
+    using_attr.flags &= ~BTHREAD_NOSIGNAL;
+    return start_from_non_worker(tid, &using_attr, fn, arg);
+}
+
+inline bool in_other_tag(const TaskGroup* g,
+                         const bthread_attr_t* __restrict attr) {
+    return attr != NULL && attr->tag != BTHREAD_TAG_INVALID &&
+        attr->tag != g->tag();
+}
+
 struct TidTraits {
     static const size_t BLOCK_SIZE = 63;
     static const size_t MAX_ENTRIES = 65536;
@@ -175,6 +207,9 @@ int bthread_start_urgent(bthread_t* __restrict tid,
                          void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
+        if (bthread::in_other_tag(g, attr)) {
+            return bthread::start_in_other_tag(tid, attr, fn, arg);
+        }
         // start from worker
         return bthread::TaskGroup::start_foreground(&g, tid, attr, fn, arg);
     }
@@ -187,6 +222,9 @@ int bthread_start_background(bthread_t* __restrict tid,
                              void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
+        if (bthread::in_other_tag(g, attr)) {
+            return bthread::start_in_other_tag(tid, attr, fn, arg);
+        }
         // start from worker
         return g->start_background<false>(tid, attr, fn, arg);
     }
@@ -307,12 +345,48 @@ int bthread_setconcurrency(int num) {
     if (num > bthread::FLAGS_bthread_concurrency) {
         // Create more workers if needed.
         bthread::FLAGS_bthread_concurrency +=
-            c->add_workers(num - bthread::FLAGS_bthread_concurrency);
+            c->add_workers(num - bthread::FLAGS_bthread_concurrency,
+                           BTHREAD_TAG_DEFAULT);
         return 0;
     }
     return (num == bthread::FLAGS_bthread_concurrency ? 0 : EPERM);
 }
 
+int bthread_getconcurrency_by_tag(bthread_tag_t tag) {
+    bthread::TaskControl* c = bthread::get_or_new_task_control();
+    if (c == NULL || tag < 0 || tag >= c->ntags()) {
+        return 0;
+    }
+    return c->concurrency(tag);
+}
+
+int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag) {
+    bthread::TaskControl* c = bthread::get_or_new_task_control();
+    if (c == NULL) {
+        return ENOMEM;
+    }
+    if (tag < 0 || tag >= c->ntags() || num <= 0 ||
+        num > BTHREAD_MAX_CONCURRENCY) {
+        LOG(ERROR) << "Invalid concurrency=" << num << " of tag=" << tag;
+        return EINVAL;
+    }
+    BAIDU_SCOPED_LOCK(bthread::g_task_control_mutex);
+    const int old_num = c->concurrency(tag);
+    if (num < old_num) {
+        return EPERM;
+    }
+    c->add_workers(num - old_num, tag);
+    if (c->concurrency() > bthread::FLAGS_bthread_concurrency) {
+        bthread::FLAGS_bthread_concurrency = c->concurrency();
+    }
+    return (num == c->concurrency(tag) ? 0 : EPERM);
+}
+
+bthread_tag_t bthread_self_tag(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    return g ? g->tag() : BTHREAD_TAG_INVALID;
+}
+
 int bthread_about_to_quit() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g != NULL) {
@@ -322,6 +396,22 @@ int bthread_about_to_quit() {
     return EPERM;
 }
 
+int bthread_get_cpu_usage(int64_t* cpu_clock_ns, int64_t* alloc_bytes) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL) {
+        return EPERM;
+    }
+    int64_t bytes = 0;
+    const int64_t ns = g->current_cpu_clock_ns(&bytes);
+    if (cpu_clock_ns) {
+        *cpu_clock_ns = ns;
+    }
+    if (alloc_bytes) {
+        *alloc_bytes = bytes;
+    }
+    return 0;
+}
+
 int bthread_timer_add(bthread_timer_t* id, timespec abstime,
                       void (*on_timer)(void*), void* arg) {
     bthread::TaskControl* c = bthread::get_or_new_task_control();
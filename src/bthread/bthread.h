@@ -146,6 +146,18 @@ extern int bthread_getconcurrency(void);
 // NOTE: currently concurrency cannot be reduced after any bthread created.
 extern int bthread_setconcurrency(int num);
 
+// Get number of worker pthreads of `tag'.
+extern int bthread_getconcurrency_by_tag(bthread_tag_t tag);
+
+// Add worker pthreads of `tag' until there're `num' of them. Like
+// bthread_setconcurrency(), workers can't be removed.
+// Returns 0 on success, error code otherwise.
+extern int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag);
+
+// Tag of the worker running the caller, BTHREAD_TAG_INVALID if the caller
+// is not in a worker.
+extern bthread_tag_t bthread_self_tag(void);
+
 // Yield processor to another bthread. 
 // Notice that current implementation is not fair, which means that 
 // even if bthread_yield() is called, suspended threads may still starve.
@@ -267,7 +279,11 @@ extern int bthread_rwlockattr_destroy(bthread_rwlockattr_t* attr);
 extern int bthread_rwlockattr_getkind_np(const bthread_rwlockattr_t* attr,
                                          int* pref);
 
-// Set reader/write preference.
+// Set reader/write preference. Writers are always preferred by
+// bthread_rwlock_t, `pref' chooses how readers are counted, either
+// BTHREAD_RWLOCK_PREFER_WRITER_NP(default) or
+// BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP, see bthread/types.h for details.
+// Returns EINVAL if `pref' is not one of them.
 extern int bthread_rwlockattr_setkind_np(bthread_rwlockattr_t* attr,
                                          int pref);
 
@@ -19,6 +19,7 @@
 
 // Date: Tue Jul 22 17:30:12 CST 2014
 
+#include <new>                               // std::nothrow
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/macros.h"
@@ -36,6 +37,7 @@
 #include "bthread/timer_thread.h"
 #include "bthread/butex.h"
 #include "bthread/mutex.h"
+#include "bthread/offcpu_profiler.h"
 
 // This file implements butex.h
 // Provides futex-like semantics which is sequenced wait and wake operations
@@ -89,6 +91,10 @@ struct ButexWaiter : public butil::LinkNode<ButexWaiter> {
     // Erasing node from middle of LinkedList is thread-unsafe, we need
     // to hold its container's lock.
     butil::atomic<Butex*> container;
+
+    // Butex::epoch of the container when this waiter was queued. The waiter
+    // is detached by butex_wake_all() if the two differ.
+    uint64_t epoch;
 };
 
 // non_pthread_task allocates this structure on stack and queue it in
@@ -106,6 +112,19 @@ struct ButexBthreadWaiter : public ButexWaiter {
 // in Butex::waiters.
 struct ButexPthreadWaiter : public ButexWaiter {
     butil::atomic<int> sig;
+    // True if this is a ButexAsyncWaiter.
+    bool async;
+};
+
+// butex_wait_async() allocates this structure on heap and queue it in
+// Butex::waiters. It's woken up as a pthread waiter except that the callback
+// is run instead of waking up the futex.
+struct ButexAsyncWaiter : public ButexPthreadWaiter {
+    void (*on_wakeup)(void*, int);
+    void* arg;
+    butil::atomic<TimerThread::TaskId> sleep_id;
+    // References held by the waking side, the timer and butex_wait_async().
+    butil::atomic<int> nref;
 };
 
 typedef butil::LinkedList<ButexWaiter> ButexWaiterList;
@@ -113,18 +132,26 @@ typedef butil::LinkedList<ButexWaiter> ButexWaiterList;
 enum ButexPthreadSignal { PTHREAD_NOT_SIGNALLED, PTHREAD_SIGNALLED };
 
 struct BAIDU_CACHELINE_ALIGNMENT Butex {
-    Butex() {}
+    Butex() : epoch(0) {}
     ~Butex() {}
 
     butil::atomic<int> value;
     ButexWaiterList waiters;
     internal::FastPthreadMutex waiter_lock;
+    // Incremented by butex_wake_all() which detaches all waiters at once.
+    uint64_t epoch;
 };
 
 BAIDU_CASSERT(offsetof(Butex, value) == 0, offsetof_value_must_0);
 BAIDU_CASSERT(sizeof(Butex) == BAIDU_CACHELINE_SIZE, butex_fits_in_one_cacheline);
 
+static void wakeup_async(ButexAsyncWaiter* aw);
+
 static void wakeup_pthread(ButexPthreadWaiter* pw) {
+    if (pw->async) {
+        wakeup_async(static_cast<ButexAsyncWaiter*>(pw));
+        return;
+    }
     // release fence makes wait_pthread see changes before wakeup.
     pw->sig.store(PTHREAD_SIGNALLED, butil::memory_order_release);
     // At this point, wait_pthread() possibly has woken up and destroyed `pw'.
@@ -256,9 +283,24 @@ void butex_destroy(void* butex) {
     butil::return_object(b);
 }
 
-inline TaskGroup* get_task_group(TaskControl* c) {
+// Get a TaskGroup to run bthreads of `tag', the current one if possible.
+inline TaskGroup* get_task_group(TaskControl* c, bthread_tag_t tag) {
     TaskGroup* g = tls_task_group;
-    return g ? g : c->choose_one_group();
+    return (g && g->tag() == tag) ? g : c->choose_one_group(tag);
+}
+
+inline bthread_tag_t waiter_tag(const ButexBthreadWaiter* bw) {
+    return bw->task_meta->attr.tag;
+}
+
+// Schedule `bw' which is not the one that caller will switch to.
+inline void run_woken_waiter(TaskGroup* g, ButexBthreadWaiter* bw) {
+    if (waiter_tag(bw) == g->tag()) {
+        g->ready_to_run_general(bw->tid, true);
+    } else {
+        get_task_group(bw->control, waiter_tag(bw))->ready_to_run_general(
+            bw->tid);
+    }
 }
 
 int butex_wake(void* arg) {
@@ -280,40 +322,57 @@ int butex_wake(void* arg) {
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
     TaskGroup* g = tls_task_group;
-    if (g) {
+    if (g && g->tag() == waiter_tag(bbw)) {
         TaskGroup::exchange(&g, bbw->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(bbw->tid);
+        bbw->control->choose_one_group(waiter_tag(bbw))->ready_to_run_remote(
+            bbw->tid);
     }
     return 1;
 }
 
+// Move all waiters in `from' to the empty `to' in O(1).
+static void splice_waiters(ButexWaiterList* from, ButexWaiterList* to) {
+    butil::LinkNode<ButexWaiter>* head = from->head();
+    // Unlink root of `from', the waiters form a ring without root.
+    head->previous()->RemoveFromList();
+    // head() of an empty list is its root.
+    head->InsertBeforeAsList(to->head());
+}
+
+// Woken bthreads are pushed into run queues in batches of this size. The
+// first batch goes to the current worker, others are spread to random workers
+// so that a large wake-all does not pile up in one run queue.
+static const size_t WAKE_ALL_BATCH = 32;
+
 int butex_wake_all(void* arg) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
 
-    ButexWaiterList bthread_waiters;
-    ButexWaiterList pthread_waiters;
+    ButexWaiterList waiters;
     {
         BAIDU_SCOPED_LOCK(b->waiter_lock);
-        while (!b->waiters.empty()) {
-            ButexWaiter* bw = b->waiters.head()->value();
-            bw->RemoveFromList();
-            bw->container.store(NULL, butil::memory_order_relaxed);
-            if (bw->tid) {
-                bthread_waiters.Append(bw);
-            } else {
-                pthread_waiters.Append(bw);
-            }
+        if (b->waiters.empty()) {
+            return 0;
         }
+        // Detach all waiters without walking them. erase_from_butex() ignores
+        // waiters queued in previous epochs, which are owned by this function
+        // from now on.
+        splice_waiters(&b->waiters, &waiters);
+        ++b->epoch;
     }
 
     int nwakeup = 0;
-    while (!pthread_waiters.empty()) {
-        ButexPthreadWaiter* bw = static_cast<ButexPthreadWaiter*>(
-            pthread_waiters.head()->value());
+    ButexWaiterList bthread_waiters;
+    while (!waiters.empty()) {
+        ButexWaiter* bw = waiters.head()->value();
         bw->RemoveFromList();
-        wakeup_pthread(bw);
-        ++nwakeup;
+        bw->container.store(NULL, butil::memory_order_relaxed);
+        if (bw->tid) {
+            bthread_waiters.Append(bw);
+        } else {
+            wakeup_pthread(static_cast<ButexPthreadWaiter*>(bw));
+            ++nwakeup;
+        }
     }
     if (bthread_waiters.empty()) {
         return nwakeup;
@@ -324,20 +383,31 @@ int butex_wake_all(void* arg) {
     next->RemoveFromList();
     unsleep_if_necessary(next, get_global_timer_thread());
     ++nwakeup;
-    TaskGroup* g = get_task_group(next->control);
-    const int saved_nwakeup = nwakeup;
+    const bthread_tag_t tag = waiter_tag(next);
+    TaskGroup* g = get_task_group(next->control, tag);
+    TaskGroup* batch_group = g;
+    bthread_t batch[WAKE_ALL_BATCH];
+    size_t nbatch = 0;
     while (!bthread_waiters.empty()) {
-        // pop reversely
+        // Batches are run in the order of waiting, see
+        // ready_to_run_batch_general().
         ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
-            bthread_waiters.tail()->value());
+            bthread_waiters.head()->value());
         w->RemoveFromList();
         unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
         ++nwakeup;
+        if (waiter_tag(w) != tag) {
+            run_woken_waiter(g, w);
+            continue;
+        }
+        batch[nbatch++] = w->tid;
+        if (nbatch == WAKE_ALL_BATCH) {
+            batch_group->ready_to_run_batch_general(batch, nbatch);
+            batch_group = next->control->choose_one_group(tag);
+            nbatch = 0;
+        }
     }
-    if (saved_nwakeup != nwakeup) {
-        g->flush_nosignal_tasks_general();
-    }
+    batch_group->ready_to_run_batch_general(batch, nbatch);
     if (g == tls_task_group) {
         TaskGroup::exchange(&g, next->tid);
     } else {
@@ -391,7 +461,7 @@ int butex_wake_except(void* arg, bthread_t excluded_bthread) {
     ButexBthreadWaiter* front = static_cast<ButexBthreadWaiter*>(
                 bthread_waiters.head()->value());
 
-    TaskGroup* g = get_task_group(front->control);
+    TaskGroup* g = get_task_group(front->control, waiter_tag(front));
     const int saved_nwakeup = nwakeup;
     do {
         // pop reversely
@@ -399,7 +469,7 @@ int butex_wake_except(void* arg, bthread_t excluded_bthread) {
             bthread_waiters.tail()->value());
         w->RemoveFromList();
         unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
+        run_woken_waiter(g, w);
         ++nwakeup;
     } while (!bthread_waiters.empty());
     if (saved_nwakeup != nwakeup) {
@@ -430,6 +500,7 @@ int butex_requeue(void* arg, void* arg2) {
             bw->RemoveFromList();
             m->waiters.Append(bw);
             bw->container.store(m, butil::memory_order_relaxed);
+            bw->epoch = m->epoch;
         }
     }
 
@@ -440,10 +511,11 @@ int butex_requeue(void* arg, void* arg2) {
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
     TaskGroup* g = tls_task_group;
-    if (g) {
+    if (g && g->tag() == waiter_tag(bbw)) {
         TaskGroup::exchange(&g, front->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(front->tid);
+        bbw->control->choose_one_group(waiter_tag(bbw))->ready_to_run_remote(
+            front->tid);
     }
     return 1;
 }
@@ -469,6 +541,10 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
         // b can be NULL when the waiter is scheduled but queued.
         BAIDU_SCOPED_LOCK(b->waiter_lock);
         if (b == bw->container.load(butil::memory_order_relaxed)) {
+            if (bw->epoch != b->epoch) {
+                // Detached and being woken up by butex_wake_all().
+                break;
+            }
             bw->RemoveFromList();
             bw->container.store(NULL, butil::memory_order_relaxed);
             if (bw->tid) {
@@ -481,7 +557,8 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
     if (erased && wakeup) {
         if (bw->tid) {
             ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(bw);
-            get_task_group(bbw->control)->ready_to_run_general(bw->tid);
+            get_task_group(bbw->control, waiter_tag(bbw))->ready_to_run_general(
+                bw->tid);
         } else {
             ButexPthreadWaiter* pw = static_cast<ButexPthreadWaiter*>(bw);
             wakeup_pthread(pw);
@@ -491,6 +568,91 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
     return erased;
 }
 
+static void release_async_waiter(ButexAsyncWaiter* aw, int nref) {
+    if (aw->nref.fetch_sub(nref, butil::memory_order_acq_rel) == nref) {
+        delete aw;
+    }
+}
+
+// Called after `aw' is removed from the butex by the waking thread.
+static void wakeup_async(ButexAsyncWaiter* aw) {
+    const TimerThread::TaskId sleep_id =
+        aw->sleep_id.load(butil::memory_order_acquire);
+    aw->on_wakeup(aw->arg, 0);
+    int nref = 1;
+    if (sleep_id != 0 &&
+        get_global_timer_thread()->unschedule(sleep_id) == 0) {
+        // The timer will never run, release its reference as well.
+        nref = 2;
+    }
+    release_async_waiter(aw, nref);
+}
+
+static void erase_async_waiter_because_of_timeout(void* arg) {
+    ButexAsyncWaiter* aw = static_cast<ButexAsyncWaiter*>(arg);
+    if (erase_from_butex(aw, false, WAITER_STATE_TIMEDOUT)) {
+        // No one is able to wake up `aw' any more, release the reference of
+        // the waking side as well.
+        aw->on_wakeup(aw->arg, ETIMEDOUT);
+        release_async_waiter(aw, 2);
+    } else {
+        release_async_waiter(aw, 1);
+    }
+}
+
+int butex_wait_async(void* arg, int expected_value, const timespec* abstime,
+                     void (*on_wakeup)(void*, int), void* on_wakeup_arg) {
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+    if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    if (abstime != NULL &&
+        butil::timespec_to_microseconds(*abstime) <
+        butil::gettimeofday_us() + MIN_SLEEP_US) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    ButexAsyncWaiter* aw = new (std::nothrow) ButexAsyncWaiter;
+    if (aw == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    aw->tid = 0;
+    aw->container.store(NULL, butil::memory_order_relaxed);
+    aw->sig.store(PTHREAD_NOT_SIGNALLED, butil::memory_order_relaxed);
+    aw->async = true;
+    aw->on_wakeup = on_wakeup;
+    aw->arg = on_wakeup_arg;
+    aw->sleep_id.store(0, butil::memory_order_relaxed);
+    // Keep one more reference until the timer is scheduled, otherwise the
+    // timer may run and destroy `aw' before sleep_id is set.
+    aw->nref.store(abstime ? 3 : 1, butil::memory_order_relaxed);
+    {
+        BAIDU_SCOPED_LOCK(b->waiter_lock);
+        if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+            delete aw;
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        b->waiters.Append(aw);
+        aw->container.store(b, butil::memory_order_relaxed);
+        aw->epoch = b->epoch;
+    }
+    if (abstime != NULL) {
+        const TimerThread::TaskId sleep_id = get_global_timer_thread()->schedule(
+            erase_async_waiter_because_of_timeout, aw, *abstime);
+        if (sleep_id != TimerThread::INVALID_TASK_ID) {
+            aw->sleep_id.store(sleep_id, butil::memory_order_release);
+            release_async_waiter(aw, 1);
+        } else {
+            LOG(ERROR) << "Fail to schedule timer, the waiter never times out";
+            release_async_waiter(aw, 2);
+        }
+    }
+    return 0;
+}
+
 static void wait_for_butex(void* arg) {
     ButexBthreadWaiter* const bw = static_cast<ButexBthreadWaiter*>(arg);
     Butex* const b = bw->initial_butex;
@@ -516,6 +678,7 @@ static void wait_for_butex(void* arg) {
                    !bw->task_meta->interrupted) {
             b->waiters.Append(bw);
             bw->container.store(b, butil::memory_order_relaxed);
+            bw->epoch = b->epoch;
             return;
         }
     }
@@ -558,6 +721,7 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     TaskMeta* task = NULL;
     ButexPthreadWaiter pw;
     pw.tid = 0;
+    pw.async = false;
     pw.sig.store(PTHREAD_NOT_SIGNALLED, butil::memory_order_relaxed);
     int rc = 0;
     
@@ -579,6 +743,7 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     } else {
         b->waiters.Append(&pw);
         pw.container.store(b, butil::memory_order_relaxed);
+        pw.epoch = b->epoch;
         b->waiter_lock.unlock();
 
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
@@ -607,19 +772,8 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
-int butex_wait(void* arg, int expected_value, const timespec* abstime) {
-    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
-    if (b->value.load(butil::memory_order_relaxed) != expected_value) {
-        errno = EWOULDBLOCK;
-        // Sometimes we may take actions immediately after unmatched butex,
-        // this fence makes sure that we see changes before changing butex.
-        butil::atomic_thread_fence(butil::memory_order_acquire);
-        return -1;
-    }
-    TaskGroup* g = tls_task_group;
-    if (NULL == g || g->is_current_pthread_task()) {
-        return butex_wait_from_pthread(g, b, expected_value, abstime);
-    }
+static int butex_wait_from_bthread(TaskGroup* g, Butex* b, int expected_value,
+                                   const timespec* abstime) {
     ButexBthreadWaiter bbw;
     // tid is 0 iff the thread is non-bthread
     bbw.tid = g->current_tid();
@@ -630,6 +784,10 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     bbw.expected_value = expected_value;
     bbw.initial_butex = b;
     bbw.control = g->control();
+    // Ask the off-CPU profiler if this wait should be sampled.
+    const size_t offcpu_sampling_range = is_offcpu_sampled();
+    const int64_t wait_start_ns =
+        (offcpu_sampling_range ? butil::cpuwide_time_ns() : 0);
 
     if (abstime != NULL) {
         // Schedule timer before queueing. If the timer is triggered before
@@ -671,6 +829,11 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
     num_waiters << -1;
 #endif
+    if (offcpu_sampling_range) {
+        submit_offcpu_sample(offcpu_sampling_range,
+                             butil::cpuwide_time_ns() - wait_start_ns,
+                             bbw.task_meta->runqueue_delay_ns);
+    }
 
     bool is_interrupted = false;
     if (bbw.task_meta->interrupted) {
@@ -692,6 +855,37 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     return 0;
 }
 
+int butex_wait(void* arg, int expected_value, const timespec* abstime,
+               ContentionSiteType site) {
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+    if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+        errno = EWOULDBLOCK;
+        // Sometimes we may take actions immediately after unmatched butex,
+        // this fence makes sure that we see changes before changing butex.
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        return -1;
+    }
+    // Ask the contention profiler if this wait should be sampled.
+    const size_t sampling_range =
+        (site != CONTENTION_SITE_NONE ? is_contention_sampled() : 0);
+    const int64_t start_ns = (sampling_range ? butil::cpuwide_time_ns() : 0);
+    int rc = 0;
+    TaskGroup* g = tls_task_group;
+    if (NULL == g || g->is_current_pthread_task()) {
+        rc = butex_wait_from_pthread(g, b, expected_value, abstime);
+    } else {
+        rc = butex_wait_from_bthread(g, b, expected_value, abstime);
+    }
+    if (sampling_range) {
+        const int saved_errno = errno;
+        const int64_t end_ns = butil::cpuwide_time_ns();
+        const bthread_contention_site_t csite = {end_ns - start_ns, sampling_range};
+        submit_contention(csite, end_ns, site);
+        errno = saved_errno;
+    }
+    return rc;
+}
+
 }  // namespace bthread
 
 namespace butil {
@@ -29,6 +29,22 @@
 
 namespace bthread {
 
+// Types of sites waiting for contended resources, reported to the
+// contention profiler and shown along with callsites in
+// /vars/contention_sites.
+enum ContentionSiteType {
+    // Not reported: deliberate waits such as bthread_join() and fd waits,
+    // or bthread_mutex_t which reports contentions by itself.
+    CONTENTION_SITE_NONE = -1,
+    CONTENTION_SITE_BTHREAD_MUTEX = 0,
+    // pthread_mutex_t, including butil::Mutex.
+    CONTENTION_SITE_PTHREAD_MUTEX,
+    CONTENTION_SITE_COND,
+    CONTENTION_SITE_COUNTDOWN_EVENT,
+    CONTENTION_SITE_RWLOCK,
+    CONTENTION_SITE_TYPE_NUM
+};
+
 // Create a butex which is a futex-like 32-bit primitive for synchronizing
 // bthreads/pthreads.
 // Returns a pointer to 32-bit data, NULL on failure.
@@ -67,8 +83,32 @@ int butex_requeue(void* butex1, void* butex2);
 // abstime is not NULL.
 // About |abstime|:
 //   Different from FUTEX_WAIT, butex_wait uses absolute time.
+// If `site' is not CONTENTION_SITE_NONE and the contention profiler is on,
+// the wait may be sampled and reported as a contention of `site'. Only
+// lock-like primitives should pass a site.
 // Returns 0 on success, -1 otherwise and errno is set.
-int butex_wait(void* butex, int expected_value, const timespec* abstime);
+int butex_wait(void* butex, int expected_value, const timespec* abstime,
+               ContentionSiteType site = CONTENTION_SITE_NONE);
+
+// Asynchronous version of butex_wait(): queue a waiter on |butex| if *butex
+// equals |expected_value| and return without blocking. |on_wakeup|(|arg|,
+// error) is called exactly once when the butex is woken up(error=0) or
+// CLOCK_REALTIME reached |abstime|(error=ETIMEDOUT). |on_wakeup| runs in the
+// thread waking up the butex or the TimerThread, it should be short and
+// never block.
+// Returns 0 when |on_wakeup| will be called, -1 otherwise and errno is set:
+// EWOULDBLOCK if *butex does not equal |expected_value|, ETIMEDOUT if
+// |abstime| is already reached.
+int butex_wait_async(void* butex, int expected_value, const timespec* abstime,
+                     void (*on_wakeup)(void* arg, int error), void* arg);
+
+// Returns a non-zero sampling range if the contention profiler is on and the
+// contention about to happen should be sampled, 0 otherwise.
+size_t is_contention_sampled();
+
+// Report a sampled contention along with the callsite's stacktrace.
+void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns,
+                       ContentionSiteType site);
 
 }  // namespace bthread
 
@@ -97,7 +97,8 @@ int bthread_cond_wait(bthread_cond_t* __restrict c,
     }
     bthread_mutex_unlock(m);
     int rc1 = 0;
-    if (bthread::butex_wait(ic->seq, expected_seq, NULL) < 0 &&
+    if (bthread::butex_wait(ic->seq, expected_seq, NULL,
+                            bthread::CONTENTION_SITE_COND) < 0 &&
         errno != EWOULDBLOCK && errno != EINTR/*note*/) {
         // EINTR should not be returned by cond_*wait according to docs on
         // pthread, however spurious wake-up is OK, just as we do here
@@ -131,7 +132,8 @@ int bthread_cond_timedwait(bthread_cond_t* __restrict c,
     }
     bthread_mutex_unlock(m);
     int rc1 = 0;
-    if (bthread::butex_wait(ic->seq, expected_seq, abstime) < 0 &&
+    if (bthread::butex_wait(ic->seq, expected_seq, abstime,
+                            bthread::CONTENTION_SITE_COND) < 0 &&
         errno != EWOULDBLOCK && errno != EINTR/*note*/) {
         // note: see comments in bthread_cond_wait on EINTR.
         rc1 = errno;
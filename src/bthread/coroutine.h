@@ -0,0 +1,351 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_COROUTINE_H
+#define BTHREAD_COROUTINE_H
+
+#include <errno.h>
+#include <time.h>                               // timespec
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"                   // bthread_timer_add
+#include "bthread/butex.h"                      // butex_wait_async
+
+namespace bthread {
+
+// Asynchronous version of bthread_fd_timedwait(): `on_ready'(`arg', error)
+// is called exactly once when any of `events' happens to `fd'(error=0) or
+// CLOCK_REALTIME reached `abstime'(error=ETIMEDOUT). `on_ready' runs in the
+// epoll thread or the TimerThread, it should be short and never block.
+// Returns 0 when `on_ready' will be called, -1 otherwise and errno is set,
+// errno=EWOULDBLOCK means that the event already happened.
+int fd_wait_async(int fd, unsigned events, const timespec* abstime,
+                  void (*on_ready)(void* arg, int error), void* arg);
+
+}  // namespace bthread
+
+// Coroutines need C++20, nothing below is visible to older standards.
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define BTHREAD_HAS_COROUTINE 1
+#endif
+#endif
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+
+namespace bthread {
+
+// Stackless tasks for short handlers which are mostly waiting.
+//
+// A bthread owns a stack during its whole life, even when it's blocked.
+// A Task is a C++20 coroutine whose frame is allocated on heap. It's
+// started and resumed in a bthread with a small stack which ends as soon
+// as the coroutine suspends again, so a suspended Task does not hold a
+// stack and is scheduled by the same run queues as other bthreads.
+//
+// Example:
+//   bthread::Task<int> add_later(int a, int b) {
+//       co_await bthread::co_usleep(1000);
+//       co_return a + b;
+//   }
+//   bthread::Task<void> handle() {
+//       int sum = co_await add_later(1, 2);  // Run in the same bthread.
+//       ...
+//   }
+//   bthread::start_coroutine(handle());
+//
+// NOTE: Blocking functions(bthread_mutex_lock, bthread_usleep, synchronous
+// RPC...) still work inside a Task, but they block the bthread running it
+// and make it hold a stack. Use co_await on the awaitables below instead.
+template <typename T> class Task;
+
+template <typename T> void start_coroutine(Task<T>&& task);
+
+namespace detail {
+
+inline void* run_coroutine(void* arg) {
+    std::coroutine_handle<>::from_address(arg).resume();
+    return NULL;
+}
+
+// Resume `h' in a new bthread. The bthread ends when the coroutine
+// suspends again or finishes.
+inline void resume_in_bthread(std::coroutine_handle<> h) {
+    bthread_t th;
+    if (bthread_start_background(&th, &BTHREAD_ATTR_SMALL, run_coroutine,
+                                 h.address()) != 0) {
+        h.resume();
+    }
+}
+
+struct PromiseBase {
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<Promise> h) noexcept {
+            PromiseBase& p = h.promise();
+            if (p.detached) {
+                if (p.exception) {
+                    LOG(ERROR) << "Uncaught exception in a detached coroutine";
+                }
+                h.destroy();
+                return std::noop_coroutine();
+            }
+            // Continue the coroutine awaiting this one in the same bthread.
+            if (p.continuation) {
+                return p.continuation;
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept {
+        exception = std::current_exception();
+    }
+    void rethrow_if_failed() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    // Set by start_coroutine(), the frame is destroyed when finished.
+    bool detached = false;
+};
+
+template <typename T>
+struct Promise : public PromiseBase {
+    Task<T> get_return_object();
+    template <typename U>
+    void return_value(U&& value) { result.emplace(std::forward<U>(value)); }
+    T get_result() {
+        rethrow_if_failed();
+        return std::move(*result);
+    }
+
+    std::optional<T> result;
+};
+
+template <>
+struct Promise<void> : public PromiseBase {
+    Task<void> get_return_object();
+    void return_void() const noexcept {}
+    void get_result() { rethrow_if_failed(); }
+};
+
+}  // namespace detail
+
+// A lazily started coroutine returning T. It runs when it's co_await-ed by
+// another Task or passed to start_coroutine().
+template <typename T>
+class Task {
+public:
+    typedef detail::Promise<T> promise_type;
+
+    Task(Task&& rhs) noexcept : _handle(std::exchange(rhs._handle, nullptr)) {}
+    Task& operator=(Task&& rhs) noexcept {
+        if (this != &rhs) {
+            if (_handle) {
+                _handle.destroy();
+            }
+            _handle = std::exchange(rhs._handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> awaiting) noexcept {
+        _handle.promise().continuation = awaiting;
+        return _handle;
+    }
+    T await_resume() { return _handle.promise().get_result(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Task);
+friend struct detail::Promise<T>;
+template <typename U> friend void start_coroutine(Task<U>&& task);
+
+    explicit Task(std::coroutine_handle<promise_type> h) : _handle(h) {}
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+namespace detail {
+template <typename T>
+inline Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+}  // namespace detail
+
+// Run `task' in background, the result is dropped. The coroutine frame is
+// destroyed after it finishes.
+template <typename T>
+void start_coroutine(Task<T>&& task) {
+    std::coroutine_handle<typename Task<T>::promise_type> h =
+        std::exchange(task._handle, nullptr);
+    if (h) {
+        h.promise().detached = true;
+        detail::resume_in_bthread(h);
+    }
+}
+
+namespace detail {
+
+// Base of awaiters resumed by callbacks of *_async() functions.
+class AsyncAwaiter {
+public:
+    bool await_ready() const noexcept { return false; }
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int await_resume() const noexcept {
+        if (_error) {
+            errno = _error;
+            return -1;
+        }
+        return 0;
+    }
+
+protected:
+    static void on_done(void* arg, int error) {
+        AsyncAwaiter* a = static_cast<AsyncAwaiter*>(arg);
+        a->_error = error;
+        resume_in_bthread(a->_handle);
+    }
+
+    std::coroutine_handle<> _handle;
+    int _error = 0;
+};
+
+}  // namespace detail
+
+class ButexAwaiter : public detail::AsyncAwaiter {
+public:
+    ButexAwaiter(void* butex, int expected_value, const timespec* abstime)
+        : _butex(butex), _expected_value(expected_value), _abstime(abstime) {}
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        _handle = h;
+        if (butex_wait_async(_butex, _expected_value, _abstime,
+                             on_done, this) == 0) {
+            // Don't touch this object any more, the coroutine may be
+            // resumed already.
+            return true;
+        }
+        _error = errno;
+        return false;
+    }
+
+private:
+    void* _butex;
+    int _expected_value;
+    const timespec* _abstime;
+};
+
+class FdAwaiter : public detail::AsyncAwaiter {
+public:
+    FdAwaiter(int fd, unsigned events, const timespec* abstime)
+        : _fd(fd), _events(events), _abstime(abstime) {}
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        _handle = h;
+        if (fd_wait_async(_fd, _events, _abstime, on_done, this) == 0) {
+            return true;
+        }
+        if (errno != EWOULDBLOCK) {
+            _error = errno;
+        }
+        return false;
+    }
+
+private:
+    int _fd;
+    unsigned _events;
+    const timespec* _abstime;
+};
+
+class SleepAwaiter : public detail::AsyncAwaiter {
+public:
+    explicit SleepAwaiter(int64_t microseconds) : _microseconds(microseconds) {}
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        _handle = h;
+        bthread_timer_t id;
+        const int rc = bthread_timer_add(
+            &id, butil::microseconds_from_now(_microseconds),
+            on_timer, this);
+        if (rc == 0) {
+            return true;
+        }
+        _error = rc;
+        return false;
+    }
+
+private:
+    static void on_timer(void* arg) { on_done(arg, 0); }
+
+    int64_t _microseconds;
+};
+
+// co_await on following functions suspends the calling Task instead of
+// blocking the bthread, and evaluates to 0 on success, -1 otherwise with
+// errno set, the same as the blocking counterparts.
+
+// Like butex_wait().
+inline ButexAwaiter co_butex_wait(void* butex, int expected_value,
+                                  const timespec* abstime = NULL) {
+    return ButexAwaiter(butex, expected_value, abstime);
+}
+
+// Like bthread_usleep().
+inline SleepAwaiter co_usleep(int64_t microseconds) {
+    return SleepAwaiter(microseconds);
+}
+
+// Like bthread_fd_timedwait().
+inline FdAwaiter co_fd_wait(int fd, unsigned events,
+                            const timespec* abstime = NULL) {
+    return FdAwaiter(fd, events, abstime);
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_HAS_COROUTINE
+
+#endif  // BTHREAD_COROUTINE_H
@@ -61,7 +61,8 @@ int CountdownEvent::wait() {
         if (seen_counter <= 0) {
             return 0;
         }
-        if (butex_wait(_butex, seen_counter, NULL) < 0 &&
+        if (butex_wait(_butex, seen_counter, NULL,
+                       CONTENTION_SITE_COUNTDOWN_EVENT) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR) {
             return errno;
         }
@@ -99,7 +100,8 @@ int CountdownEvent::timed_wait(const timespec& duetime) {
         if (seen_counter <= 0) {
             return 0;
         }
-        if (butex_wait(_butex, seen_counter, &duetime) < 0 &&
+        if (butex_wait(_butex, seen_counter, &duetime,
+                       CONTENTION_SITE_COUNTDOWN_EVENT) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR) {
             return errno;
         }
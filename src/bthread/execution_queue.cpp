@@ -24,12 +24,13 @@
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/object_pool.h"           // butil::get_object
 #include "butil/resource_pool.h"         // butil::get_resource
+#include "butil/time.h"                  // butil::cpuwide_time_ns
 
 namespace bthread {
 
 //May be false on different platforms
-//BAIDU_CASSERT(sizeof(TaskNode) == 128, sizeof_TaskNode_must_be_128);
-//BAIDU_CASSERT(offsetof(TaskNode, static_task_mem) + sizeof(TaskNode().static_task_mem) == 128, sizeof_TaskNode_must_be_128);
+//BAIDU_CASSERT(sizeof(TaskNode) == 192, sizeof_TaskNode_must_be_192);
+//BAIDU_CASSERT(offsetof(TaskNode, static_task_mem) + sizeof(TaskNode().static_task_mem) == 192, sizeof_TaskNode_must_be_192);
 BAIDU_CASSERT(sizeof(ExecutionQueue<int>) == sizeof(ExecutionQueueBase),
               sizeof_ExecutionQueue_must_be_the_same_with_ExecutionQueueBase);
 BAIDU_CASSERT(sizeof(TaskIterator<int>) == sizeof(TaskIteratorBase),
@@ -51,6 +52,7 @@ struct ExecutionQueueVars {
     bvar::Adder<int64_t> running_task_count;
     bvar::Adder<int64_t> execq_count;
     bvar::Adder<int64_t> execq_active_count;
+    bvar::Adder<int64_t> execq_full_count;
     
     ExecutionQueueVars();
 };
@@ -58,9 +60,28 @@ struct ExecutionQueueVars {
 ExecutionQueueVars::ExecutionQueueVars()
     : running_task_count("bthread_execq_running_task_count")
     , execq_count("bthread_execq_count")
-    , execq_active_count("bthread_execq_active_count") {
+    , execq_active_count("bthread_execq_active_count")
+    , execq_full_count("bthread_execq_full_count") {
 }
 
+static int64_t get_ntasks(void* arg) {
+    return static_cast<butil::atomic<int64_t>*>(arg)->load(
+        butil::memory_order_relaxed);
+}
+
+// Vars of a queue created with non-empty ExecutionQueueOptions.bvar_prefix
+struct ExecutionQueueExposedVars {
+    bvar::PassiveStatus<int64_t> depth;
+    bvar::LatencyRecorder lag;
+
+    ExecutionQueueExposedVars(const std::string& prefix,
+                              butil::atomic<int64_t>* ntasks)
+        : depth(get_ntasks, ntasks) {
+        depth.expose_as(prefix, "depth");
+        lag.expose(prefix, "lag");
+    }
+};
+
 inline ExecutionQueueVars* get_execq_vars() {
     return butil::get_leaky_singleton<ExecutionQueueVars>();
 }
@@ -69,6 +90,9 @@ void ExecutionQueueBase::start_execute(TaskNode* node) {
     node->next = TaskNode::UNCONNECTED;
     node->status = UNEXECUTED;
     node->iterated = false;
+    if (_exposed_vars) {
+        node->enqueue_ns = butil::cpuwide_time_ns();
+    }
     if (node->high_priority) {
         // Add _high_priority_tasks before pushing this task into queue to
         // make sure that _execute_tasks sees the newest number when this 
@@ -174,6 +198,10 @@ void* ExecutionQueueBase::_execute_tasks(void* arg) {
     if (destroy_queue) {
         CHECK(m->_head.load(butil::memory_order_relaxed) == NULL);
         CHECK(m->_stopped);
+        // Hide the vars before waking up joiners which may expose vars
+        // with the same prefix again.
+        delete m->_exposed_vars;
+        m->_exposed_vars = NULL;
         // Add _join_butex by 2 to make it equal to the next version of the
         // ExecutionQueue from the same slot so that join with old id would
         // return immediatly.
@@ -190,6 +218,9 @@ void* ExecutionQueueBase::_execute_tasks(void* arg) {
 }
 
 void ExecutionQueueBase::return_task_node(TaskNode* node) {
+    if (!node->stop_task) {
+        release_task();
+    }
     node->clear_before_return(_clear_func);
     butil::return_object<TaskNode>(node);
     get_execq_vars()->running_task_count << -1;
@@ -212,6 +243,47 @@ void ExecutionQueueBase::_on_recycle() {
     }
 }
 
+int ExecutionQueueBase::_reserve_task_slow() {
+    const int64_t max_size = (int64_t)_options.max_tasks_size;
+    bool counted_full = false;
+    for (;;) {
+        // Load the butex before checking the size, paired with the release
+        // fence in _release_task() so that a release after the check always
+        // makes butex_wait() below return.
+        const int expected = _space_butex->load(butil::memory_order_acquire);
+        int64_t n = _ntasks.load(butil::memory_order_relaxed);
+        while (n < max_size) {
+            if (_ntasks.compare_exchange_weak(
+                    n, n + 1, butil::memory_order_relaxed)) {
+                return 0;
+            }
+        }
+        if (!counted_full) {
+            counted_full = true;
+            get_execq_vars()->execq_full_count << 1;
+        }
+        if (!_options.wait_when_full) {
+            return EAGAIN;
+        }
+        if (stopped()) {
+            return EINVAL;
+        }
+        if (butex_wait(_space_butex, expected, NULL) < 0 &&
+            errno != EWOULDBLOCK && errno != EINTR) {
+            return errno;
+        }
+    }
+}
+
+void ExecutionQueueBase::_release_task() {
+    const int64_t n = _ntasks.fetch_sub(1, butil::memory_order_relaxed);
+    if (n == (int64_t)_options.max_tasks_size) {
+        // The queue was full, wake up waiting producers.
+        _space_butex->fetch_add(1, butil::memory_order_release);
+        butex_wake_all(_space_butex);
+    }
+}
+
 int ExecutionQueueBase::join(uint64_t id) {
     const slot_id_t slot = slot_of_id(id);
     ExecutionQueueBase* const m = butil::address_resource(slot);
@@ -245,6 +317,12 @@ int ExecutionQueueBase::stop() {
                     butil::memory_order_relaxed)) {
             // Set _stopped to make lattern execute() fail immediately
             _stopped.store(true, butil::memory_order_release);
+            if (_options.max_tasks_size != 0) {
+                // Producers waiting for space hold references to this
+                // queue, wake them up to fail.
+                _space_butex->fetch_add(1, butil::memory_order_release);
+                butex_wake_all(_space_butex);
+            }
             // Deref additionally which is added at creation so that this
             // queue's reference will hit 0(recycle) when no one addresses it.
             _release_additional_reference();
@@ -355,11 +433,17 @@ int ExecutionQueueBase::create(uint64_t* id, const ExecutionQueueOptions* option
         m->_type_specific_function = type_specific_function;
         CHECK(m->_head.load(butil::memory_order_relaxed) == NULL);
         CHECK_EQ(0, m->_high_priority_tasks.load(butil::memory_order_relaxed));
+        CHECK_EQ(0, m->_ntasks.load(butil::memory_order_relaxed));
         ExecutionQueueOptions opt;
         if (options != NULL) {
             opt = *options;   
         }
         m->_options = opt;
+        if (!opt.bvar_prefix.empty()) {
+            m->_exposed_vars =
+                new ExecutionQueueExposedVars(opt.bvar_prefix, &m->_ntasks);
+        }
+        m->_count_tasks = (opt.max_tasks_size != 0 || m->_exposed_vars);
         m->_stopped.store(false, butil::memory_order_relaxed);
         m->_this_id = make_id(
                 _version_of_vref(m->_versioned_ref.fetch_add(
@@ -396,6 +480,10 @@ void TaskIteratorBase::operator++() {
             if (!_cur_node->iterated && _cur_node->peek_to_execute()) {
                 ++_num_iterated;
                 _cur_node->iterated = true;
+                if (_q->_exposed_vars) {
+                    _q->_exposed_vars->lag << (butil::cpuwide_time_ns() -
+                                               _cur_node->enqueue_ns) / 1000;
+                }
                 return;
             }
             _num_iterated += !_cur_node->iterated;
@@ -22,6 +22,7 @@
 #ifndef  BTHREAD_EXECUTION_QUEUE_H
 #define  BTHREAD_EXECUTION_QUEUE_H
 
+#include <string>
 #include "bthread/bthread.h"
 #include "butil/type_traits.h"
 
@@ -97,6 +98,16 @@ public:
     pointer operator->() const { return &(operator*()); }
     TaskIterator& operator++();
     void operator++(int);
+
+    // Store pointers to at most |max| following tasks into |tasks| and move
+    // the iterator past them, so that tasks can be processed in batches:
+    //   T* tasks[32];
+    //   for (size_t n; (n = iter.next_batch(tasks, 32)) != 0;) {
+    //       process(tasks, n);
+    //   }
+    // The tasks are valid until |execute| returns.
+    // Returns number of stored tasks, 0 when there're no more tasks.
+    size_t next_batch(pointer* tasks, size_t max);
 };
 
 struct TaskHandle {
@@ -149,6 +160,23 @@ struct ExecutionQueueOptions {
     // Note that TaskOptions.in_place_if_possible = false will not work, if implementation of
     // Executor is in-place(synchronous).
     Executor * executor;
+
+    // Max number of tasks in the queue which are not executed or still
+    // being executed, 0 means unlimited. When the queue is full,
+    // execution_queue_execute fails with EAGAIN, or waits until some tasks
+    // are executed if |wait_when_full| is true.
+    // NOTE: Waiting in |execute| of the queue itself never returns.
+    // default: 0
+    size_t max_tasks_size;
+
+    // default: false
+    bool wait_when_full;
+
+    // If it's not empty, number of tasks in the queue and delay of tasks
+    // before being executed are exposed as bvars named <bvar_prefix>_depth
+    // and <bvar_prefix>_lag_latency(and other vars of bvar::LatencyRecorder)
+    // default: empty
+    std::string bvar_prefix;
 };
 
 // Start a ExecutionQueue. If |options| is NULL, the queue will be created with
@@ -177,8 +205,11 @@ int execution_queue_stop(ExecutionQueueId<T> id);
 template <typename T>
 int execution_queue_join(ExecutionQueueId<T> id);
 
-// Thread-safe and Wait-free.
+// Thread-safe and Wait-free(unless ExecutionQueueOptions.wait_when_full is
+// true and the queue is full).
 // Execute a task with defaut TaskOptions (normal task);
+// Returns 0 on success, EAGAIN when the bounded queue is full, EINVAL when
+// the queue is stopped.
 template <typename T>
 int execution_queue_execute(ExecutionQueueId<T> id, 
                             typename butil::add_const_reference<T>::type task);
@@ -57,6 +57,7 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
         , in_place(false) 
         , next(UNCONNECTED)
         , q(NULL)
+        , enqueue_ns(0)
     {}
     ~TaskNode() {}
     int cancel(int64_t expected_version) {
@@ -91,8 +92,13 @@ struct BAIDU_CACHELINE_ALIGNMENT TaskNode {
     bool in_place;
     TaskNode* next;
     ExecutionQueueBase* q;
+    // butil::cpuwide_time_ns() when the task was enqueued, set only if
+    // ExecutionQueueOptions.bvar_prefix is not empty.
+    int64_t enqueue_ns;
+    // enqueue_ns spills the node into one more cacheline which is used
+    // for inline task storage as well, tasks inlined before still are.
     union {
-        char static_task_mem[56];  // Make sizeof TaskNode exactly 128 bytes
+        char static_task_mem[112];  // Make sizeof TaskNode exactly 192 bytes
         char* dynamic_task_mem;
     };
 
@@ -150,6 +156,7 @@ struct TaskAllocator : public TaskAllocatorBase<
 {};
 
 class TaskIteratorBase;
+struct ExecutionQueueExposedVars;
 
 class BAIDU_CACHELINE_ALIGNMENT ExecutionQueueBase {
 DISALLOW_COPY_AND_ASSIGN(ExecutionQueueBase);
@@ -168,12 +175,18 @@ public:
         : _head(NULL)
         , _versioned_ref(0)  // join() depends on even version
         , _high_priority_tasks(0)
+        , _ntasks(0)
+        , _count_tasks(false)
+        , _exposed_vars(NULL)
     {
         _join_butex = butex_create_checked<butil::atomic<int> >();
         _join_butex->store(0, butil::memory_order_relaxed);
+        _space_butex = butex_create_checked<butil::atomic<int> >();
+        _space_butex->store(0, butil::memory_order_relaxed);
     }
 
     ~ExecutionQueueBase() {
+        butex_destroy(_space_butex);
         butex_destroy(_join_butex);
     }
 
@@ -192,6 +205,25 @@ protected:
     void start_execute(TaskNode* node);
     TaskNode* allocate_node();
     void return_task_node(TaskNode* node);
+    // Count a task to be executed, waiting for space if the queue is full
+    // and ExecutionQueueOptions.wait_when_full is true.
+    // Returns 0 on success, EAGAIN if the queue is full, EINVAL if the
+    // queue is stopped while waiting.
+    int reserve_task() {
+        if (!_count_tasks) {
+            return 0;
+        }
+        if (_options.max_tasks_size == 0) {
+            _ntasks.fetch_add(1, butil::memory_order_relaxed);
+            return 0;
+        }
+        return _reserve_task_slow();
+    }
+    void release_task() {
+        if (_count_tasks) {
+            _release_task();
+        }
+    }
 
 private:
 
@@ -201,6 +233,8 @@ private:
         dereference();
     }
     void _on_recycle();
+    int _reserve_task_slow();
+    void _release_task();
     int _execute(TaskNode* head, bool high_priority, int* niterated);
     static void* _execute_tasks(void* arg);
 
@@ -234,6 +268,13 @@ private:
     clear_task_mem _clear_func;
     ExecutionQueueOptions _options;
     butil::atomic<int>* _join_butex;
+    // Number of tasks not returned yet, counted only when the queue is
+    // bounded or exposed.
+    butil::atomic<int64_t> _ntasks;
+    bool _count_tasks;
+    // Changed and woken up when a full queue has space again or is stopped.
+    butil::atomic<int>* _space_butex;
+    ExecutionQueueExposedVars* _exposed_vars;
 };
 
 template <typename T>
@@ -293,17 +334,22 @@ public:
         if (stopped()) {
             return EINVAL;
         }
+        const int rc = reserve_task();
+        if (rc != 0) {
+            return rc;
+        }
         TaskNode* node = allocate_node();
         if (BAIDU_UNLIKELY(node == NULL)) {
+            release_task();
             return ENOMEM;
         }
+        node->stop_task = false;
         void* const mem = allocator::allocate(node);
         if (BAIDU_UNLIKELY(!mem)) {
             return_task_node(node);
             return ENOMEM;
         }
         new (mem) T(task);
-        node->stop_task = false;
         TaskOptions opt;
         if (options) {
             opt = *options;
@@ -321,6 +367,7 @@ public:
 
 inline ExecutionQueueOptions::ExecutionQueueOptions()
     : bthread_attr(BTHREAD_ATTR_NORMAL), executor(NULL)
+    , max_tasks_size(0), wait_when_full(false)
 {}
 
 template <typename T>
@@ -416,6 +463,15 @@ void TaskIterator<T>::operator++(int) {
     operator++();
 }
 
+template <typename T>
+size_t TaskIterator<T>::next_batch(pointer* tasks, size_t max) {
+    size_t n = 0;
+    for (; n < max && *this; operator++()) {
+        tasks[n++] = operator->();
+    }
+    return n;
+}
+
 inline TaskHandle::TaskHandle()
     : node(NULL)
     , version(0)
@@ -34,6 +34,7 @@
 #include "bthread/butex.h"                       // butex_*
 #include "bthread/task_group.h"                  // TaskGroup
 #include "bthread/bthread.h"                             // bthread_start_urgent
+#include "bthread/coroutine.h"                   // fd_wait_async
 
 // Implement bthread functions on file descriptors
 
@@ -197,10 +198,36 @@ public:
     }
 
     int fd_wait(int fd, unsigned events, const timespec* abstime) {
+        int expected_val = 0;
+        EpollButex* butex = fd_register(fd, events, &expected_val);
+        if (NULL == butex) {
+            return -1;
+        }
+        if (butex_wait(butex, expected_val, abstime) < 0 &&
+            errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int fd_wait_async(int fd, unsigned events, const timespec* abstime,
+                      void (*on_ready)(void*, int), void* arg) {
+        int expected_val = 0;
+        EpollButex* butex = fd_register(fd, events, &expected_val);
+        if (NULL == butex) {
+            return -1;
+        }
+        return butex_wait_async(butex, expected_val, abstime, on_ready, arg);
+    }
+
+    // Add `fd' into epoll and return the butex which is changed when any of
+    // `events' happens, the value before adding is stored in `expected_val'.
+    // Returns NULL on error.
+    EpollButex* fd_register(int fd, unsigned events, int* expected_val) {
         butil::atomic<EpollButex*>* p = fd_butexes.get_or_new(fd);
         if (NULL == p) {
             errno = ENOMEM;
-            return -1;
+            return NULL;
         }
 
         EpollButex* butex = p->load(butil::memory_order_consume);
@@ -221,14 +248,14 @@ public:
         
         while (butex == CLOSING_GUARD) {  // bthread_close() is running.
             if (sched_yield() < 0) {
-                return -1;
+                return NULL;
             }
             butex = p->load(butil::memory_order_consume);
         }
         // Save value of butex before adding to epoll because the butex may
         // be changed before butex_wait. No memory fence because EPOLL_CTL_MOD
         // and EPOLL_CTL_ADD shall have release fence.
-        const int expected_val = butex->load(butil::memory_order_relaxed);
+        *expected_val = butex->load(butil::memory_order_relaxed);
 
 #if defined(OS_LINUX)
 # ifdef BAIDU_KERNEL_FIXED_EPOLLONESHOT_BUG
@@ -237,7 +264,7 @@ public:
             if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &evt) < 0 &&
                     errno != EEXIST) {
                 PLOG(FATAL) << "Fail to add fd=" << fd << " into epfd=" << _epfd;
-                return -1;
+                return NULL;
             }
         }
 # else
@@ -247,7 +274,7 @@ public:
         if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &evt) < 0 &&
             errno != EEXIST) {
             PLOG(FATAL) << "Fail to add fd=" << fd << " into epfd=" << _epfd;
-            return -1;
+            return NULL;
         }
 # endif
 #elif defined(OS_MACOSX)
@@ -256,14 +283,10 @@ public:
                 0, 0, butex);
         if (kevent(_epfd, &kqueue_event, 1, NULL, 0, NULL) < 0) {
             PLOG(FATAL) << "Fail to add fd=" << fd << " into kqueuefd=" << _epfd;
-            return -1;
+            return NULL;
         }
 #endif
-        if (butex_wait(butex, expected_val, abstime) < 0 &&
-            errno != EWOULDBLOCK && errno != EINTR) {
-            return -1;
-        }
-        return 0;
+        return butex;
     }
 
     int fd_close(int fd) {
@@ -410,6 +433,15 @@ static inline EpollThread& get_epoll_thread(int fd) {
     return et;
 }
 
+int fd_wait_async(int fd, unsigned events, const timespec* abstime,
+                  void (*on_ready)(void*, int), void* arg) {
+    if (fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return get_epoll_thread(fd).fd_wait_async(fd, events, abstime, on_ready, arg);
+}
+
 //TODO(zhujiashun): change name
 int stop_and_join_epoll_threads() {
     // Returns -1 if any epoll thread failed to stop.
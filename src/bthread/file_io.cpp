@@ -0,0 +1,255 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>                              // pread, pwrite, fsync
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/time.h"                          // cpuwide_time_us
+#include "bvar/bvar.h"
+#include "bthread/butex.h"                       // butex_*
+#include "bthread/task_group.h"                  // TaskGroup
+#include "bthread/file_io.h"
+
+namespace bthread {
+
+DEFINE_int32(bthread_file_io_threads, 4,
+             "Number of pthreads running file I/O of bthread_pread, "
+             "bthread_pwrite, bthread_fsync and the IOBuf variants. Read "
+             "once when the first I/O is issued from a bthread");
+
+static bool validate_bthread_file_io_threads(const char*, int32_t val) {
+    return val > 0;
+}
+const bool ALLOW_UNUSED dummy_bthread_file_io_threads =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_file_io_threads,
+                                    validate_bthread_file_io_threads);
+
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+
+struct FileIOTask {
+    ssize_t (*run)(FileIOTask*);
+    int fd;
+    void* buf;
+    size_t count;
+    off_t offset;
+    butil::IOBuf* iobuf;
+
+    // Set by the I/O pthread.
+    ssize_t rc;
+    int error;
+    // Becomes non-zero when the task is done.
+    butil::atomic<int>* done;
+    FileIOTask* next;
+};
+
+static ssize_t run_pread(FileIOTask* t) {
+    return ::pread(t->fd, t->buf, t->count, t->offset);
+}
+
+static ssize_t run_pwrite(FileIOTask* t) {
+    return ::pwrite(t->fd, t->buf, t->count, t->offset);
+}
+
+static ssize_t run_fsync(FileIOTask* t) {
+    return ::fsync(t->fd);
+}
+
+static ssize_t run_pappend(FileIOTask* t) {
+    return static_cast<butil::IOPortal*>(t->iobuf)->pappend_from_file_descriptor(
+        t->fd, t->offset, t->count);
+}
+
+static ssize_t run_pcut(FileIOTask* t) {
+    return t->iobuf->pcut_into_file_descriptor(t->fd, t->offset, t->count);
+}
+
+// Pthreads taking tasks from a FIFO list. Never destroyed.
+class FileIOPool {
+public:
+    FileIOPool();
+
+    // Run `task' in one of the pthreads and suspend the calling bthread
+    // until it's done.
+    ssize_t run(FileIOTask* task);
+
+private:
+    static void* run_tasks(void* arg);
+
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    FileIOTask* _head;
+    FileIOTask* _tail;
+    int _nthreads;
+    bvar::Adder<int64_t> _depth;
+    bvar::LatencyRecorder _latency;
+};
+
+FileIOPool::FileIOPool()
+    : _head(NULL)
+    , _tail(NULL)
+    , _nthreads(0)
+    , _depth("bthread_file_io_depth")
+    , _latency("bthread_file_io") {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    for (int i = 0; i < FLAGS_bthread_file_io_threads; ++i) {
+        pthread_t th;
+        const int rc = pthread_create(&th, NULL, run_tasks, this);
+        if (rc != 0) {
+            LOG(ERROR) << "Fail to create file I/O thread: " << berror(rc);
+            break;
+        }
+        pthread_detach(th);
+        ++_nthreads;
+    }
+}
+
+void* FileIOPool::run_tasks(void* arg) {
+    FileIOPool* p = static_cast<FileIOPool*>(arg);
+    while (true) {
+        pthread_mutex_lock(&p->_mutex);
+        while (p->_head == NULL) {
+            pthread_cond_wait(&p->_cond, &p->_mutex);
+        }
+        FileIOTask* task = p->_head;
+        p->_head = task->next;
+        if (p->_head == NULL) {
+            p->_tail = NULL;
+        }
+        pthread_mutex_unlock(&p->_mutex);
+
+        task->rc = task->run(task);
+        task->error = errno;
+        butil::atomic<int>* done = task->done;
+        // `task' may be destroyed after the store.
+        done->store(1, butil::memory_order_release);
+        butex_wake(done);
+    }
+    return NULL;
+}
+
+ssize_t FileIOPool::run(FileIOTask* task) {
+    if (_nthreads == 0) {
+        return task->run(task);
+    }
+    butil::atomic<int>* done = butex_create_checked<butil::atomic<int> >();
+    if (done == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    done->store(0, butil::memory_order_relaxed);
+    task->done = done;
+    task->next = NULL;
+    const int64_t start_us = butil::cpuwide_time_us();
+    _depth << 1;
+    pthread_mutex_lock(&_mutex);
+    if (_tail) {
+        _tail->next = task;
+    } else {
+        _head = task;
+    }
+    _tail = task;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    // `task' is being used by the I/O pthread, don't quit on interruptions.
+    while (done->load(butil::memory_order_acquire) == 0) {
+        butex_wait(done, 0, NULL);
+    }
+    _depth << -1;
+    _latency << butil::cpuwide_time_us() - start_us;
+    butex_destroy(done);
+    errno = task->error;
+    return task->rc;
+}
+
+// Run `task' in the pool when called from a bthread, or directly otherwise.
+static ssize_t run_file_io(FileIOTask* task) {
+    TaskGroup* g = tls_task_group;
+    if (NULL == g || g->is_current_pthread_task()) {
+        return task->run(task);
+    }
+    return butil::get_leaky_singleton<FileIOPool>()->run(task);
+}
+
+ssize_t pappend_from_file_descriptor(butil::IOPortal* portal, int fd,
+                                     off_t offset, size_t max_count) {
+    FileIOTask task;
+    task.run = run_pappend;
+    task.fd = fd;
+    task.buf = NULL;
+    task.count = max_count;
+    task.offset = offset;
+    task.iobuf = portal;
+    return run_file_io(&task);
+}
+
+ssize_t pcut_into_file_descriptor(butil::IOBuf* buf, int fd, off_t offset,
+                                  size_t size_hint) {
+    FileIOTask task;
+    task.run = run_pcut;
+    task.fd = fd;
+    task.buf = NULL;
+    task.count = size_hint;
+    task.offset = offset;
+    task.iobuf = buf;
+    return run_file_io(&task);
+}
+
+}  // namespace bthread
+
+extern "C" {
+
+ssize_t bthread_pread(int fd, void* buf, size_t count, off_t offset) {
+    bthread::FileIOTask task;
+    task.run = bthread::run_pread;
+    task.fd = fd;
+    task.buf = buf;
+    task.count = count;
+    task.offset = offset;
+    task.iobuf = NULL;
+    return bthread::run_file_io(&task);
+}
+
+ssize_t bthread_pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    bthread::FileIOTask task;
+    task.run = bthread::run_pwrite;
+    task.fd = fd;
+    task.buf = const_cast<void*>(buf);
+    task.count = count;
+    task.offset = offset;
+    task.iobuf = NULL;
+    return bthread::run_file_io(&task);
+}
+
+int bthread_fsync(int fd) {
+    bthread::FileIOTask task;
+    task.run = bthread::run_fsync;
+    task.fd = fd;
+    task.buf = NULL;
+    task.count = 0;
+    task.offset = 0;
+    task.iobuf = NULL;
+    return bthread::run_file_io(&task);
+}
+
+}  // extern "C"
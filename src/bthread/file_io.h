@@ -0,0 +1,55 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_FILE_IO_H
+#define BTHREAD_FILE_IO_H
+
+#include <sys/types.h>
+#include "butil/iobuf.h"
+
+// Blocking file I/O suspending only the calling bthread. The I/O is run by
+// a pool of -bthread_file_io_threads pthreads instead of the worker pthread.
+// Called from pthreads or bthreads with BTHREAD_ATTR_PTHREAD, the I/O is
+// done in the calling thread directly.
+// Number of pending I/O and their latencies are exposed as bvar
+// "bthread_file_io_depth" and "bthread_file_io_latency".
+
+__BEGIN_DECLS
+
+// Same as pread(2), pwrite(2) and fsync(2) respectively.
+extern ssize_t bthread_pread(int fd, void* buf, size_t count, off_t offset);
+extern ssize_t bthread_pwrite(int fd, const void* buf, size_t count,
+                              off_t offset);
+extern int bthread_fsync(int fd);
+
+__END_DECLS
+
+namespace bthread {
+
+// Same as portal->pappend_from_file_descriptor(fd, offset, max_count)
+ssize_t pappend_from_file_descriptor(butil::IOPortal* portal, int fd,
+                                     off_t offset, size_t max_count);
+
+// Same as buf->pcut_into_file_descriptor(fd, offset, size_hint)
+ssize_t pcut_into_file_descriptor(butil::IOBuf* buf, int fd, off_t offset,
+                                  size_t size_hint = 1024*1024);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_FILE_IO_H
@@ -22,7 +22,11 @@
 #include <pthread.h>
 #include <execinfo.h>
 #include <dlfcn.h>                               // dlsym
+#include <cxxabi.h>                              // __cxa_demangle
 #include <fcntl.h>                               // O_RDONLY
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "butil/atomicops.h"
 #include "bvar/bvar.h"
 #include "bvar/collector.h"
@@ -56,7 +60,8 @@ const int ALLOW_UNUSED dummy_bt = backtrace(dummy_buf, arraysize(dummy_buf));
 static bvar::CollectorSpeedLimit g_cp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
 
 const size_t MAX_CACHED_CONTENTIONS = 512;
-// Skip frames which are always same: the unlock function and submit_contention()
+// Skip frames which are always same: the unlock function(or butex_wait) and
+// submit_contention()
 const int SKIPPED_STACK_FRAMES = 2;
 
 struct SampledContention : public bvar::Collected {
@@ -297,6 +302,142 @@ void SampledContention::destroy() {
     butil::return_object(this);
 }
 
+static const char* const g_site_names[CONTENTION_SITE_TYPE_NUM] = {
+    "bthread_mutex", "pthread_mutex", "bthread_cond", "countdown_event",
+    "bthread_rwlock"
+};
+
+// Sampled contentions aggregated by callsites, normalized in the same way as
+// profiles. A callsite is the type of the primitive plus the top frames of
+// the stack, which tells which lock is hot without running pprof.
+class ContentionSites : public bvar::Variable {
+public:
+    // Frames identifying a callsite, submit_contention() excluded.
+    static const int MAX_FRAMES = 6;
+    // Contentions at more callsites are counted in _nuntracked only.
+    static const size_t MAX_SITES = 1024;
+    // Callsites with the longest waits shown in describe().
+    static const size_t MAX_SHOWN_SITES = 32;
+
+    ContentionSites() : _nuntracked(0) {}
+    ~ContentionSites() { hide(); }
+
+    // Called inside submit_contention() only, where the pthread_mutex_t
+    // locked is never sampled.
+    void add(ContentionSiteType type, void* const* stack, int nframes,
+             int64_t count, int64_t wait_us);
+
+    void describe(std::ostream& os, bool quote_string) const override;
+
+private:
+    struct Site {
+        ContentionSiteType type;
+        int nframes;
+        void* frames[MAX_FRAMES];
+        int64_t count;
+        int64_t wait_us;
+    };
+    static bool WaitsLonger(const Site& s1, const Site& s2) {
+        return s1.wait_us > s2.wait_us;
+    }
+
+    mutable butil::Mutex _mutex;
+    // Keyed by the bytes of type and frames.
+    std::unordered_map<std::string, Site> _sites;
+    int64_t _nuntracked;
+};
+
+void ContentionSites::add(ContentionSiteType type, void* const* stack,
+                          int nframes, int64_t count, int64_t wait_us) {
+    nframes = std::min(nframes, (int)MAX_FRAMES);
+    std::string key((const char*)&type, sizeof(type));
+    key.append((const char*)stack, sizeof(void*) * nframes);
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::unordered_map<std::string, Site>::iterator it = _sites.find(key);
+    if (it == _sites.end()) {
+        if (_sites.size() >= MAX_SITES) {
+            _nuntracked += count;
+            return;
+        }
+        Site& s = _sites[key];
+        s.type = type;
+        s.nframes = nframes;
+        std::copy(stack, stack + nframes, s.frames);
+        s.count = count;
+        s.wait_us = wait_us;
+        return;
+    }
+    it->second.count += count;
+    it->second.wait_us += wait_us;
+}
+
+// Print `pc' as "symbol+offset (module)" with the dynamic symbol table which
+// is known to be right for PIE executables and shared libraries, or as
+// "module+offset" for symbols not exported, which addr2line accepts.
+static void describe_frame(std::ostream& os, void* pc) {
+    const uintptr_t addr = (uintptr_t)pc;
+    Dl_info info;
+    if (dladdr(pc, &info) == 0 || info.dli_fname == NULL) {
+        os << pc;
+        return;
+    }
+    const char* module = strrchr(info.dli_fname, '/');
+    module = (module ? module + 1 : info.dli_fname);
+    if (info.dli_sname == NULL || info.dli_saddr == NULL) {
+        os << module << "+0x" << std::hex << addr - (uintptr_t)info.dli_fbase
+           << std::dec;
+        return;
+    }
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+    os << (demangled ? demangled : info.dli_sname) << "+0x" << std::hex
+       << addr - (uintptr_t)info.dli_saddr << std::dec << " (" << module << ')';
+    free(demangled);
+}
+
+void ContentionSites::describe(std::ostream& os, bool) const {
+    std::vector<Site> sites;
+    int64_t nuntracked = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        sites.reserve(_sites.size());
+        for (std::unordered_map<std::string, Site>::const_iterator
+                 it = _sites.begin(); it != _sites.end(); ++it) {
+            sites.push_back(it->second);
+        }
+        nuntracked = _nuntracked;
+    }
+    // Symbolize out of the lock.
+    std::sort(sites.begin(), sites.end(), WaitsLonger);
+    for (size_t i = 0; i < sites.size() && i < MAX_SHOWN_SITES; ++i) {
+        const Site& s = sites[i];
+        os << "wait_us=" << s.wait_us << " count=" << s.count
+           << " type=" << g_site_names[s.type] << '\n';
+        for (int j = 0; j < s.nframes; ++j) {
+            os << "  #" << j << ' ';
+            describe_frame(os, s.frames[j]);
+            os << '\n';
+        }
+    }
+    if (sites.size() > MAX_SHOWN_SITES) {
+        os << "... " << sites.size() - MAX_SHOWN_SITES << " more sites\n";
+    }
+    if (nuntracked) {
+        os << "untracked_count=" << nuntracked << '\n';
+    }
+}
+
+// Exposed as /vars/contention_sites when the contention profiler is started
+// for the first time. Never deleted since submit_contention() may be running.
+static ContentionSites* g_contention_sites = NULL;
+
+static bool expose_contention_sites() {
+    ContentionSites* sites = new ContentionSites;
+    sites->expose("contention_sites");
+    g_contention_sites = sites;
+    return true;
+}
+
 // Remember the conflict hashes for troubleshooting, should be 0 at most of time.
 static butil::static_atomic<int64_t> g_nconflicthash = BUTIL_STATIC_ATOMIC_INIT(0);
 static int64_t get_nconflicthash(void*) {
@@ -319,6 +460,8 @@ bool ContentionProfilerStart(const char* filename) {
         ("contention_profiler_conflict_hash", get_nconflicthash, NULL);
     static bvar::DisplaySamplingRatio g_sampling_ratio_var(
         "contention_profiler_sampling_ratio", &g_cp_sl);
+    static const bool ALLOW_UNUSED g_contention_sites_exposed =
+        expose_contention_sites();
     
     // Optimistic locking. A not-used ContentionProfiler does not write file.
     std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
@@ -502,8 +645,16 @@ inline bool remove_pthread_contention_site(
     return true;
 }
 
+size_t is_contention_sampled() {
+    if (!g_cp) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_cp_sl);
+}
+
 // Submit the contention along with the callsite('s stacktrace)
-void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
+void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns,
+                       ContentionSiteType site) {
     tls_inside_lock = true;
     SampledContention* sc = butil::get_object<SampledContention>();
     // Normalize duration_us and count so that they're addable in later
@@ -513,6 +664,12 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
         / csite.sampling_range;
     sc->count = bvar::COLLECTOR_SAMPLING_BASE / (double)csite.sampling_range;
     sc->nframes = backtrace(sc->stack, arraysize(sc->stack)); // may lock
+    if (g_contention_sites && sc->nframes > 1) {
+        // Skip the frame of this function.
+        g_contention_sites->add(site, sc->stack + 1, sc->nframes - 1,
+                                (int64_t)ceil(sc->count),
+                                sc->duration_ns / 1000);
+    }
     sc->submit(now_ns / 1000);  // may lock
     tls_inside_lock = false;
 }
@@ -606,7 +763,8 @@ BUTIL_FORCE_INLINE int pthread_mutex_unlock_impl(pthread_mutex_t* mutex) {
     if (unlock_start_ns) {
         const int64_t unlock_end_ns = butil::cpuwide_time_ns();
         saved_csite.duration_ns += unlock_end_ns - unlock_start_ns;
-        submit_contention(saved_csite, unlock_end_ns);
+        submit_contention(saved_csite, unlock_end_ns,
+                          CONTENTION_SITE_PTHREAD_MUTEX);
     }
     return rc;
 }
@@ -631,7 +789,8 @@ BAIDU_CASSERT(sizeof(unsigned) == sizeof(MutexInternal),
 inline int mutex_lock_contended(bthread_mutex_t* m) {
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
-        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL) < 0 &&
+        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL,
+                                CONTENTION_SITE_NONE) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR/*note*/) {
             // a mutex lock should ignore interrruptions in general since
             // user code is unlikely to check the return value.
@@ -645,7 +804,8 @@ inline int mutex_timedlock_contended(
     bthread_mutex_t* m, const struct timespec* __restrict abstime) {
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
-        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime) < 0 &&
+        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime,
+                                CONTENTION_SITE_NONE) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR/*note*/) {
             // a mutex lock should ignore interrruptions in general since
             // user code is unlikely to check the return value.
@@ -778,7 +938,8 @@ int bthread_mutex_timedlock(bthread_mutex_t* __restrict m,
         // Failed to lock due to ETIMEDOUT, submit the elapse directly.
         const int64_t end_ns = butil::cpuwide_time_ns();
         const bthread_contention_site_t csite = {end_ns - start_ns, sampling_range};
-        bthread::submit_contention(csite, end_ns);
+        bthread::submit_contention(csite, end_ns,
+                                   bthread::CONTENTION_SITE_BTHREAD_MUTEX);
     }
     return rc;
 }
@@ -804,7 +965,8 @@ int bthread_mutex_unlock(bthread_mutex_t* m) {
     bthread::butex_wake(whole);
     const int64_t unlock_end_ns = butil::cpuwide_time_ns();
     saved_csite.duration_ns += unlock_end_ns - unlock_start_ns;
-    bthread::submit_contention(saved_csite, unlock_end_ns);
+    bthread::submit_contention(saved_csite, unlock_end_ns,
+                               bthread::CONTENTION_SITE_BTHREAD_MUTEX);
     return 0;
 }
 
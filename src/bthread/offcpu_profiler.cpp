@@ -0,0 +1,340 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <execinfo.h>                            // backtrace
+#include <fcntl.h>                               // O_RDONLY
+#include <math.h>                                // ceil
+#include <pthread.h>
+#include <string.h>                              // memcpy
+#include "butil/compiler_specific.h"             // NOINLINE
+#include "butil/containers/flat_map.h"
+#include "butil/fd_guard.h"
+#include "butil/file_util.h"
+#include "butil/files/file_path.h"
+#include "butil/iobuf.h"
+#include "butil/logging.h"
+#include "butil/macros.h"                        // BAIDU_CASSERT
+#include "butil/object_pool.h"
+#include "butil/scoped_lock.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "butil/time.h"
+#include "butil/unique_ptr.h"
+#include "bvar/bvar.h"
+#include "bvar/collector.h"
+#include "bthread/log.h"
+#include "bthread/offcpu_profiler.h"
+
+namespace bthread {
+
+// Leaf frames of off-CPU samples, symbolized by pprof. Bodies differ so that
+// the linker does not fold them into one function.
+NOINLINE int blocked_on_butex() { return 1; }
+NOINLINE int waiting_in_runqueue() { return 2; }
+
+// For controlling waits collected per second.
+static bvar::CollectorSpeedLimit g_ocp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
+
+const size_t MAX_CACHED_OFFCPU_SAMPLES = 512;
+
+struct SampledOffCpu : public bvar::Collected {
+    // off-CPU time normalized according to sampling_range
+    int64_t duration_ns;
+    // number of samples, normalized according to to sampling_range
+    double count;
+    int nframes;          // #elements in stack
+    void* stack[26];      // backtrace, stack[0] is one of the leaf frames.
+
+    // Implement bvar::Collected
+    void dump_and_destroy(size_t round) override;
+    void destroy() override;
+    bvar::CollectorSpeedLimit* speed_limit() override { return &g_ocp_sl; }
+
+    // For combining samples with hashmap.
+    size_t hash_code() const {
+        if (nframes == 0) {
+            return 0;
+        }
+        uint32_t code = 1;
+        uint32_t seed = nframes;
+        butil::MurmurHash3_x86_32(stack, sizeof(void*) * nframes, seed, &code);
+        return code;
+    }
+};
+
+BAIDU_CASSERT(sizeof(SampledOffCpu) == 256, be_friendly_to_allocator);
+
+struct OffCpuEqual {
+    bool operator()(const SampledOffCpu* s1, const SampledOffCpu* s2) const {
+        return s1->hash_code() == s2->hash_code() &&
+            s1->nframes == s2->nframes &&
+            memcmp(s1->stack, s2->stack, sizeof(void*) * s1->nframes) == 0;
+    }
+};
+
+struct OffCpuHash {
+    size_t operator()(const SampledOffCpu* s) const {
+        return s->hash_code();
+    }
+};
+
+// The global context for off-CPU profiler.
+class OffCpuProfiler {
+public:
+    typedef butil::FlatMap<SampledOffCpu*, SampledOffCpu*,
+                           OffCpuHash, OffCpuEqual> OffCpuMap;
+
+    explicit OffCpuProfiler(const char* name);
+    ~OffCpuProfiler();
+
+    void dump_and_destroy(SampledOffCpu* s);
+
+    // Write buffered data into resulting file. If `ending' is true, append
+    // content of /proc/self/maps and retry writing until buffer is empty.
+    void flush_to_disk(bool ending);
+
+    void init_if_needed();
+private:
+    bool _init;  // false before first dump_and_destroy is called
+    bool _first_write;      // true if buffer was not written to file yet.
+    std::string _filename;  // the file storing profiling result.
+    butil::IOBuf _disk_buf;  // temp buf before saving the file.
+    OffCpuMap _dedup_map; // combining same samples to make result smaller.
+};
+
+OffCpuProfiler::OffCpuProfiler(const char* name)
+    : _init(false)
+    , _first_write(true)
+    , _filename(name) {
+}
+
+OffCpuProfiler::~OffCpuProfiler() {
+    if (!_init) {
+        return;
+    }
+    flush_to_disk(true);
+}
+
+void OffCpuProfiler::init_if_needed() {
+    if (!_init) {
+        // Same format as contention profiles which pprof understands.
+        _disk_buf.append("--- contention\ncycles/second=1000000000\n");
+        CHECK_EQ(0, _dedup_map.init(1024, 60));
+        _init = true;
+    }
+}
+
+void OffCpuProfiler::dump_and_destroy(SampledOffCpu* s) {
+    init_if_needed();
+    SampledOffCpu** p_s2 = _dedup_map.seek(s);
+    if (p_s2) {
+        SampledOffCpu* s2 = *p_s2;
+        s2->duration_ns += s->duration_ns;
+        s2->count += s->count;
+        s->destroy();
+    } else {
+        _dedup_map.insert(s, s);
+    }
+    if (_dedup_map.size() > MAX_CACHED_OFFCPU_SAMPLES) {
+        flush_to_disk(false);
+    }
+}
+
+void OffCpuProfiler::flush_to_disk(bool ending) {
+    BT_VLOG << "flush_to_disk(ending=" << ending << ")";
+
+    if (!_dedup_map.empty()) {
+        butil::IOBufBuilder os;
+        for (OffCpuMap::const_iterator
+                 it = _dedup_map.begin(); it != _dedup_map.end(); ++it) {
+            SampledOffCpu* s = it->second;
+            os << s->duration_ns << ' ' << (size_t)ceil(s->count) << " @";
+            for (int i = 0; i < s->nframes; ++i) {
+                os << ' ' << s->stack[i];
+            }
+            os << '\n';
+            s->destroy();
+        }
+        _dedup_map.clear();
+        _disk_buf.append(os.buf());
+    }
+
+    // Append /proc/self/maps which is required by pprof.pl to interpret
+    // functions in shared libraries.
+    if (ending) {
+        butil::IOPortal mem_maps;
+        const butil::fd_guard fd(open("/proc/self/maps", O_RDONLY));
+        if (fd >= 0) {
+            while (true) {
+                ssize_t nr = mem_maps.append_from_file_descriptor(fd, 8192);
+                if (nr < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    PLOG(ERROR) << "Fail to read /proc/self/maps";
+                    break;
+                }
+                if (nr == 0) {
+                    _disk_buf.append(mem_maps);
+                    break;
+                }
+            }
+        } else {
+            PLOG(ERROR) << "Fail to open /proc/self/maps";
+        }
+    }
+    butil::File::Error error;
+    butil::FilePath path(_filename);
+    butil::FilePath dir = path.DirName();
+    if (!butil::CreateDirectoryAndGetError(dir, &error)) {
+        LOG(ERROR) << "Fail to create directory=`" << dir.value()
+                   << "', " << error;
+        return;
+    }
+    // Truncate on first write, append on later writes.
+    int flag = O_APPEND;
+    if (_first_write) {
+        _first_write = false;
+        flag = O_TRUNC;
+    }
+    butil::fd_guard fd(open(_filename.c_str(), O_WRONLY|O_CREAT|flag, 0666));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << _filename;
+        return;
+    }
+    // Write once normally, write until empty in the end.
+    do {
+        ssize_t nw = _disk_buf.cut_into_file_descriptor(fd);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to write into " << _filename;
+            return;
+        }
+        BT_VLOG << "Write " << nw << " bytes into " << _filename;
+    } while (!_disk_buf.empty() && ending);
+}
+
+OffCpuProfiler* BAIDU_CACHELINE_ALIGNMENT g_ocp = NULL;
+// Protecting accesss to g_ocp.
+static pthread_mutex_t g_ocp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void SampledOffCpu::dump_and_destroy(size_t /*round*/) {
+    if (g_ocp) {
+        BAIDU_SCOPED_LOCK(g_ocp_mutex);
+        if (g_ocp) {
+            g_ocp->dump_and_destroy(this);
+            return;
+        }
+    }
+    destroy();
+}
+
+void SampledOffCpu::destroy() {
+    butil::return_object(this);
+}
+
+bool OffCpuProfilerStart(const char* filename) {
+    if (filename == NULL) {
+        LOG(ERROR) << "Parameter [filename] is NULL";
+        return false;
+    }
+    if (g_ocp) {
+        return false;
+    }
+    static bvar::DisplaySamplingRatio g_sampling_ratio_var(
+        "offcpu_profiler_sampling_ratio", &g_ocp_sl);
+
+    std::unique_ptr<OffCpuProfiler> ctx(new OffCpuProfiler(filename));
+    {
+        BAIDU_SCOPED_LOCK(g_ocp_mutex);
+        if (g_ocp) {
+            return false;
+        }
+        g_ocp = ctx.release();
+    }
+    return true;
+}
+
+void OffCpuProfilerStop() {
+    OffCpuProfiler* ctx = NULL;
+    if (g_ocp) {
+        std::unique_lock<pthread_mutex_t> mu(g_ocp_mutex);
+        if (g_ocp) {
+            ctx = g_ocp;
+            g_ocp = NULL;
+            mu.unlock();
+            // Make sure something is written so that pprof does not fail.
+            ctx->init_if_needed();
+            delete ctx;
+            return;
+        }
+    }
+    LOG(ERROR) << "Off-CPU profiler is not started!";
+}
+
+size_t is_offcpu_sampled() {
+    if (!g_ocp) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_ocp_sl);
+}
+
+static SampledOffCpu* new_offcpu_sample(size_t sampling_range,
+                                        int64_t duration_ns) {
+    SampledOffCpu* s = butil::get_object<SampledOffCpu>();
+    if (s == NULL) {
+        return NULL;
+    }
+    // Normalize so that samples are addable in later processings.
+    s->duration_ns = duration_ns * bvar::COLLECTOR_SAMPLING_BASE / sampling_range;
+    s->count = bvar::COLLECTOR_SAMPLING_BASE / (double)sampling_range;
+    return s;
+}
+
+void submit_offcpu_sample(size_t sampling_range, int64_t offcpu_ns,
+                          int64_t runqueue_delay_ns) {
+    if (runqueue_delay_ns > offcpu_ns) {
+        // The delay was measured before this wait.
+        runqueue_delay_ns = 0;
+    }
+    const int64_t now_us = butil::cpuwide_time_us();
+    SampledOffCpu* blocked = new_offcpu_sample(
+        sampling_range, offcpu_ns - runqueue_delay_ns);
+    if (blocked == NULL) {
+        return;
+    }
+    // Frame 0 is inside this function, replace it with the leaf frame.
+    blocked->nframes = backtrace(blocked->stack, arraysize(blocked->stack));
+    blocked->stack[0] = (void*)blocked_on_butex;
+    if (runqueue_delay_ns > 0) {
+        SampledOffCpu* queued =
+            new_offcpu_sample(sampling_range, runqueue_delay_ns);
+        if (queued != NULL) {
+            queued->nframes = blocked->nframes;
+            memcpy(queued->stack, blocked->stack,
+                   sizeof(void*) * blocked->nframes);
+            queued->stack[0] = (void*)waiting_in_runqueue;
+            queued->submit(now_us);
+        }
+    }
+    blocked->submit(now_us);
+}
+
+}  // namespace bthread
@@ -0,0 +1,53 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_OFFCPU_PROFILER_H
+#define BTHREAD_OFFCPU_PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace bthread {
+
+// Profile time that bthreads spend off CPU: blocking in butex_wait() until
+// being woken up and then waiting in a runqueue until being scheduled.
+// Sampled waits are written into `filename' in the format of contention
+// profiles, with a leaf frame bthread::blocked_on_butex or
+// bthread::waiting_in_runqueue telling where the time was spent.
+// Returns false if another off-CPU profiler is running.
+bool OffCpuProfilerStart(const char* filename);
+void OffCpuProfilerStop();
+
+class OffCpuProfiler;
+// Non-NULL when the off-CPU profiler is running.
+extern OffCpuProfiler* g_ocp;
+
+// Returns a non-zero sampling range if the wait about to happen should be
+// sampled, 0 otherwise.
+size_t is_offcpu_sampled();
+
+// Submit a sampled wait along with the callsite's stacktrace. `offcpu_ns' is
+// the time between starting waiting and being scheduled again, including
+// `runqueue_delay_ns'.
+void submit_offcpu_sample(size_t sampling_range, int64_t offcpu_ns,
+                          int64_t runqueue_delay_ns);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_OFFCPU_PROFILER_H
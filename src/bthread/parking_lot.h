@@ -23,7 +23,9 @@
 #define BTHREAD_PARKING_LOT_H
 
 #include "butil/atomicops.h"
+#include "butil/time.h"
 #include "bthread/sys_futex.h"
+#include "bthread/processor.h"
 
 namespace bthread {
 
@@ -40,13 +42,46 @@ public:
         int val;
     };
 
-    ParkingLot() : _pending_signal(0) {}
+    ParkingLot()
+        : _pending_signal(0), _nwaiters(0), _nspinners(0), _nwakeups(0)
+        , _nwoken(0), _last_wakeup_ns(0) {}
 
-    // Wake up at most `num_task' workers.
-    // Returns #workers woken up.
-    int signal(int num_task) {
-        _pending_signal.fetch_add((num_task << 1), butil::memory_order_release);
-        return futex_wake_private(&_pending_signal, num_task);
+    // Wake up at most `num_task' workers. Spinning workers see the signal
+    // without futex_wake, which is also skipped when no one is waiting.
+    // If `merge_window_ns' is positive, futex_wake within so many
+    // nanoseconds after the previous one is skipped as well when workers
+    // woken by the previous one have not returned from wait(): they steal
+    // tasks after returning, including the new ones. Bursts of signals are
+    // merged into fewer syscalls at the cost of fewer workers running.
+    // Returns #workers woken up, including the spinning and merged ones.
+    int signal(int num_task, int64_t merge_window_ns = 0) {
+        // seq_cst RMW and loads pair with the ones in wait() and spin(): the
+        // worker either is counted here or sees the new signal.
+        _pending_signal.fetch_add((num_task << 1));
+        const int nspinners = _nspinners.load();
+        if (nspinners >= num_task) {
+            return num_task;
+        }
+        if (_nwaiters.load() == 0) {
+            return nspinners;
+        }
+        if (merge_window_ns > 0 && _nwoken.load() > 0 &&
+            butil::cpuwide_time_ns() <
+            _last_wakeup_ns.load(butil::memory_order_relaxed) + merge_window_ns) {
+            return num_task;
+        }
+        _nwakeups.fetch_add(1, butil::memory_order_relaxed);
+        const int nwoken =
+            futex_wake_private(&_pending_signal, num_task - nspinners);
+        if (nwoken > 0) {
+            _last_wakeup_ns.store(butil::cpuwide_time_ns(),
+                                  butil::memory_order_relaxed);
+            // May be counted after the woken workers returned from wait()
+            // which makes _nwoken negative temporarily, merging less.
+            _nwoken.fetch_add(nwoken);
+            return nspinners + nwoken;
+        }
+        return nspinners;
     }
 
     // Get a state for later wait().
@@ -56,10 +91,38 @@ public:
 
     // Wait for tasks.
     // If the `expected_state' does not match, wait() may finish directly.
-    void wait(const State& expected_state) {
-        futex_wait_private(&_pending_signal, expected_state.val, NULL);
+    // If `timeout' is not NULL, wait() finishes after the relative time.
+    void wait(const State& expected_state, const timespec* timeout = NULL) {
+        _nwaiters.fetch_add(1);
+        if (futex_wait_private(&_pending_signal, expected_state.val,
+                               timeout) == 0) {
+            // Woken by futex_wake, usually from signal().
+            _nwoken.fetch_sub(1);
+        }
+        _nwaiters.fetch_sub(1, butil::memory_order_relaxed);
     }
 
+    // Spin until the state does not match `expected_state' or
+    // butil::cpuwide_time_ns() reaches `deadline_ns'.
+    // Returns true if the state changed.
+    bool spin(const State& expected_state, int64_t deadline_ns) {
+        _nspinners.fetch_add(1);
+        bool changed = false;
+        do {
+            if (_pending_signal.load() != expected_state.val) {
+                changed = true;
+                break;
+            }
+            cpu_relax();
+        } while (butil::cpuwide_time_ns() < deadline_ns);
+        _nspinners.fetch_sub(1, butil::memory_order_relaxed);
+        return changed;
+    }
+
+    // Number of futex_wake issued by signal().
+    int64_t wakeup_count() const
+    { return _nwakeups.load(butil::memory_order_relaxed); }
+
     // Wakeup suspended wait() and make them unwaitable ever. 
     void stop() {
         _pending_signal.fetch_or(1);
@@ -68,6 +131,14 @@ public:
 private:
     // higher 31 bits for signalling, LSB for stopping.
     butil::atomic<int> _pending_signal;
+    // Workers blocking in wait() and spinning in spin().
+    butil::atomic<int> _nwaiters;
+    butil::atomic<int> _nspinners;
+    butil::atomic<int64_t> _nwakeups;
+    // Workers woken by signal() but not returned from wait() yet, and the
+    // time of the latest futex_wake that woke someone.
+    butil::atomic<int> _nwoken;
+    butil::atomic<int64_t> _last_wakeup_ns;
 };
 
 }  // namespace bthread
@@ -0,0 +1,324 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include <new>                                   // std::nothrow
+#include "butil/atomicops.h"
+#include "butil/macros.h"                        // BAIDU_CASSERT
+#include "butil/thread_local.h"                  // BAIDU_THREAD_LOCAL
+#include "bthread/butex.h"                       // butex_*
+#include "bthread/types.h"                       // bthread_rwlock_t
+
+extern "C" {
+extern int bthread_mutex_init(bthread_mutex_t* __restrict mutex,
+                              const bthread_mutexattr_t* __restrict attr);
+extern int bthread_mutex_destroy(bthread_mutex_t* mutex);
+extern int bthread_mutex_trylock(bthread_mutex_t* mutex);
+extern int bthread_mutex_lock(bthread_mutex_t* mutex);
+extern int bthread_mutex_timedlock(bthread_mutex_t* __restrict mutex,
+                                   const struct timespec* __restrict abstime);
+extern int bthread_mutex_unlock(bthread_mutex_t* mutex);
+}
+
+namespace bthread {
+
+// Layout of bthread_rwlock_t::state:
+//   A writer is waiting for readers to leave or holding the lock. Readers
+//   coming after are blocked.
+static const unsigned RWLOCK_WRITER = 1u << 31;
+//   The writer is holding the lock.
+static const unsigned RWLOCK_WRITER_LOCKED = 1u << 30;
+//   Number of readers holding the lock. If readers are counted in
+//   distributed counters, this is a sequence changed by readers leaving
+//   when a writer is waiting, to make sure the writer does not miss
+//   the wakeup.
+static const unsigned RWLOCK_READER_MASK = RWLOCK_WRITER_LOCKED - 1;
+
+// Number of distributed reader counters, must be power of 2.
+static const unsigned RWLOCK_READER_SLOTS = 16;
+
+struct ReaderSlot {
+    butil::atomic<int> count;
+    char padding[BAIDU_CACHELINE_SIZE - sizeof(butil::atomic<int>)];
+};
+BAIDU_CASSERT(sizeof(ReaderSlot) == BAIDU_CACHELINE_SIZE,
+              sizeof_reader_slot_must_equal_cacheline);
+
+// Threads are assigned to the counters in round-robin. A reader may leave
+// from a different worker and decrease another counter, which is fine
+// since only the sum of the counters matters.
+static butil::static_atomic<unsigned> g_next_reader_slot =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static BAIDU_THREAD_LOCAL unsigned tls_reader_slot = (unsigned)-1;
+
+inline butil::atomic<int>* local_reader_count(const bthread_rwlock_t* rw) {
+    unsigned index = tls_reader_slot;
+    if (index == (unsigned)-1) {
+        index = g_next_reader_slot.fetch_add(1, butil::memory_order_relaxed)
+            & (RWLOCK_READER_SLOTS - 1);
+        tls_reader_slot = index;
+    }
+    return &static_cast<ReaderSlot*>(rw->reader_slots)[index].count;
+}
+
+inline butil::atomic<unsigned>* rwlock_state(const bthread_rwlock_t* rw) {
+    return reinterpret_cast<butil::atomic<unsigned>*>(rw->state);
+}
+
+inline butil::atomic<unsigned>* rwlock_writer_seq(const bthread_rwlock_t* rw) {
+    return reinterpret_cast<butil::atomic<unsigned>*>(rw->writer_seq);
+}
+
+// Returns true if any reader is holding the lock. `state' is the value of
+// the state loaded before checking.
+static bool has_readers(const bthread_rwlock_t* rw, unsigned state) {
+    if (rw->reader_slots == NULL) {
+        return (state & RWLOCK_READER_MASK) != 0;
+    }
+    const ReaderSlot* slots = static_cast<const ReaderSlot*>(rw->reader_slots);
+    int nreader = 0;
+    for (unsigned i = 0; i < RWLOCK_READER_SLOTS; ++i) {
+        nreader += slots[i].count.load(butil::memory_order_acquire);
+    }
+    return nreader != 0;
+}
+
+static void rwlock_unrdlock(bthread_rwlock_t* rw) {
+    butil::atomic<unsigned>* state = rwlock_state(rw);
+    if (rw->reader_slots == NULL) {
+        const unsigned s = state->fetch_sub(1, butil::memory_order_release);
+        if ((s & RWLOCK_WRITER) && (s & RWLOCK_READER_MASK) == 1) {
+            // The last reader blocking the writer.
+            butex_wake(state);
+        }
+        return;
+    }
+    local_reader_count(rw)->fetch_sub(1, butil::memory_order_release);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (state->load(butil::memory_order_relaxed) & RWLOCK_WRITER) {
+        // The writer can't tell whether we're the last reader, wake it up
+        // to check the counters again.
+        state->fetch_add(1, butil::memory_order_relaxed);
+        butex_wake(state);
+    }
+}
+
+// Returns true if the read lock is acquired, false if a writer is waiting
+// or holding the lock.
+static bool rwlock_rdlock_once(bthread_rwlock_t* rw) {
+    butil::atomic<unsigned>* state = rwlock_state(rw);
+    if (rw->reader_slots == NULL) {
+        if (!(state->fetch_add(1, butil::memory_order_acquire) & RWLOCK_WRITER)) {
+            return true;
+        }
+    } else {
+        local_reader_count(rw)->fetch_add(1, butil::memory_order_relaxed);
+        // Pairs with the fence in rwlock_wrlock_impl: either the writer sees
+        // the counter or we see the writer.
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        if (!(state->load(butil::memory_order_acquire) & RWLOCK_WRITER)) {
+            return true;
+        }
+    }
+    // Back out to let the writer go.
+    rwlock_unrdlock(rw);
+    return false;
+}
+
+static int rwlock_rdlock_impl(bthread_rwlock_t* rw,
+                              const struct timespec* abstime) {
+    butil::atomic<unsigned>* state = rwlock_state(rw);
+    butil::atomic<unsigned>* writer_seq = rwlock_writer_seq(rw);
+    while (!rwlock_rdlock_once(rw)) {
+        // Load the sequence before checking the state, the sequence is
+        // changed if the writer releases the lock after the check.
+        const unsigned seq = writer_seq->load(butil::memory_order_acquire);
+        if (!(state->load(butil::memory_order_acquire) & RWLOCK_WRITER)) {
+            continue;
+        }
+        if (butex_wait(writer_seq, seq, abstime, CONTENTION_SITE_RWLOCK) < 0 &&
+            errno != EWOULDBLOCK && errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+// Release the writer bits and wake up blocked readers. Called by the
+// writer holding `writer_mutex'.
+static void rwlock_release_writer(bthread_rwlock_t* rw) {
+    butil::atomic<unsigned>* state = rwlock_state(rw);
+    if (rw->reader_slots == NULL) {
+        // Keep readers which are backing out.
+        state->fetch_and(RWLOCK_READER_MASK, butil::memory_order_release);
+    } else {
+        // Reset the sequence as well, it's only meaningful when the
+        // writer is waiting.
+        state->store(0, butil::memory_order_release);
+    }
+    butil::atomic<unsigned>* writer_seq = rwlock_writer_seq(rw);
+    writer_seq->fetch_add(1, butil::memory_order_release);
+    butex_wake_all(writer_seq);
+    bthread_mutex_unlock(&rw->writer_mutex);
+}
+
+static int rwlock_wrlock_impl(bthread_rwlock_t* rw,
+                              const struct timespec* abstime) {
+    const int rc = (abstime ? bthread_mutex_timedlock(&rw->writer_mutex, abstime)
+                    : bthread_mutex_lock(&rw->writer_mutex));
+    if (rc != 0) {
+        return rc;
+    }
+    butil::atomic<unsigned>* state = rwlock_state(rw);
+    state->fetch_or(RWLOCK_WRITER, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    while (true) {
+        const unsigned s = state->load(butil::memory_order_acquire);
+        if (!has_readers(rw, s)) {
+            break;
+        }
+        if (butex_wait(state, s, abstime, CONTENTION_SITE_RWLOCK) < 0 &&
+            errno == ETIMEDOUT) {
+            rwlock_release_writer(rw);
+            return ETIMEDOUT;
+        }
+    }
+    state->fetch_or(RWLOCK_WRITER_LOCKED, butil::memory_order_relaxed);
+    return 0;
+}
+
+}  // namespace bthread
+
+extern "C" {
+
+int bthread_rwlock_init(bthread_rwlock_t* __restrict rw,
+                        const bthread_rwlockattr_t* __restrict attr) {
+    rw->state = NULL;
+    rw->writer_seq = NULL;
+    rw->reader_slots = NULL;
+    if (attr != NULL && attr->kind == BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP) {
+        bthread::ReaderSlot* slots =
+            new (std::nothrow) bthread::ReaderSlot[bthread::RWLOCK_READER_SLOTS];
+        if (slots == NULL) {
+            return ENOMEM;
+        }
+        for (unsigned i = 0; i < bthread::RWLOCK_READER_SLOTS; ++i) {
+            slots[i].count.store(0, butil::memory_order_relaxed);
+        }
+        rw->reader_slots = slots;
+    }
+    rw->state = bthread::butex_create_checked<unsigned>();
+    rw->writer_seq = bthread::butex_create_checked<unsigned>();
+    if (rw->state == NULL || rw->writer_seq == NULL ||
+        bthread_mutex_init(&rw->writer_mutex, NULL) != 0) {
+        bthread::butex_destroy(rw->state);
+        bthread::butex_destroy(rw->writer_seq);
+        delete [] static_cast<bthread::ReaderSlot*>(rw->reader_slots);
+        rw->reader_slots = NULL;
+        return ENOMEM;
+    }
+    *rw->state = 0;
+    *rw->writer_seq = 0;
+    return 0;
+}
+
+int bthread_rwlock_destroy(bthread_rwlock_t* rw) {
+    bthread::butex_destroy(rw->state);
+    bthread::butex_destroy(rw->writer_seq);
+    bthread_mutex_destroy(&rw->writer_mutex);
+    delete [] static_cast<bthread::ReaderSlot*>(rw->reader_slots);
+    rw->state = NULL;
+    rw->writer_seq = NULL;
+    rw->reader_slots = NULL;
+    return 0;
+}
+
+int bthread_rwlock_rdlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_rdlock_impl(rw, NULL);
+}
+
+int bthread_rwlock_tryrdlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_rdlock_once(rw) ? 0 : EBUSY;
+}
+
+int bthread_rwlock_timedrdlock(bthread_rwlock_t* __restrict rw,
+                               const struct timespec* __restrict abstime) {
+    return bthread::rwlock_rdlock_impl(rw, abstime);
+}
+
+int bthread_rwlock_wrlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_wrlock_impl(rw, NULL);
+}
+
+int bthread_rwlock_trywrlock(bthread_rwlock_t* rw) {
+    if (bthread_mutex_trylock(&rw->writer_mutex) != 0) {
+        return EBUSY;
+    }
+    butil::atomic<unsigned>* state = bthread::rwlock_state(rw);
+    state->fetch_or(bthread::RWLOCK_WRITER, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (bthread::has_readers(rw, state->load(butil::memory_order_acquire))) {
+        bthread::rwlock_release_writer(rw);
+        return EBUSY;
+    }
+    state->fetch_or(bthread::RWLOCK_WRITER_LOCKED, butil::memory_order_relaxed);
+    return 0;
+}
+
+int bthread_rwlock_timedwrlock(bthread_rwlock_t* __restrict rw,
+                               const struct timespec* __restrict abstime) {
+    return bthread::rwlock_wrlock_impl(rw, abstime);
+}
+
+int bthread_rwlock_unlock(bthread_rwlock_t* rw) {
+    // Readers can't hold the lock together with the writer, so the bit is
+    // set iff the caller is the writer.
+    if (bthread::rwlock_state(rw)->load(butil::memory_order_relaxed) &
+        bthread::RWLOCK_WRITER_LOCKED) {
+        bthread::rwlock_release_writer(rw);
+    } else {
+        bthread::rwlock_unrdlock(rw);
+    }
+    return 0;
+}
+
+int bthread_rwlockattr_init(bthread_rwlockattr_t* attr) {
+    attr->kind = BTHREAD_RWLOCK_PREFER_WRITER_NP;
+    return 0;
+}
+
+int bthread_rwlockattr_destroy(bthread_rwlockattr_t*) {
+    return 0;
+}
+
+int bthread_rwlockattr_getkind_np(const bthread_rwlockattr_t* attr, int* pref) {
+    *pref = attr->kind;
+    return 0;
+}
+
+int bthread_rwlockattr_setkind_np(bthread_rwlockattr_t* attr, int pref) {
+    if (pref != BTHREAD_RWLOCK_PREFER_WRITER_NP &&
+        pref != BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP) {
+        return EINVAL;
+    }
+    attr->kind = pref;
+    return 0;
+}
+
+}  // extern "C"
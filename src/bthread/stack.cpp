@@ -23,7 +23,9 @@
 #include <sys/mman.h>                             // mmap, munmap, mprotect
 #include <algorithm>                              // std::max
 #include <stdlib.h>                               // posix_memalign
+#include "butil/build_config.h"                    // OS_LINUX
 #include "butil/macros.h"                          // BAIDU_CASSERT
+#include "butil/thread_local.h"                    // BAIDU_THREAD_LOCAL
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/third_party/dynamic_annotations/dynamic_annotations.h" // RunningOnValgrind
 #include "butil/third_party/valgrind/valgrind.h"   // VALGRIND_STACK_REGISTER
@@ -37,6 +39,15 @@ DEFINE_int32(stack_size_large, 8388608, "size of large stacks");
 DEFINE_int32(guard_page_size, 4096, "size of guard page, allocate stacks by malloc if it's 0(not recommended)");
 DEFINE_int32(tc_stack_small, 32, "maximum small stacks cached by each thread");
 DEFINE_int32(tc_stack_normal, 8, "maximum normal stacks cached by each thread");
+DEFINE_int32(stack_pool_high_watermark_mb, -1, "Release memory of stacks "
+             "returned to the pool when pooled stacks are estimated to commit "
+             "more than so many megabytes, negative to disable");
+DEFINE_int32(stack_pool_low_watermark_mb, 128, "Stop releasing memory of "
+             "returned stacks when pooled stacks are estimated to commit less "
+             "than so many megabytes");
+DEFINE_int32(stack_usage_sample_interval, 1024, "Measure memory committed by "
+             "one in so many returned stacks to track the high-water usage of "
+             "stacks, 0 to disable");
 
 namespace bthread {
 
@@ -75,6 +86,8 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + stacksize;
         s->stacksize = stacksize;
         s->guardsize = 0;
+        s->committed_size = 0;
+        s->pooled = false;
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -120,6 +133,8 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + memsize;
         s->stacksize = stacksize;
         s->guardsize = guardsize;
+        s->committed_size = 0;
+        s->pooled = false;
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -146,6 +161,184 @@ void deallocate_stack_storage(StackStorage* s) {
     }
 }
 
+// Stacks returned to butil::ObjectPool are never deallocated, pages touched
+// by bthreads stay committed. We estimate memory committed by pooled stacks
+// and release memory of stacks being returned with madvise(MADV_DONTNEED)
+// when the estimation is above -stack_pool_high_watermark_mb, until it's
+// below -stack_pool_low_watermark_mb. MADV_FREE is not used because freed
+// pages still count in RSS until the system is short of memory.
+//
+// Committed size of a stack is measured by mincore() for one in every
+// -stack_usage_sample_interval returned stacks, the maximum is the
+// high-water usage of the stack type. Unmeasured stacks are assumed to
+// commit as much as the high-water usage, which overestimates when most
+// bthreads use much less than the deepest one, so releasing is off unless
+// -stack_pool_high_watermark_mb is set.
+static butil::static_atomic<int64_t> s_pooled_stack_bytes =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<int64_t> s_pooled_committed_bytes =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<bool> s_releasing_stacks =
+    BUTIL_STATIC_ATOMIC_INIT(false);
+static butil::static_atomic<int> s_stack_high_water[STACK_TYPE_LARGE + 1] = {
+    BUTIL_STATIC_ATOMIC_INIT(0), BUTIL_STATIC_ATOMIC_INIT(0),
+    BUTIL_STATIC_ATOMIC_INIT(0), BUTIL_STATIC_ATOMIC_INIT(0),
+    BUTIL_STATIC_ATOMIC_INIT(0)
+};
+
+// Stacks are got and returned each time a bthread is created and destroyed,
+// changes are accumulated in TLS and added to the globals when they're large
+// enough to avoid contending on the global atomics.
+struct PooledStackDelta {
+    int64_t stack_bytes;
+    int64_t committed_bytes;
+    int nreturned;
+};
+static BAIDU_THREAD_LOCAL PooledStackDelta tls_pooled_delta = { 0, 0, 0 };
+static const int64_t MAX_POOLED_DELTA = 1048576;
+
+inline void add_pooled_delta(int64_t stack_bytes, int64_t committed_bytes) {
+    PooledStackDelta& d = tls_pooled_delta;
+    d.stack_bytes += stack_bytes;
+    d.committed_bytes += committed_bytes;
+    if (std::abs(d.stack_bytes) >= MAX_POOLED_DELTA ||
+        std::abs(d.committed_bytes) >= MAX_POOLED_DELTA) {
+        s_pooled_stack_bytes.fetch_add(d.stack_bytes, butil::memory_order_relaxed);
+        s_pooled_committed_bytes.fetch_add(d.committed_bytes,
+                                           butil::memory_order_relaxed);
+        d.stack_bytes = 0;
+        d.committed_bytes = 0;
+    }
+}
+
+// Returns bytes from the lowest page of the stack in physical memory to the
+// bottom, -1 on error. Stacks grow downwards from the bottom.
+static int measure_committed_size(const StackStorage& s) {
+#if defined(OS_LINUX)
+    const static int PAGESIZE = getpagesize();
+    char* const top = (char*)s.bottom - s.stacksize;
+    unsigned char vec[256];
+    const int chunk_size = (int)sizeof(vec) * PAGESIZE;
+    for (int offset = 0; offset < s.stacksize; offset += chunk_size) {
+        const int len = std::min(s.stacksize - offset, chunk_size);
+        if (mincore(top + offset, len, vec) != 0) {
+            return -1;
+        }
+        for (int i = 0; i < len / PAGESIZE; ++i) {
+            if (vec[i] & 1) {
+                return s.stacksize - offset - i * PAGESIZE;
+            }
+        }
+    }
+    return 0;
+#else
+    (void)s;
+    return -1;
+#endif
+}
+
+static void update_high_water(StackType type, int committed_size) {
+    butil::static_atomic<int>& high_water = s_stack_high_water[type];
+    int old = high_water.load(butil::memory_order_relaxed);
+    while (committed_size > old &&
+           !high_water.compare_exchange_weak(old, committed_size,
+                                             butil::memory_order_relaxed)) {}
+}
+
+static bool should_release_stack() {
+    if (FLAGS_stack_pool_high_watermark_mb < 0) {
+        return false;
+    }
+    const int64_t committed =
+        s_pooled_committed_bytes.load(butil::memory_order_relaxed);
+    if (s_releasing_stacks.load(butil::memory_order_relaxed)) {
+        if (committed < FLAGS_stack_pool_low_watermark_mb * 1048576L) {
+            s_releasing_stacks.store(false, butil::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    if (committed > FLAGS_stack_pool_high_watermark_mb * 1048576L) {
+        s_releasing_stacks.store(true, butil::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void on_stack_got(ContextualStack* cs) {
+    StackStorage& s = cs->storage;
+    if (s.pooled) {
+        s.pooled = false;
+        add_pooled_delta(-s.stacksize, -s.committed_size);
+    }
+}
+
+void on_stack_returned(ContextualStack* cs) {
+    const static int PAGESIZE = getpagesize();
+    StackStorage& s = cs->storage;
+    // Committed pages stay until being released.
+    int committed_size = std::min(
+        std::max(s.committed_size,
+                 s_stack_high_water[cs->stacktype].load(butil::memory_order_relaxed)),
+        s.stacksize);
+    PooledStackDelta& d = tls_pooled_delta;
+    if (FLAGS_stack_usage_sample_interval > 0 &&
+        ++d.nreturned >= FLAGS_stack_usage_sample_interval) {
+        d.nreturned = 0;
+        const int measured = measure_committed_size(s);
+        if (measured >= 0) {
+            committed_size = measured;
+            update_high_water(cs->stacktype, measured);
+        }
+    }
+    // Stacks allocated by malloc are not page-aligned.
+    if (s.guardsize > 0 && committed_size > PAGESIZE && should_release_stack()) {
+        // Keep the page at bottom which is touched again soon by next bthread.
+        if (madvise((char*)s.bottom - s.stacksize, s.stacksize - PAGESIZE,
+                    MADV_DONTNEED) == 0) {
+            committed_size = PAGESIZE;
+        }
+    }
+    s.committed_size = committed_size;
+    s.pooled = true;
+    add_pooled_delta(s.stacksize, committed_size);
+}
+
+static int64_t get_pooled_stack_bytes(void*) {
+    return s_pooled_stack_bytes.load(butil::memory_order_relaxed);
+}
+static bvar::PassiveStatus<int64_t> bvar_pooled_stack_bytes(
+    "bthread_stack_pooled_bytes", get_pooled_stack_bytes, NULL);
+
+static int64_t get_pooled_committed_bytes(void*) {
+    return s_pooled_committed_bytes.load(butil::memory_order_relaxed);
+}
+static bvar::PassiveStatus<int64_t> bvar_pooled_committed_bytes(
+    "bthread_stack_pooled_committed_bytes", get_pooled_committed_bytes, NULL);
+
+static int get_stack_high_water(void* arg) {
+    return s_stack_high_water[(intptr_t)arg].load(butil::memory_order_relaxed);
+}
+static bvar::PassiveStatus<int> bvar_stack_high_water_small(
+    "bthread_stack_high_water_bytes_small", get_stack_high_water,
+    (void*)(intptr_t)STACK_TYPE_SMALL);
+static bvar::PassiveStatus<int> bvar_stack_high_water_normal(
+    "bthread_stack_high_water_bytes_normal", get_stack_high_water,
+    (void*)(intptr_t)STACK_TYPE_NORMAL);
+static bvar::PassiveStatus<int> bvar_stack_high_water_large(
+    "bthread_stack_high_water_bytes_large", get_stack_high_water,
+    (void*)(intptr_t)STACK_TYPE_LARGE);
+
+// Twice of the high-water usage of normal stacks, 0 if it's not measured yet.
+static int get_suggested_stack_size_normal(void*) {
+    const static int PAGESIZE = getpagesize();
+    const int high_water =
+        s_stack_high_water[STACK_TYPE_NORMAL].load(butil::memory_order_relaxed);
+    return (high_water * 2 + PAGESIZE - 1) & ~(PAGESIZE - 1);
+}
+static bvar::PassiveStatus<int> bvar_suggested_stack_size_normal(
+    "bthread_stack_size_normal_suggested", get_suggested_stack_size_normal, NULL);
+
 int* SmallStackClass::stack_size_flag = &FLAGS_stack_size_small;
 int* NormalStackClass::stack_size_flag = &FLAGS_stack_size_normal;
 int* LargeStackClass::stack_size_flag = &FLAGS_stack_size_large;
@@ -37,6 +37,10 @@ struct StackStorage {
     // http://www.boost.org/doc/libs/1_55_0/libs/context/doc/html/context/stack.html
     void* bottom;
     unsigned valgrind_stack_id;
+    // Estimated bytes of the stack backed by physical memory.
+    int committed_size;
+    // True if the stack is returned to the pool and not reused yet.
+    bool pooled;
 
     // Clears all members.
     void zeroize() {
@@ -44,6 +48,8 @@ struct StackStorage {
         guardsize = 0;
         bottom = NULL;
         valgrind_stack_id = 0;
+        committed_size = 0;
+        pooled = false;
     }
 };
  
@@ -72,6 +78,11 @@ struct ContextualStack {
 ContextualStack* get_stack(StackType type, void (*entry)(intptr_t));
 // Recycle a stack. NULL does nothing.
 void return_stack(ContextualStack*);
+// Update statistics of pooled stacks when a stack is got from or returned to
+// the pool. A stack being returned may have its memory released if pooled
+// stacks commit too much memory, see -stack_pool_high_watermark_mb.
+void on_stack_got(ContextualStack* s);
+void on_stack_returned(ContextualStack* s);
 // Jump from stack `from' to stack `to'. `from' must be the stack of callsite
 // (to save contexts before jumping)
 void jump_stack(ContextualStack* from, ContextualStack* to);
@@ -68,10 +68,15 @@ template <typename StackClass> struct StackFactory {
     };
     
     static ContextualStack* get_stack(void (*entry)(intptr_t)) {
-        return butil::get_object<Wrapper>(entry);
+        ContextualStack* sc = butil::get_object<Wrapper>(entry);
+        if (sc != NULL) {
+            on_stack_got(sc);
+        }
+        return sc;
     }
     
     static void return_stack(ContextualStack* sc) {
+        on_stack_returned(sc);
         butil::return_object(static_cast<Wrapper*>(sc));
     }
 };
@@ -19,6 +19,7 @@
 
 // Date: Tue Jul 10 17:40:58 CST 2012
 
+#include <math.h>                          // ceil
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
 #include "butil/logging.h"
@@ -38,6 +39,39 @@ DEFINE_int32(task_group_runqueue_capacity, 4096,
              "capacity of runqueue in each TaskGroup");
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
+DEFINE_int32(task_group_ntags, 1,
+             "Number of tags that worker pthreads are evenly divided into. "
+             "bthreads run and steal tasks only in workers of their own tags,"
+             " see bthread_attr_t::tag. Can't be changed after bthread is "
+             "initialized");
+DEFINE_bool(bthread_elastic_workers, false,
+            "Park workers when they're mostly idle, and resume them or add "
+            "workers(up to -bthread_concurrency) when they're busy or run "
+            "queues are backlogged. Parked workers don't spin or wake up on "
+            "new tasks");
+DEFINE_int32(bthread_elastic_interval_ms, 1000,
+             "Interval of sampling usage of workers to park or resume them");
+DEFINE_double(bthread_elastic_shrink_usage, 0.3,
+              "Park one worker of a tag when average usage of its active "
+              "workers stays below this value for "
+              "-bthread_elastic_shrink_rounds intervals");
+DEFINE_int32(bthread_elastic_shrink_rounds, 5,
+             "See -bthread_elastic_shrink_usage");
+DEFINE_double(bthread_elastic_grow_usage, 0.8,
+              "Resume parked workers of a tag when average usage of its active"
+              " workers stays above this value or its run queues hold more "
+              "tasks than active workers for -bthread_elastic_grow_rounds "
+              "intervals");
+DEFINE_int32(bthread_elastic_grow_rounds, 2,
+             "See -bthread_elastic_grow_usage");
+DEFINE_int32(bthread_elastic_min_workers, 2,
+             "Min number of active workers of each tag in elastic mode");
+DEFINE_int32(bthread_signal_merge_window_us, 0,
+             "Signals of new tasks within so many microseconds after waking "
+             "up a worker are merged into the wakeup as long as the woken "
+             "worker has not started stealing tasks, saving futex_wake under "
+             "bursts of new tasks at the cost of less parallelism. "
+             "0 disables merging");
 
 namespace bthread {
 
@@ -45,7 +79,37 @@ DECLARE_int32(bthread_concurrency);
 DECLARE_int32(bthread_min_concurrency);
 
 extern pthread_mutex_t g_task_control_mutex;
+extern TaskControl* g_task_control;
 extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+
+static bool validate_task_group_ntags(const char*, int32_t val) {
+    if (val < 1 || val > BTHREAD_MAX_CONCURRENCY) {
+        return false;
+    }
+    // Groups of tags are created in TaskControl::init().
+    return g_task_control == NULL || val == FLAGS_task_group_ntags;
+}
+const bool ALLOW_UNUSED dummy_task_group_ntags =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_task_group_ntags,
+                                    validate_task_group_ntags);
+
+static bool validate_bthread_elastic_workers(const char*, bool val) {
+    if (val && g_task_control != NULL) {
+        g_task_control->start_adjusting_workers();
+    }
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bthread_elastic_workers =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_elastic_workers,
+                                    validate_bthread_elastic_workers);
+
+static bool validate_bthread_elastic_interval_ms(const char*, int32_t val) {
+    return val > 0;
+}
+const bool ALLOW_UNUSED dummy_bthread_elastic_interval_ms =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_elastic_interval_ms,
+                                    validate_bthread_elastic_interval_ms);
+
 void (*g_worker_startfn)() = NULL;
 
 // May be called in other modules to run startfn in non-worker pthreads.
@@ -55,21 +119,29 @@ void run_worker_startfn() {
     }
 }
 
+struct WorkerThreadArgs {
+    TaskControl* control;
+    bthread_tag_t tag;
+};
+
 void* TaskControl::worker_thread(void* arg) {
     run_worker_startfn();    
 #ifdef BAIDU_INTERNAL
     logging::ComlogInitializer comlog_initializer;
 #endif
     
-    TaskControl* c = static_cast<TaskControl*>(arg);
-    TaskGroup* g = c->create_group();
+    WorkerThreadArgs* args = static_cast<WorkerThreadArgs*>(arg);
+    TaskControl* c = args->control;
+    const bthread_tag_t tag = args->tag;
+    delete args;
+    TaskGroup* g = c->create_group(tag);
     TaskStatistics stat;
     if (NULL == g) {
         LOG(ERROR) << "Fail to create TaskGroup in pthread=" << pthread_self();
         return NULL;
     }
     BT_VLOG << "Created worker=" << pthread_self()
-            << " bthread=" << g->main_tid();
+            << " bthread=" << g->main_tid() << " tag=" << tag;
 
     tls_task_group = g;
     c->_nworkers << 1;
@@ -85,8 +157,22 @@ void* TaskControl::worker_thread(void* arg) {
     return NULL;
 }
 
-TaskGroup* TaskControl::create_group() {
-    TaskGroup* g = new (std::nothrow) TaskGroup(this);
+int TaskControl::create_worker(pthread_t* th, bthread_tag_t tag) {
+    WorkerThreadArgs* args = new (std::nothrow) WorkerThreadArgs;
+    if (NULL == args) {
+        return ENOMEM;
+    }
+    args->control = this;
+    args->tag = tag;
+    const int rc = pthread_create(th, NULL, worker_thread, args);
+    if (rc) {
+        delete args;
+    }
+    return rc;
+}
+
+TaskGroup* TaskControl::create_group(bthread_tag_t tag) {
+    TaskGroup* g = new (std::nothrow) TaskGroup(this, tag);
     if (NULL == g) {
         LOG(FATAL) << "Fail to new TaskGroup";
         return NULL;
@@ -120,14 +206,23 @@ static int64_t get_cumulated_signal_count_from_this(void *arg) {
     return static_cast<TaskControl*>(arg)->get_cumulated_signal_count();
 }
 
+static int64_t get_cumulated_wakeup_count_from_this(void *arg) {
+    return static_cast<TaskControl*>(arg)->get_cumulated_wakeup_count();
+}
+
 TaskControl::TaskControl()
     // NOTE: all fileds must be initialized before the vars.
-    : _ngroup(0)
-    , _groups((TaskGroup**)calloc(BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*)))
+    : _ntags(0)
+    , _tagged(NULL)
     , _stop(false)
     , _concurrency(0)
+    , _adjusting_workers(false)
+    , _adjust_timer_id(TimerThread::INVALID_TASK_ID)
+    , _last_adjust_ns(0)
     , _nworkers("bthread_worker_count")
+    , _nparked_workers("bthread_parked_worker_count")
     , _pending_time(NULL)
+    , _runqueue_delay(NULL)
       // Delay exposure of following two vars because they rely on TC which
       // is not initialized yet.
     , _cumulated_worker_time(get_cumulated_worker_time_from_this, this)
@@ -136,11 +231,11 @@ TaskControl::TaskControl()
     , _switch_per_second(&_cumulated_switch_count)
     , _cumulated_signal_count(get_cumulated_signal_count_from_this, this)
     , _signal_per_second(&_cumulated_signal_count)
+    , _cumulated_wakeup_count(get_cumulated_wakeup_count_from_this, this)
+    , _wakeup_per_second(&_cumulated_wakeup_count)
     , _status(print_rq_sizes_in_the_tc, this)
     , _nbthreads("bthread_count")
 {
-    // calloc shall set memory to zero
-    CHECK(_groups) << "Fail to create array of groups";
 }
 
 int TaskControl::init(int concurrency) {
@@ -152,6 +247,30 @@ int TaskControl::init(int concurrency) {
         LOG(ERROR) << "Invalid concurrency=" << concurrency;
         return -1;
     }
+    const int ntags = FLAGS_task_group_ntags;
+    if (concurrency < ntags) {
+        LOG(WARNING) << "concurrency=" << concurrency << " is less than "
+            "-task_group_ntags=" << ntags << ", create one worker per tag";
+        concurrency = ntags;
+    }
+    _tagged = new (std::nothrow) TaggedGroups[ntags];
+    if (NULL == _tagged) {
+        LOG(ERROR) << "Fail to new TaggedGroups";
+        return -1;
+    }
+    _ntags = ntags;
+    for (int i = 0; i < ntags; ++i) {
+        TaggedGroups* tg = &_tagged[i];
+        tg->control = this;
+        tg->tag = i;
+        // calloc shall set memory to zero
+        tg->groups = (TaskGroup**)calloc(BTHREAD_MAX_CONCURRENCY,
+                                         sizeof(TaskGroup*));
+        if (NULL == tg->groups) {
+            LOG(ERROR) << "Fail to create array of groups";
+            return -1;
+        }
+    }
     _concurrency = concurrency;
 
     // Make sure TimerThread is ready.
@@ -162,7 +281,9 @@ int TaskControl::init(int concurrency) {
     
     _workers.resize(_concurrency);   
     for (int i = 0; i < _concurrency; ++i) {
-        const int rc = pthread_create(&_workers[i], NULL, worker_thread, this);
+        const bthread_tag_t tag = i % ntags;
+        _tagged[tag].concurrency.fetch_add(1, butil::memory_order_relaxed);
+        const int rc = create_worker(&_workers[i], tag);
         if (rc) {
             LOG(ERROR) << "Fail to create _workers[" << i << "], " << berror(rc);
             return -1;
@@ -171,19 +292,195 @@ int TaskControl::init(int concurrency) {
     _worker_usage_second.expose("bthread_worker_usage");
     _switch_per_second.expose("bthread_switch_second");
     _signal_per_second.expose("bthread_signal_second");
+    _wakeup_per_second.expose("bthread_wakeup_second");
     _status.expose("bthread_group_status");
+    if (ntags > 1) {
+        for (int i = 0; i < ntags; ++i) {
+            expose_tagged_vars(&_tagged[i]);
+        }
+    }
 
-    // Wait for at least one group is added so that choose_one_group()
-    // never returns NULL.
+    // Wait for at least one group of each tag is added so that
+    // choose_one_group() never returns NULL.
     // TODO: Handle the case that worker quits before add_group
-    while (_ngroup == 0) {
-        usleep(100);  // TODO: Elaborate
+    for (int i = 0; i < ntags; ++i) {
+        while (_tagged[i].ngroup == 0) {
+            usleep(100);  // TODO: Elaborate
+        }
+    }
+    if (FLAGS_bthread_elastic_workers) {
+        start_adjusting_workers();
     }
     return 0;
 }
 
-int TaskControl::add_workers(int num) {
-    if (num <= 0) {
+void TaskControl::start_adjusting_workers() {
+    if (_adjusting_workers.exchange(true, butil::memory_order_relaxed)) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    if (_stop) {
+        return;
+    }
+    // Usage is sampled from now on.
+    for (int tag = 0; tag < _ntags; ++tag) {
+        TaggedGroups& tg = _tagged[tag];
+        const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            tg.groups[i]->_last_sampled_cputime_ns =
+                tg.groups[i]->_cumulated_cputime_ns;
+        }
+    }
+    _last_adjust_ns = butil::cpuwide_time_ns();
+    _adjust_timer_id = get_global_timer_thread()->schedule(
+        adjust_workers_periodically, this,
+        butil::milliseconds_from_now(FLAGS_bthread_elastic_interval_ms));
+}
+
+void TaskControl::adjust_workers_periodically(void* arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    const int64_t now_ns = butil::cpuwide_time_ns();
+    const int64_t elapse_ns = now_ns - c->_last_adjust_ns;
+    c->_last_adjust_ns = now_ns;
+    for (int tag = 0; tag < c->_ntags; ++tag) {
+        c->adjust_workers(&c->_tagged[tag], elapse_ns);
+    }
+    BAIDU_SCOPED_LOCK(c->_modify_group_mutex);
+    if (!c->_stop) {
+        c->_adjust_timer_id = get_global_timer_thread()->schedule(
+            adjust_workers_periodically, c,
+            butil::milliseconds_from_now(FLAGS_bthread_elastic_interval_ms));
+    }
+}
+
+void TaskControl::adjust_workers(TaggedGroups* tg, int64_t elapse_ns) {
+    const bool elastic = FLAGS_bthread_elastic_workers;
+    bool add_worker = false;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        if (_stop) {
+            return;
+        }
+        // Usage of a worker is the ratio of time running bthreads, which is
+        // also shown by -show_per_worker_usage_in_vars.
+        int nactive = 0;
+        int64_t active_cputime_ns = 0;
+        size_t backlog = 0;
+        TaskGroup* idlest = NULL;
+        int64_t idlest_cputime_ns = 0;
+        const size_t ngroup = tg->ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            TaskGroup* g = tg->groups[i];
+            const int64_t cputime_ns = g->_cumulated_cputime_ns;
+            const int64_t delta_ns = cputime_ns - g->_last_sampled_cputime_ns;
+            g->_last_sampled_cputime_ns = cputime_ns;
+            if (g->_park_state.load(butil::memory_order_relaxed) !=
+                TaskGroup::PARK_NONE) {
+                if (!elastic) {
+                    g->unpark();
+                }
+                continue;
+            }
+            ++nactive;
+            active_cputime_ns += delta_ns;
+            backlog += g->_rq.volatile_size();
+            if (idlest == NULL || delta_ns < idlest_cputime_ns) {
+                idlest = g;
+                idlest_cputime_ns = delta_ns;
+            }
+        }
+        if (!elastic || nactive == 0 || elapse_ns <= 0) {
+            tg->busy_rounds = 0;
+            tg->idle_rounds = 0;
+            return;
+        }
+        // Sum of usages of active workers, in [0, nactive].
+        const double usage = active_cputime_ns / (double)elapse_ns;
+        const double grow_usage = FLAGS_bthread_elastic_grow_usage;
+        const double shrink_usage = FLAGS_bthread_elastic_shrink_usage;
+        if (usage > grow_usage * nactive || backlog > (size_t)nactive) {
+            tg->idle_rounds = 0;
+            if (++tg->busy_rounds >= FLAGS_bthread_elastic_grow_rounds) {
+                tg->busy_rounds = 0;
+                // Resume enough workers to bring the average usage back to
+                // the middle of the thresholds, which at most doubles
+                // active workers when they're saturated.
+                const double target = (grow_usage + shrink_usage) / 2;
+                int nresume = (int)ceil(usage / target) - nactive;
+                if (nresume < 1) {
+                    nresume = 1;
+                }
+                int nresumed = 0;
+                for (size_t i = 0; i < ngroup && nresumed < nresume; ++i) {
+                    if (tg->groups[i]->unpark()) {
+                        ++nresumed;
+                    }
+                }
+                add_worker = (nresumed == 0);
+            }
+        } else if (usage < shrink_usage * nactive && backlog == 0 &&
+                   nactive > FLAGS_bthread_elastic_min_workers &&
+                   // Don't make remaining workers busy, otherwise the
+                   // worker would be resumed soon.
+                   usage < grow_usage * (nactive - 1)) {
+            tg->busy_rounds = 0;
+            if (++tg->idle_rounds >= FLAGS_bthread_elastic_shrink_rounds) {
+                tg->idle_rounds = 0;
+                if (idlest->request_park()) {
+                    // The worker checks the request after waking up.
+                    idlest->_pl->signal(ngroup);
+                }
+            }
+        } else {
+            tg->busy_rounds = 0;
+            tg->idle_rounds = 0;
+        }
+    }
+    // All workers are active and still busy.
+    if (add_worker &&
+        _concurrency.load(butil::memory_order_relaxed) < FLAGS_bthread_concurrency) {
+        BAIDU_SCOPED_LOCK(g_task_control_mutex);
+        if (_concurrency.load(butil::memory_order_acquire) < FLAGS_bthread_concurrency) {
+            add_workers(1, tg->tag);
+        }
+    }
+}
+
+double TaskControl::get_cumulated_worker_time_of_tag(void* arg) {
+    TaggedGroups* tg = static_cast<TaggedGroups*>(arg);
+    return tg->control->get_cumulated_worker_time(tg->tag);
+}
+
+int TaskControl::get_concurrency_of_tag(void* arg) {
+    TaggedGroups* tg = static_cast<TaggedGroups*>(arg);
+    return tg->control->concurrency(tg->tag);
+}
+
+void TaskControl::expose_tagged_vars(TaggedGroups* tg) {
+    char name[64];
+    tg->cumulated_worker_time = new bvar::PassiveStatus<double>(
+        get_cumulated_worker_time_of_tag, tg);
+    tg->worker_usage_second =
+        new bvar::PerSecond<bvar::PassiveStatus<double> >(
+            tg->cumulated_worker_time, 1);
+    snprintf(name, sizeof(name), "bthread_worker_usage_tag_%d", tg->tag);
+    tg->worker_usage_second->expose(name);
+    tg->worker_count = new bvar::PassiveStatus<int>(get_concurrency_of_tag, tg);
+    snprintf(name, sizeof(name), "bthread_worker_count_tag_%d", tg->tag);
+    tg->worker_count->expose(name);
+}
+
+void TaskControl::hide_tagged_vars(TaggedGroups* tg) {
+    delete tg->worker_count;
+    tg->worker_count = NULL;
+    delete tg->worker_usage_second;
+    tg->worker_usage_second = NULL;
+    delete tg->cumulated_worker_time;
+    tg->cumulated_worker_time = NULL;
+}
+
+int TaskControl::add_workers(int num, bthread_tag_t tag) {
+    if (num <= 0 || tag < 0 || tag >= _ntags) {
         return 0;
     }
     try {
@@ -196,11 +493,12 @@ int TaskControl::add_workers(int num) {
         // Worker will add itself to _idle_workers, so we have to add
         // _concurrency before create a worker.
         _concurrency.fetch_add(1);
-        const int rc = pthread_create(
-                &_workers[i + old_concurency], NULL, worker_thread, this);
+        _tagged[tag].concurrency.fetch_add(1);
+        const int rc = create_worker(&_workers[i + old_concurency], tag);
         if (rc) {
             LOG(WARNING) << "Fail to create _workers[" << i + old_concurency
                          << "], " << berror(rc);
+            _tagged[tag].concurrency.fetch_sub(1, butil::memory_order_release);
             _concurrency.fetch_sub(1, butil::memory_order_release);
             break;
         }
@@ -210,10 +508,12 @@ int TaskControl::add_workers(int num) {
     return _concurrency.load(butil::memory_order_relaxed) - old_concurency;
 }
 
-TaskGroup* TaskControl::choose_one_group() {
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire);
+TaskGroup* TaskControl::choose_one_group(bthread_tag_t tag) {
+    DCHECK(tag >= 0 && tag < _ntags) << "tag=" << tag;
+    TaggedGroups& tg = _tagged[tag];
+    const size_t ngroup = tg.ngroup.load(butil::memory_order_acquire);
     if (ngroup != 0) {
-        return _groups[butil::fast_rand_less_than(ngroup)];
+        return tg.groups[butil::fast_rand_less_than(ngroup)];
     }
     CHECK(false) << "Impossible: ngroup is 0";
     return NULL;
@@ -230,10 +530,23 @@ void TaskControl::stop_and_join() {
     {
         BAIDU_SCOPED_LOCK(_modify_group_mutex);
         _stop = true;
-        _ngroup.exchange(0, butil::memory_order_relaxed); 
+        if (_adjust_timer_id != TimerThread::INVALID_TASK_ID) {
+            get_global_timer_thread()->unschedule(_adjust_timer_id);
+        }
+        for (int i = 0; i < _ntags; ++i) {
+            TaggedGroups& tg = _tagged[i];
+            // Parked workers don't wait on the parking lots stopped below.
+            const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
+            for (size_t j = 0; j < ngroup; ++j) {
+                tg.groups[j]->unpark();
+            }
+            tg.ngroup.exchange(0, butil::memory_order_relaxed);
+        }
     }
-    for (int i = 0; i < PARKING_LOT_NUM; ++i) {
-        _pl[i].stop();
+    for (int i = 0; i < _ntags; ++i) {
+        for (int j = 0; j < PARKING_LOT_NUM; ++j) {
+            _tagged[i].pl[j].stop();
+        }
     }
     // Interrupt blocking operations.
     for (size_t i = 0; i < _workers.size(); ++i) {
@@ -249,34 +562,43 @@ TaskControl::~TaskControl() {
     // NOTE: g_task_control is not destructed now because the situation
     //       is extremely racy.
     delete _pending_time.exchange(NULL, butil::memory_order_relaxed);
+    delete _runqueue_delay.exchange(NULL, butil::memory_order_relaxed);
     _worker_usage_second.hide();
     _switch_per_second.hide();
     _signal_per_second.hide();
+    _wakeup_per_second.hide();
     _status.hide();
+    for (int i = 0; i < _ntags; ++i) {
+        hide_tagged_vars(&_tagged[i]);
+    }
     
     stop_and_join();
 
-    free(_groups);
-    _groups = NULL;
+    for (int i = 0; i < _ntags; ++i) {
+        free(_tagged[i].groups);
+    }
+    delete [] _tagged;
+    _tagged = NULL;
 }
 
 int TaskControl::_add_group(TaskGroup* g) {
     if (__builtin_expect(NULL == g, 0)) {
         return -1;
     }
+    TaggedGroups& tg = _tagged[g->tag()];
     std::unique_lock<butil::Mutex> mu(_modify_group_mutex);
     if (_stop) {
         return -1;
     }
-    size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+    size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
     if (ngroup < (size_t)BTHREAD_MAX_CONCURRENCY) {
-        _groups[ngroup] = g;
-        _ngroup.store(ngroup + 1, butil::memory_order_release);
+        tg.groups[ngroup] = g;
+        tg.ngroup.store(ngroup + 1, butil::memory_order_release);
     }
     mu.unlock();
     // See the comments in _destroy_group
     // TODO: Not needed anymore since non-worker pthread cannot have TaskGroup
-    signal_task(65536);
+    signal_task(65536, g->tag());
     return 0;
 }
 
@@ -296,12 +618,13 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     }
     bool erased = false;
     {
+        TaggedGroups& tg = _tagged[g->tag()];
         BAIDU_SCOPED_LOCK(_modify_group_mutex);
-        const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+        const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
         for (size_t i = 0; i < ngroup; ++i) {
-            if (_groups[i] == g) {
+            if (tg.groups[i] == g) {
                 // No need for atomic_thread_fence because lock did it.
-                _groups[i] = _groups[ngroup - 1];
+                tg.groups[i] = tg.groups[ngroup - 1];
                 // Change _ngroup and keep _groups unchanged at last so that:
                 //  - If steal_task sees the newest _ngroup, it would not touch
                 //    _groups[ngroup -1]
@@ -311,8 +634,8 @@ int TaskControl::_destroy_group(TaskGroup* g) {
                 //    overwrite it, since we do signal_task in _add_group(),
                 //    we think the pending tasks of _groups[ngroup - 1] would
                 //    not miss.
-                _ngroup.store(ngroup - 1, butil::memory_order_release);
-                //_groups[ngroup - 1] = NULL;
+                tg.ngroup.store(ngroup - 1, butil::memory_order_release);
+                //tg.groups[ngroup - 1] = NULL;
                 erased = true;
                 break;
             }
@@ -332,10 +655,12 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     return 0;
 }
 
-bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
+bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                             bthread_tag_t tag) {
+    TaggedGroups& tg = _tagged[tag];
     // 1: Acquiring fence is paired with releasing fence in _add_group to
-    // avoid accessing uninitialized slot of _groups.
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire/*1*/);
+    // avoid accessing uninitialized slot of groups.
+    const size_t ngroup = tg.ngroup.load(butil::memory_order_acquire/*1*/);
     if (0 == ngroup) {
         return false;
     }
@@ -344,7 +669,7 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     bool stolen = false;
     size_t s = *seed;
     for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = _groups[s % ngroup];
+        TaskGroup* g = tg.groups[s % ngroup];
         // g is possibly NULL because of concurrent _destroy_group
         if (g) {
             if (g->_rq.steal(tid)) {
@@ -361,7 +686,7 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     return stolen;
 }
 
-void TaskControl::signal_task(int num_task) {
+void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
     if (num_task <= 0) {
         return;
     }
@@ -372,14 +697,17 @@ void TaskControl::signal_task(int num_task) {
     if (num_task > 2) {
         num_task = 2;
     }
+    ParkingLot* pl = _tagged[tag].pl;
+    const int64_t merge_window_ns =
+        FLAGS_bthread_signal_merge_window_us * 1000L;
     int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= _pl[start_index].signal(1);
+    num_task -= pl[start_index].signal(1, merge_window_ns);
     if (num_task > 0) {
         for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
             if (++start_index >= PARKING_LOT_NUM) {
                 start_index = 0;
             }
-            num_task -= _pl[start_index].signal(1);
+            num_task -= pl[start_index].signal(1, merge_window_ns);
         }
     }
     if (num_task > 0 &&
@@ -388,34 +716,49 @@ void TaskControl::signal_task(int num_task) {
         // TODO: Reduce this lock
         BAIDU_SCOPED_LOCK(g_task_control_mutex);
         if (_concurrency.load(butil::memory_order_acquire) < FLAGS_bthread_concurrency) {
-            add_workers(1);
+            add_workers(1, tag);
         }
     }
 }
 
 void TaskControl::print_rq_sizes(std::ostream& os) {
-    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
-    DEFINE_SMALL_ARRAY(int, nums, ngroup, 128);
-    {
-        BAIDU_SCOPED_LOCK(_modify_group_mutex);
-        // ngroup > _ngroup: nums[_ngroup ... ngroup-1] = 0
-        // ngroup < _ngroup: just ignore _groups[_ngroup ... ngroup-1]
+    for (int tag = 0; tag < _ntags; ++tag) {
+        TaggedGroups& tg = _tagged[tag];
+        const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
+        DEFINE_SMALL_ARRAY(int, nums, ngroup, 128);
+        {
+            BAIDU_SCOPED_LOCK(_modify_group_mutex);
+            // ngroup > tg.ngroup: nums[tg.ngroup ... ngroup-1] = 0
+            // ngroup < tg.ngroup: just ignore groups[tg.ngroup ... ngroup-1]
+            for (size_t i = 0; i < ngroup; ++i) {
+                nums[i] = (tg.groups[i] ? tg.groups[i]->_rq.volatile_size() : 0);
+            }
+        }
+        if (tag != 0) {
+            os << "| ";
+        }
         for (size_t i = 0; i < ngroup; ++i) {
-            nums[i] = (_groups[i] ? _groups[i]->_rq.volatile_size() : 0);
+            os << nums[i] << ' ';
         }
     }
-    for (size_t i = 0; i < ngroup; ++i) {
-        os << nums[i] << ' ';
-    }
 }
 
 double TaskControl::get_cumulated_worker_time() {
+    double t = 0;
+    for (int tag = 0; tag < _ntags; ++tag) {
+        t += get_cumulated_worker_time(tag);
+    }
+    return t;
+}
+
+double TaskControl::get_cumulated_worker_time(bthread_tag_t tag) {
     int64_t cputime_ns = 0;
+    TaggedGroups& tg = _tagged[tag];
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
-    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+    const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
     for (size_t i = 0; i < ngroup; ++i) {
-        if (_groups[i]) {
-            cputime_ns += _groups[i]->_cumulated_cputime_ns;
+        if (tg.groups[i]) {
+            cputime_ns += tg.groups[i]->_cumulated_cputime_ns;
         }
     }
     return cputime_ns / 1000000000.0;
@@ -424,10 +767,13 @@ double TaskControl::get_cumulated_worker_time() {
 int64_t TaskControl::get_cumulated_switch_count() {
     int64_t c = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
-    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
-    for (size_t i = 0; i < ngroup; ++i) {
-        if (_groups[i]) {
-            c += _groups[i]->_nswitch;
+    for (int tag = 0; tag < _ntags; ++tag) {
+        TaggedGroups& tg = _tagged[tag];
+        const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            if (tg.groups[i]) {
+                c += tg.groups[i]->_nswitch;
+            }
         }
     }
     return c;
@@ -436,11 +782,24 @@ int64_t TaskControl::get_cumulated_switch_count() {
 int64_t TaskControl::get_cumulated_signal_count() {
     int64_t c = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
-    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
-    for (size_t i = 0; i < ngroup; ++i) {
-        TaskGroup* g = _groups[i];
-        if (g) {
-            c += g->_nsignaled + g->_remote_nsignaled;
+    for (int tag = 0; tag < _ntags; ++tag) {
+        TaggedGroups& tg = _tagged[tag];
+        const size_t ngroup = tg.ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            TaskGroup* g = tg.groups[i];
+            if (g) {
+                c += g->_nsignaled + g->_remote_nsignaled;
+            }
+        }
+    }
+    return c;
+}
+
+int64_t TaskControl::get_cumulated_wakeup_count() {
+    int64_t c = 0;
+    for (int tag = 0; tag < _ntags; ++tag) {
+        for (int i = 0; i < PARKING_LOT_NUM; ++i) {
+            c += _tagged[tag].pl[i].wakeup_count();
         }
     }
     return c;
@@ -462,4 +821,20 @@ bvar::LatencyRecorder* TaskControl::create_exposed_pending_time() {
     return pt;
 }
 
+bvar::LatencyRecorder* TaskControl::create_exposed_runqueue_delay() {
+    bool is_creator = false;
+    _pending_time_mutex.lock();
+    bvar::LatencyRecorder* rd = _runqueue_delay.load(butil::memory_order_consume);
+    if (!rd) {
+        rd = new bvar::LatencyRecorder;
+        _runqueue_delay.store(rd, butil::memory_order_release);
+        is_creator = true;
+    }
+    _pending_time_mutex.unlock();
+    if (is_creator) {
+        rd->expose("bthread_runqueue_delay");
+    }
+    return rd;
+}
+
 }  // namespace bthread
@@ -32,6 +32,7 @@
 #include "butil/resource_pool.h"                 // ResourcePool
 #include "bthread/work_stealing_queue.h"        // WorkStealingQueue
 #include "bthread/parking_lot.h"
+#include "bthread/timer_thread.h"           // TimerThread
 
 namespace bthread {
 
@@ -45,17 +46,20 @@ public:
     TaskControl();
     ~TaskControl();
 
-    // Must be called before using. `nconcurrency' is # of worker pthreads.
+    // Must be called before using. `nconcurrency' is # of worker pthreads
+    // which are evenly divided into -task_group_ntags tags.
     int init(int nconcurrency);
     
-    // Create a TaskGroup in this control.
-    TaskGroup* create_group();
+    // Create a TaskGroup of `tag' in this control.
+    TaskGroup* create_group(bthread_tag_t tag);
 
-    // Steal a task from a "random" group.
-    bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
+    // Steal a task from a "random" group of `tag'.
+    bool steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                    bthread_tag_t tag);
 
-    // Tell other groups that `n' tasks was just added to caller's runqueue
-    void signal_task(int num_task);
+    // Tell other groups of `tag' that `n' tasks was just added to caller's
+    // runqueue
+    void signal_task(int num_task, bthread_tag_t tag);
 
     // Stop and join worker threads in TaskControl.
     void stop_and_join();
@@ -64,21 +68,70 @@ public:
     int concurrency() const 
     { return _concurrency.load(butil::memory_order_acquire); }
 
+    // Get # of worker threads of `tag'.
+    int concurrency(bthread_tag_t tag) const
+    { return _tagged[tag].concurrency.load(butil::memory_order_acquire); }
+
+    // Number of tags, fixed after init().
+    int ntags() const { return _ntags; }
+
     void print_rq_sizes(std::ostream& os);
 
     double get_cumulated_worker_time();
+    double get_cumulated_worker_time(bthread_tag_t tag);
     int64_t get_cumulated_switch_count();
     int64_t get_cumulated_signal_count();
+    // Number of futex_wake issued to wake up idle workers.
+    int64_t get_cumulated_wakeup_count();
 
-    // [Not thread safe] Add more worker threads.
+    // [Not thread safe] Add more worker threads of `tag'.
     // Return the number of workers actually added, which may be less than |num|
-    int add_workers(int num);
+    int add_workers(int num, bthread_tag_t tag);
 
-    // Choose one TaskGroup (randomly right now).
+    // Choose one TaskGroup of `tag' (randomly right now).
     // If this method is called after init(), it never returns NULL.
-    TaskGroup* choose_one_group();
+    TaskGroup* choose_one_group(bthread_tag_t tag = BTHREAD_TAG_DEFAULT);
+
+    // Start parking and resuming workers periodically according to their
+    // usage, see -bthread_elastic_workers. Only the first call matters.
+    void start_adjusting_workers();
 
 private:
+    static const int PARKING_LOT_NUM = 4;
+
+    // TaskGroups and ParkingLots of workers with a same tag. Workers only
+    // steal tasks from groups of their own tag.
+    struct TaggedGroups {
+        TaggedGroups()
+            : control(NULL), tag(BTHREAD_TAG_INVALID), ngroup(0), groups(NULL)
+            , concurrency(0), busy_rounds(0), idle_rounds(0)
+            , cumulated_worker_time(NULL)
+            , worker_usage_second(NULL), worker_count(NULL) {}
+
+        TaskControl* control;
+        bthread_tag_t tag;
+        butil::atomic<size_t> ngroup;
+        TaskGroup** groups;
+        butil::atomic<int> concurrency;
+        ParkingLot pl[PARKING_LOT_NUM];
+        // Consecutive intervals that workers are busy or idle.
+        int busy_rounds;
+        int idle_rounds;
+        // Exposed when there're more than one tag.
+        bvar::PassiveStatus<double>* cumulated_worker_time;
+        bvar::PerSecond<bvar::PassiveStatus<double> >* worker_usage_second;
+        bvar::PassiveStatus<int>* worker_count;
+    };
+
+    ParkingLot* tagged_pl(bthread_tag_t tag) { return _tagged[tag].pl; }
+    static double get_cumulated_worker_time_of_tag(void* tagged_groups);
+    static int get_concurrency_of_tag(void* tagged_groups);
+    void expose_tagged_vars(TaggedGroups* tg);
+    void hide_tagged_vars(TaggedGroups* tg);
+
+    // Create a worker pthread of `tag' and put its handle in `th'.
+    int create_worker(pthread_t* th, bthread_tag_t tag);
+
     // Add/Remove a TaskGroup.
     // Returns 0 on success, -1 otherwise.
     int _add_group(TaskGroup*);
@@ -86,33 +139,45 @@ private:
 
     static void delete_task_group(void* arg);
 
+    // Park or resume workers of `tg' according to their usage in last
+    // `elapse_ns' nanoseconds. Called by TimerThread.
+    void adjust_workers(TaggedGroups* tg, int64_t elapse_ns);
+    static void adjust_workers_periodically(void* task_control);
+
     static void* worker_thread(void* task_control);
 
     bvar::LatencyRecorder& exposed_pending_time();
     bvar::LatencyRecorder* create_exposed_pending_time();
+    bvar::LatencyRecorder& exposed_runqueue_delay();
+    bvar::LatencyRecorder* create_exposed_runqueue_delay();
 
-    butil::atomic<size_t> _ngroup;
-    TaskGroup** _groups;
+    int _ntags;
+    TaggedGroups* _tagged;
     butil::Mutex _modify_group_mutex;
 
     bool _stop;
     butil::atomic<int> _concurrency;
     std::vector<pthread_t> _workers;
 
+    butil::atomic<bool> _adjusting_workers;
+    TimerThread::TaskId _adjust_timer_id;
+    int64_t _last_adjust_ns;
+
     bvar::Adder<int64_t> _nworkers;
+    bvar::Adder<int64_t> _nparked_workers;
     butil::Mutex _pending_time_mutex;
     butil::atomic<bvar::LatencyRecorder*> _pending_time;
+    butil::atomic<bvar::LatencyRecorder*> _runqueue_delay;
     bvar::PassiveStatus<double> _cumulated_worker_time;
     bvar::PerSecond<bvar::PassiveStatus<double> > _worker_usage_second;
     bvar::PassiveStatus<int64_t> _cumulated_switch_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _switch_per_second;
     bvar::PassiveStatus<int64_t> _cumulated_signal_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _signal_per_second;
+    bvar::PassiveStatus<int64_t> _cumulated_wakeup_count;
+    bvar::PerSecond<bvar::PassiveStatus<int64_t> > _wakeup_per_second;
     bvar::PassiveStatus<std::string> _status;
     bvar::Adder<int64_t> _nbthreads;
-
-    static const int PARKING_LOT_NUM = 4;
-    ParkingLot _pl[PARKING_LOT_NUM];
 };
 
 inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
@@ -123,6 +188,14 @@ inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
     return *pt;
 }
 
+inline bvar::LatencyRecorder& TaskControl::exposed_runqueue_delay() {
+    bvar::LatencyRecorder* rd = _runqueue_delay.load(butil::memory_order_consume);
+    if (!rd) {
+        rd = create_exposed_runqueue_delay();
+    }
+    return *rd;
+}
+
 }  // namespace bthread
 
 #endif  // BTHREAD_TASK_CONTROL_H
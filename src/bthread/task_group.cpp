@@ -21,8 +21,11 @@
 
 #include <sys/types.h>
 #include <stddef.h>                         // size_t
+#include <algorithm>                        // std::push_heap
+#include <time.h>                           // clock_gettime
 #include <gflags/gflags.h>
 #include "butil/compat.h"                   // OS_MACOSX
+#include "butil/compiler_specific.h"        // BAIDU_WEAK
 #include "butil/macros.h"                   // ARRAY_SIZE
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/fast_rand.h"
@@ -32,6 +35,7 @@
 #include "bthread/butex.h"                  // butex_*
 #include "bthread/sys_futex.h"              // futex_wake_private
 #include "bthread/processor.h"              // cpu_relax
+#include "bthread/offcpu_profiler.h"        // g_ocp
 #include "bthread/task_control.h"
 #include "bthread/task_group.h"
 #include "bthread/timer_thread.h"
@@ -40,7 +44,7 @@
 namespace bthread {
 
 static const bthread_attr_t BTHREAD_ATTR_TASKGROUP = {
-    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL };
+    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL, BTHREAD_TAG_INVALID };
 
 static bool pass_bool(const char*, bool) { return true; }
 
@@ -51,12 +55,72 @@ const bool ALLOW_UNUSED dummy_show_bthread_creation_in_vars =
     ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_creation_in_vars,
                                     pass_bool);
 
+DEFINE_bool(show_bthread_runqueue_delay_in_vars, false, "When this flag is "
+            "on, the time from a bthread being put into a runqueue to being "
+            "scheduled will be recorded and shown in /vars");
+const bool ALLOW_UNUSED dummy_show_bthread_runqueue_delay_in_vars =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_runqueue_delay_in_vars,
+                                    pass_bool);
+
 DEFINE_bool(show_per_worker_usage_in_vars, false,
             "Show per-worker usage in /vars/bthread_per_worker_usage_<tid>");
 const bool ALLOW_UNUSED dummy_show_per_worker_usage_in_vars =
     ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_per_worker_usage_in_vars,
                                     pass_bool);
 
+DEFINE_int32(bthread_worker_max_spin_us, 0,
+             "Idle workers spin for at most so many microseconds before "
+             "parking if their recent idle durations are shorter than that. "
+             "Signalling spinning workers doesn't need futex_wake. "
+             "0 disables spinning");
+
+DEFINE_int64(bthread_local_timer_max_us, 1000,
+             "bthread_usleep() not longer than so many microseconds is timed "
+             "by the worker running the bthread rather than the global "
+             "TimerThread, saving a handoff between threads. The bthread may "
+             "wake up late when the worker is occupied. <= 0 to disable");
+
+// Defined in tcmalloc(gperftools/malloc_hook_c.h), NULL if not linked.
+extern "C" {
+typedef void (*MallocHook_NewHook)(const void* ptr, size_t size);
+int BAIDU_WEAK MallocHook_AddNewHook(MallocHook_NewHook hook);
+}
+
+// Bytes allocated by this pthread, counted by the tcmalloc hook.
+static __thread int64_t tls_alloc_bytes = 0;
+
+static void count_allocated_bytes(const void*, size_t size) {
+    tls_alloc_bytes += size;
+}
+
+static pthread_once_t g_add_new_hook_once = PTHREAD_ONCE_INIT;
+static void add_new_hook() {
+    if (MallocHook_AddNewHook != NULL) {
+        MallocHook_AddNewHook(count_allocated_bytes);
+    }
+}
+
+static bool validate_bthread_enable_cpu_accounting(const char*, bool val) {
+    if (val) {
+        pthread_once(&g_add_new_hook_once, add_new_hook);
+    }
+    return true;
+}
+
+DEFINE_bool(bthread_enable_cpu_accounting, false,
+            "Measure CPU time and bytes allocated(when tcmalloc is linked) of "
+            "each bthread at context switches, which costs a "
+            "clock_gettime(CLOCK_THREAD_CPUTIME_ID) per switch");
+const bool ALLOW_UNUSED dummy_bthread_enable_cpu_accounting =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_enable_cpu_accounting,
+                                    validate_bthread_enable_cpu_accounting);
+
+inline int64_t thread_cpu_clock_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
 __thread TaskGroup* tls_task_group = NULL;
 // Sync with TaskMeta::local_storage when a bthread is created or destroyed.
 // During running, the two fields may be inconsistent, use tls_bls as the
@@ -70,7 +134,7 @@ extern void return_keytable(bthread_keytable_pool_t*, KeyTable*);
 // overhead of creation keytable, may be removed later.
 BAIDU_THREAD_LOCAL void* tls_unique_user_ptr = NULL;
 
-const TaskStatistics EMPTY_STAT = { 0, 0 };
+const TaskStatistics EMPTY_STAT = { 0, 0, 0, 0 };
 
 const size_t OFFSET_TABLE[] = {
 #include "bthread/offset_inl.list"
@@ -116,13 +180,23 @@ bool TaskGroup::is_stopped(bthread_t tid) {
 }
 
 bool TaskGroup::wait_task(bthread_t* tid) {
+    const int64_t begin_ns = butil::cpuwide_time_ns();
     do {
+        if (run_local_timers(tid)) {
+            end_idle(begin_ns);
+            return true;
+        }
+        if (_park_state.load(butil::memory_order_relaxed) == PARK_REQUESTED) {
+            park_if_requested();
+        }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         if (_last_pl_state.stopped()) {
             return false;
         }
-        _pl->wait(_last_pl_state);
+        spin_parking_lot(_last_pl_state);
+        wait_parking_lot(_last_pl_state);
         if (steal_task(tid)) {
+            end_idle(begin_ns);
             return true;
         }
 #else
@@ -131,13 +205,123 @@ bool TaskGroup::wait_task(bthread_t* tid) {
             return false;
         }
         if (steal_task(tid)) {
+            end_idle(begin_ns);
             return true;
         }
-        _pl->wait(st);
+        spin_parking_lot(st);
+        wait_parking_lot(st);
 #endif
     } while (true);
 }
 
+void TaskGroup::wait_parking_lot(const ParkingLot::State& st) {
+    if (_local_timers.empty()) {
+        return _pl->wait(st);
+    }
+    const int64_t timeout_us =
+        _local_timers.front().deadline_us - butil::cpuwide_time_us();
+    if (timeout_us <= 0) {
+        return;
+    }
+    const timespec timeout = butil::microseconds_to_timespec(timeout_us);
+    _pl->wait(st, &timeout);
+}
+
+void TaskGroup::spin_parking_lot(const ParkingLot::State& st) {
+    const int64_t max_spin_ns = FLAGS_bthread_worker_max_spin_us * 1000L;
+    // Parking is cheaper when idle durations are usually longer than
+    // the spinning.
+    if (max_spin_ns <= 0 || _idle_ewma_ns > max_spin_ns) {
+        return;
+    }
+    int64_t deadline_ns = butil::cpuwide_time_ns() + max_spin_ns;
+    if (!_local_timers.empty()) {
+        deadline_ns = std::min(deadline_ns,
+                               _local_timers.front().deadline_us * 1000);
+    }
+    _pl->spin(st, deadline_ns);
+}
+
+void TaskGroup::end_idle(int64_t begin_ns) {
+    if (FLAGS_bthread_worker_max_spin_us <= 0) {
+        return;
+    }
+    // Cap the sample so that a long idle period stops spinning for just a
+    // few rounds.
+    const int64_t max_sample_ns = FLAGS_bthread_worker_max_spin_us * 2000L;
+    const int64_t idle_ns =
+        std::min(butil::cpuwide_time_ns() - begin_ns, max_sample_ns);
+    _idle_ewma_ns += (idle_ns - _idle_ewma_ns) / 8;
+}
+
+bool TaskGroup::request_park() {
+    int expected = PARK_NONE;
+    return _park_state.compare_exchange_strong(
+        expected, PARK_REQUESTED, butil::memory_order_relaxed);
+}
+
+bool TaskGroup::unpark() {
+    const int prev = _park_state.exchange(PARK_NONE, butil::memory_order_release);
+    if (prev == PARKED) {
+        futex_wake_private(&_park_state, 1);
+    }
+    return prev != PARK_NONE;
+}
+
+void TaskGroup::park_if_requested() {
+    // Tasks in _rq can only be stolen when other workers are woken up, and
+    // local timers are only run by this worker, don't park with them.
+    if (!_local_timers.empty() || _rq.volatile_size() != 0) {
+        return;
+    }
+    int expected = PARK_REQUESTED;
+    if (!_park_state.compare_exchange_strong(
+            expected, PARKED, butil::memory_order_relaxed)) {
+        return;
+    }
+    _control->_nparked_workers << 1;
+    while (_park_state.load(butil::memory_order_acquire) == PARKED) {
+        futex_wait_private(&_park_state, PARKED, NULL);
+    }
+    _control->_nparked_workers << -1;
+}
+
+bool TaskGroup::run_local_timers(bthread_t* tid) {
+    if (_local_timers.empty()) {
+        return false;
+    }
+    const int64_t now_us = butil::cpuwide_time_us();
+    bthread_t first = 0;
+    while (!_local_timers.empty() &&
+           _local_timers.front().deadline_us <= now_us) {
+        const LocalTimer t = _local_timers.front();
+        std::pop_heap(_local_timers.begin(), _local_timers.end());
+        _local_timers.pop_back();
+        TaskMeta* m = address_meta(t.tid);
+        uint64_t expected = t.token;
+        if (m == NULL ||
+            !m->local_sleep.compare_exchange_strong(expected, 0)) {
+            // Interrupted and scheduled by the interrupter.
+            continue;
+        }
+        if (first == 0) {
+            first = t.tid;
+        } else {
+            ready_to_run(t.tid);
+        }
+    }
+    if (first == 0) {
+        return false;
+    }
+    if (tid != NULL) {
+        *tid = first;
+    } else {
+        // Pushed last without signalling, popped by this worker next.
+        push_rq(first);
+    }
+    return true;
+}
+
 static double get_cumulated_cputime_from_this(void* arg) {
     return static_cast<TaskGroup*>(arg)->cumulated_cputime_ns() / 1000000000.0;
 }
@@ -173,17 +357,20 @@ void TaskGroup::run_main_task() {
     current_task()->stat.cputime_ns += butil::cpuwide_time_ns() - _last_run_ns;
 }
 
-TaskGroup::TaskGroup(TaskControl* c)
+TaskGroup::TaskGroup(TaskControl* c, bthread_tag_t tag)
     :
 #ifndef NDEBUG
     _sched_recursive_guard(0),
 #endif
     _cur_meta(NULL)
     , _control(c)
+    , _tag(tag)
     , _num_nosignal(0)
     , _nsignaled(0)
     , _last_run_ns(butil::cpuwide_time_ns())
     , _cumulated_cputime_ns(0)
+    , _last_cpu_clock_ns(0)
+    , _last_alloc_bytes(0)
     , _nswitch(0)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
@@ -192,10 +379,15 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _main_tid(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
+    , _idle_ewma_ns(0)
+    , _park_state(PARK_NONE)
+    , _last_sampled_cputime_ns(0)
 {
     _steal_seed = butil::fast_rand();
+    _local_sleep_seq = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
-    _pl = &c->_pl[butil::fmix64(pthread_numeric_id()) % TaskControl::PARKING_LOT_NUM];
+    _pl = &c->tagged_pl(tag)[butil::fmix64(pthread_numeric_id()) %
+                             TaskControl::PARKING_LOT_NUM];
     CHECK(c);
 }
 
@@ -223,6 +415,20 @@ int TaskGroup::init(size_t runqueue_capacity) {
         LOG(FATAL) << "Fail to get main stack container";
         return -1;
     }
+#if defined(OS_LINUX)
+    // Record bounds of the pthread stack running the main task so that
+    // stack walkers (e.g. the continuous profiler) can check frames.
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void* stack_addr = NULL;
+        size_t stack_size = 0;
+        if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+            stk->storage.bottom = (char*)stack_addr + stack_size;
+            stk->storage.stacksize = (int)stack_size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+#endif
     butil::ResourceId<TaskMeta> slot;
     TaskMeta* m = butil::get_resource<TaskMeta>(&slot);
     if (NULL == m) {
@@ -238,6 +444,7 @@ int TaskGroup::init(size_t runqueue_capacity) {
     m->cpuwide_start_ns = butil::cpuwide_time_ns();
     m->stat = EMPTY_STAT;
     m->attr = BTHREAD_ATTR_TASKGROUP;
+    m->attr.tag = _tag;
     m->tid = make_tid(*m->version_butex, slot);
     m->set_stack(stk);
 
@@ -378,6 +585,7 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    m->attr.tag = (*pg)->_tag;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
@@ -433,6 +641,7 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    m->attr.tag = _tag;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
@@ -508,6 +717,8 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
+    // Busy workers don't call wait_task(), check expired local timers here.
+    g->run_local_timers(NULL);
 #ifndef BTHREAD_FAIR_WSQ
     // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
     // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
@@ -549,6 +760,7 @@ void TaskGroup::sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
+    g->run_local_timers(NULL);
 #ifndef BTHREAD_FAIR_WSQ
     const bool popped = g->_rq.pop(&next_tid);
 #else
@@ -583,6 +795,24 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
     }
     ++cur_meta->stat.nswitch;
     ++ g->_nswitch;
+    if (FLAGS_bthread_enable_cpu_accounting) {
+        g->account_cpu(cur_meta);
+    } else if (g->_last_cpu_clock_ns != 0) {
+        // Account the last slice so that clocks read by
+        // current_cpu_clock_ns() never go backwards.
+        g->account_cpu(cur_meta);
+        g->_last_cpu_clock_ns = 0;
+    }
+    if (next_meta->ready_ns != 0) {
+        next_meta->runqueue_delay_ns = now - next_meta->ready_ns;
+        next_meta->ready_ns = 0;
+        if (FLAGS_show_bthread_runqueue_delay_in_vars) {
+            g->_control->exposed_runqueue_delay() <<
+                next_meta->runqueue_delay_ns / 1000L;
+        }
+    } else {
+        next_meta->runqueue_delay_ns = 0;
+    }
     // Switch to the task
     if (__builtin_expect(next_meta != cur_meta, 1)) {
         g->_cur_meta = next_meta;
@@ -634,6 +864,28 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
     *pg = g;
 }
 
+void TaskGroup::account_cpu(TaskMeta* cur_meta) {
+    const int64_t now = thread_cpu_clock_ns();
+    // _last_cpu_clock_ns is 0 when accounting was just turned on.
+    if (_last_cpu_clock_ns != 0) {
+        cur_meta->stat.cpu_clock_ns += now - _last_cpu_clock_ns;
+        cur_meta->stat.alloc_bytes += tls_alloc_bytes - _last_alloc_bytes;
+    }
+    _last_cpu_clock_ns = now;
+    _last_alloc_bytes = tls_alloc_bytes;
+}
+
+int64_t TaskGroup::current_cpu_clock_ns(int64_t* alloc_bytes) const {
+    if (_last_cpu_clock_ns == 0) {
+        *alloc_bytes = _cur_meta->stat.alloc_bytes;
+        return _cur_meta->stat.cpu_clock_ns;
+    }
+    *alloc_bytes = _cur_meta->stat.alloc_bytes +
+        tls_alloc_bytes - _last_alloc_bytes;
+    return _cur_meta->stat.cpu_clock_ns +
+        thread_cpu_clock_ns() - _last_cpu_clock_ns;
+}
+
 void TaskGroup::destroy_self() {
     if (_control) {
         _control->_destroy_group(this);
@@ -643,7 +895,16 @@ void TaskGroup::destroy_self() {
     }
 }
 
+// Remember when the task is put into a runqueue, to measure how long it
+// waits there before being scheduled.
+inline void mark_ready(bthread_t tid) {
+    if (FLAGS_show_bthread_runqueue_delay_in_vars || g_ocp != NULL) {
+        TaskGroup::address_meta(tid)->ready_ns = butil::cpuwide_time_ns();
+    }
+}
+
 void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
+    mark_ready(tid);
     push_rq(tid);
     if (nosignal) {
         ++_num_nosignal;
@@ -651,7 +912,7 @@ void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
         const int additional_signal = _num_nosignal;
         _num_nosignal = 0;
         _nsignaled += 1 + additional_signal;
-        _control->signal_task(1 + additional_signal);
+        _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
@@ -660,11 +921,12 @@ void TaskGroup::flush_nosignal_tasks() {
     if (val) {
         _num_nosignal = 0;
         _nsignaled += val;
-        _control->signal_task(val);
+        _control->signal_task(val, _tag);
     }
 }
 
 void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
+    mark_ready(tid);
     _remote_rq._mutex.lock();
     while (!_remote_rq.push_locked(tid)) {
         flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
@@ -681,7 +943,7 @@ void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
         _remote_num_nosignal = 0;
         _remote_nsignaled += 1 + additional_signal;
         _remote_rq._mutex.unlock();
-        _control->signal_task(1 + additional_signal);
+        _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
@@ -694,7 +956,7 @@ void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
     _remote_num_nosignal = 0;
     _remote_nsignaled += val;
     locked_mutex.unlock();
-    _control->signal_task(val);
+    _control->signal_task(val, _tag);
 }
 
 void TaskGroup::ready_to_run_general(bthread_t tid, bool nosignal) {
@@ -711,6 +973,34 @@ void TaskGroup::flush_nosignal_tasks_general() {
     return flush_nosignal_tasks_remote();
 }
 
+void TaskGroup::ready_to_run_batch_general(const bthread_t* tids, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (tls_task_group == this) {
+        // The worker pops the local runqueue from the end, push reversely.
+        for (size_t i = n; i > 0; --i) {
+            ready_to_run(tids[i - 1], true);
+        }
+        return flush_nosignal_tasks();
+    }
+    for (size_t i = 0; i < n; ++i) {
+        mark_ready(tids[i]);
+    }
+    _remote_rq._mutex.lock();
+    for (size_t i = 0; i < n; ++i) {
+        while (!_remote_rq.push_locked(tids[i])) {
+            flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+            LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
+                                    << _remote_rq.capacity();
+            ::usleep(1000);
+            _remote_rq._mutex.lock();
+        }
+        ++_remote_num_nosignal;
+    }
+    flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+}
+
 void TaskGroup::ready_to_run_in_worker(void* args_in) {
     ReadyToRunArgs* args = static_cast<ReadyToRunArgs*>(args_in);
     return tls_task_group->ready_to_run(args->tid, args->nosignal);
@@ -718,6 +1008,7 @@ void TaskGroup::ready_to_run_in_worker(void* args_in) {
 
 void TaskGroup::ready_to_run_in_worker_ignoresignal(void* args_in) {
     ReadyToRunArgs* args = static_cast<ReadyToRunArgs*>(args_in);
+    mark_ready(args->tid);
     return tls_task_group->push_rq(args->tid);
 }
 
@@ -731,7 +1022,8 @@ struct SleepArgs {
 static void ready_to_run_from_timer_thread(void* arg) {
     CHECK(tls_task_group == NULL);
     const SleepArgs* e = static_cast<const SleepArgs*>(arg);
-    e->group->control()->choose_one_group()->ready_to_run_remote(e->tid);
+    TaskGroup* g = e->group;
+    g->control()->choose_one_group(g->tag())->ready_to_run_remote(e->tid);
 }
 
 void TaskGroup::_add_sleep_event(void* void_args) {
@@ -741,6 +1033,10 @@ void TaskGroup::_add_sleep_event(void* void_args) {
     SleepArgs e = *static_cast<SleepArgs*>(void_args);
     TaskGroup* g = e.group;
 
+    if ((int64_t)e.timeout_us <= FLAGS_bthread_local_timer_max_us) {
+        return g->add_local_sleep(e.tid, e.meta, e.timeout_us);
+    }
+
     TimerThread::TaskId sleep_id;
     sleep_id = get_global_timer_thread()->schedule(
         ready_to_run_from_timer_thread, void_args,
@@ -776,6 +1072,29 @@ void TaskGroup::_add_sleep_event(void* void_args) {
     }
 }
 
+void TaskGroup::add_local_sleep(bthread_t tid, TaskMeta* meta,
+                                uint64_t timeout_us) {
+    uint64_t token = ++_local_sleep_seq;
+    if (token == 0) {
+        token = ++_local_sleep_seq;
+    }
+    // Set TaskMeta::local_sleep which is for interruption. The timer is
+    // pushed even if the thread is interrupted before we push it, the
+    // stale timer does nothing because the token was consumed.
+    const uint32_t given_ver = get_version(tid);
+    {
+        BAIDU_SCOPED_LOCK(meta->version_lock);
+        if (given_ver != *meta->version_butex || meta->interrupted) {
+            return ready_to_run(tid);
+        }
+        meta->local_sleep.store(token, butil::memory_order_relaxed);
+    }
+    const LocalTimer t = { butil::cpuwide_time_us() + (int64_t)timeout_us,
+                           tid, token };
+    _local_timers.push_back(t);
+    std::push_heap(_local_timers.begin(), _local_timers.end());
+}
+
 // To be consistent with sys_usleep, set errno and return -1 on error.
 int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     if (0 == timeout_us) {
@@ -808,7 +1127,8 @@ int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
 bool erase_from_butex_because_of_interruption(ButexWaiter* bw);
 
 static int interrupt_and_consume_waiters(
-    bthread_t tid, ButexWaiter** pw, uint64_t* sleep_id) {
+    bthread_t tid, ButexWaiter** pw, uint64_t* sleep_id, bool* local_sleep,
+    bthread_tag_t* tag) {
     TaskMeta* const m = TaskGroup::address_meta(tid);
     if (m == NULL) {
         return EINVAL;
@@ -819,6 +1139,10 @@ static int interrupt_and_consume_waiters(
         *pw = m->current_waiter.exchange(NULL, butil::memory_order_acquire);
         *sleep_id = m->current_sleep;
         m->current_sleep = 0;  // only one stopper gets the sleep_id
+        // Races with the worker timing the sleep, only one of them gets
+        // the token.
+        *local_sleep = (m->local_sleep.exchange(0) != 0);
+        *tag = m->attr.tag;
         m->interrupted = true;
         return 0;
     }
@@ -850,12 +1174,16 @@ int TaskGroup::interrupt(bthread_t tid, TaskControl* c) {
     // Consume current_waiter in the TaskMeta, wake it up then set it back.
     ButexWaiter* w = NULL;
     uint64_t sleep_id = 0;
-    int rc = interrupt_and_consume_waiters(tid, &w, &sleep_id);
+    bool local_sleep = false;
+    bthread_tag_t tag = BTHREAD_TAG_DEFAULT;
+    int rc = interrupt_and_consume_waiters(tid, &w, &sleep_id, &local_sleep,
+                                           &tag);
     if (rc) {
         return rc;
     }
     // a bthread cannot wait on a butex and be sleepy at the same time.
     CHECK(!sleep_id || !w);
+    CHECK(!local_sleep || (!sleep_id && !w));
     if (w != NULL) {
         erase_from_butex_because_of_interruption(w);
         // If butex_wait() already wakes up before we set current_waiter back,
@@ -865,16 +1193,17 @@ int TaskGroup::interrupt(bthread_t tid, TaskControl* c) {
             LOG(FATAL) << "butex_wait should spin until setting back waiter";
             return rc;
         }
-    } else if (sleep_id != 0) {
-        if (get_global_timer_thread()->unschedule(sleep_id) == 0) {
+    } else if (sleep_id != 0 || local_sleep) {
+        if (local_sleep ||
+            get_global_timer_thread()->unschedule(sleep_id) == 0) {
             bthread::TaskGroup* g = bthread::tls_task_group;
-            if (g) {
+            if (g && g->tag() == tag) {
                 g->ready_to_run(tid);
             } else {
                 if (!c) {
                     return EINVAL;
                 }
-                c->choose_one_group()->ready_to_run_remote(tid);
+                c->choose_one_group(tag)->ready_to_run_remote(tid);
             }
         }
     }
@@ -904,7 +1233,7 @@ void print_task(std::ostream& os, bthread_t tid) {
     bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
     bool has_tls = false;
     int64_t cpuwide_start_ns = 0;
-    TaskStatistics stat = {0, 0};
+    TaskStatistics stat = {0, 0, 0, 0};
     {
         BAIDU_SCOPED_LOCK(m->version_lock);
         if (given_ver == *m->version_butex) {
@@ -935,6 +1264,10 @@ void print_task(std::ostream& os, bthread_t tid) {
            << "\nuptime_ns=" << butil::cpuwide_time_ns() - cpuwide_start_ns
            << "\ncputime_ns=" << stat.cputime_ns
            << "\nnswitch=" << stat.nswitch;
+        if (FLAGS_bthread_enable_cpu_accounting) {
+            os << "\ncpu_clock_ns=" << stat.cpu_clock_ns
+               << "\nalloc_bytes=" << stat.alloc_bytes;
+        }
     }
 }
 
@@ -22,6 +22,7 @@
 #ifndef BTHREAD_TASK_GROUP_H
 #define BTHREAD_TASK_GROUP_H
 
+#include <vector>
 #include "butil/time.h"                             // cpuwide_time_ns
 #include "bthread/task_control.h"
 #include "bthread/task_meta.h"                     // bthread_t, TaskMeta
@@ -146,10 +147,18 @@ public:
     // True iff current task is in pthread-mode.
     bool is_current_pthread_task() const
     { return _cur_meta->stack == _main_stack; }
+    // Stack of the pthread running the main task, storage is zeroized if
+    // bounds of the pthread stack are unknown.
+    const ContextualStack* main_stack() const { return _main_stack; }
 
     // Active time in nanoseconds spent by this TaskGroup.
     int64_t cumulated_cputime_ns() const { return _cumulated_cputime_ns; }
 
+    // CPU time in nanoseconds consumed by current task, including the
+    // running slice. Bytes allocated are stored in *alloc_bytes.
+    // Zero if -bthread_enable_cpu_accounting was never on.
+    int64_t current_cpu_clock_ns(int64_t* alloc_bytes) const;
+
     // Push a bthread into the runqueue
     void ready_to_run(bthread_t tid, bool nosignal = false);
     // Flush tasks pushed to rq but signalled.
@@ -165,9 +174,17 @@ public:
     void ready_to_run_general(bthread_t tid, bool nosignal = false);
     void flush_nosignal_tasks_general();
 
+    // Push `n' bthreads into the runqueue and signal workers once. Called
+    // from other threads, the remote runqueue is locked only once as well.
+    // The bthreads are run in the order of `tids' by the worker.
+    void ready_to_run_batch_general(const bthread_t* tids, size_t n);
+
     // The TaskControl that this TaskGroup belongs to.
     TaskControl* control() const { return _control; }
 
+    // Tag of the workers that this TaskGroup belongs to.
+    bthread_tag_t tag() const { return _tag; }
+
     // Call this instead of delete.
     void destroy_self();
 
@@ -183,10 +200,13 @@ public:
     void push_rq(bthread_t tid);
 
 private:
+    // Add CPU time and allocated bytes since last scheduling to `cur_meta'.
+    void account_cpu(TaskMeta* cur_meta);
+
 friend class TaskControl;
 
     // You shall use TaskControl::create_group to create new instance.
-    explicit TaskGroup(TaskControl*);
+    TaskGroup(TaskControl*, bthread_tag_t tag);
 
     int init(size_t runqueue_capacity);
 
@@ -199,6 +219,32 @@ friend class TaskControl;
     // Callbacks for set_remained()
     static void _release_last_context(void*);
     static void _add_sleep_event(void*);
+    // Time the sleep of `tid' by the heap of this worker.
+    void add_local_sleep(bthread_t tid, TaskMeta* meta, uint64_t timeout_us);
+    // Wake up bthreads whose worker-local timers expired. The first woken
+    // bthread is stored in `tid' if it's not NULL, otherwise it's pushed
+    // into _rq to be run next.
+    // Returns true if any bthread is woken up.
+    bool run_local_timers(bthread_t* tid);
+    // Park on _pl until the state changes or the earliest local timer expires.
+    void wait_parking_lot(const ParkingLot::State& st);
+    // Spin on _pl before parking if recent idle durations are short, see
+    // -bthread_worker_max_spin_us.
+    void spin_parking_lot(const ParkingLot::State& st);
+    // Update _idle_ewma_ns with the idle duration since `begin_ns'.
+    void end_idle(int64_t begin_ns);
+
+    // Parking of idle workers, see -bthread_elastic_workers.
+    enum ParkState { PARK_NONE = 0, PARK_REQUESTED = 1, PARKED = 2 };
+    // Ask this worker to park when it becomes idle.
+    // Returns false if the worker was already asked or parked.
+    bool request_park();
+    // Cancel the request or resume the parked worker.
+    // Returns true if the worker was parked or asked to.
+    bool unpark();
+    // Called by the worker in wait_task(). Blocks until unpark() if the
+    // worker was asked to park and has no pending tasks or local timers.
+    void park_if_requested();
     struct ReadyToRunArgs {
         bthread_t tid;
         bool nosignal;
@@ -218,7 +264,7 @@ friend class TaskControl;
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        return _control->steal_task(tid, &_steal_seed, _steal_offset, _tag);
     }
 
 #ifndef NDEBUG
@@ -229,11 +275,16 @@ friend class TaskControl;
     
     // the control that this group belongs to
     TaskControl* _control;
+    bthread_tag_t _tag;
     int _num_nosignal;
     int _nsignaled;
     // last scheduling time
     int64_t _last_run_ns;
     int64_t _cumulated_cputime_ns;
+    // thread CPU clock and allocated bytes of the worker at last
+    // scheduling, 0 if -bthread_enable_cpu_accounting is off.
+    int64_t _last_cpu_clock_ns;
+    int64_t _last_alloc_bytes;
 
     size_t _nswitch;
     RemainedFn _last_context_remained;
@@ -251,6 +302,27 @@ friend class TaskControl;
     RemoteTaskQueue _remote_rq;
     int _remote_num_nosignal;
     int _remote_nsignaled;
+
+    // Min-heap of short sleeps timed by this worker, see add_local_sleep().
+    struct LocalTimer {
+        int64_t deadline_us;  // in butil::cpuwide_time_us()
+        bthread_t tid;
+        uint64_t token;
+        bool operator<(const LocalTimer& rhs) const {
+            return deadline_us > rhs.deadline_us;
+        }
+    };
+    std::vector<LocalTimer> _local_timers;
+    uint64_t _local_sleep_seq;
+
+    // EWMA of durations that this worker waited for tasks.
+    int64_t _idle_ewma_ns;
+
+    // Futex of ParkState. Parked workers don't wait on _pl and are not
+    // woken up by signal_task(), tasks in their _remote_rq are stolen.
+    butil::atomic<int> _park_state;
+    // Accessed by TaskControl::adjust_workers() only.
+    int64_t _last_sampled_cputime_ns;
 };
 
 }  // namespace bthread
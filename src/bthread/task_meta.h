@@ -33,6 +33,12 @@ namespace bthread {
 struct TaskStatistics {
     int64_t cputime_ns;
     int64_t nswitch;
+    // Measured only when -bthread_enable_cpu_accounting is on.
+    // Thread CPU time(CLOCK_THREAD_CPUTIME_ID) consumed by the task, unlike
+    // cputime_ns, preemptions by the OS are excluded.
+    int64_t cpu_clock_ns;
+    // Bytes allocated by the task, non-zero only when tcmalloc is linked.
+    int64_t alloc_bytes;
 };
 
 class KeyTable;
@@ -42,9 +48,11 @@ struct LocalStorage {
     KeyTable* keytable;
     void* assigned_data;
     void* rpcz_parent_span;
+    // Attached to samples of profilers, e.g. the RPC method being processed.
+    const char* profiling_label;
 };
 
-#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL }
+#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL, NULL }
 
 const static LocalStorage LOCAL_STORAGE_INIT = BTHREAD_LOCAL_STORAGE_INITIALIZER;
 
@@ -52,6 +60,10 @@ struct TaskMeta {
     // [Not Reset]
     butil::atomic<ButexWaiter*> current_waiter;
     uint64_t current_sleep;
+    // [Not Reset] token of the worker-local timer when the thread is
+    // sleeping in a worker, 0 otherwise. The one who changes it to 0 wakes
+    // up the thread.
+    butil::atomic<uint64_t> local_sleep;
 
     // A builtin flag to mark if the thread is stopping.
     bool stop;
@@ -86,6 +98,13 @@ struct TaskMeta {
     int64_t cpuwide_start_ns;
     TaskStatistics stat;
 
+    // [Not Reset] cpuwide time when the task was put into a runqueue, 0 if
+    // the task is not in a runqueue or the time is not measured.
+    int64_t ready_ns;
+    // [Not Reset] time the task spent in a runqueue before the last
+    // scheduling, 0 if not measured.
+    int64_t runqueue_delay_ns;
+
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
     // when the bthread is created or destroyed.
     // DO NOT use this field directly, use tls_bls instead.
@@ -97,7 +116,10 @@ public:
     TaskMeta()
         : current_waiter(NULL)
         , current_sleep(0)
-        , stack(NULL) {
+        , local_sleep(0)
+        , stack(NULL)
+        , ready_ns(0)
+        , runqueue_delay_ns(0) {
         pthread_spin_init(&version_lock, 0);
         version_butex = butex_create_checked<uint32_t>();
         *version_butex = 1;
@@ -46,6 +46,13 @@ static const bthread_attrflags_t BTHREAD_LOG_START_AND_FINISH = 8;
 static const bthread_attrflags_t BTHREAD_LOG_CONTEXT_SWITCH = 16;
 static const bthread_attrflags_t BTHREAD_NOSIGNAL = 32;
 
+// Tag of a group of workers. Workers are evenly divided into
+// -task_group_ntags tags, bthreads of a tag run and steal tasks only in
+// workers of the tag so that tags don't starve each other.
+typedef int bthread_tag_t;
+static const bthread_tag_t BTHREAD_TAG_INVALID = -1;
+static const bthread_tag_t BTHREAD_TAG_DEFAULT = 0;
+
 // Key of thread-local data, created by bthread_key_create.
 typedef struct {
     uint32_t index;    // index in KeyTable
@@ -91,12 +98,17 @@ typedef struct bthread_attr_t {
     bthread_stacktype_t stack_type;
     bthread_attrflags_t flags;
     bthread_keytable_pool_t* keytable_pool;
+    // Run the bthread in workers of this tag. BTHREAD_TAG_INVALID means the
+    // tag of the creating worker, or BTHREAD_TAG_DEFAULT when the creator
+    // is not a worker.
+    bthread_tag_t tag;
 
 #if defined(__cplusplus)
     void operator=(unsigned stacktype_and_flags) {
         stack_type = (stacktype_and_flags & 7);
         flags = (stacktype_and_flags & ~(unsigned)7u);
         keytable_pool = NULL;
+        tag = BTHREAD_TAG_INVALID;
     }
     bthread_attr_t operator|(unsigned other_flags) const {
         CHECK(!(other_flags & 7)) << "flags=" << other_flags;
@@ -114,23 +126,24 @@ typedef struct bthread_attr_t {
 // obvious drawback is that you need more worker pthreads when you have a lot
 // of such bthreads.
 static const bthread_attr_t BTHREAD_ATTR_PTHREAD =
-{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL };
+{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL, BTHREAD_TAG_INVALID };
 
 // bthreads created with following attributes will have different size of
 // stacks. Default is BTHREAD_ATTR_NORMAL.
 static const bthread_attr_t BTHREAD_ATTR_SMALL =
-{ BTHREAD_STACKTYPE_SMALL, 0, NULL };
+{ BTHREAD_STACKTYPE_SMALL, 0, NULL, BTHREAD_TAG_INVALID };
 static const bthread_attr_t BTHREAD_ATTR_NORMAL =
-{ BTHREAD_STACKTYPE_NORMAL, 0, NULL };
+{ BTHREAD_STACKTYPE_NORMAL, 0, NULL, BTHREAD_TAG_INVALID };
 static const bthread_attr_t BTHREAD_ATTR_LARGE =
-{ BTHREAD_STACKTYPE_LARGE, 0, NULL };
+{ BTHREAD_STACKTYPE_LARGE, 0, NULL, BTHREAD_TAG_INVALID };
 
 // bthreads created with this attribute will print log when it's started,
 // context-switched, finished.
 static const bthread_attr_t BTHREAD_ATTR_DEBUG = {
     BTHREAD_STACKTYPE_NORMAL,
     BTHREAD_LOG_START_AND_FINISH | BTHREAD_LOG_CONTEXT_SWITCH,
-    NULL
+    NULL,
+    BTHREAD_TAG_INVALID
 };
 
 static const size_t BTHREAD_EPOLL_THREAD_NUM = 1;
@@ -173,9 +186,32 @@ typedef struct {
 } bthread_condattr_t;
 
 typedef struct {
+    // butex: whether a writer is waiting or holding the lock and number of
+    // readers holding the lock.
+    unsigned* state;
+    // butex: incremented each time a writer releases the lock, readers
+    // blocked by the writer wait on this.
+    unsigned* writer_seq;
+    // Serializes writers.
+    bthread_mutex_t writer_mutex;
+    // Distributed reader counters, NULL unless the lock is created with
+    // BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP.
+    void* reader_slots;
 } bthread_rwlock_t;
 
+// Kinds of bthread_rwlock_t, set by bthread_rwlockattr_setkind_np().
+// Writers are always preferred: new readers are blocked once a writer
+// starts waiting.
+// Readers modify a shared counter, which is suitable for most cases.
+static const int BTHREAD_RWLOCK_PREFER_WRITER_NP = 0;
+// Each reader modifies one of several counters on separate cachelines, so
+// that readers on different workers do not contend on a same cacheline,
+// at the cost of a slower writer which has to check all counters.
+// Suitable for read-mostly data, e.g. configurations and route tables.
+static const int BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP = 1;
+
 typedef struct {
+    int kind;
 } bthread_rwlockattr_t;
 
 typedef struct {
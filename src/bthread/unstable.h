@@ -43,6 +43,12 @@ extern void bthread_flush();
 // worker pthreads are not notified.
 extern int bthread_about_to_quit();
 
+// Get CPU time in nanoseconds consumed by the calling bthread so far, and
+// bytes allocated by it when tcmalloc is linked. Both are measured only
+// when -bthread_enable_cpu_accounting is on. NULL arguments are ignored.
+// Returns 0 on success, EPERM if the caller is not run by a bthread worker.
+extern int bthread_get_cpu_usage(int64_t* cpu_clock_ns, int64_t* alloc_bytes);
+
 // Run `on_timer(arg)' at or after real-time `abstime'. Put identifier of the
 // timer into *id.
 // Return 0 on success, errno otherwise.
@@ -0,0 +1,133 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <math.h>                       // ceil
+#include <limits>                       // std::numeric_limits
+#include <gflags/gflags_declare.h>
+#include "butil/logging.h"
+#include "bvar/detail/histogram.h"
+
+namespace bvar {
+
+DECLARE_int32(bvar_dump_interval);
+
+namespace detail {
+
+const int HistogramBuckets::SUB_BUCKET_BITS;
+const uint32_t HistogramBuckets::SUB_BUCKET_COUNT;
+const uint32_t HistogramBuckets::SUB_BUCKET_HALF;
+const size_t HistogramBuckets::NUM_BUCKETS;
+
+uint32_t HistogramBuckets::get_number(double ratio) const {
+    uint64_t n = (uint64_t)ceil(ratio * _count);
+    if (n > _count) {
+        n = _count;
+    } else if (n == 0) {
+        return 0;
+    }
+    uint64_t accumulated = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        const uint64_t c = _counts[i];
+        if (accumulated + c < n) {
+            accumulated += c;
+            continue;
+        }
+        const uint32_t lower = lower_bound(i);
+        return lower + (uint32_t)((upper_bound(i) - lower) *
+                                  (double)(n - accumulated) / c);
+    }
+    CHECK(false) << "Can't reach here";
+    return std::numeric_limits<uint32_t>::max();
+}
+
+void HistogramBuckets::describe(std::ostream& os) const {
+    os << "count=" << _count << " sum=" << _sum;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        if (_counts[i]) {
+            os << ' ' << upper_bound(i) << ':' << _counts[i];
+        }
+    }
+}
+
+struct AddToHistogram {
+    void operator()(HistogramBuckets& b, uint32_t latency) const {
+        b.add(latency);
+    }
+};
+
+Histogram::Histogram() : _combiner(NULL), _sampler(NULL) {
+    _combiner = new combiner_type;
+}
+
+Histogram::~Histogram() {
+    // Have to destroy sampler first to avoid the race between destruction and
+    // sampler
+    if (_sampler != NULL) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+    delete _combiner;
+}
+
+Histogram::value_type Histogram::reset() {
+    return _combiner->reset_all_agents();
+}
+
+Histogram::value_type Histogram::get_value() const {
+    return _combiner->combine_agents();
+}
+
+Histogram& Histogram::operator<<(int64_t latency) {
+    agent_type* agent = _combiner->get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        LOG(FATAL) << "Fail to create agent";
+        return *this;
+    }
+    if (latency < 0) {
+        if (!_debug_name.empty()) {
+            LOG(WARNING) << "Input=" << latency << " to `" << _debug_name
+                       << "' is negative, drop";
+        } else {
+            LOG(WARNING) << "Input=" << latency << " to Histogram("
+                       << (void*)this << ") is negative, drop";
+        }
+        return *this;
+    }
+    // Overflowed values are counted in the last bucket, as in Percentile.
+    if (latency > std::numeric_limits<uint32_t>::max()) {
+        latency = std::numeric_limits<uint32_t>::max();
+    }
+    agent->element.modify(AddToHistogram(), (uint32_t)latency);
+    return *this;
+}
+
+HistogramWindow::HistogramWindow(Histogram* h, time_t window_size)
+    : _window_size(window_size > 0 ? window_size : FLAGS_bvar_dump_interval)
+    , _sampler(h->get_sampler()) {
+    CHECK_EQ(0, _sampler->set_window_size(_window_size));
+}
+
+HistogramBuckets HistogramWindow::get_value() const {
+    Sample<HistogramBuckets> tmp;
+    if (_sampler->get_value(_window_size, &tmp)) {
+        return tmp.data;
+    }
+    return HistogramBuckets();
+}
+
+}  // namespace detail
+}  // namespace bvar
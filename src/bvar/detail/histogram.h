@@ -0,0 +1,218 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_DETAIL_HISTOGRAM_H
+#define  BVAR_DETAIL_HISTOGRAM_H
+
+#include <string.h>                     // memset
+#include <stdint.h>                     // uint32_t
+#include <ostream>                      // std::ostream
+#include "butil/macros.h"
+#include "bvar/detail/combiner.h"       // AgentCombiner
+#include "bvar/detail/sampler.h"        // ReducerSampler
+
+namespace bvar {
+namespace detail {
+
+// Counts of latencies in log-linear buckets(as in HdrHistogram): values
+// below SUB_BUCKET_COUNT have their own buckets, each power-of-2 range
+// above is split into SUB_BUCKET_COUNT/2 equal-width buckets, so the width
+// of a bucket is at most 1/16 of its lower bound. Boundaries are fixed,
+// thus histograms from different threads, seconds or processes are merged
+// or subtracted exactly by adding or subtracting counts.
+class HistogramBuckets {
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const uint32_t SUB_BUCKET_COUNT = (1 << SUB_BUCKET_BITS);
+    static const uint32_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    // Covering all uint32_t.
+    static const size_t NUM_BUCKETS =
+        SUB_BUCKET_COUNT + (32 - SUB_BUCKET_BITS) * SUB_BUCKET_HALF;
+
+    HistogramBuckets() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    // Index of the bucket containing `value'.
+    static size_t index_of(uint32_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return value;
+        }
+        const int shift = 31 - __builtin_clz(value) - SUB_BUCKET_BITS + 1;
+        return SUB_BUCKET_COUNT + (shift - 1) * SUB_BUCKET_HALF
+            + ((value >> shift) - SUB_BUCKET_HALF);
+    }
+    // Min value in the bucket at `index'.
+    static uint32_t lower_bound(size_t index) {
+        if (index < SUB_BUCKET_COUNT) {
+            return index;
+        }
+        index -= SUB_BUCKET_COUNT;
+        const int shift = index / SUB_BUCKET_HALF + 1;
+        return (uint32_t)(index % SUB_BUCKET_HALF + SUB_BUCKET_HALF) << shift;
+    }
+    // Max value in the bucket at `index'.
+    static uint32_t upper_bound(size_t index) {
+        if (index < SUB_BUCKET_COUNT) {
+            return index;
+        }
+        const int shift = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_HALF + 1;
+        return lower_bound(index) + ((1U << shift) - 1);
+    }
+
+    void add(uint32_t value) {
+        ++_counts[index_of(value)];
+        ++_count;
+        _sum += value;
+    }
+
+    void merge(const HistogramBuckets& rhs) {
+        if (rhs._count == 0) {
+            return;
+        }
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            _counts[i] += rhs._counts[i];
+        }
+        _count += rhs._count;
+        _sum += rhs._sum;
+    }
+
+    void subtract(const HistogramBuckets& rhs) {
+        if (rhs._count == 0) {
+            return;
+        }
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            _counts[i] -= rhs._counts[i];
+        }
+        _count -= rhs._count;
+        _sum -= rhs._sum;
+    }
+
+    // Get the `ratio'-ile value. E.g. 0.99 means 99%-ile value. The value
+    // is interpolated linearly inside the bucket.
+    uint32_t get_number(double ratio) const;
+
+    // Number of added values.
+    uint64_t count() const { return _count; }
+    // Sum of added values.
+    uint64_t sum() const { return _sum; }
+    // Number of values in the bucket at `index'.
+    uint64_t count_at(size_t index) const { return _counts[index]; }
+
+    // Print count, sum and non-empty buckets in form of
+    // "count=N sum=S upper_bound:count upper_bound:count ...".
+    void describe(std::ostream& os) const;
+
+private:
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _counts[NUM_BUCKETS];
+};
+
+inline std::ostream& operator<<(std::ostream& os, const HistogramBuckets& b) {
+    b.describe(os);
+    return os;
+}
+
+// A specialized reducer counting latencies in HistogramBuckets. Each thread
+// adds into its own buckets without contention. Unlike Percentile, values
+// are never sampled away and buckets are subtractable, so that windows over
+// this reducer and percentiles from it are exact up to width of a bucket.
+// NOTE: DON'T use it directly, use LatencyRecorder instead.
+class Histogram {
+public:
+    struct AddHistogramBuckets {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const {
+            b1.merge(b2);
+        }
+    };
+    struct MinusHistogramBuckets {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const {
+            b1.subtract(b2);
+        }
+    };
+
+    typedef HistogramBuckets                               value_type;
+    typedef ReducerSampler<Histogram,
+                           HistogramBuckets,
+                           AddHistogramBuckets,
+                           MinusHistogramBuckets>          sampler_type;
+    typedef AgentCombiner <HistogramBuckets,
+                           HistogramBuckets,
+                           AddHistogramBuckets>            combiner_type;
+    typedef combiner_type::Agent                           agent_type;
+
+    Histogram();
+    ~Histogram();
+
+    AddHistogramBuckets op() const { return AddHistogramBuckets(); }
+    MinusHistogramBuckets inv_op() const { return MinusHistogramBuckets(); }
+
+    // The sampler for windows over histogram.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+    value_type reset();
+
+    // All values added so far.
+    value_type get_value() const;
+
+    Histogram& operator<<(int64_t latency);
+
+    bool valid() const { return _combiner != NULL && _combiner->valid(); }
+
+    // This name is useful for warning negative latencies in operator<<
+    void set_debug_name(const butil::StringPiece& name) {
+        _debug_name.assign(name.data(), name.size());
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Histogram);
+
+    combiner_type*          _combiner;
+    sampler_type*           _sampler;
+    std::string _debug_name;
+};
+
+// Get HistogramBuckets of a Histogram within a time window. Different from
+// Window<Histogram>, this is not a Variable and never saves series, which
+// are useless for histograms and cost 174 HistogramBuckets each.
+class HistogramWindow {
+public:
+    // `window_size' <= 0 means -bvar_dump_interval as in Window<>.
+    HistogramWindow(Histogram* h, time_t window_size);
+
+    HistogramBuckets get_value() const;
+
+    time_t window_size() const { return _window_size; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(HistogramWindow);
+
+    time_t _window_size;
+    Histogram::sampler_type* _sampler;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  //BVAR_DETAIL_HISTOGRAM_H
@@ -17,6 +17,7 @@
 
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <gflags/gflags.h>
 #include "butil/time.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/reducer.h"
@@ -25,9 +26,16 @@
 #include "bvar/window.h"
 
 namespace bvar {
+
+DEFINE_int32(bvar_sampler_thread_num, 1,
+             "Number of threads calling take_sample() of samplers, which are "
+             "distributed to the threads evenly. Read once when the first "
+             "sampler is scheduled");
+
 namespace detail {
 
 const int WARN_NOSLEEP_THRESHOLD = 2;
+const int MAX_SAMPLER_THREAD_NUM = 64;
 
 // Combine two circular linked list into one.
 struct CombineSampler {
@@ -43,10 +51,6 @@ struct CombineSampler {
     }
 };
 
-// True iff pthread_atfork was called. The callback to atfork works for child
-// of child as well, no need to register in the child again.
-static bool registered_atfork = false;
-
 // Call take_sample() of all scheduled samplers.
 // This can be done with regular timer thread, but it's way too slow(global
 // contention + log(N) heap manipulations). We need it to be super fast so that
@@ -58,10 +62,13 @@ static bool registered_atfork = false;
 // list of Samplers. Waking through the list and call take_sample().
 // If a Sampler needs to be deleted, we just mark it as unused and the
 // deletion is taken place in the thread as well.
+// Samplers are distributed to -bvar_sampler_thread_num collectors so that
+// a lot of samplers can still be sampled within one second.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
 public:
-    SamplerCollector()
-        : _created(false)
+    explicit SamplerCollector(int index)
+        : _index(index)
+        , _created(false)
         , _stop(false)
         , _cumulated_time_us(0) {
         create_sampling_thread();
@@ -74,36 +81,23 @@ public:
         }
     }
 
-private:
-    // Support for fork:
-    // * The singleton can be null before forking, the child callback will not
-    //   be registered.
-    // * If the singleton is not null before forking, the child callback will
-    //   be registered and the sampling thread will be re-created.
-    // * A forked program can be forked again.
-
-    static void child_callback_atfork() {
-        butil::get_leaky_singleton<SamplerCollector>()->after_forked_as_child();
+    void after_forked_as_child() {
+        _created = false;
+        create_sampling_thread();
     }
 
+    int64_t cumulated_time_us() const { return _cumulated_time_us; }
+
+private:
     void create_sampling_thread() {
         const int rc = pthread_create(&_tid, NULL, sampling_thread, this);
         if (rc != 0) {
             LOG(FATAL) << "Fail to create sampling_thread, " << berror(rc);
         } else {
             _created = true;
-            if (!registered_atfork) {
-                registered_atfork = true;
-                pthread_atfork(NULL, NULL, child_callback_atfork);
-            }
         }
     }
 
-    void after_forked_as_child() {
-        _created = false;
-        create_sampling_thread();
-    }
-
     void run();
 
     static void* sampling_thread(void* arg) {
@@ -111,17 +105,68 @@ private:
         return NULL;
     }
 
-    static double get_cumulated_time(void* arg) {
-        return static_cast<SamplerCollector*>(arg)->_cumulated_time_us / 1000.0 / 1000.0;
-    }
-
 private:
+    int _index;
     bool _created;
     bool _stop;
     int64_t _cumulated_time_us;
     pthread_t _tid;
 };
 
+// True iff pthread_atfork was called. The callback to atfork works for child
+// of child as well, no need to register in the child again.
+static bool registered_atfork = false;
+
+class SamplerCollectorGroup {
+public:
+    SamplerCollectorGroup()
+        : _ncollector(std::max(1, std::min(FLAGS_bvar_sampler_thread_num,
+                                           MAX_SAMPLER_THREAD_NUM)))
+        , _next(0) {
+        for (int i = 0; i < _ncollector; ++i) {
+            _collectors[i] = new SamplerCollector(i);
+        }
+        if (!registered_atfork) {
+            registered_atfork = true;
+            pthread_atfork(NULL, NULL, child_callback_atfork);
+        }
+    }
+
+    // Pick collectors in turn.
+    SamplerCollector* next_collector() {
+        return _collectors[_next.fetch_add(1, butil::memory_order_relaxed)
+                           % _ncollector];
+    }
+
+    static double get_cumulated_time(void* arg) {
+        SamplerCollectorGroup* g = static_cast<SamplerCollectorGroup*>(arg);
+        int64_t total = 0;
+        for (int i = 0; i < g->_ncollector; ++i) {
+            total += g->_collectors[i]->cumulated_time_us();
+        }
+        return total / 1000.0 / 1000.0;
+    }
+
+private:
+    // Support for fork:
+    // * The singleton can be null before forking, the child callback will not
+    //   be registered.
+    // * If the singleton is not null before forking, the child callback will
+    //   be registered and the sampling threads will be re-created.
+    // * A forked program can be forked again.
+    static void child_callback_atfork() {
+        SamplerCollectorGroup* g =
+            butil::get_leaky_singleton<SamplerCollectorGroup>();
+        for (int i = 0; i < g->_ncollector; ++i) {
+            g->_collectors[i]->after_forked_as_child();
+        }
+    }
+
+    const int _ncollector;
+    butil::atomic<size_t> _next;
+    SamplerCollector* _collectors[MAX_SAMPLER_THREAD_NUM];
+};
+
 #ifndef UNIT_TEST
 static PassiveStatus<double>* s_cumulated_time_bvar = NULL;
 static bvar::PerSecond<bvar::PassiveStatus<double> >* s_sampling_thread_usage_bvar = NULL;
@@ -134,11 +179,14 @@ void SamplerCollector::run() {
     //   may be adandoned at any time after forking.
     // * They can't created inside the constructor of SamplerCollector as well,
     //   which results in deadlock.
-    if (s_cumulated_time_bvar == NULL) {
-        s_cumulated_time_bvar =
-            new PassiveStatus<double>(get_cumulated_time, this);
+    // * Only created by the first collector, usage of all collectors is
+    //   summed.
+    if (_index == 0 && s_cumulated_time_bvar == NULL) {
+        s_cumulated_time_bvar = new PassiveStatus<double>(
+            SamplerCollectorGroup::get_cumulated_time,
+            butil::get_leaky_singleton<SamplerCollectorGroup>());
     }
-    if (s_sampling_thread_usage_bvar == NULL) {
+    if (_index == 0 && s_sampling_thread_usage_bvar == NULL) {
         s_sampling_thread_usage_bvar =
             new bvar::PerSecond<bvar::PassiveStatus<double> >(
                     "bvar_sampler_collector_usage", s_cumulated_time_bvar, 10);
@@ -166,9 +214,13 @@ void SamplerCollector::run() {
                 delete s;
                 ++nremoved;
             } else {
-                s->take_sample();
+                // Samplers with longer intervals are skipped in most rounds.
+                if (--s->_countdown <= 0) {
+                    s->_countdown = s->_interval_s;
+                    s->take_sample();
+                    ++nsampled;
+                }
                 s->_mutex.unlock();
-                ++nsampled;
             }
             p = saved_next;
         }
@@ -193,12 +245,26 @@ void SamplerCollector::run() {
     }
 }
 
-Sampler::Sampler() : _used(true) {}
+Sampler::Sampler() : _used(true), _interval_s(1), _countdown(1) {}
 
 Sampler::~Sampler() {}
 
 void Sampler::schedule() {
-    *butil::get_leaky_singleton<SamplerCollector>() << this;
+    *butil::get_leaky_singleton<SamplerCollectorGroup>()->next_collector()
+        << this;
+}
+
+int Sampler::set_sampling_interval(int interval_s) {
+    if (interval_s <= 0 || interval_s > MAX_SAMPLING_INTERVAL) {
+        LOG(ERROR) << "Invalid interval_s=" << interval_s;
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    _interval_s = interval_s;
+    if (_countdown > interval_s) {
+        _countdown = interval_s;
+    }
+    return 0;
 }
 
 void Sampler::destroy() {
@@ -54,6 +54,11 @@ public:
     // periodically.
     void schedule();
 
+    // Call take_sample() every `interval_s' seconds rather than every second,
+    // which saves sampling cost of rarely changed variables.
+    // Returns 0 on success, -1 otherwise.
+    int set_sampling_interval(int interval_s);
+
     // Call this function instead of delete to destroy the sampler. Deletion
     // of the sampler may be delayed for seconds.
     void destroy();
@@ -63,10 +68,16 @@ protected:
     
 friend class SamplerCollector;
     bool _used;
-    // Sync destroy() and take_sample().
+    // Sync destroy(), set_sampling_interval() and take_sample().
     butil::Mutex _mutex;
+    int _interval_s;
+    // Rounds before next take_sample(), only accessed by the collector.
+    int _countdown;
 };
 
+// Max interval of samplers in seconds.
+static const int MAX_SAMPLING_INTERVAL = 3600;
+
 // Representing a non-existing operator so that we can test
 // is_same<Op, VoidOp>::value to write code for different branches.
 // The false branch should be removed by compiler at compile-time.
@@ -103,9 +114,9 @@ public:
         // Make _q ready.
         // If _window_size is larger than what _q can hold, e.g. a larger
         // Window<> is created after running of sampler, make _q larger.
-        if ((size_t)_window_size + 1 > _q.capacity()) {
-            const size_t new_cap =
-                std::max(_q.capacity() * 2, (size_t)_window_size + 1);
+        const size_t nsample = nsample_of(_window_size);
+        if (nsample + 1 > _q.capacity()) {
+            const size_t new_cap = std::max(_q.capacity() * 2, nsample + 1);
             const size_t memsize = sizeof(Sample<T>) * new_cap;
             void* mem = malloc(memsize);
             if (NULL == mem) {
@@ -150,7 +161,7 @@ public:
             // We need more samples to get reasonable result.
             return false;
         }
-        Sample<T>* oldest = _q.bottom(window_size);
+        Sample<T>* oldest = _q.bottom(nsample_of(window_size));
         if (NULL == oldest) {
             oldest = _q.top();
         }
@@ -198,7 +209,7 @@ public:
             // We need more samples to get reasonable result.
             return;
         }
-        Sample<T>* oldest = _q.bottom(window_size);
+        Sample<T>* oldest = _q.bottom(nsample_of(window_size));
         if (NULL == oldest) {
             oldest = _q.top();
         }
@@ -212,6 +223,12 @@ public:
     }
 
 private:
+    // Number of samples covering `window_size' seconds. Samples are taken
+    // every _interval_s seconds, _mutex must be locked.
+    size_t nsample_of(time_t window_size) const {
+        return (window_size + _interval_s - 1) / _interval_s;
+    }
+
     R* _reducer;
     time_t _window_size;
     butil::BoundedQueue<Sample<T> > _q;
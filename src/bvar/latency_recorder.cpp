@@ -39,11 +39,32 @@ const bool ALLOW_UNUSED dummy_bvar_latency_p2 = ::GFLAGS_NS::RegisterFlagValidat
 const bool ALLOW_UNUSED dummy_bvar_latency_p3 = ::GFLAGS_NS::RegisterFlagValidator(
     &FLAGS_bvar_latency_p3, valid_percentile);
 
+DEFINE_bool(bvar_latency_recorder_use_histogram, false,
+            "Calculate percentiles of LatencyRecorder from log-linear "
+            "histograms which are exact up to 1/16 of the value and mergeable "
+            "across processes, and export the histograms to prometheus. Only "
+            "affects LatencyRecorders created afterwards");
+
 namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
-CDF::CDF(PercentileWindow* w) : _w(w) {}
+CDF::CDF(PercentileWindow* w, HistogramWindow* hw) : _w(w), _hw(hw) {}
+
+// `samples' is CombinedPercentileSamples or HistogramBuckets.
+template <typename Samples>
+static void get_cdf_values(Samples& samples, std::pair<int, int> (&values)[20]) {
+    size_t n = 0;
+    for (int i = 1; i < 10; ++i) {
+        values[n++] = std::make_pair(i*10, samples.get_number(i * 0.1));
+    }
+    for (int i = 91; i < 100; ++i) {
+        values[n++] = std::make_pair(i, samples.get_number(i * 0.01));
+    }
+    values[n++] = std::make_pair(100, samples.get_number(0.999));
+    values[n++] = std::make_pair(101, samples.get_number(0.9999));
+    CHECK_EQ(n, arraysize(values));
+}
 
 CDF::~CDF() {
     hide();
@@ -55,29 +76,26 @@ void CDF::describe(std::ostream& os, bool) const {
 
 int CDF::describe_series(
     std::ostream& os, const SeriesOptions& options) const {
-    if (_w == NULL) {
+    if (_w == NULL && _hw == NULL) {
         return 1;
     }
     if (options.test_only) {
         return 0;
     }
-    std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
-    std::vector<GlobalPercentileSamples> buckets;
-    _w->get_samples(&buckets);
-    for (size_t i = 0; i < buckets.size(); ++i) {
-        cb->combine_of(buckets.begin(), buckets.end());
-    }
     std::pair<int, int> values[20];
-    size_t n = 0;
-    for (int i = 1; i < 10; ++i) {
-        values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
-    }
-    for (int i = 91; i < 100; ++i) {
-        values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+    if (_hw != NULL) {
+        const HistogramBuckets b = _hw->get_value();
+        get_cdf_values(b, values);
+    } else {
+        std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
+        std::vector<GlobalPercentileSamples> buckets;
+        _w->get_samples(&buckets);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            cb->combine_of(buckets.begin(), buckets.end());
+        }
+        get_cdf_values(*cb, values);
     }
-    values[n++] = std::make_pair(100, cb->get_number(0.999));
-    values[n++] = std::make_pair(101, cb->get_number(0.9999));
-    CHECK_EQ(n, arraysize(values));
+    const size_t n = arraysize(values);
     os << "{\"label\":\"cdf\",\"data\":[";
     for (size_t i = 0; i < n; ++i) {
         if (i) {
@@ -89,6 +107,10 @@ int CDF::describe_series(
     return 0;
 }
 
+void LatencyHistogram::describe(std::ostream& os, bool) const {
+    os << _h->get_value();
+}
+
 static int64_t get_window_recorder_qps(void* arg) {
     detail::Sample<Stat> s;
     static_cast<RecorderWindow*>(arg)->get_span(1, &s);
@@ -131,42 +153,69 @@ static int64_t get_p3(void* arg) {
     return lr->latency_percentile(FLAGS_bvar_latency_p3 / 100.0);
 }
 
-static Vector<int64_t, 4> get_latencies(void *arg) {
-    std::unique_ptr<CombinedPercentileSamples> cb(
-        combine((PercentileWindow*)arg));
+// `samples' is CombinedPercentileSamples or HistogramBuckets.
+template <typename Samples>
+static Vector<int64_t, 4> get_latencies_of(Samples& samples) {
     // NOTE: We don't show 99.99% since it's often significantly larger than
     // other values and make other curves on the plotted graph small and
     // hard to read.
     Vector<int64_t, 4> result;
-    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
-    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
-    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
-    result[3] = cb->get_number(0.999);
+    result[0] = samples.get_number(FLAGS_bvar_latency_p1 / 100.0);
+    result[1] = samples.get_number(FLAGS_bvar_latency_p2 / 100.0);
+    result[2] = samples.get_number(FLAGS_bvar_latency_p3 / 100.0);
+    result[3] = samples.get_number(0.999);
     return result;
 }
 
+static Vector<int64_t, 4> get_latencies(void *arg) {
+    return static_cast<LatencyRecorder*>(arg)->latency_percentiles();
+}
+
+static Histogram* new_histogram_if_needed() {
+    return FLAGS_bvar_latency_recorder_use_histogram ? new Histogram : NULL;
+}
+
+static Percentile* new_percentile_if_needed(Histogram* h) {
+    return h == NULL ? new Percentile : NULL;
+}
+
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
-    : _max_latency(0)
+    : _latency_histogram(new_histogram_if_needed())
+    , _latency_histogram_window(
+        _latency_histogram ?
+        new HistogramWindow(_latency_histogram.get(), window_size) : NULL)
+    , _latency_histogram_var(
+        _latency_histogram ?
+        new LatencyHistogram(_latency_histogram.get()) : NULL)
+    , _latency_percentile(new_percentile_if_needed(_latency_histogram.get()))
+    , _latency_percentile_window(
+        _latency_percentile ?
+        new PercentileWindow(_latency_percentile.get(), window_size) : NULL)
+    , _max_latency(0)
     , _latency_window(&_latency, window_size)
     , _max_latency_window(&_max_latency, window_size)
     , _count(get_recorder_count, &_latency)
     , _qps(get_window_recorder_qps, &_latency_window)
-    , _latency_percentile_window(&_latency_percentile, window_size)
     , _latency_p1(get_p1, this)
     , _latency_p2(get_p2, this)
     , _latency_p3(get_p3, this)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
-    , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
+    , _latency_cdf(_latency_percentile_window.get(),
+                   _latency_histogram_window.get())
+    , _latency_percentiles(get_latencies, this)
 {}
 
 }  // namespace detail
 
 Vector<int64_t, 4> LatencyRecorder::latency_percentiles() const {
-    // const_cast here is just to adapt parameter type and safe.
-    return detail::get_latencies(
-        const_cast<detail::PercentileWindow*>(&_latency_percentile_window));
+    if (_latency_histogram_window) {
+        const detail::HistogramBuckets b = _latency_histogram_window->get_value();
+        return detail::get_latencies_of(b);
+    }
+    std::unique_ptr<detail::CombinedPercentileSamples> cb(
+        combine(_latency_percentile_window.get()));
+    return detail::get_latencies_of(*cb);
 }
 
 int64_t LatencyRecorder::qps(time_t window_size) const {
@@ -205,7 +254,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 
     // set debug names for printing helpful error log.
     _latency.set_debug_name(prefix);
-    _latency_percentile.set_debug_name(prefix);
+    if (_latency_histogram) {
+        _latency_histogram->set_debug_name(prefix);
+    } else {
+        _latency_percentile->set_debug_name(prefix);
+    }
 
     if (_latency_window.expose_as(prefix, "latency") != 0) {
         return -1;
@@ -244,6 +297,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     if (_latency_percentiles.expose_as(prefix, "latency_percentiles", DISPLAY_ON_HTML) != 0) {
         return -1;
     }
+    if (_latency_histogram_var &&
+        _latency_histogram_var->expose_as(
+            prefix, "latency_histogram", DISPLAY_ON_PLAIN_TEXT) != 0) {
+        return -1;
+    }
     snprintf(namebuf, sizeof(namebuf), "%d%%,%d%%,%d%%,99.9%%",
              (int)FLAGS_bvar_latency_p1, (int)FLAGS_bvar_latency_p2,
              (int)FLAGS_bvar_latency_p3);
@@ -252,8 +310,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 }
 
 int64_t LatencyRecorder::latency_percentile(double ratio) const {
+    if (_latency_histogram_window) {
+        return _latency_histogram_window->get_value().get_number(ratio);
+    }
     std::unique_ptr<detail::CombinedPercentileSamples> cb(
-        combine((detail::PercentileWindow*)&_latency_percentile_window));
+        combine(_latency_percentile_window.get()));
     return cb->get_number(ratio);
 }
 
@@ -269,12 +330,24 @@ void LatencyRecorder::hide() {
     _latency_9999.hide();
     _latency_cdf.hide();
     _latency_percentiles.hide();
+    if (_latency_histogram_var) {
+        _latency_histogram_var->hide();
+    }
+}
+
+const std::string& LatencyRecorder::latency_histogram_name() const {
+    static const std::string s_empty;
+    return _latency_histogram_var ? _latency_histogram_var->name() : s_empty;
 }
 
 LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
     _latency << latency;
     _max_latency << latency;
-    _latency_percentile << latency;
+    if (_latency_histogram) {
+        *_latency_histogram << latency;
+    } else {
+        *_latency_percentile << latency;
+    }
     return *this;
 }
 
@@ -20,10 +20,12 @@
 #ifndef  BVAR_LATENCY_RECORDER_H
 #define  BVAR_LATENCY_RECORDER_H
 
+#include <memory>                       // std::unique_ptr
 #include "bvar/recorder.h"
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
 #include "bvar/detail/percentile.h"
+#include "bvar/detail/histogram.h"
 
 namespace bvar {
 namespace detail {
@@ -37,12 +39,26 @@ typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
 
 class CDF : public Variable {
 public:
-    explicit CDF(PercentileWindow* w);
+    // Values are from `hw' if it's not NULL, from `w' otherwise. One of
+    // them is NULL.
+    CDF(PercentileWindow* w, HistogramWindow* hw);
     ~CDF();
     void describe(std::ostream& os, bool quote_string) const override;
     int describe_series(std::ostream& os, const SeriesOptions& options) const override;
 private:
     PercentileWindow* _w; 
+    HistogramWindow* _hw;
+};
+
+// Print all latencies ever recorded in HistogramBuckets, which is
+// exported as a histogram in prometheus format.
+class LatencyHistogram : public Variable {
+public:
+    explicit LatencyHistogram(Histogram* h) : _h(h) {}
+    ~LatencyHistogram() { hide(); }
+    void describe(std::ostream& os, bool quote_string) const override;
+private:
+    Histogram* _h;
 };
 
 // For mimic constructor inheritance.
@@ -51,15 +67,22 @@ public:
     explicit LatencyRecorderBase(time_t window_size);
     time_t window_size() const { return _latency_window.window_size(); }
 protected:
+    // Created when -bvar_latency_recorder_use_histogram is true, otherwise
+    // the Percentile and its window are created. Declared before other
+    // members which are initialized with them.
+    std::unique_ptr<Histogram> _latency_histogram;
+    std::unique_ptr<HistogramWindow> _latency_histogram_window;
+    std::unique_ptr<LatencyHistogram> _latency_histogram_var;
+    std::unique_ptr<Percentile> _latency_percentile;
+    std::unique_ptr<PercentileWindow> _latency_percentile_window;
+
     IntRecorder _latency;
     Maxer<int64_t> _max_latency;
-    Percentile _latency_percentile;
 
     RecorderWindow _latency_window;
     MaxWindow _max_latency_window;
     PassiveStatus<int64_t> _count;
     PassiveStatus<int64_t> _qps;
-    PercentileWindow _latency_percentile_window;
     PassiveStatus<int64_t> _latency_p1;
     PassiveStatus<int64_t> _latency_p2;
     PassiveStatus<int64_t> _latency_p3;
@@ -130,6 +153,10 @@ public:
     // Get p1/p2/p3/99.9-ile latencies in recent window_size-to-ctor seconds.
     Vector<int64_t, 4> latency_percentiles() const;
 
+    // True if percentiles are calculated from log-linear histograms rather
+    // than from samples, see -bvar_latency_recorder_use_histogram.
+    bool use_histogram() const { return _latency_histogram.get() != NULL; }
+
     // Get the max latency in recent window_size-to-ctor seconds.
     int64_t max_latency() const { return _max_latency_window.get_value(); }
 
@@ -151,6 +178,8 @@ public:
     const std::string& latency_percentiles_name() const
     { return _latency_percentiles.name(); }
     const std::string& latency_cdf_name() const { return _latency_cdf.name(); }
+    // Empty if histogram is not used.
+    const std::string& latency_histogram_name() const;
     const std::string& max_latency_name() const
     { return _max_latency_window.name(); }
     const std::string& count_name() const { return _count.name(); }
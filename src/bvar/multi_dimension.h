@@ -0,0 +1,338 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_MULTI_DIMENSION_H
+#define  BVAR_MULTI_DIMENSION_H
+
+#include <pthread.h>
+#include <algorithm>                                  // std::sort
+#include <sstream>                                  // std::ostringstream
+#include <string>
+#include <utility>                                  // std::pair
+#include <vector>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"                      // BAIDU_SCOPED_LOCK
+#include "butil/containers/flat_map.h"              // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"  // butil::DoublyBufferedData
+#include "bvar/mvariable.h"
+#include "bvar/latency_recorder.h"
+
+namespace bvar {
+
+namespace detail {
+
+struct LabelValuesHasher {
+    size_t operator()(const std::vector<std::string>& values) const {
+        butil::DefaultHasher<std::string> hasher;
+        size_t result = 0;
+        for (size_t i = 0; i < values.size(); ++i) {
+            result = result * 131 + hasher(values[i]);
+        }
+        return result;
+    }
+};
+
+// Dump `stats' of a multi-dimensional variable named `name', each
+// element is formatted labels and the stats. Returns number of dumped
+// values. Overload this function for stats which are not Variable.
+// Values with a same name must be dumped consecutively.
+template <typename T>
+inline int dump_mvar_stats(
+    Dumper* dumper, const std::string& name,
+    const std::vector<std::pair<std::string, T*> >& stats) {
+    int n = 0;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        std::ostringstream os;
+        stats[i].second->describe(os, false);
+        if (!dumper->dump_mvar(name, stats[i].first, os.str())) {
+            break;
+        }
+        ++n;
+    }
+    return n;
+}
+
+inline int dump_mvar_stats(
+    Dumper* dumper, const std::string& name,
+    const std::vector<std::pair<std::string, LatencyRecorder*> >& stats) {
+    static const char* const suffixes[] = {
+        "_latency", "_max_latency", "_qps", "_count"
+    };
+    int n = 0;
+    for (size_t i = 0; i < arraysize(suffixes); ++i) {
+        const std::string full_name = name + suffixes[i];
+        for (size_t j = 0; j < stats.size(); ++j) {
+            LatencyRecorder* r = stats[j].second;
+            int64_t value = 0;
+            switch (i) {
+            case 0: value = r->latency(); break;
+            case 1: value = r->max_latency(); break;
+            case 2: value = r->qps(); break;
+            default: value = r->count(); break;
+            }
+            std::ostringstream os;
+            os << value;
+            if (!dumper->dump_mvar(full_name, stats[j].first, os.str())) {
+                return n;
+            }
+            ++n;
+        }
+    }
+    return n;
+}
+
+}  // namespace detail
+
+// A family of variables of type T distinguished by values of labels, say
+// the latency of a service broken down by method and status. Each label
+// combination gets its own T which is created on first access and kept
+// until deleted, so bvar types such as Adder<int64_t> or LatencyRecorder
+// are still combined from thread-local agents without any contention.
+// Lookup of an existing combination is lock-free.
+// Number of combinations is capped by -bvar_max_multi_dimension_stats_count,
+// combinations beyond the cap share one overflow T whose label values are
+// all "__overflow__", which keeps memory bounded under high-cardinality
+// label values.
+// Example:
+//   bvar::MultiDimension<bvar::Adder<int> > g_request_count(
+//       "request_count", {"method", "status"});
+//   ...
+//   *g_request_count.get_stats({"Echo", "ok"}) << 1;
+// Exposed as (prometheus format):
+//   request_count{method="Echo",status="ok"} 1
+template <typename T>
+class MultiDimension : public MVariable {
+public:
+    typedef std::vector<std::string> key_type;
+    typedef T value_type;
+
+    explicit MultiDimension(const key_type& labels)
+        : MVariable(labels) { init(); }
+
+    MultiDimension(const butil::StringPiece& name, const key_type& labels)
+        : MVariable(labels) {
+        init();
+        expose(name);
+    }
+
+    MultiDimension(const butil::StringPiece& prefix,
+                   const butil::StringPiece& name,
+                   const key_type& labels)
+        : MVariable(labels) {
+        init();
+        expose_as(prefix, name);
+    }
+
+    ~MultiDimension() {
+        hide();
+        clear_stats();
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    // Get the stats of `label_values', created if it does not exist.
+    // The returned pointer is valid until the stats is deleted by
+    // delete_stats() or clear_stats(), callers are suggested to cache it.
+    // Returns NULL if number of values does not match number of labels.
+    T* get_stats(const key_type& label_values);
+
+    // True if stats of `label_values' exists.
+    bool has_stats(const key_type& label_values);
+
+    // Delete the stats of `label_values'. Pointers to the stats returned
+    // by get_stats() become invalid.
+    void delete_stats(const key_type& label_values);
+
+    // Delete all stats.
+    void clear_stats();
+
+    // Put label values of all stats into `keys'.
+    void list_stats(std::vector<key_type>* keys);
+
+    size_t count_stats();
+
+    int dump(Dumper* dumper, const DumpOptions* options);
+
+private:
+    typedef butil::FlatMap<key_type, T*, detail::LabelValuesHasher> StatsMap;
+    typedef butil::DoublyBufferedData<StatsMap> DBStatsMap;
+
+    void init() {
+        pthread_mutex_init(&_mutex, NULL);
+        _stats.Modify(init_map);
+    }
+
+    static size_t init_map(StatsMap& m) {
+        CHECK_EQ(0, m.init(64, 80));
+        return 1;
+    }
+    static size_t insert_stats(StatsMap& m, const key_type& key,
+                               T* const& stats) {
+        m[key] = stats;
+        return 1;
+    }
+    static size_t erase_stats(StatsMap& m, const key_type& key) {
+        return m.erase(key);
+    }
+    static size_t clear_map(StatsMap& m) {
+        m.clear();
+        return 1;
+    }
+
+    T* find_stats(const key_type& label_values) {
+        typename DBStatsMap::ScopedPtr ptr;
+        if (_stats.Read(&ptr) != 0) {
+            return NULL;
+        }
+        T** p = ptr->seek(label_values);
+        return p ? *p : NULL;
+    }
+
+    // Serializing modifications, also prevents stats from being deleted
+    // during dump().
+    pthread_mutex_t _mutex;
+    DBStatsMap _stats;
+};
+
+template <typename T>
+T* MultiDimension<T>::get_stats(const key_type& label_values) {
+    if (label_values.size() != _labels.size()) {
+        LOG(ERROR) << "Number of label values=" << label_values.size()
+                   << " does not match number of labels=" << _labels.size();
+        return NULL;
+    }
+    T* stats = find_stats(label_values);
+    if (stats != NULL) {
+        return stats;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    stats = find_stats(label_values);
+    if (stats != NULL) {
+        return stats;
+    }
+    const key_type* key = &label_values;
+    key_type overflow_key;
+    if (count_stats() >= (size_t)FLAGS_bvar_max_multi_dimension_stats_count) {
+        overflow_key.assign(_labels.size(), "__overflow__");
+        stats = find_stats(overflow_key);
+        if (stats != NULL) {
+            return stats;
+        }
+        LOG_FIRST_N(WARNING, 1) << "Number of stats of `" << name()
+            << "' reached -bvar_max_multi_dimension_stats_count="
+            << FLAGS_bvar_max_multi_dimension_stats_count
+            << ", further label values are merged into an overflow stats";
+        key = &overflow_key;
+    }
+    stats = new T;
+    _stats.Modify(insert_stats, *key, stats);
+    return stats;
+}
+
+template <typename T>
+bool MultiDimension<T>::has_stats(const key_type& label_values) {
+    return find_stats(label_values) != NULL;
+}
+
+template <typename T>
+void MultiDimension<T>::delete_stats(const key_type& label_values) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    T* stats = find_stats(label_values);
+    if (stats == NULL) {
+        return;
+    }
+    // Modify() returns after all readers of the old map are done, nobody
+    // can find `stats' anymore.
+    _stats.Modify(erase_stats, label_values);
+    delete stats;
+}
+
+template <typename T>
+void MultiDimension<T>::clear_stats() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<T*> all_stats;
+    {
+        typename DBStatsMap::ScopedPtr ptr;
+        if (_stats.Read(&ptr) != 0) {
+            return;
+        }
+        all_stats.reserve(ptr->size());
+        for (typename StatsMap::const_iterator
+                 it = ptr->begin(); it != ptr->end(); ++it) {
+            all_stats.push_back(it->second);
+        }
+    }
+    _stats.Modify(clear_map);
+    for (size_t i = 0; i < all_stats.size(); ++i) {
+        delete all_stats[i];
+    }
+}
+
+template <typename T>
+void MultiDimension<T>::list_stats(std::vector<key_type>* keys) {
+    if (keys == NULL) {
+        return;
+    }
+    keys->clear();
+    typename DBStatsMap::ScopedPtr ptr;
+    if (_stats.Read(&ptr) != 0) {
+        return;
+    }
+    keys->reserve(ptr->size());
+    for (typename StatsMap::const_iterator
+             it = ptr->begin(); it != ptr->end(); ++it) {
+        keys->push_back(it->first);
+    }
+}
+
+template <typename T>
+size_t MultiDimension<T>::count_stats() {
+    typename DBStatsMap::ScopedPtr ptr;
+    if (_stats.Read(&ptr) != 0) {
+        return 0;
+    }
+    return ptr->size();
+}
+
+template <typename T>
+int MultiDimension<T>::dump(Dumper* dumper, const DumpOptions*) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<std::pair<key_type, T*> > all_stats;
+    {
+        // Don't call dumper while reading which blocks modifications.
+        typename DBStatsMap::ScopedPtr ptr;
+        if (_stats.Read(&ptr) != 0) {
+            return -1;
+        }
+        all_stats.reserve(ptr->size());
+        for (typename StatsMap::const_iterator
+                 it = ptr->begin(); it != ptr->end(); ++it) {
+            all_stats.push_back(std::make_pair(it->first, it->second));
+        }
+    }
+    // Dump in a stable order.
+    std::sort(all_stats.begin(), all_stats.end());
+    std::vector<std::pair<std::string, T*> > labeled_stats(all_stats.size());
+    for (size_t i = 0; i < all_stats.size(); ++i) {
+        format_labels(all_stats[i].first, &labeled_stats[i].first);
+        labeled_stats[i].second = all_stats[i].second;
+    }
+    return detail::dump_mvar_stats(dumper, name(), labeled_stats);
+}
+
+}  // namespace bvar
+
+#endif  // BVAR_MULTI_DIMENSION_H
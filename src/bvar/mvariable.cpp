@@ -0,0 +1,189 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <map>
+#include <sstream>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "bvar/mvariable.h"
+
+namespace bvar {
+
+DEFINE_int32(bvar_max_multi_dimension_stats_count, 20000,
+             "Max number of label combinations of a multi-dimensional bvar, "
+             "values of other combinations go to an overflow bucket");
+
+typedef std::map<std::string, MVariable*> MVarMap;
+
+struct MVarMapWithLock : public MVarMap {
+    pthread_mutex_t mutex;
+
+    MVarMapWithLock() {
+        pthread_mutex_init(&mutex, NULL);
+    }
+};
+
+// Initialized on need because bvar is possibly used before main().
+static pthread_once_t s_mvar_map_once = PTHREAD_ONCE_INIT;
+static MVarMapWithLock* s_mvar_map = NULL;
+
+static void init_mvar_map() {
+    s_mvar_map = new MVarMapWithLock;
+}
+
+inline MVarMapWithLock& get_mvar_map() {
+    pthread_once(&s_mvar_map_once, init_mvar_map);
+    return *s_mvar_map;
+}
+
+MVariable::MVariable(const std::vector<std::string>& labels)
+    : _labels(labels) {}
+
+MVariable::~MVariable() {
+    CHECK(!hide()) << "Subclass of MVariable MUST call hide() manually in their"
+        " dtors to avoid dumping a variable that is just destructing";
+}
+
+void MVariable::describe(std::ostream& os) {
+    os << "{\"name\" : \"" << _name << "\", \"labels\" : [";
+    for (size_t i = 0; i < _labels.size(); ++i) {
+        if (i != 0) {
+            os << ", ";
+        }
+        os << '"' << _labels[i] << '"';
+    }
+    os << "], \"stats_count\" : " << count_stats() << '}';
+}
+
+int MVariable::expose_impl(const butil::StringPiece& prefix,
+                           const butil::StringPiece& name) {
+    if (name.empty()) {
+        LOG(ERROR) << "Parameter[name] is empty";
+        return -1;
+    }
+    hide();
+
+    _name.clear();
+    if (!prefix.empty()) {
+        to_underscored_name(&_name, prefix);
+        if (!_name.empty() && butil::back_char(_name) != '_') {
+            _name.push_back('_');
+        }
+    }
+    to_underscored_name(&_name, name);
+
+    MVarMapWithLock& m = get_mvar_map();
+    {
+        BAIDU_SCOPED_LOCK(m.mutex);
+        MVariable*& var = m[_name];
+        if (var == NULL) {
+            var = this;
+            return 0;
+        }
+    }
+    LOG(ERROR) << "Already exposed multi-dimensional bvar `" << _name << '\'';
+    _name.clear();
+    return -1;
+}
+
+bool MVariable::hide() {
+    if (_name.empty()) {
+        return false;
+    }
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    MVarMap::iterator it = m.find(_name);
+    if (it != m.end() && it->second == this) {
+        m.erase(it);
+    } else {
+        CHECK(false) << "`" << _name << "' must exist";
+    }
+    _name.clear();
+    return true;
+}
+
+void MVariable::format_labels(const std::vector<std::string>& values,
+                              std::string* out) const {
+    for (size_t i = 0; i < _labels.size() && i < values.size(); ++i) {
+        if (i != 0) {
+            out->push_back(',');
+        }
+        out->append(_labels[i]);
+        out->append("=\"");
+        const std::string& v = values[i];
+        for (size_t j = 0; j < v.size(); ++j) {
+            switch (v[j]) {
+            case '\\':
+                out->append("\\\\");
+                break;
+            case '"':
+                out->append("\\\"");
+                break;
+            case '\n':
+                out->append("\\n");
+                break;
+            default:
+                out->push_back(v[j]);
+                break;
+            }
+        }
+        out->push_back('"');
+    }
+}
+
+size_t MVariable::count_exposed() {
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    return m.size();
+}
+
+void MVariable::list_exposed(std::vector<std::string>* names) {
+    if (names == NULL) {
+        return;
+    }
+    names->clear();
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    names->reserve(m.size());
+    for (MVarMap::const_iterator it = m.begin(); it != m.end(); ++it) {
+        names->push_back(it->first);
+    }
+}
+
+int MVariable::dump_exposed(Dumper* dumper, const DumpOptions* options) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    MVarMapWithLock& m = get_mvar_map();
+    int count = 0;
+    // Dumping under the lock so that variables are not destroyed meanwhile,
+    // dumpers must not expose or hide multi-dimensional variables.
+    BAIDU_SCOPED_LOCK(m.mutex);
+    for (MVarMap::const_iterator it = m.begin(); it != m.end(); ++it) {
+        const int rc = it->second->dump(dumper, options);
+        if (rc < 0) {
+            return -1;
+        }
+        count += rc;
+    }
+    return count;
+}
+
+}  // namespace bvar
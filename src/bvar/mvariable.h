@@ -0,0 +1,98 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_MVARIABLE_H
+#define  BVAR_MVARIABLE_H
+
+#include <ostream>                      // std::ostream
+#include <string>                       // std::string
+#include <vector>                       // std::vector
+#include <gflags/gflags_declare.h>
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/variable.h"              // Dumper, DumpOptions
+
+namespace bvar {
+
+DECLARE_int32(bvar_max_multi_dimension_stats_count);
+
+// Base class of multi-dimensional variables which are families of values
+// distinguished by label values. Unlike Variable, each value is not
+// registered globally, only the family is.
+class MVariable {
+public:
+    explicit MVariable(const std::vector<std::string>& labels);
+    virtual ~MVariable();
+
+    // Number of label combinations with values.
+    virtual size_t count_stats() = 0;
+
+    // Dump all values into `dumper'.
+    // Returns number of dumped values, -1 on error.
+    virtual int dump(Dumper* dumper, const DumpOptions* options) = 0;
+
+    // Print names of labels and number of values.
+    virtual void describe(std::ostream& os);
+
+    // Expose this variable globally so that it's dumped by dump_exposed().
+    // Returns 0 on success, -1 otherwise.
+    int expose(const butil::StringPiece& name) {
+        return expose_impl(butil::StringPiece(), name);
+    }
+    int expose_as(const butil::StringPiece& prefix,
+                  const butil::StringPiece& name) {
+        return expose_impl(prefix, name);
+    }
+
+    // Hide this variable. Subclasses must call this in their dtors.
+    // Returns false if this variable is not exposed.
+    bool hide();
+
+    const std::string& name() const { return _name; }
+    const std::vector<std::string>& labels() const { return _labels; }
+
+    // Number of exposed multi-dimensional variables.
+    static size_t count_exposed();
+
+    // Put names of all exposed multi-dimensional variables into `names'.
+    static void list_exposed(std::vector<std::string>* names);
+
+    // Dump all exposed multi-dimensional variables in the order of names.
+    // `options' is passed to dump() of each variable.
+    // Returns number of dumped values, -1 on error.
+    static int dump_exposed(Dumper* dumper, const DumpOptions* options);
+
+protected:
+    int expose_impl(const butil::StringPiece& prefix,
+                    const butil::StringPiece& name);
+
+    // Append `k1="v1",k2="v2"' into `out'. Quotes, backslashes and newlines
+    // in values are escaped.
+    void format_labels(const std::vector<std::string>& values,
+                       std::string* out) const;
+
+    const std::vector<std::string> _labels;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MVariable);
+
+    std::string _name;
+};
+
+}  // namespace bvar
+
+#endif  // BVAR_MVARIABLE_H
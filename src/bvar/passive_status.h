@@ -126,6 +126,15 @@ public:
         os << get_value();
     }
 
+    bool get_numeric_value(double* value) const override {
+        // Don't call _getfn for non-numeric types which may be costly.
+        if (!butil::is_integral<Tp>::value &&
+            !butil::is_floating_point<Tp>::value) {
+            return false;
+        }
+        return get_numeric(get_value(), value);
+    }
+
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override {
         if (_getfn) {
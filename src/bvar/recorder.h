@@ -67,6 +67,12 @@ struct Stat {
     }
 };
 
+// Numeric value of Stat is the average.
+inline bool get_numeric(const Stat& s, double* value) {
+    *value = s.get_average_double();
+    return true;
+}
+
 inline std::ostream& operator<<(std::ostream& os, const Stat& s) {
     const int64_t v = s.get_average_int();
     if (v != 0) {
@@ -160,6 +166,10 @@ public:
         os << get_value();
     }
 
+    bool get_numeric_value(double* value) const override {
+        return get_numeric(get_value(), value);
+    }
+
     bool valid() const { return _combiner.valid(); }
     
     sampler_type* get_sampler() {
@@ -134,6 +134,10 @@ public:
             os << get_value();
         }
     }
+
+    bool get_numeric_value(double* value) const override {
+        return get_numeric(get_value(), value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override { *value = get_value(); }
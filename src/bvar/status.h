@@ -57,6 +57,10 @@ public:
     void describe(std::ostream& os, bool /*quote_string*/) const override {
         os << get_value();
     }
+
+    bool get_numeric_value(double* value) const override {
+        return get_numeric(get_value(), value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override {
@@ -126,6 +130,10 @@ public:
     void describe(std::ostream& os, bool /*quote_string*/) const override {
         os << get_value();
     }
+
+    bool get_numeric_value(double* value) const override {
+        return get_numeric(get_value(), value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override {
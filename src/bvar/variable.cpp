@@ -258,6 +258,20 @@ int Variable::describe_exposed(const std::string& name, std::ostream& os,
     return 0;
 }
 
+int Variable::get_numeric_exposed(const std::string& name, double* value,
+                                  DisplayFilter display_filter) {
+    VarMapWithLock& m = get_var_map(name);
+    BAIDU_SCOPED_LOCK(m.mutex);
+    VarEntry* p = m.seek(name);
+    if (p == NULL) {
+        return -1;
+    }
+    if (!(display_filter & p->display_filter)) {
+        return -1;
+    }
+    return p->var->get_numeric_value(value) ? 0 : -1;
+}
+
 std::string Variable::describe_exposed(const std::string& name,
                                        bool quote_string,
                                        DisplayFilter display_filter) {
@@ -458,6 +472,41 @@ DumpOptions::DumpOptions()
     , display_filter(DISPLAY_ON_PLAIN_TEXT)
 {}
 
+// Put names of exposed variables matching wildcards in `opt' into `names'.
+static void list_dumped_names(const DumpOptions& opt,
+                              std::vector<std::string>* names) {
+    names->clear();
+    WildcardMatcher black_matcher(opt.black_wildcards,
+                                  opt.question_mark,
+                                  false);
+    WildcardMatcher white_matcher(opt.white_wildcards,
+                                  opt.question_mark,
+                                  true);
+    if (white_matcher.wildcards().empty() &&
+        !white_matcher.exact_names().empty()) {
+        for (std::set<std::string>::const_iterator
+                 it = white_matcher.exact_names().begin();
+             it != white_matcher.exact_names().end(); ++it) {
+            if (!black_matcher.match(*it)) {
+                names->push_back(*it);
+            }
+        }
+        return;
+    }
+    // Have to iterate all variables.
+    std::vector<std::string> varnames;
+    bvar::Variable::list_exposed(&varnames, opt.display_filter);
+    // Sort the names to make them more readable.
+    std::sort(varnames.begin(), varnames.end());
+    names->reserve(varnames.size());
+    for (std::vector<std::string>::const_iterator
+             it = varnames.begin(); it != varnames.end(); ++it) {
+        if (white_matcher.match(*it) && !black_matcher.match(*it)) {
+            names->push_back(*it);
+        }
+    }
+}
+
 int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     if (NULL == dumper) {
         LOG(ERROR) << "Parameter[dumper] is NULL";
@@ -470,61 +519,27 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     CharArrayStreamBuf streambuf;
     std::ostream os(&streambuf);
     int count = 0;
-    WildcardMatcher black_matcher(opt.black_wildcards,
-                                  opt.question_mark,
-                                  false);
-    WildcardMatcher white_matcher(opt.white_wildcards,
-                                  opt.question_mark,
-                                  true);
+    std::vector<std::string> varnames;
+    list_dumped_names(opt, &varnames);
 
     std::ostringstream dumpped_info;
     const bool log_dummped = FLAGS_bvar_log_dumpped;
 
-    if (white_matcher.wildcards().empty() &&
-        !white_matcher.exact_names().empty()) {
-        for (std::set<std::string>::const_iterator
-                 it = white_matcher.exact_names().begin();
-             it != white_matcher.exact_names().end(); ++it) {
-            const std::string& name = *it;
-            if (!black_matcher.match(name)) {
-                if (bvar::Variable::describe_exposed(
-                        name, os, opt.quote_string, opt.display_filter) != 0) {
-                    continue;
-                }
-                if (log_dummped) {
-                    dumpped_info << '\n' << name << ": " << streambuf.data();
-                }
-                if (!dumper->dump(name, streambuf.data())) {
-                    return -1;
-                }
-                streambuf.reset();
-                ++count;
-            }
+    for (std::vector<std::string>::const_iterator
+             it = varnames.begin(); it != varnames.end(); ++it) {
+        const std::string& name = *it;
+        if (bvar::Variable::describe_exposed(
+                name, os, opt.quote_string, opt.display_filter) != 0) {
+            continue;
         }
-    } else {
-        // Have to iterate all variables.
-        std::vector<std::string> varnames;
-        bvar::Variable::list_exposed(&varnames, opt.display_filter);
-        // Sort the names to make them more readable.
-        std::sort(varnames.begin(), varnames.end());
-        for (std::vector<std::string>::const_iterator
-                 it = varnames.begin(); it != varnames.end(); ++it) {
-            const std::string& name = *it;
-            if (white_matcher.match(name) && !black_matcher.match(name)) {
-                if (bvar::Variable::describe_exposed(
-                        name, os, opt.quote_string, opt.display_filter) != 0) {
-                    continue;
-                }
-                if (log_dummped) {
-                    dumpped_info << '\n' << name << ": " << streambuf.data();
-                }
-                if (!dumper->dump(name, streambuf.data())) {
-                    return -1;
-                }
-                streambuf.reset();
-                ++count;
-            }
+        if (log_dummped) {
+            dumpped_info << '\n' << name << ": " << streambuf.data();
+        }
+        if (!dumper->dump(name, streambuf.data())) {
+            return -1;
         }
+        streambuf.reset();
+        ++count;
     }
     if (log_dummped) {
         LOG(INFO) << "Dumpped variables:" << dumpped_info.str();
@@ -532,6 +547,32 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     return count;
 }
 
+int Variable::dump_exposed_numeric(NumericDumper* dumper,
+                                   const DumpOptions* poptions) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    DumpOptions opt;
+    if (poptions) {
+        opt = *poptions;
+    }
+    std::vector<std::string> varnames;
+    list_dumped_names(opt, &varnames);
+    int count = 0;
+    for (std::vector<std::string>::const_iterator
+             it = varnames.begin(); it != varnames.end(); ++it) {
+        double value = 0;
+        if (get_numeric_exposed(*it, &value, opt.display_filter) != 0) {
+            continue;
+        }
+        if (!dumper->dump(*it, value)) {
+            return -1;
+        }
+        ++count;
+    }
+    return count;
+}
 
 // ============= export to files ==============
 
@@ -25,6 +25,7 @@
 #include <vector>                      // std::vector
 #include <gflags/gflags_declare.h>
 #include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/type_traits.h"           // butil::enable_if
 #include "butil/strings/string_piece.h" // butil::StringPiece
 
 #ifdef BAIDU_INTERNAL
@@ -53,6 +54,30 @@ public:
     virtual ~Dumper() { }
     virtual bool dump(const std::string& name,
                       const butil::StringPiece& description) = 0;
+
+    // Dump a value of a multi-dimensional variable(see bvar/multi_dimension.h)
+    // named `name' with `labels' in form of `k1="v1",k2="v2"'.
+    // Values of a variable are dumped consecutively.
+    // Dumped as `name{labels}' by default.
+    virtual bool dump_mvar(const std::string& name,
+                           const butil::StringPiece& labels,
+                           const butil::StringPiece& description) {
+        std::string full_name;
+        full_name.reserve(name.size() + labels.size() + 2);
+        full_name.append(name);
+        full_name.push_back('{');
+        full_name.append(labels.data(), labels.size());
+        full_name.push_back('}');
+        return dump(full_name, description);
+    }
+};
+
+// Implement this class to get numeric values of exposed variables without
+// formatting them into strings, see Variable::dump_exposed_numeric().
+class NumericDumper {
+public:
+    virtual ~NumericDumper() { }
+    virtual bool dump(const std::string& name, double value) = 0;
 };
 
 // Options for Variable::dump_exposed().
@@ -107,6 +132,11 @@ public:
     // string form of describe().
     std::string get_description() const;
 
+    // Put the value into `value' if it's a number, which is much cheaper
+    // than describe() for dumpers that don't need strings.
+    // Returns false if the value is not a number(default).
+    virtual bool get_numeric_value(double* /*value*/) const { return false; }
+
 #ifdef BAIDU_INTERNAL
     // Get value.
     // If subclass does not override this method, the value is the description
@@ -185,6 +215,12 @@ public:
                                         bool quote_string = false,
                                         DisplayFilter = DISPLAY_ON_ALL);
 
+    // Find an exposed variable by `name' and put its numeric value into
+    // `value'.
+    // Returns 0 on found and the value is a number, -1 otherwise.
+    static int get_numeric_exposed(const std::string& name, double* value,
+                                   DisplayFilter = DISPLAY_ON_ALL);
+
     // Describe saved series of variable `name' as a json-string into `os'.
     // The output will be ploted by flot.js
     // Returns 0 on success, 1 when the variable does not save series, -1
@@ -205,6 +241,11 @@ public:
     // Return number of dumped variables, -1 on error.
     static int dump_exposed(Dumper* dumper, const DumpOptions* options);
 
+    // Same with dump_exposed() but only variables with numeric values are
+    // dumped, without formatting. `quote_string' in options is ignored.
+    static int dump_exposed_numeric(NumericDumper* dumper,
+                                    const DumpOptions* options);
+
 protected:
     virtual int expose_impl(const butil::StringPiece& prefix,
                             const butil::StringPiece& name,
@@ -229,6 +270,22 @@ private:
 //   HELLO           -> hello
 void to_underscored_name(std::string* out, const butil::StringPiece& name);
 
+// Convert `v' to double for Variable::get_numeric_value(). Overload this
+// function in namespace of T for types convertible to numbers.
+template <typename T>
+inline typename butil::enable_if<butil::is_integral<T>::value ||
+                                 butil::is_floating_point<T>::value, bool>::type
+get_numeric(const T& v, double* value) {
+    *value = (double)v;
+    return true;
+}
+template <typename T>
+inline typename butil::enable_if<!butil::is_integral<T>::value &&
+                                 !butil::is_floating_point<T>::value, bool>::type
+get_numeric(const T&, double*) {
+    return false;
+}
+
 }  // namespace bvar
 
 // Make variables printable.
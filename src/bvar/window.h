@@ -117,6 +117,10 @@ public:
             os << get_value();
         }
     }
+
+    bool get_numeric_value(double* value) const override {
+        return get_numeric(get_value(), value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override { *value = get_value(); }
@@ -124,6 +128,15 @@ public:
 
     time_t window_size() const { return _window_size; }
 
+    // Sample the underlying variable every `interval_s' seconds instead of
+    // every second to save CPU for variables that are rarely changed. The
+    // interval is shared by all windows over the same variable and should
+    // be set before the window gets samples.
+    // Returns 0 on success, -1 otherwise.
+    int set_sampling_interval(int interval_s) {
+        return _sampler->set_sampling_interval(interval_s);
+    }
+
     int describe_series(std::ostream& os, const SeriesOptions& options) const override {
         if (_series_sampler == NULL) {
             return 1;
@@ -52,6 +52,9 @@
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/common.h"
 #include "brpc/builtin/bad_method_service.h"
+#include "brpc/span.h"
+#include "brpc/span_exporter.h"
+#include "brpc/details/continuous_profiler.h"
 #include "echo.pb.h"
 
 DEFINE_bool(foo, false, "Flags for UT");
@@ -60,6 +63,8 @@ BRPC_VALIDATE_GFLAG(foo, brpc::PassValidate);
 namespace brpc {
 DECLARE_bool(enable_rpcz);
 DECLARE_bool(rpcz_hex_log_id);
+DECLARE_int32(rpcz_ring_buffer_mb);
+DECLARE_bool(rpcz_export_all_spans);
 DECLARE_int32(idle_timeout_second);
 } // namespace rpc
 
@@ -489,6 +494,78 @@ protected:
         
         StopAndJoin();
     }
+
+    void TestRpczRingBuffer() {
+        struct SpanCollector : public brpc::SpanExporter {
+            void Export(const std::deque<brpc::RpczSpan>& spans) override {
+                BAIDU_SCOPED_LOCK(mutex);
+                this->spans.insert(this->spans.end(), spans.begin(), spans.end());
+            }
+            butil::Mutex mutex;
+            std::deque<brpc::RpczSpan> spans;
+        };
+        SpanCollector collector;
+        brpc::SetSpanExporter(&collector);
+        brpc::FLAGS_enable_rpcz = true;
+        brpc::FLAGS_rpcz_ring_buffer_mb = 1;
+        brpc::FLAGS_rpcz_export_all_spans = true;
+
+        ASSERT_EQ(0, _server.AddService(new EchoServiceImpl(),
+                                        brpc::SERVER_OWNS_SERVICE));
+        butil::EndPoint ep;
+        ASSERT_EQ(0, str2endpoint("127.0.0.1:9748", &ep));
+        ASSERT_EQ(0, _server.Start(ep, NULL));
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init(ep, NULL));
+        test::EchoService_Stub stub(&channel);
+        test::EchoRequest echo_req;
+        test::EchoResponse echo_res;
+        brpc::Controller echo_cntl;
+        echo_req.set_message("hello");
+        echo_cntl.set_log_id(20190425);
+        stub.Echo(&echo_cntl, &echo_req, &echo_res, NULL);
+        ASSERT_FALSE(echo_cntl.Failed());
+        // Spans are dumped and exported in background threads.
+        usleep(2500000);
+
+        std::deque<brpc::BriefSpan> briefs;
+        brpc::ListSpans(butil::gettimeofday_us(), 100, &briefs, NULL);
+        uint64_t trace_id = 0;
+        for (size_t i = 0; i < briefs.size(); ++i) {
+            if (briefs[i].log_id() == 20190425) {
+                trace_id = briefs[i].trace_id();
+            }
+        }
+        ASSERT_NE(0u, trace_id);
+        std::deque<brpc::RpczSpan> spans;
+        brpc::FindSpans(trace_id, &spans);
+        ASSERT_FALSE(spans.empty());
+        brpc::RpczSpan span;
+        ASSERT_EQ(0, brpc::FindSpan(trace_id, spans[0].span_id(), &span));
+        ASSERT_EQ(trace_id, span.trace_id());
+        std::ostringstream os;
+        brpc::DescribeSpanDB(os);
+        ASSERT_NE(std::string::npos, os.str().find("memory ring buffer"))
+            << os.str();
+
+        {
+            BAIDU_SCOPED_LOCK(collector.mutex);
+            bool found = false;
+            for (size_t i = 0; i < collector.spans.size(); ++i) {
+                found = found || collector.spans[i].trace_id() == trace_id;
+            }
+            ASSERT_TRUE(found);
+            butil::IOBuf otlp;
+            brpc::SpansToOTLP(collector.spans, &otlp);
+            ASSERT_NE(std::string::npos,
+                      otlp.to_string().find("test.EchoService.Echo"));
+        }
+        brpc::SetSpanExporter(NULL);
+        brpc::FLAGS_rpcz_export_all_spans = false;
+        brpc::FLAGS_rpcz_ring_buffer_mb = 0;
+        brpc::FLAGS_enable_rpcz = false;
+        StopAndJoin();
+    }
     
 private:
     brpc::Server _server;
@@ -647,6 +724,10 @@ TEST_F(BuiltinServiceTest, rpcz) {
     }
 }
 
+TEST_F(BuiltinServiceTest, rpcz_ring_buffer) {
+    TestRpczRingBuffer();
+}
+
 TEST_F(BuiltinServiceTest, pprof) {
     brpc::PProfService service;
     {
@@ -689,6 +770,56 @@ TEST_F(BuiltinServiceTest, pprof) {
     }
 }
 
+static NOINLINE void BurnCpu(int64_t us) {
+    const int64_t deadline = butil::cpuwide_time_us() + us;
+    while (butil::cpuwide_time_us() < deadline) {}
+}
+
+// Callers of BurnCpu are only seen by walking the stack of the bthread,
+// e.g. TaskGroup::task_runner which is exported by the library.
+static NOINLINE void* BurnCpuInBthread(void*) {
+    brpc::SetProfilingLabel(brpc::InternProfilingLabel("test.BurnCpu"));
+    BurnCpu(500000);
+    brpc::SetProfilingLabel(NULL);
+    return NULL;
+}
+
+TEST_F(BuiltinServiceTest, continuous_profiling) {
+    brpc::PProfService service;
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        service.continuous(&cntl, NULL, NULL, &done);
+        EXPECT_EQ(brpc::ENOMETHOD, cntl.ErrorCode());
+    }
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "continuous_profiling_hz", "100").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "enable_continuous_profiling", "true").empty());
+    // Wait for the timer being armed.
+    usleep(300000);
+    brpc::SetProfilingLabel(brpc::InternProfilingLabel("test.BurnCpu"));
+    ASSERT_STREQ("test.BurnCpu", brpc::GetProfilingLabel());
+    brpc::SetProfilingLabel(NULL);
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, BurnCpuInBthread, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        cntl.http_request().uri().SetQuery("seconds", "10");
+        service.continuous(&cntl, NULL, NULL, &done);
+        EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        CheckContent(cntl, "[method] test.BurnCpu");
+        CheckContent(cntl, "TaskGroup::task_runner");
+        CheckContent(cntl, "nanoseconds");
+    }
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "enable_continuous_profiling", "false").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "continuous_profiling_hz", "19").empty());
+}
+
 TEST_F(BuiltinServiceTest, dir) {
     brpc::DirService service;
     brpc::DirRequest req;
@@ -22,6 +22,7 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/grpc.h"
+#include "brpc/stream.h"
 #include "butil/time.h"
 #include "grpc.pb.h"
 
@@ -47,6 +48,92 @@ const std::string g_req = "wyt";
 const int64_t g_timeout_ms = 1000;
 const std::string g_protocol = "h2:grpc";
 
+const int g_nmessage = 3;
+
+// Server-side handler of streaming methods, replies every request message
+// when `echo' is true, otherwise replies all messages in one after the
+// client finished writing.
+class ServerStreamHandler : public brpc::StreamInputHandler {
+public:
+    explicit ServerStreamHandler(bool echo) : _echo(echo) {}
+
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf *const messages[],
+                             size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            test::GrpcRequest req;
+            butil::IOBufAsZeroCopyInputStream wrapper(*messages[i]);
+            EXPECT_TRUE(req.ParseFromZeroCopyStream(&wrapper));
+            _received.append(req.message());
+            if (_echo) {
+                Reply(id, g_prefix + req.message());
+            }
+        }
+        return 0;
+    }
+    void on_half_closed(brpc::StreamId id) {
+        if (!_echo) {
+            Reply(id, g_prefix + _received);
+        }
+        brpc::StreamClose(id);
+    }
+    void on_idle_timeout(brpc::StreamId) {}
+    void on_closed(brpc::StreamId) { delete this; }
+
+    static void Reply(brpc::StreamId id, const std::string& msg) {
+        test::GrpcResponse res;
+        res.set_message(msg);
+        butil::IOBuf buf;
+        butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+        EXPECT_TRUE(res.SerializeToZeroCopyStream(&wrapper));
+        EXPECT_EQ(0, brpc::StreamWrite(id, buf));
+    }
+
+private:
+    bool _echo;
+    std::string _received;
+};
+
+class ClientStreamHandler : public brpc::StreamInputHandler {
+public:
+    ClientStreamHandler() : _closed(false) {}
+
+    int on_received_messages(brpc::StreamId,
+                             butil::IOBuf *const messages[],
+                             size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            test::GrpcResponse res;
+            butil::IOBufAsZeroCopyInputStream wrapper(*messages[i]);
+            EXPECT_TRUE(res.ParseFromZeroCopyStream(&wrapper));
+            _received.push_back(res.message());
+        }
+        return 0;
+    }
+    void on_idle_timeout(brpc::StreamId) {}
+    void on_closed(brpc::StreamId) { _closed = true; }
+
+    bool WaitClosed() {
+        for (int i = 0; i < 1000 && !_closed; ++i) {
+            bthread_usleep(1000);
+        }
+        return _closed;
+    }
+
+    std::vector<std::string> _received;
+    butil::atomic<bool> _closed;
+};
+
+void WriteRequest(brpc::StreamId id, const std::string& msg) {
+    test::GrpcRequest req;
+    req.set_message(msg);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    butil::IOBuf buf;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+    EXPECT_TRUE(req.SerializeToZeroCopyStream(&wrapper));
+    EXPECT_EQ(0, brpc::StreamWrite(id, buf));
+}
+
 class MyGrpcService : public ::test::GrpcService {
 public:
     void Method(::google::protobuf::RpcController* cntl_base,
@@ -86,6 +173,60 @@ public:
         res->set_message(g_prefix + req->message());
         return;
     }
+
+    void ServerStreaming(::google::protobuf::RpcController* cntl_base,
+                         const ::test::GrpcRequest* req,
+                         ::test::GrpcResponse*,
+                         ::google::protobuf::Closure* done) {
+        brpc::Controller* cntl =
+                static_cast<brpc::Controller*>(cntl_base);
+        brpc::ClosureGuard done_guard(done);
+        brpc::StreamId sid;
+        ASSERT_EQ(0, brpc::StreamAccept(&sid, *cntl, NULL));
+        for (int i = 0; i < g_nmessage; ++i) {
+            ServerStreamHandler::Reply(sid, g_prefix + req->message());
+        }
+        brpc::StreamClose(sid);
+    }
+
+    void ClientStreaming(::google::protobuf::RpcController* cntl_base,
+                         const ::test::GrpcRequest* req,
+                         ::test::GrpcResponse*,
+                         ::google::protobuf::Closure* done) {
+        AcceptStream(cntl_base, req, done, false);
+    }
+
+    void BidiStreaming(::google::protobuf::RpcController* cntl_base,
+                       const ::test::GrpcRequest* req,
+                       ::test::GrpcResponse*,
+                       ::google::protobuf::Closure* done) {
+        AcceptStream(cntl_base, req, done, true);
+    }
+
+private:
+    static void AcceptStream(::google::protobuf::RpcController* cntl_base,
+                             const ::test::GrpcRequest* req,
+                             ::google::protobuf::Closure* done,
+                             bool echo) {
+        brpc::Controller* cntl =
+                static_cast<brpc::Controller*>(cntl_base);
+        brpc::ClosureGuard done_guard(done);
+        ServerStreamHandler* handler = new ServerStreamHandler(echo);
+        // The request is the first message.
+        butil::IOBuf first;
+        butil::IOBufAsZeroCopyOutputStream wrapper(&first);
+        EXPECT_TRUE(req->SerializeToZeroCopyStream(&wrapper));
+        butil::IOBuf* msgs[] = { &first };
+        brpc::StreamOptions options;
+        options.handler = handler;
+        brpc::StreamId sid;
+        if (brpc::StreamAccept(&sid, *cntl, &options) != 0) {
+            delete handler;
+            cntl->SetFailed("Fail to accept stream");
+            return;
+        }
+        handler->on_received_messages(sid, msgs, 1);
+    }
 };
 
 class GrpcTest : public ::testing::Test {
@@ -272,4 +413,76 @@ TEST_F(GrpcTest, GrpcTimeOut) {
     }
 }
 
+TEST_F(GrpcTest, ServerStreaming) {
+    ClientStreamHandler handler;
+    brpc::StreamOptions options;
+    options.handler = &handler;
+    brpc::Controller cntl;
+    brpc::StreamId sid;
+    ASSERT_EQ(0, brpc::StreamCreate(&sid, cntl, &options));
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    stub.ServerStreaming(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    // The request ended this side.
+    ASSERT_TRUE(handler.WaitClosed());
+    ASSERT_EQ((size_t)g_nmessage, handler._received.size());
+    for (int i = 0; i < g_nmessage; ++i) {
+        EXPECT_EQ(g_prefix + g_req, handler._received[i]);
+    }
+    ASSERT_NE(0, brpc::StreamWrite(sid, butil::IOBuf()));
+}
+
+TEST_F(GrpcTest, ClientStreaming) {
+    brpc::Controller cntl;
+    brpc::StreamId sid;
+    ASSERT_EQ(0, brpc::StreamCreate(&sid, cntl, NULL));
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message("0");
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    const brpc::CallId cid = cntl.call_id();
+    stub.ClientStreaming(&cntl, &req, &res, brpc::DoNothing());
+    for (int i = 1; i < g_nmessage; ++i) {
+        WriteRequest(sid, std::to_string(i));
+    }
+    // The server responds after this side is closed.
+    ASSERT_EQ(0, brpc::StreamClose(sid));
+    brpc::Join(cid);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(g_prefix + "012", res.message());
+}
+
+TEST_F(GrpcTest, BidiStreaming) {
+    ClientStreamHandler handler;
+    brpc::StreamOptions options;
+    options.handler = &handler;
+    brpc::Controller cntl;
+    brpc::StreamId sid;
+    ASSERT_EQ(0, brpc::StreamCreate(&sid, cntl, &options));
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message("0");
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    stub.BidiStreaming(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    for (int i = 1; i < g_nmessage; ++i) {
+        WriteRequest(sid, std::to_string(i));
+    }
+    ASSERT_EQ(0, brpc::StreamClose(sid));
+    ASSERT_TRUE(handler.WaitClosed());
+    ASSERT_EQ((size_t)g_nmessage, handler._received.size());
+    for (int i = 0; i < g_nmessage; ++i) {
+        EXPECT_EQ(g_prefix + std::to_string(i), handler._received[i]);
+    }
+}
+
 } // namespace 
@@ -84,6 +84,7 @@ public:
 
 class MyEchoService : public ::test::EchoService {
 public:
+    MyEchoService() : _last_trace_id(0), _last_span_id(0) {}
     void Echo(::google::protobuf::RpcController* cntl_base,
               const ::test::EchoRequest* req,
               ::test::EchoResponse* res,
@@ -91,6 +92,8 @@ public:
         brpc::ClosureGuard done_guard(done);
         brpc::Controller* cntl =
             static_cast<brpc::Controller*>(cntl_base);
+        _last_trace_id = cntl->trace_id();
+        _last_span_id = cntl->span_id();
         const std::string* sleep_ms_str =
             cntl->http_request().uri().GetQuery("sleep_ms");
         if (sleep_ms_str) {
@@ -98,6 +101,11 @@ public:
         }
         res->set_message(EXP_RESPONSE);
     }
+    uint64_t last_trace_id() const { return _last_trace_id; }
+    uint64_t last_span_id() const { return _last_span_id; }
+private:
+    uint64_t _last_trace_id;
+    uint64_t _last_span_id;
 };
 
 class HttpTest : public ::testing::Test{
@@ -1480,4 +1488,117 @@ TEST_F(HttpTest, spring_protobuf_content_type) {
     ASSERT_EQ("application/x-protobuf", cntl.http_response().content_type());
 }
 
+TEST_F(HttpTest, parse_trace_context) {
+    {
+        brpc::HttpHeader header;
+        header.SetHeader("traceparent",
+            "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+        header.SetHeader("tracestate", "congo=t61rcWkgMzE");
+        brpc::policy::HttpTraceContext ctx;
+        ASSERT_TRUE(brpc::policy::ParseHttpTraceContext(header, &ctx));
+        ASSERT_EQ(0x4bf92f3577b34da6ULL, ctx.trace_id_high);
+        ASSERT_EQ(0xa3ce929d0e0e4736ULL, ctx.trace_id);
+        ASSERT_EQ(0x00f067aa0ba902b7ULL, ctx.span_id);
+        ASSERT_EQ(0u, ctx.parent_span_id);
+        ASSERT_EQ(1, ctx.sampled);
+        ASSERT_EQ("congo=t61rcWkgMzE", ctx.trace_state);
+    }
+    {
+        brpc::HttpHeader header;
+        header.SetHeader("traceparent",
+            "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-00");
+        brpc::policy::HttpTraceContext ctx;
+        ASSERT_TRUE(brpc::policy::ParseHttpTraceContext(header, &ctx));
+        ASSERT_EQ(0, ctx.sampled);
+    }
+    {
+        // Invalid traceparent: all-zero trace id, bad length, bad version.
+        const char* const bad[] = {
+            "00-00000000000000000000000000000000-00f067aa0ba902b7-01",
+            "00-4bf92f3577b34da6a3ce929d0e0e473-00f067aa0ba902b7-01",
+            "ff-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01",
+            "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902bx-01",
+        };
+        for (size_t i = 0; i < arraysize(bad); ++i) {
+            brpc::HttpHeader header;
+            header.SetHeader("traceparent", bad[i]);
+            brpc::policy::HttpTraceContext ctx;
+            ASSERT_FALSE(brpc::policy::ParseHttpTraceContext(header, &ctx))
+                << bad[i];
+        }
+    }
+    {
+        brpc::HttpHeader header;
+        header.SetHeader("b3", "80f198ee56343ba864fe8b2a57d3eff7-"
+                         "e457b5a2e4d86bd1-1-05e3ac9a4f6e3b90");
+        brpc::policy::HttpTraceContext ctx;
+        ASSERT_TRUE(brpc::policy::ParseHttpTraceContext(header, &ctx));
+        ASSERT_EQ(0x80f198ee56343ba8ULL, ctx.trace_id_high);
+        ASSERT_EQ(0x64fe8b2a57d3eff7ULL, ctx.trace_id);
+        ASSERT_EQ(0xe457b5a2e4d86bd1ULL, ctx.span_id);
+        ASSERT_EQ(0x05e3ac9a4f6e3b90ULL, ctx.parent_span_id);
+        ASSERT_EQ(1, ctx.sampled);
+    }
+    {
+        brpc::HttpHeader header;
+        header.SetHeader("b3", "0");
+        brpc::policy::HttpTraceContext ctx;
+        ASSERT_TRUE(brpc::policy::ParseHttpTraceContext(header, &ctx));
+        ASSERT_EQ(0u, ctx.trace_id);
+        ASSERT_EQ(0, ctx.sampled);
+    }
+    {
+        brpc::HttpHeader header;
+        header.SetHeader("X-B3-TraceId", "463ac35c9f6413ad");
+        header.SetHeader("X-B3-SpanId", "a2fb4a1d1a96d312");
+        header.SetHeader("X-B3-ParentSpanId", "0020000000000001");
+        brpc::policy::HttpTraceContext ctx;
+        ASSERT_TRUE(brpc::policy::ParseHttpTraceContext(header, &ctx));
+        ASSERT_EQ(0u, ctx.trace_id_high);
+        ASSERT_EQ(0x463ac35c9f6413adULL, ctx.trace_id);
+        ASSERT_EQ(0xa2fb4a1d1a96d312ULL, ctx.span_id);
+        ASSERT_EQ(0x0020000000000001ULL, ctx.parent_span_id);
+        ASSERT_EQ(-1, ctx.sampled);
+    }
+    {
+        brpc::HttpHeader header;
+        brpc::policy::HttpTraceContext ctx;
+        ASSERT_FALSE(brpc::policy::ParseHttpTraceContext(header, &ctx));
+    }
+}
+
+TEST_F(HttpTest, propagate_trace_context) {
+    const int port = 8923;
+    brpc::Server server;
+    EXPECT_EQ(0, server.AddService(&_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    // Upstream sampled the request, it's traced even if rpcz is disabled.
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/EchoService/Echo";
+    cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+    cntl.http_request().SetHeader("traceparent",
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+    cntl.request_attachment().append("{\"message\":\"" + EXP_REQUEST + "\"}");
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(0xa3ce929d0e0e4736ULL, _svc.last_trace_id());
+    ASSERT_EQ(0x00f067aa0ba902b7ULL, _svc.last_span_id());
+
+    // Upstream didn't sample the request.
+    brpc::Controller cntl2;
+    cntl2.http_request().uri() = "/EchoService/Echo";
+    cntl2.http_request().set_method(brpc::HTTP_METHOD_POST);
+    cntl2.http_request().SetHeader("traceparent",
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-00");
+    cntl2.request_attachment().append("{\"message\":\"" + EXP_REQUEST + "\"}");
+    channel.CallMethod(NULL, &cntl2, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl2.Failed()) << cntl2.ErrorText();
+    ASSERT_EQ(0u, _svc.last_trace_id());
+}
+
 } //namespace
@@ -16,10 +16,17 @@
 // under the License.
 
 #include <iostream>
+#include <map>
+#include <memory>
 #include "butil/time.h"
 #include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/sys_byteorder.h"
+#include "butil/synchronization/lock.h"
 #include <brpc/memcache.h>
+#include <brpc/memcache_cluster.h>
 #include <brpc/channel.h>
+#include <brpc/policy/memcache_binary_header.h>
 #include <gtest/gtest.h>
 
 namespace brpc {
@@ -222,4 +229,264 @@ TEST_F(MemcacheTest, version) {
     ASSERT_TRUE(response.PopVersion(&version)) << response.LastError();
     std::cout << "version=" << version << std::endl;
 }
+
+// A memcached speaking binary GET/SET only, for testing MemcacheClusterChannel
+// without real memcached servers. Never destroyed since connections are
+// served by detached threads.
+class FakeMemcached {
+public:
+    FakeMemcached() : _listen_fd(-1), _nop(0), _nconn(0), _slow_ms(0) {}
+
+    int Start() {
+        butil::EndPoint ep;
+        butil::str2endpoint("127.0.0.1:0", &ep);
+        _listen_fd = butil::tcp_listen(ep);
+        if (_listen_fd < 0) {
+            return -1;
+        }
+        if (butil::get_local_side(_listen_fd, &_addr) != 0) {
+            return -1;
+        }
+        pthread_t th;
+        if (pthread_create(&th, NULL, AcceptThread, this) != 0) {
+            return -1;
+        }
+        pthread_detach(th);
+        return 0;
+    }
+
+    const butil::EndPoint& address() const { return _addr; }
+    int nop() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _nop;
+    }
+    // Replies on the first connection are delayed for so many milliseconds.
+    void set_slow_ms(int ms) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _slow_ms = ms;
+    }
+
+private:
+    struct Conn {
+        FakeMemcached* server;
+        int fd;
+        int index;
+    };
+
+    static void* AcceptThread(void* arg) {
+        FakeMemcached* s = static_cast<FakeMemcached*>(arg);
+        while (true) {
+            const int fd = accept(s->_listen_fd, NULL, NULL);
+            if (fd < 0) {
+                break;
+            }
+            Conn* conn = new Conn{s, fd, s->_nconn++};
+            pthread_t th;
+            pthread_create(&th, NULL, ServeThread, conn);
+            pthread_detach(th);
+        }
+        return NULL;
+    }
+
+    static bool ReadN(int fd, void* buf, size_t n) {
+        size_t nr = 0;
+        while (nr < n) {
+            const ssize_t rc = read(fd, (char*)buf + nr, n - nr);
+            if (rc <= 0) {
+                return false;
+            }
+            nr += rc;
+        }
+        return true;
+    }
+
+    static void* ServeThread(void* arg) {
+        std::unique_ptr<Conn> conn(static_cast<Conn*>(arg));
+        brpc::policy::MemcacheRequestHeader header;
+        while (ReadN(conn->fd, &header, sizeof(header))) {
+            const uint32_t body_len = butil::NetToHost32(header.total_body_length);
+            const uint16_t key_len = butil::NetToHost16(header.key_length);
+            std::string body(body_len, '\0');
+            if (!ReadN(conn->fd, &body[0], body_len)) {
+                break;
+            }
+            const std::string key = body.substr(header.extras_length, key_len);
+            std::string reply_body;
+            uint16_t status = 0;
+            int slow_ms = 0;
+            {
+                FakeMemcached* s = conn->server;
+                BAIDU_SCOPED_LOCK(s->_mutex);
+                if (conn->index == 0) {
+                    slow_ms = s->_slow_ms;
+                }
+                ++s->_nop;
+                if (header.command == brpc::policy::MC_BINARY_SET) {
+                    s->_kv[key] = body.substr(header.extras_length + key_len);
+                } else {
+                    std::map<std::string, std::string>::iterator
+                        it = s->_kv.find(key);
+                    if (it == s->_kv.end()) {
+                        status = brpc::MemcacheResponse::STATUS_KEY_ENOENT;
+                        reply_body = "Not found";
+                    } else {
+                        // flags = 0
+                        reply_body.assign(4, '\0');
+                        reply_body.append(it->second);
+                    }
+                }
+            }
+            brpc::policy::MemcacheResponseHeader rh;
+            memset(&rh, 0, sizeof(rh));
+            rh.magic = brpc::policy::MC_MAGIC_RESPONSE;
+            rh.command = header.command;
+            rh.extras_length = (status == 0 && !reply_body.empty() ? 4 : 0);
+            rh.status = butil::HostToNet16(status);
+            rh.total_body_length = butil::HostToNet32(reply_body.size());
+            rh.opaque = header.opaque;
+            rh.cas_value = butil::HostToNet64(1);
+            std::string out((const char*)&rh, sizeof(rh));
+            out.append(reply_body);
+            if (slow_ms) {
+                usleep(slow_ms * 1000L);
+            }
+            if (write(conn->fd, out.data(), out.size()) != (ssize_t)out.size()) {
+                break;
+            }
+        }
+        close(conn->fd);
+        return NULL;
+    }
+
+    int _listen_fd;
+    butil::EndPoint _addr;
+    butil::Mutex _mutex;
+    std::map<std::string, std::string> _kv;
+    int _nop;
+    int _nconn;
+    int _slow_ms;
+};
+
+TEST_F(MemcacheTest, cluster_channel) {
+    const int NSERVER = 3;
+    std::string url = "list://";
+    std::vector<FakeMemcached*> servers;
+    for (int i = 0; i < NSERVER; ++i) {
+        servers.push_back(new FakeMemcached);
+        ASSERT_EQ(0, servers.back()->Start());
+        if (i != 0) {
+            url.push_back(',');
+        }
+        url.append(butil::endpoint2str(servers.back()->address()).c_str());
+    }
+    brpc::MemcacheClusterChannel channel;
+    ASSERT_EQ(-1, channel.Init(url.c_str(), "rr", NULL));
+    ASSERT_EQ(0, channel.Init(url.c_str(), "c_murmurhash", NULL));
+
+    const int N = 30;
+    brpc::MemcacheRequest request;
+    brpc::MemcacheResponse response;
+    brpc::Controller cntl;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.Set(butil::string_printf("key_%d", i),
+                                butil::string_printf("value_%d", i), 0, 0, 0));
+    }
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(response.PopSet(NULL)) << response.LastError();
+    }
+    int total = 0;
+    for (int i = 0; i < NSERVER; ++i) {
+        // Keys are partitioned.
+        ASSERT_GT(servers[i]->nop(), 0);
+        ASSERT_LT(servers[i]->nop(), N);
+        total += servers[i]->nop();
+    }
+    ASSERT_EQ(N, total);
+
+    // Results are in the order of operations.
+    cntl.Reset();
+    request.Clear();
+    response.Clear();
+    for (int i = N - 1; i >= 0; --i) {
+        ASSERT_TRUE(request.Get(butil::string_printf("key_%d", i)));
+        ASSERT_TRUE(request.Get("not_exist"));
+    }
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    for (int i = N - 1; i >= 0; --i) {
+        std::string value;
+        ASSERT_TRUE(response.PopGet(&value, NULL, NULL)) << response.LastError();
+        ASSERT_EQ(butil::string_printf("value_%d", i), value);
+        ASSERT_FALSE(response.PopGet(&value, NULL, NULL));
+        ASSERT_EQ("Not found", response.LastError());
+    }
+
+    // Operations without keys are rejected.
+    cntl.Reset();
+    request.Clear();
+    response.Clear();
+    request.Version();
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_EQ(brpc::EREQUEST, cntl.ErrorCode());
+}
+
+TEST_F(MemcacheTest, cluster_channel_backup_request) {
+    const int NSERVER = 3;
+    std::string url = "list://";
+    std::vector<FakeMemcached*> servers;
+    for (int i = 0; i < NSERVER; ++i) {
+        servers.push_back(new FakeMemcached);
+        ASSERT_EQ(0, servers.back()->Start());
+        if (i != 0) {
+            url.push_back(',');
+        }
+        url.append(butil::endpoint2str(servers.back()->address()).c_str());
+    }
+    brpc::ChannelOptions options;
+    options.backup_request_ms = 30;
+    options.timeout_ms = 3000;
+    brpc::MemcacheClusterChannel channel;
+    ASSERT_EQ(0, channel.Init(url.c_str(), "c_murmurhash", &options));
+
+    const int N = 30;
+    brpc::MemcacheRequest request;
+    brpc::Controller cntl;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.Set(butil::string_printf("key_%d", i),
+                                butil::string_printf("value_%d", i), 0, 0, 0));
+    }
+    brpc::MemcacheResponse set_response;
+    channel.CallMethod(NULL, &cntl, &request, &set_response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+
+    // The connections used by the sub calls become slow, GETs are answered
+    // by backup requests to the same servers rather than NOT_FOUND from
+    // servers not owning the keys.
+    for (int i = 0; i < NSERVER; ++i) {
+        servers[i]->set_slow_ms(500);
+    }
+    cntl.Reset();
+    request.Clear();
+    brpc::MemcacheResponse response;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.Get(butil::string_printf("key_%d", i)));
+    }
+    ASSERT_TRUE(request.Get("not_exist"));
+    butil::Timer tm;
+    tm.start();
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    tm.stop();
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_LT(tm.m_elapsed(), 400);
+    for (int i = 0; i < N; ++i) {
+        std::string value;
+        ASSERT_TRUE(response.PopGet(&value, NULL, NULL)) << response.LastError();
+        ASSERT_EQ(butil::string_printf("value_%d", i), value);
+    }
+    std::string value;
+    ASSERT_FALSE(response.PopGet(&value, NULL, NULL));
+    ASSERT_EQ("Not found", response.LastError());
+}
 } //namespace
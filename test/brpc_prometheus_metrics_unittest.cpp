@@ -18,12 +18,21 @@
 // brpc - A framework to host and access services throughout Baidu.
 
 #include <gtest/gtest.h>
+#include <map>
+#include <google/protobuf/io/coded_stream.h>
+#include "butil/iobuf.h"
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/builtin/prometheus_metrics_service.h"
 #include "butil/strings/string_piece.h"
+#include "bvar/bvar.h"
 #include "echo.pb.h"
 
+namespace bvar {
+DECLARE_bool(bvar_latency_recorder_use_histogram);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -142,3 +151,120 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+TEST(PrometheusMetrics, latency_histogram) {
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    bvar::LatencyRecorder rec("prometheus_test_hist");
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = false;
+    ASSERT_TRUE(rec.use_histogram());
+    ASSERT_EQ("prometheus_test_hist_latency_histogram",
+              rec.latency_histogram_name());
+    rec << 1 << 10 << 1000;
+
+    butil::IOBuf buf;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+    const std::string res = buf.to_string();
+    const std::string name = "prometheus_test_hist_latency_histogram";
+    ASSERT_NE(std::string::npos,
+              res.find("# TYPE " + name + " histogram\n"));
+    ASSERT_NE(std::string::npos,
+              res.find(name + "_bucket{le=\"0\"} 0\n"));
+    ASSERT_NE(std::string::npos,
+              res.find(name + "_bucket{le=\"1\"} 1\n"));
+    ASSERT_NE(std::string::npos,
+              res.find(name + "_bucket{le=\"10\"} 2\n"));
+    ASSERT_NE(std::string::npos,
+              res.find(name + "_bucket{le=\"4294967295\"} 3\n"));
+    ASSERT_NE(std::string::npos,
+              res.find(name + "_bucket{le=\"+Inf\"} 3\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_sum 1011\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_count 3\n"));
+}
+
+// Parse output of DumpPrometheusMetricsPbToIOBuf into name -> value.
+static void ParseMetricFamilies(const butil::IOBuf& buf,
+                                std::map<std::string, double>* m) {
+    const std::string data = buf.to_string();
+    google::protobuf::io::CodedInputStream in(
+        (const uint8_t*)data.data(), data.size());
+    uint32_t family_size = 0;
+    while (in.ReadVarint32(&family_size)) {
+        const google::protobuf::io::CodedInputStream::Limit family_limit =
+            in.PushLimit(family_size);
+        std::string name;
+        double value = 0;
+        uint32_t tag = 0;
+        while ((tag = in.ReadTag()) != 0) {
+            uint32_t len = 0;
+            uint32_t type = 0;
+            switch (tag) {
+            case 0x0a:
+                ASSERT_TRUE(in.ReadVarint32(&len));
+                ASSERT_TRUE(in.ReadString(&name, len));
+                break;
+            case 0x18:
+                ASSERT_TRUE(in.ReadVarint32(&type));
+                ASSERT_EQ(1u, type);
+                break;
+            case 0x22: {
+                ASSERT_TRUE(in.ReadVarint32(&len));
+                ASSERT_EQ(0x12u, in.ReadTag());
+                ASSERT_TRUE(in.ReadVarint32(&len));
+                ASSERT_EQ(0x09u, in.ReadTag());
+                uint64_t bits = 0;
+                ASSERT_TRUE(in.ReadLittleEndian64(&bits));
+                memcpy(&value, &bits, sizeof(value));
+                break;
+            }
+            default:
+                ASSERT_TRUE(false) << "Unknown tag=" << tag;
+            }
+        }
+        in.PopLimit(family_limit);
+        (*m)[name] = value;
+    }
+}
+
+TEST(PrometheusMetrics, protobuf_format) {
+    bvar::Adder<int> adder("prometheus_pb_test_adder");
+    bvar::Status<std::string> str("prometheus_pb_test_str", "hello");
+    bvar::IntRecorder recorder;
+    recorder.expose("prometheus_pb_test_recorder");
+    adder << 3;
+    recorder << 1 << 2;
+
+    butil::IOBuf buf;
+    uint64_t token = 0;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsPbToIOBuf(0, &buf, &token));
+    ASSERT_NE(0u, token);
+    std::map<std::string, double> m;
+    ParseMetricFamilies(buf, &m);
+    ASSERT_EQ(3, m["prometheus_pb_test_adder"]);
+    ASSERT_EQ(1.5, m["prometheus_pb_test_recorder"]);
+    ASSERT_TRUE(m.find("prometheus_pb_test_str") == m.end());
+
+    // Unchanged variables are skipped by incremental scrapes.
+    adder << 1;
+    buf.clear();
+    m.clear();
+    uint64_t token2 = 0;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsPbToIOBuf(token, &buf, &token2));
+    ASSERT_NE(token, token2);
+    ParseMetricFamilies(buf, &m);
+    ASSERT_EQ(4, m["prometheus_pb_test_adder"]);
+    ASSERT_TRUE(m.find("prometheus_pb_test_recorder") == m.end());
+
+    buf.clear();
+    m.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsPbToIOBuf(token2, &buf, NULL));
+    ParseMetricFamilies(buf, &m);
+    ASSERT_TRUE(m.find("prometheus_pb_test_adder") == m.end());
+
+    // Unknown tokens get all variables.
+    buf.clear();
+    m.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsPbToIOBuf(12345, &buf, NULL));
+    ParseMetricFamilies(buf, &m);
+    ASSERT_EQ(4, m["prometheus_pb_test_adder"]);
+    ASSERT_EQ(1.5, m["prometheus_pb_test_recorder"]);
+}
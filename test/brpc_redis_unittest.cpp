@@ -25,6 +25,8 @@
 #include <brpc/policy/redis_authenticator.h>
 #include <brpc/server.h>
 #include <brpc/redis_command.h>
+#include <brpc/redis_cluster.h>
+#include <bthread/countdown_event.h>
 #include <gtest/gtest.h>
 
 namespace brpc {
@@ -38,6 +40,10 @@ int main(int argc, char* argv[]) {
 }
 
 namespace {
+static void SignalCountdown(bthread::CountdownEvent* event) {
+    event->signal();
+}
+
 static pthread_once_t download_redis_server_once = PTHREAD_ONCE_INIT;
 
 static pid_t g_redis_pid = -1; 
@@ -1238,4 +1244,404 @@ TEST_F(RedisTest, server_handle_pipeline) {
     ASSERT_STREQ(response.reply(7).c_str(), "world");
 }
 
+class ShardedIncrCommandHandler : public IncrCommandHandler {
+public:
+    bool IsKeyPartitionable() const { return true; }
+};
+
+// Sum of all counters, not partitionable.
+class SumCommandHandler : public brpc::RedisCommandHandler {
+public:
+    brpc::RedisCommandHandlerResult Run(const std::vector<butil::StringPiece>& args,
+                                        brpc::RedisReply* output,
+                                        bool flush_batched) {
+        int64_t sum = 0;
+        s_mutex.lock();
+        for (auto it = int_map.begin(); it != int_map.end(); ++it) {
+            if (butil::StringPiece(it->first).starts_with("sharded_")) {
+                sum += it->second;
+            }
+        }
+        s_mutex.unlock();
+        output->SetInteger(sum);
+        return brpc::REDIS_CMD_HANDLED;
+    }
+};
+
+TEST_F(RedisTest, server_execution_shards) {
+    brpc::Server server;
+    brpc::ServerOptions server_options;
+    RedisServiceImpl* rsimpl = new RedisServiceImpl;
+    rsimpl->AddCommandHandler("incr", new ShardedIncrCommandHandler);
+    rsimpl->AddCommandHandler("sum", new SumCommandHandler);
+    ASSERT_EQ(0, rsimpl->SetExecutionShards(4));
+    ASSERT_EQ(-1, rsimpl->SetExecutionShards(4));
+    server_options.redis_service = rsimpl;
+    brpc::PortRange pr(8081, 8900);
+    ASSERT_EQ(0, server.Start("127.0.0.1", pr, &server_options));
+
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_REDIS;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1", server.listen_address().port, &options));
+
+    const int N = 8;
+    const int ROUNDS = 50;
+    for (int k = 0; k < 3; ++k) {
+        brpc::RedisRequest request;
+        brpc::RedisResponse response;
+        brpc::Controller cntl;
+        for (int r = 0; r < ROUNDS; ++r) {
+            for (int i = 0; i < N; ++i) {
+                ASSERT_TRUE(request.AddCommand("incr sharded_%d", i));
+            }
+        }
+        ASSERT_TRUE(request.AddCommand("sum"));
+        ASSERT_TRUE(request.AddCommand("incr sharded_0"));
+        channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(N * ROUNDS + 2, response.reply_size());
+        // Commands with a same key run in order.
+        for (int r = 0; r < ROUNDS; ++r) {
+            for (int i = 0; i < N; ++i) {
+                const brpc::RedisReply& reply = response.reply(r * N + i);
+                ASSERT_TRUE(reply.is_integer());
+                const int base = k * ROUNDS + (i == 0 ? k : 0);
+                ASSERT_EQ(base + r + 1, reply.integer());
+            }
+        }
+        // sum waits for all previous commands.
+        ASSERT_TRUE(response.reply(N * ROUNDS).is_integer());
+        ASSERT_EQ(N * ROUNDS * (k + 1) + k, response.reply(N * ROUNDS).integer());
+        ASSERT_TRUE(response.reply(N * ROUNDS + 1).is_integer());
+        ASSERT_EQ((k + 1) * (ROUNDS + 1), response.reply(N * ROUNDS + 1).integer());
+    }
+}
+
+// A redis cluster of two nodes, slots [0, 8192) are owned by node 0 and
+// others by node 1 as CLUSTER SLOTS says. Owners of slots can be changed to
+// make nodes reply MOVED, or marked as migrating to make nodes reply ASK.
+class FakeRedisCluster {
+public:
+    static const int NNODE = 2;
+
+    FakeRedisCluster() : _nmoved(0), _nask(0), _delay_ms(0) {
+        for (int i = 0; i < brpc::REDIS_CLUSTER_SLOTS; ++i) {
+            _owner[i] = (i < brpc::REDIS_CLUSTER_SLOTS / 2 ? 0 : 1);
+            _migrating[i] = false;
+            _bouncing[i] = false;
+        }
+        for (int i = 0; i < NNODE; ++i) {
+            _asking[i] = false;
+            _ncommand[i] = 0;
+        }
+    }
+
+    int Start() {
+        const char* const cmds[] = { "cluster", "asking", "get", "set",
+                                     "mget", "del" };
+        for (int i = 0; i < NNODE; ++i) {
+            brpc::RedisService* service = new brpc::RedisService;
+            for (size_t j = 0; j < arraysize(cmds); ++j) {
+                service->AddCommandHandler(cmds[j], new Handler(this, i));
+            }
+            brpc::ServerOptions options;
+            options.redis_service = service;
+            if (_servers[i].Start("127.0.0.1", brpc::PortRange(8081, 8900),
+                                  &options) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    std::string seeds() const {
+        return butil::endpoint2str(_servers[0].listen_address()).c_str();
+    }
+
+    void Run(int node, const std::vector<butil::StringPiece>& args,
+             brpc::RedisReply* output) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        ++_ncommand[node];
+        const bool asking = _asking[node];
+        _asking[node] = false;
+        if (args[0] == "cluster") {
+            output->SetArray(NNODE);
+            for (int i = 0; i < NNODE; ++i) {
+                brpc::RedisReply& range = (*output)[i];
+                range.SetArray(3);
+                range[0].SetInteger(i * brpc::REDIS_CLUSTER_SLOTS / NNODE);
+                range[1].SetInteger((i + 1) * brpc::REDIS_CLUSTER_SLOTS / NNODE - 1);
+                range[2].SetArray(2);
+                range[2][0].SetString("127.0.0.1");
+                range[2][1].SetInteger(_servers[i].listen_address().port);
+            }
+            return;
+        }
+        if (args[0] == "asking") {
+            _asking[node] = true;
+            output->SetStatus("OK");
+            return;
+        }
+        if (args.size() < 2) {
+            output->SetError("ERR wrong number of arguments");
+            return;
+        }
+        const int slot = brpc::RedisClusterKeySlot(args[1]);
+        for (size_t i = 2; args[0] != "set" && i < args.size(); ++i) {
+            if (brpc::RedisClusterKeySlot(args[i]) != slot) {
+                output->SetError("CROSSSLOT Keys don't hash to the same slot");
+                return;
+            }
+        }
+        const int owner = _owner[slot];
+        if (_bouncing[slot]) {
+            // Every node claims that the other one owns the slot.
+            ++_nmoved;
+            output->FormatError("MOVED %d %s", slot, address(1 - node).c_str());
+            return;
+        }
+        if (_migrating[slot] && node == owner) {
+            ++_nask;
+            output->FormatError("ASK %d %s", slot, address(1 - owner).c_str());
+            return;
+        }
+        if (node != owner && !(asking && _migrating[slot])) {
+            ++_nmoved;
+            output->FormatError("MOVED %d %s", slot, address(owner).c_str());
+            return;
+        }
+        if (args[0] == "set" && args.size() == 3) {
+            _kv[args[1].as_string()] = args[2].as_string();
+            output->SetStatus("OK");
+        } else if (args[0] == "get") {
+            Get(args[1], output);
+        } else if (args[0] == "mget") {
+            output->SetArray(args.size() - 1);
+            for (size_t i = 1; i < args.size(); ++i) {
+                Get(args[i], &(*output)[i - 1]);
+            }
+        } else if (args[0] == "del") {
+            int64_t n = 0;
+            for (size_t i = 1; i < args.size(); ++i) {
+                n += _kv.erase(args[i].as_string());
+            }
+            output->SetInteger(n);
+        } else {
+            output->SetError("ERR wrong number of arguments");
+        }
+    }
+
+    std::string address(int node) const {
+        return butil::endpoint2str(_servers[node].listen_address()).c_str();
+    }
+
+    void Get(const butil::StringPiece& key, brpc::RedisReply* output) {
+        std::map<std::string, std::string>::const_iterator
+            it = _kv.find(key.as_string());
+        if (it == _kv.end()) {
+            output->SetNullString();
+        } else {
+            output->SetString(it->second);
+        }
+    }
+
+    class Handler : public brpc::RedisCommandHandler {
+    public:
+        Handler(FakeRedisCluster* cluster, int node)
+            : _cluster(cluster), _node(node) {}
+        brpc::RedisCommandHandlerResult Run(
+            const std::vector<butil::StringPiece>& args,
+            brpc::RedisReply* output, bool) {
+            if (_cluster->_delay_ms) {
+                bthread_usleep(_cluster->_delay_ms * 1000L);
+            }
+            _cluster->Run(_node, args, output);
+            return brpc::REDIS_CMD_HANDLED;
+        }
+    private:
+        FakeRedisCluster* _cluster;
+        int _node;
+    };
+
+    butil::Mutex _mutex;
+    brpc::Server _servers[NNODE];
+    int _owner[brpc::REDIS_CLUSTER_SLOTS];
+    bool _migrating[brpc::REDIS_CLUSTER_SLOTS];
+    bool _bouncing[brpc::REDIS_CLUSTER_SLOTS];
+    bool _asking[NNODE];
+    int _ncommand[NNODE];
+    int _nmoved;
+    int _nask;
+    int _delay_ms;
+    std::map<std::string, std::string> _kv;
+};
+
+TEST_F(RedisTest, cluster_key_slot) {
+    // Examples in https://redis.io/topics/cluster-spec
+    ASSERT_EQ(12739, brpc::RedisClusterKeySlot("123456789"));
+    ASSERT_EQ(brpc::RedisClusterKeySlot("user1000"),
+              brpc::RedisClusterKeySlot("{user1000}.following"));
+    ASSERT_EQ(brpc::RedisClusterKeySlot("user1000"),
+              brpc::RedisClusterKeySlot("foo{user1000}{bar}"));
+    // Empty hash tags are not used.
+    ASSERT_NE(brpc::RedisClusterKeySlot(""),
+              brpc::RedisClusterKeySlot("{}.following"));
+}
+
+TEST_F(RedisTest, cluster_channel) {
+    FakeRedisCluster cluster;
+    ASSERT_EQ(0, cluster.Start());
+    brpc::RedisClusterChannel channel;
+    ASSERT_EQ(0, channel.Init(cluster.seeds().c_str(), NULL));
+
+    const int N = 16;
+    brpc::RedisRequest request;
+    brpc::RedisResponse response;
+    brpc::Controller cntl;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.AddCommand("set key%d value%d", i, i));
+    }
+    std::string mget = "mget";
+    for (int i = 0; i < N; ++i) {
+        mget.append(butil::string_printf(" key%d", i));
+    }
+    mget.append(" no_such_key");
+    ASSERT_TRUE(request.AddCommand(mget));
+    ASSERT_TRUE(request.AddCommand("get key1"));
+    ASSERT_TRUE(request.AddCommand("del key0 key1 no_such_key"));
+    ASSERT_TRUE(request.AddCommand("mset a 1 b 2"));
+    ASSERT_TRUE(request.AddCommand("get key1"));
+    ASSERT_TRUE(request.AddCommand("multi"));
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(N + 6, response.reply_size());
+    for (int i = 0; i < N; ++i) {
+        ASSERT_STREQ("OK", response.reply(i).c_str());
+    }
+    const brpc::RedisReply& mget_reply = response.reply(N);
+    ASSERT_TRUE(mget_reply.is_array());
+    ASSERT_EQ((size_t)N + 1, mget_reply.size());
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(butil::string_printf("value%d", i), mget_reply[i].data());
+    }
+    ASSERT_TRUE(mget_reply[N].is_nil());
+    ASSERT_STREQ("value1", response.reply(N + 1).c_str());
+    ASSERT_EQ(2, response.reply(N + 2).integer());
+    // The fake cluster does not support mset.
+    ASSERT_TRUE(response.reply(N + 3).is_error());
+    ASSERT_TRUE(response.reply(N + 4).is_nil());
+    ASSERT_TRUE(response.reply(N + 5).is_error());
+    // Keys are spread over both nodes.
+    ASSERT_GT(cluster._ncommand[0], 1);
+    ASSERT_GT(cluster._ncommand[1], 1);
+    ASSERT_EQ(0, cluster._nmoved);
+}
+
+TEST_F(RedisTest, cluster_channel_redirect) {
+    FakeRedisCluster cluster;
+    ASSERT_EQ(0, cluster.Start());
+    brpc::RedisClusterChannel channel;
+    ASSERT_EQ(0, channel.Init(cluster.seeds().c_str(), NULL));
+
+    // The slot of key2 is moved to the other node.
+    const int moved_slot = brpc::RedisClusterKeySlot("key2");
+    cluster._owner[moved_slot] = 1 - cluster._owner[moved_slot];
+    // The slot of key3 is being migrated.
+    const int ask_slot = brpc::RedisClusterKeySlot("key3");
+    ASSERT_NE(moved_slot, ask_slot);
+    cluster._migrating[ask_slot] = true;
+    for (int i = 0; i < 2; ++i) {
+        brpc::RedisRequest request;
+        brpc::RedisResponse response;
+        brpc::Controller cntl;
+        ASSERT_TRUE(request.AddCommand("set key2 v2"));
+        ASSERT_TRUE(request.AddCommand("set key3 v3"));
+        ASSERT_TRUE(request.AddCommand("mget key2 key3"));
+        channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(3, response.reply_size());
+        ASSERT_STREQ("OK", response.reply(0).c_str());
+        ASSERT_STREQ("OK", response.reply(1).c_str());
+        ASSERT_EQ(2u, response.reply(2).size());
+        ASSERT_STREQ("v2", response.reply(2)[0].c_str());
+        ASSERT_STREQ("v3", response.reply(2)[1].c_str());
+        // The slot map is updated by MOVED but not ASK.
+        ASSERT_EQ(2, cluster._nmoved);
+        ASSERT_EQ(2 * (i + 1), cluster._nask);
+    }
+
+    // Redirections are limited.
+    cluster._owner[moved_slot] = 1 - cluster._owner[moved_slot];
+    cluster._migrating[moved_slot] = true;
+    cluster._owner[ask_slot] = 1 - cluster._owner[ask_slot];
+    brpc::RedisClusterChannelOptions options;
+    options.max_redirect = 0;
+    brpc::RedisClusterChannel channel2;
+    ASSERT_EQ(0, channel2.Init(cluster.seeds().c_str(), &options));
+    brpc::RedisRequest request;
+    brpc::RedisResponse response;
+    brpc::Controller cntl;
+    ASSERT_TRUE(request.AddCommand("get key2"));
+    ASSERT_TRUE(request.AddCommand("get key3"));
+    channel2.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_TRUE(butil::StringPiece(response.reply(0).error_message()).starts_with("ASK "));
+    ASSERT_TRUE(butil::StringPiece(response.reply(1).error_message()).starts_with("MOVED "));
+}
+
+TEST_F(RedisTest, cluster_channel_timeout_across_redirects) {
+    FakeRedisCluster cluster;
+    ASSERT_EQ(0, cluster.Start());
+    brpc::RedisClusterChannelOptions options;
+    options.max_redirect = 100;
+    brpc::RedisClusterChannel channel;
+    ASSERT_EQ(0, channel.Init(cluster.seeds().c_str(), &options));
+    cluster._bouncing[brpc::RedisClusterKeySlot("key1")] = true;
+    cluster._delay_ms = 20;
+    brpc::RedisRequest request;
+    brpc::RedisResponse response;
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(200);
+    ASSERT_TRUE(request.AddCommand("get key1"));
+    butil::Timer tm;
+    tm.start();
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    tm.stop();
+    // All rounds share one deadline instead of 100 * 20ms.
+    ASSERT_TRUE(cntl.Failed());
+    ASSERT_EQ(brpc::ERPCTIMEDOUT, cntl.ErrorCode()) << cntl.ErrorText();
+    ASSERT_LT(tm.m_elapsed(), 600);
+    ASSERT_LT(cluster._nmoved, 30);
+}
+
+TEST_F(RedisTest, cluster_channel_async) {
+    FakeRedisCluster cluster;
+    ASSERT_EQ(0, cluster.Start());
+    brpc::RedisClusterChannel channel;
+    ASSERT_EQ(0, channel.Init(cluster.seeds().c_str(), NULL));
+    brpc::RedisRequest request;
+    brpc::RedisResponse response;
+    brpc::Controller cntl;
+    ASSERT_TRUE(request.AddCommand("set key1 value1"));
+    ASSERT_TRUE(request.AddCommand("get key1"));
+    bthread::CountdownEvent event;
+    channel.CallMethod(NULL, &cntl, &request, &response,
+                       brpc::NewCallback(SignalCountdown, &event));
+    event.wait();
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(2, response.reply_size());
+    ASSERT_STREQ("value1", response.reply(1).c_str());
+
+    // Fail when the cluster is unreachable.
+    cntl.Reset();
+    response.Clear();
+    cluster._servers[0].Stop(0);
+    cluster._servers[0].Join();
+    cluster._servers[1].Stop(0);
+    cluster._servers[1].Join();
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_TRUE(cntl.Failed());
+}
+
 } //namespace
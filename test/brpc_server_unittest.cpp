@@ -28,6 +28,7 @@
 #include "butil/macros.h"
 #include "butil/fd_guard.h"
 #include "butil/files/scoped_file.h"
+#include "bvar/bvar.h"
 #include "brpc/socket.h"
 #include "brpc/builtin/version_service.h"
 #include "brpc/builtin/health_service.h"
@@ -66,6 +67,10 @@ DECLARE_bool(enable_threads_service);
 DECLARE_bool(enable_dir_service);
 }
 
+namespace bthread {
+DECLARE_bool(bthread_enable_cpu_accounting);
+}
+
 namespace {
 void* RunClosure(void* arg) {
     google::protobuf::Closure* done = (google::protobuf::Closure*)arg;
@@ -1401,4 +1406,67 @@ TEST_F(ServerTest, max_concurrency) {
     stub.Echo(&cntl4, &req, NULL, NULL);
     ASSERT_FALSE(cntl4.Failed()) << cntl4.ErrorText();
 }
+
+class CpuEchoServiceImpl : public test::EchoService {
+public:
+    CpuEchoServiceImpl() : cpu_time_ns(-1) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        // Burn CPU
+        const int64_t deadline = butil::cpuwide_time_us() + 20000;
+        while (butil::cpuwide_time_us() < deadline) {}
+        response->set_message(request->message());
+        cpu_time_ns = cntl->cpu_time_ns();
+    }
+    int64_t cpu_time_ns;
+};
+
+TEST_F(ServerTest, cpu_accounting) {
+    bthread::FLAGS_bthread_enable_cpu_accounting = true;
+    const int port = 9201;
+    brpc::Server server;
+    CpuEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(EXP_REQUEST);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    bthread::FLAGS_bthread_enable_cpu_accounting = false;
+    // Not a server-side controller.
+    ASSERT_EQ(-1, cntl.cpu_time_ns());
+    // The busy loop may be preempted by other threads.
+    ASSERT_GT(service.cpu_time_ns, 5000000);
+
+    // Method status is exposed by a background bthread of the server and
+    // updated after the response is written.
+    int64_t cpu_time_us = 0;
+    for (int i = 0; i < 20 && cpu_time_us == 0; ++i) {
+        std::vector<std::string> names;
+        bvar::Variable::list_exposed(&names);
+        for (size_t j = 0; j < names.size(); ++j) {
+            if (butil::StringPiece(names[j]).ends_with(
+                    "9201_test_echo_service_echo_cpu_time_us")) {
+                cpu_time_us = strtoll(bvar::Variable::describe_exposed(
+                        names[j]).c_str(), NULL, 10);
+                break;
+            }
+        }
+        if (cpu_time_us == 0) {
+            bthread_usleep(100000);
+        }
+    }
+    ASSERT_GE(cpu_time_us, service.cpu_time_ns / 1000);
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
 } //namespace
@@ -15,8 +15,11 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <vector>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"
+#include "butil/file_util.h"
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/logging.h"
@@ -25,6 +28,8 @@
 #include "bthread/task_group.h"
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
+#include "bthread/offcpu_profiler.h"
+#include "bvar/variable.h"
 
 namespace bthread {
 extern butil::atomic<TaskControl*> g_task_control;
@@ -394,4 +399,116 @@ TEST(ButexTest, stop_before_sleeping) {
         ASSERT_EQ(EINVAL, bthread_stop(th));
     }
 }
+
+struct WakeAllArg {
+    butil::atomic<int>* butex;
+    long wait_msec;  // 0 means no timeout
+    butil::atomic<int>* nwoken;
+    butil::atomic<int>* ntimedout;
+};
+
+void* wait_for_wake_all(void* void_arg) {
+    WakeAllArg* arg = static_cast<WakeAllArg*>(void_arg);
+    timespec ts;
+    if (arg->wait_msec) {
+        ts = butil::milliseconds_from_now(arg->wait_msec);
+    }
+    const int rc = bthread::butex_wait(arg->butex, 0,
+                                       arg->wait_msec ? &ts : NULL);
+    if (rc == 0) {
+        arg->nwoken->fetch_add(1);
+    } else if (errno == ETIMEDOUT) {
+        arg->ntimedout->fetch_add(1);
+    } else {
+        EXPECT_EQ(EWOULDBLOCK, errno);
+    }
+    return NULL;
+}
+
+TEST(ButexTest, wake_all_many_waiters) {
+    const size_t NBTHREAD = 1000;
+    const size_t NPTHREAD = 4;
+    butil::atomic<int>* b =
+        bthread::butex_create_checked<butil::atomic<int> >();
+    *b = 0;
+    butil::atomic<int> nwoken(0);
+    butil::atomic<int> ntimedout(0);
+    std::vector<WakeAllArg> args(NBTHREAD + NPTHREAD);
+    std::vector<bthread_t> bths(NBTHREAD);
+    std::vector<pthread_t> pths(NPTHREAD);
+    for (size_t i = 0; i < args.size(); ++i) {
+        args[i].butex = b;
+        // Some waiters time out around butex_wake_all() to race with it.
+        args[i].wait_msec = (i % 10 == 0 ? 100 + i % 7 : 0);
+        args[i].nwoken = &nwoken;
+        args[i].ntimedout = &ntimedout;
+    }
+    for (size_t i = 0; i < NBTHREAD; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&bths[i], NULL,
+                                              wait_for_wake_all, &args[i]));
+    }
+    for (size_t i = 0; i < NPTHREAD; ++i) {
+        ASSERT_EQ(0, pthread_create(&pths[i], NULL, wait_for_wake_all,
+                                    &args[NBTHREAD + i]));
+    }
+    usleep(100000);
+    b->store(1);
+    const int n = bthread::butex_wake_all(b);
+    ASSERT_EQ(0, bthread::butex_wake_all(b));
+    for (size_t i = 0; i < NBTHREAD; ++i) {
+        ASSERT_EQ(0, bthread_join(bths[i], NULL));
+    }
+    for (size_t i = 0; i < NPTHREAD; ++i) {
+        ASSERT_EQ(0, pthread_join(pths[i], NULL));
+    }
+    // Waiters detached by butex_wake_all() never time out.
+    ASSERT_EQ(n, nwoken.load());
+    ASSERT_LE(n + ntimedout.load(), (int)args.size());
+    ASSERT_LT((int)(args.size() * 8 / 10), n);
+    bthread::butex_destroy(b);
+}
+
+void* wait_butex_until_set(void* arg) {
+    butil::atomic<int>* b = (butil::atomic<int>*)arg;
+    while (b->load() == 0) {
+        bthread::butex_wait(b, 0, NULL);
+    }
+    return NULL;
+}
+
+TEST(ButexTest, offcpu_profiler_and_runqueue_delay) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "show_bthread_runqueue_delay_in_vars", "true").empty());
+    const char* const prof_name = "./offcpu_profiler_and_runqueue_delay.prof";
+    ASSERT_TRUE(bthread::OffCpuProfilerStart(prof_name));
+    ASSERT_FALSE(bthread::OffCpuProfilerStart(prof_name));
+    for (int i = 0; i < 20; ++i) {
+        butil::atomic<int>* b = bthread::butex_create_checked<butil::atomic<int> >();
+        b->store(0);
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, wait_butex_until_set, b));
+        bthread_usleep(5000);
+        b->store(1);
+        bthread::butex_wake(b);
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        bthread::butex_destroy(b);
+    }
+    // Wait for the collector to dump samples.
+    bthread_usleep(1500000);
+    bthread::OffCpuProfilerStop();
+    ASSERT_FALSE(bthread::g_ocp);
+    GFLAGS_NS::SetCommandLineOption(
+        "show_bthread_runqueue_delay_in_vars", "false");
+
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath(prof_name), &content));
+    ASSERT_EQ(0u, content.find("--- contention\ncycles/second=1000000000\n"));
+    ASSERT_NE(std::string::npos, content.find(" @ ")) << content;
+    butil::DeleteFile(butil::FilePath(prof_name), false);
+
+    const std::string count =
+        bvar::Variable::describe_exposed("bthread_runqueue_delay_count");
+    ASSERT_FALSE(count.empty());
+    ASSERT_LT(0, atoi(count.c_str()));
+}
 } // namespace
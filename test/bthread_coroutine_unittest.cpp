@@ -0,0 +1,140 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/butex.h"
+#include "bthread/countdown_event.h"
+#include "bthread/coroutine.h"
+#include "brpc/coroutine.h"
+
+namespace {
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+bthread::Task<int> add_later(int a, int b, int64_t delay_us) {
+    EXPECT_EQ(0, co_await bthread::co_usleep(delay_us));
+    co_return a + b;
+}
+
+bthread::Task<void> sum_up(int* result, bthread::CountdownEvent* event) {
+    const int64_t start_us = butil::gettimeofday_us();
+    *result = co_await add_later(1, 2, 10000);
+    *result += co_await add_later(3, 4, 0);
+    EXPECT_GE(butil::gettimeofday_us() - start_us, 10000);
+    event->signal();
+}
+
+TEST(CoroutineTest, task_and_sleep) {
+    int result = 0;
+    bthread::CountdownEvent event;
+    bthread::start_coroutine(sum_up(&result, &event));
+    ASSERT_EQ(0, event.wait());
+    ASSERT_EQ(10, result);
+}
+
+bthread::Task<void> wait_butex(void* butex, int* rc, int* error,
+                               const timespec* abstime,
+                               bthread::CountdownEvent* event) {
+    *rc = co_await bthread::co_butex_wait(butex, 0, abstime);
+    *error = errno;
+    event->signal();
+}
+
+TEST(CoroutineTest, butex) {
+    int* butex = bthread::butex_create_checked<int>();
+    *butex = 0;
+    int rc = 1;
+    int error = 0;
+    bthread::CountdownEvent event;
+    bthread::start_coroutine(wait_butex(butex, &rc, &error, NULL, &event));
+    bthread_usleep(10000);
+    ASSERT_EQ(1, rc);
+    ASSERT_EQ(1, bthread::butex_wake(butex));
+    ASSERT_EQ(0, event.wait());
+    ASSERT_EQ(0, rc);
+
+    event.reset();
+    const timespec abstime = butil::milliseconds_from_now(10);
+    bthread::start_coroutine(wait_butex(butex, &rc, &error, &abstime, &event));
+    ASSERT_EQ(0, event.wait());
+    ASSERT_EQ(-1, rc);
+    ASSERT_EQ(ETIMEDOUT, error);
+
+    event.reset();
+    *butex = 1;
+    bthread::start_coroutine(wait_butex(butex, &rc, &error, NULL, &event));
+    ASSERT_EQ(0, event.wait());
+    ASSERT_EQ(-1, rc);
+    ASSERT_EQ(EWOULDBLOCK, error);
+    bthread::butex_destroy(butex);
+}
+
+bthread::Task<void> read_fd(int fd, char* c, bthread::CountdownEvent* event) {
+    EXPECT_EQ(0, co_await bthread::co_fd_wait(fd, EPOLLIN));
+    EXPECT_EQ(1, read(fd, c, 1));
+    event->signal();
+}
+
+TEST(CoroutineTest, fd_wait) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    char c = 0;
+    bthread::CountdownEvent event;
+    bthread::start_coroutine(read_fd(fds[0], &c, &event));
+    bthread_usleep(10000);
+    ASSERT_EQ(0, c);
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+    ASSERT_EQ(0, event.wait());
+    ASSERT_EQ('x', c);
+    bthread_close(fds[0]);
+    close(fds[1]);
+}
+
+void* run_done_later(void* arg) {
+    bthread_usleep(10000);
+    static_cast<google::protobuf::Closure*>(arg)->Run();
+    return NULL;
+}
+
+bthread::Task<void> wait_done(bool run_before_await,
+                              bthread::CountdownEvent* event) {
+    brpc::AwaitableDone done;
+    if (run_before_await) {
+        done.Run();
+    } else {
+        bthread_t th;
+        EXPECT_EQ(0, bthread_start_background(&th, NULL, run_done_later, &done));
+    }
+    co_await done;
+    event->signal();
+}
+
+TEST(CoroutineTest, awaitable_done) {
+    for (int i = 0; i < 2; ++i) {
+        bthread::CountdownEvent event;
+        bthread::start_coroutine(wait_done(i == 0, &event));
+        ASSERT_EQ(0, event.wait());
+    }
+}
+
+#endif  // BTHREAD_HAS_COROUTINE
+
+} // namespace
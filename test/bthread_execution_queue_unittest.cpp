@@ -23,6 +23,7 @@
 #include "butil/time.h"
 #include "butil/fast_rand.h"
 #include "butil/gperftools_profiler.h"
+#include "bvar/variable.h"
 
 namespace {
 bool stopped = false;
@@ -465,6 +466,8 @@ TEST_F(ExecutionQueueTest, inplace_and_order) {
 
 TEST_F(ExecutionQueueTest, size_of_task_node) {
     LOG(INFO) << "sizeof(TaskNode)=" << sizeof(bthread::TaskNode);
+    // Tasks of up to 56 bytes are stored in TaskNode without allocation.
+    ASSERT_LE(56UL, sizeof(bthread::TaskNode().static_task_mem));
 }
 
 int add_with_suspend2(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
@@ -708,4 +711,167 @@ TEST_F(ExecutionQueueTest, cancel_unexecuted_high_priority_task) {
 
     ASSERT_EQ(12345, result);
 }
+
+butil::atomic<bool> g_blocking(false);
+
+int add_blocking(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    stopped = iter.is_queue_stopped();
+    int64_t* result = (int64_t*)meta;
+    for (; iter; ++iter) {
+        while (g_blocking) {
+            usleep(1000);
+        }
+        *result += iter->value;
+    }
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, bounded_queue_fails_when_full) {
+    int64_t result = 0;
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.max_tasks_size = 4;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_blocking, &result));
+    g_blocking = true;
+    for (int i = 1; i <= 4; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, i));
+    }
+    ASSERT_EQ(EAGAIN, bthread::execution_queue_execute(queue_id, 100));
+    g_blocking = false;
+    int rc = EAGAIN;
+    for (int i = 0; i < 1000 && rc == EAGAIN; ++i) {
+        rc = bthread::execution_queue_execute(queue_id, 5);
+        usleep(1000);
+    }
+    ASSERT_EQ(0, rc);
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(15, result);
+    ASSERT_TRUE(stopped);
+}
+
+struct BlockingPushArg {
+    bthread::ExecutionQueueId<LongIntTask> id;
+    butil::atomic<bool> done;
+    int rc;
+};
+
+void* blocking_push_thread(void* arg) {
+    BlockingPushArg* pa = (BlockingPushArg*)arg;
+    pa->rc = bthread::execution_queue_execute(pa->id, 3);
+    pa->done = true;
+    return NULL;
+}
+
+TEST_F(ExecutionQueueTest, bounded_queue_waits_when_full) {
+    int64_t result = 0;
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.max_tasks_size = 2;
+    options.wait_when_full = true;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_blocking, &result));
+    g_blocking = true;
+    ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, 1));
+    ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, 2));
+    BlockingPushArg pa;
+    pa.id = queue_id;
+    pa.done = false;
+    pa.rc = -1;
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, blocking_push_thread, &pa));
+    usleep(50000);
+    ASSERT_FALSE(pa.done);
+    g_blocking = false;
+    pthread_join(th, NULL);
+    ASSERT_EQ(0, pa.rc);
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(6, result);
+}
+
+TEST_F(ExecutionQueueTest, stop_wakes_up_waiting_producers) {
+    int64_t result = 0;
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.max_tasks_size = 1;
+    options.wait_when_full = true;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_blocking, &result));
+    g_blocking = true;
+    ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, 1));
+    BlockingPushArg pa;
+    pa.id = queue_id;
+    pa.done = false;
+    pa.rc = -1;
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, blocking_push_thread, &pa));
+    usleep(50000);
+    ASSERT_FALSE(pa.done);
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    pthread_join(th, NULL);
+    ASSERT_EQ(EINVAL, pa.rc);
+    g_blocking = false;
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(1, result);
+}
+
+size_t g_max_batch_size = 0;
+
+int add_in_batch(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    stopped = iter.is_queue_stopped();
+    int64_t* result = (int64_t*)meta;
+    LongIntTask* tasks[8];
+    for (size_t n; (n = iter.next_batch(tasks, arraysize(tasks))) != 0;) {
+        g_max_batch_size = std::max(g_max_batch_size, n);
+        for (size_t i = 0; i < n; ++i) {
+            *result += tasks[i]->value;
+        }
+    }
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, next_batch) {
+    int64_t result = 0;
+    int64_t expected_result = 0;
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_in_batch, &result));
+    for (int i = 0; i < 1000; ++i) {
+        expected_result += i;
+        ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, i));
+    }
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(expected_result, result);
+    ASSERT_TRUE(stopped);
+    ASSERT_LE(g_max_batch_size, 8u);
+}
+
+TEST_F(ExecutionQueueTest, exposed_vars) {
+    int64_t result = 0;
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.bvar_prefix = "test_execq";
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_blocking, &result));
+    g_blocking = true;
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, i));
+    }
+    ASSERT_EQ("10", bvar::Variable::describe_exposed("test_execq_depth"));
+    g_blocking = false;
+    for (int i = 0; i < 1000 &&
+             bvar::Variable::describe_exposed("test_execq_depth") != "0"; ++i) {
+        usleep(1000);
+    }
+    ASSERT_EQ("0", bvar::Variable::describe_exposed("test_execq_depth"));
+    ASSERT_EQ("10", bvar::Variable::describe_exposed("test_execq_lag_count"));
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(45, result);
+    ASSERT_EQ("", bvar::Variable::describe_exposed("test_execq_depth"));
+}
 } // namespace
@@ -0,0 +1,119 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "butil/files/temp_file.h"
+#include "butil/iobuf.h"
+#include "bthread/bthread.h"
+#include "bthread/file_io.h"
+#include "bvar/variable.h"
+
+namespace {
+
+struct FileIOArg {
+    int fd;
+    int index;
+};
+
+const size_t BLOCK_SIZE = 4096;
+
+void* write_and_read_block(void* void_arg) {
+    FileIOArg* arg = static_cast<FileIOArg*>(void_arg);
+    char wbuf[BLOCK_SIZE];
+    memset(wbuf, 'a' + arg->index % 26, sizeof(wbuf));
+    const off_t offset = arg->index * BLOCK_SIZE;
+    EXPECT_EQ((ssize_t)BLOCK_SIZE,
+              bthread_pwrite(arg->fd, wbuf, sizeof(wbuf), offset));
+    char rbuf[BLOCK_SIZE];
+    EXPECT_EQ((ssize_t)BLOCK_SIZE,
+              bthread_pread(arg->fd, rbuf, sizeof(rbuf), offset));
+    EXPECT_EQ(0, memcmp(wbuf, rbuf, sizeof(rbuf)));
+    return NULL;
+}
+
+TEST(FileIOTest, pread_pwrite_in_bthreads) {
+    butil::TempFile tmp;
+    const int fd = open(tmp.fname(), O_RDWR);
+    ASSERT_LE(0, fd);
+    const int N = 64;
+    FileIOArg args[N];
+    bthread_t th[N];
+    for (int i = 0; i < N; ++i) {
+        args[i].fd = fd;
+        args[i].index = i;
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL,
+                                              write_and_read_block, &args[i]));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(0, bthread_fsync(fd));
+    ASSERT_EQ((off_t)(N * BLOCK_SIZE), lseek(fd, 0, SEEK_END));
+    ASSERT_EQ(0, close(fd));
+
+    // The I/O went through the pool and was recorded.
+    ASSERT_LE(N * 2L, atol(bvar::Variable::describe_exposed(
+                               "bthread_file_io_count").c_str()));
+    ASSERT_EQ("0", bvar::Variable::describe_exposed("bthread_file_io_depth"));
+}
+
+void* io_on_bad_fd(void*) {
+    char buf[16];
+    EXPECT_EQ(-1, bthread_pread(-1, buf, sizeof(buf), 0));
+    EXPECT_EQ(EBADF, errno);
+    EXPECT_EQ(-1, bthread_pwrite(-1, buf, sizeof(buf), 0));
+    EXPECT_EQ(EBADF, errno);
+    EXPECT_EQ(-1, bthread_fsync(-1));
+    EXPECT_EQ(EBADF, errno);
+    return NULL;
+}
+
+TEST(FileIOTest, errno_is_set) {
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, io_on_bad_fd, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Done in the calling pthread.
+    io_on_bad_fd(NULL);
+}
+
+void* cut_and_append_iobuf(void* void_arg) {
+    const int fd = *static_cast<int*>(void_arg);
+    butil::IOBuf buf;
+    buf.append("hello bthread file io");
+    const size_t len = buf.size();
+    EXPECT_EQ((ssize_t)len, bthread::pcut_into_file_descriptor(&buf, fd, 10));
+    EXPECT_TRUE(buf.empty());
+    butil::IOPortal portal;
+    EXPECT_EQ((ssize_t)len,
+              bthread::pappend_from_file_descriptor(&portal, fd, 10, 1024));
+    EXPECT_EQ("hello bthread file io", portal.to_string());
+    return NULL;
+}
+
+TEST(FileIOTest, iobuf) {
+    butil::TempFile tmp;
+    int fd = open(tmp.fname(), O_RDWR);
+    ASSERT_LE(0, fd);
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, cut_and_append_iobuf, &fd));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, close(fd));
+}
+
+} // namespace
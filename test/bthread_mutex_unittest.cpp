@@ -25,7 +25,16 @@
 #include "bthread/butex.h"
 #include "bthread/task_control.h"
 #include "bthread/mutex.h"
+#include "bthread/condition_variable.h"
+#include "bthread/countdown_event.h"
 #include "butil/gperftools_profiler.h"
+#include "butil/file_util.h"
+#include "bvar/variable.h"
+
+namespace bthread {
+bool ContentionProfilerStart(const char* filename);
+void ContentionProfilerStop();
+}
 
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
@@ -266,4 +275,53 @@ TEST(MutexTest, mix_thread_types) {
         pthread_join(pthreads[i], NULL);
     }
 }
+
+struct ContentionArg {
+    bthread::Mutex mutex;
+    bthread::ConditionVariable cond;
+    bthread::CountdownEvent event;
+    bool ready;
+    ContentionArg() : ready(false) {}
+};
+
+void* signal_later(void* void_arg) {
+    ContentionArg* arg = (ContentionArg*)void_arg;
+    bthread_usleep(10000);
+    {
+        BAIDU_SCOPED_LOCK(arg->mutex);
+        arg->ready = true;
+        arg->cond.notify_one();
+    }
+    bthread_usleep(10000);
+    arg->event.signal();
+    return NULL;
+}
+
+TEST(MutexTest, contention_of_other_primitives) {
+    const char* const prof_name = "./contention_of_other_primitives.prof";
+    ASSERT_TRUE(bthread::ContentionProfilerStart(prof_name));
+    ContentionArg arg;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, signal_later, &arg));
+    {
+        std::unique_lock<bthread::Mutex> lck(arg.mutex);
+        while (!arg.ready) {
+            arg.cond.wait(lck);
+        }
+    }
+    ASSERT_EQ(0, arg.event.wait());
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    bthread::ContentionProfilerStop();
+    butil::DeleteFile(butil::FilePath(prof_name), false);
+
+    // Both waits are aggregated by their callsites, bthread_join() is not
+    // sampled.
+    const std::string sites =
+        bvar::Variable::describe_exposed("contention_sites");
+    ASSERT_NE(std::string::npos, sites.find("type=bthread_cond")) << sites;
+    ASSERT_NE(std::string::npos, sites.find("type=countdown_event")) << sites;
+    ASSERT_NE(std::string::npos,
+              sites.find("bthread::CountdownEvent::wait()")) << sites;
+    ASSERT_EQ(std::string::npos, sites.find("bthread_join")) << sites;
+}
 } // namespace
@@ -28,13 +28,21 @@
 #include <bthread/sys_futex.h>
 #include <bthread/butex.h>
 #include "bthread/bthread.h"
+#include "bthread/task_control.h"
 #include "butil/atomicops.h"
 
+namespace bthread {
+extern TaskControl* g_task_control;
+DECLARE_int32(bthread_worker_max_spin_us);
+}
+DECLARE_int32(bthread_signal_merge_window_us);
+
 namespace {
 DEFINE_int32(thread_num, 1, "#pairs of threads doing ping pong");
 DEFINE_bool(loop, false, "run until ctrl-C is pressed");
 DEFINE_bool(use_futex, false, "use futex instead of pipe");
 DEFINE_bool(use_butex, false, "use butex instead of pipe");
+DEFINE_int32(small_task_num, 200000, "#small tasks started in wakeups_per_task");
 
 void ALLOW_UNUSED (*ignore_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
 
@@ -218,4 +226,101 @@ TEST(PingPongTest, ping_pong) {
     stop = true;
     // Program quits, Let resource leak.
 }
+
+void* empty_task(void*) {
+    return NULL;
+}
+
+void* start_small_tasks(void*) {
+    for (int i = 0; i < FLAGS_small_task_num; ++i) {
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, empty_task, NULL) != 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+void* butex_ping_pong_for_a_while(void* void_arg) {
+    PlayerArg* arg = static_cast<PlayerArg*>(void_arg);
+    int counter = INITIAL_FUTEX_VALUE;
+    for (int i = 0; i < 20000; ++i) {
+        bthread::butex_wait(arg->wait_addr, counter, NULL);
+        ++counter;
+        ++*arg->wake_addr;
+        bthread::butex_wake(arg->wake_addr);
+        ++arg->counter;
+    }
+    return NULL;
+}
+
+// Start small tasks at a high rate and ping-pong with butex, report signals
+// to idle workers and futex wakeups per task with and without spinning or
+// merging signals.
+TEST(PingPongTest, wakeups_per_task) {
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, empty_task, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    bthread::TaskControl* c = bthread::g_task_control;
+    ASSERT_TRUE(c != NULL);
+    const int32_t saved_spin_us = bthread::FLAGS_bthread_worker_max_spin_us;
+    const int32_t saved_merge_us = FLAGS_bthread_signal_merge_window_us;
+    // { max_spin_us, merge_window_us }
+    const int32_t configs[][2] = { { 0, 0 }, { 50, 0 }, { 0, 100 } };
+    for (size_t i = 0; i < arraysize(configs); ++i) {
+        const int32_t spin_us = configs[i][0];
+        const int32_t merge_us = configs[i][1];
+        bthread::FLAGS_bthread_worker_max_spin_us = spin_us;
+        FLAGS_bthread_signal_merge_window_us = merge_us;
+
+        int64_t signal0 = c->get_cumulated_signal_count();
+        int64_t wakeup0 = c->get_cumulated_wakeup_count();
+        butil::Timer tm;
+        tm.start();
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, start_small_tasks, NULL));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        tm.stop();
+        printf("small tasks: max_spin_us=%d merge_window_us=%d tasks=%d "
+               "%" PRId64 "ns/task signal/task=%.3f wakeup/task=%.3f\n",
+               spin_us, merge_us, FLAGS_small_task_num,
+               tm.n_elapsed() / FLAGS_small_task_num,
+               (c->get_cumulated_signal_count() - signal0) /
+               (double)FLAGS_small_task_num,
+               (c->get_cumulated_wakeup_count() - wakeup0) /
+               (double)FLAGS_small_task_num);
+
+        PlayerArg arg1;
+        PlayerArg arg2;
+        arg1.wait_addr = bthread::butex_create_checked<int>();
+        *arg1.wait_addr = INITIAL_FUTEX_VALUE;
+        arg1.wake_addr = bthread::butex_create_checked<int>();
+        *arg1.wake_addr = INITIAL_FUTEX_VALUE;
+        arg1.counter = 0;
+        arg2.wait_addr = arg1.wake_addr;
+        arg2.wake_addr = arg1.wait_addr;
+        arg2.counter = 0;
+        signal0 = c->get_cumulated_signal_count();
+        wakeup0 = c->get_cumulated_wakeup_count();
+        tm.start();
+        bthread_t th1, th2;
+        ASSERT_EQ(0, bthread_start_background(&th1, NULL, butex_ping_pong_for_a_while, &arg1));
+        ASSERT_EQ(0, bthread_start_background(&th2, NULL, butex_ping_pong_for_a_while, &arg2));
+        ++*arg1.wait_addr;
+        bthread::butex_wake(arg1.wait_addr);
+        ASSERT_EQ(0, bthread_join(th1, NULL));
+        ASSERT_EQ(0, bthread_join(th2, NULL));
+        tm.stop();
+        const long n = arg1.counter + arg2.counter;
+        printf("butex ping-pong: max_spin_us=%d merge_window_us=%d "
+               "pingpongs=%ld %" PRId64 "ns/pingpong signal/pingpong=%.3f "
+               "wakeup/pingpong=%.3f\n",
+               spin_us, merge_us, n, tm.n_elapsed() / n,
+               (c->get_cumulated_signal_count() - signal0) / (double)n,
+               (c->get_cumulated_wakeup_count() - wakeup0) / (double)n);
+        bthread::butex_destroy(arg1.wait_addr);
+        bthread::butex_destroy(arg1.wake_addr);
+    }
+    bthread::FLAGS_bthread_worker_max_spin_us = saved_spin_us;
+    FLAGS_bthread_signal_merge_window_us = saved_merge_us;
+}
 } // namespace
@@ -19,9 +19,13 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <algorithm>
+#include <vector>
 #include <gtest/gtest.h>
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/logging.h"
+#include "bthread/bthread.h"
 
 namespace {
 void* read_thread(void* arg) {
@@ -76,4 +80,161 @@ TEST(RWLockTest, rdlock_performance) {
     pthread_mutex_destroy(&lock1);
 #endif
 }
+
+const int g_rwlock_kinds[] = {
+    BTHREAD_RWLOCK_PREFER_WRITER_NP,
+    BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP
+};
+
+void init_rwlock(bthread_rwlock_t* rw, int kind) {
+    bthread_rwlockattr_t attr;
+    ASSERT_EQ(0, bthread_rwlockattr_init(&attr));
+    ASSERT_EQ(0, bthread_rwlockattr_setkind_np(&attr, kind));
+    int pref = -1;
+    ASSERT_EQ(0, bthread_rwlockattr_getkind_np(&attr, &pref));
+    ASSERT_EQ(kind, pref);
+    ASSERT_EQ(0, bthread_rwlock_init(rw, &attr));
+    ASSERT_EQ(0, bthread_rwlockattr_destroy(&attr));
+}
+
+TEST(RWLockTest, sanity) {
+    bthread_rwlockattr_t attr;
+    ASSERT_EQ(0, bthread_rwlockattr_init(&attr));
+    ASSERT_EQ(EINVAL, bthread_rwlockattr_setkind_np(&attr, 100));
+    for (size_t k = 0; k < ARRAY_SIZE(g_rwlock_kinds); ++k) {
+        bthread_rwlock_t rw;
+        init_rwlock(&rw, g_rwlock_kinds[k]);
+        ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+        ASSERT_EQ(EBUSY, bthread_rwlock_trywrlock(&rw));
+        timespec abstime = butil::milliseconds_from_now(10);
+        ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedwrlock(&rw, &abstime));
+        // Readers are not blocked by the timed out writer.
+        ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+        ASSERT_EQ(0, bthread_rwlock_wrlock(&rw));
+        ASSERT_EQ(EBUSY, bthread_rwlock_tryrdlock(&rw));
+        ASSERT_EQ(EBUSY, bthread_rwlock_trywrlock(&rw));
+        abstime = butil::milliseconds_from_now(10);
+        ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedrdlock(&rw, &abstime));
+        abstime = butil::milliseconds_from_now(10);
+        ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedwrlock(&rw, &abstime));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+        ASSERT_EQ(0, bthread_rwlock_trywrlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        abstime = butil::milliseconds_from_now(10);
+        ASSERT_EQ(0, bthread_rwlock_timedrdlock(&rw, &abstime));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+    }
+}
+
+void* wrlock_and_unlock(void* arg) {
+    bthread_rwlock_t* rw = (bthread_rwlock_t*)arg;
+    bthread_rwlock_wrlock(rw);
+    bthread_rwlock_unlock(rw);
+    return NULL;
+}
+
+TEST(RWLockTest, writer_preference) {
+    for (size_t k = 0; k < ARRAY_SIZE(g_rwlock_kinds); ++k) {
+        bthread_rwlock_t rw;
+        init_rwlock(&rw, g_rwlock_kinds[k]);
+        ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_urgent(&th, NULL, wrlock_and_unlock, &rw));
+        bthread_usleep(10000);
+        // New readers are blocked by the waiting writer.
+        ASSERT_EQ(EBUSY, bthread_rwlock_tryrdlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+    }
+}
+
+struct BAIDU_CACHELINE_ALIGNMENT RWLockArgs {
+    bthread_rwlock_t* rw;
+    // Written under the write lock.
+    int64_t* data;
+    int write_percent;
+    int64_t nop;
+    int64_t elapse_ns;
+
+    RWLockArgs() : rw(NULL), data(NULL), write_percent(0), nop(0), elapse_ns(0) {}
+};
+
+bool g_stopped = false;
+
+void* read_and_write(void* void_arg) {
+    RWLockArgs* args = (RWLockArgs*)void_arg;
+    const long t1 = butil::cpuwide_time_ns();
+    while (!g_stopped) {
+        if (args->write_percent > 0 && args->nop % 100 < args->write_percent) {
+            bthread_rwlock_wrlock(args->rw);
+            // Readers see both fields changed or none of them.
+            ++args->data[0];
+            ++args->data[1];
+            bthread_rwlock_unlock(args->rw);
+        } else {
+            bthread_rwlock_rdlock(args->rw);
+            const int64_t v0 = args->data[0];
+            const int64_t v1 = args->data[1];
+            bthread_rwlock_unlock(args->rw);
+            if (v0 != v1) {
+                LOG(FATAL) << "Inconsistent data: " << v0 << " vs " << v1;
+            }
+        }
+        ++args->nop;
+    }
+    args->elapse_ns = butil::cpuwide_time_ns() - t1;
+    return NULL;
+}
+
+void RWLockPerfTest(int kind, int thread_num, int write_percent) {
+    bthread_rwlock_t rw;
+    init_rwlock(&rw, kind);
+    int64_t data[2] = { 0, 0 };
+    g_stopped = false;
+    std::vector<bthread_t> threads(thread_num);
+    std::vector<RWLockArgs> args(thread_num);
+    for (int i = 0; i < thread_num; ++i) {
+        args[i].rw = &rw;
+        args[i].data = data;
+        args[i].write_percent = write_percent;
+        ASSERT_EQ(0, bthread_start_background(&threads[i], NULL,
+                                              read_and_write, &args[i]));
+    }
+    usleep(300 * 1000);
+    g_stopped = true;
+    int64_t nop = 0;
+    int64_t elapse_ns = 0;
+    for (int i = 0; i < thread_num; ++i) {
+        bthread_join(threads[i], NULL);
+        nop += args[i].nop;
+        elapse_ns += args[i].elapse_ns;
+    }
+    ASSERT_EQ(data[0], data[1]);
+    LOG(INFO) << (kind == BTHREAD_RWLOCK_DISTRIBUTED_READERS_NP ?
+                  "distributed" : "shared") << " readers"
+              << " thread_num=" << thread_num
+              << " write_percent=" << write_percent
+              << " count=" << nop
+              << " average_time=" << elapse_ns / (double)std::max(nop, (int64_t)1);
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+}
+
+TEST(RWLockTest, bthread_rwlock_performance) {
+    const int thread_num = 12;
+    for (size_t k = 0; k < ARRAY_SIZE(g_rwlock_kinds); ++k) {
+        RWLockPerfTest(g_rwlock_kinds[k], thread_num, 0);
+        RWLockPerfTest(g_rwlock_kinds[k], thread_num, 1);
+        RWLockPerfTest(g_rwlock_kinds[k], thread_num, 20);
+    }
+}
 } // namespace
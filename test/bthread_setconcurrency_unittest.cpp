@@ -26,6 +26,13 @@
 #include "butil/logging.h"
 #include "bthread/bthread.h"
 #include "bthread/task_control.h"
+#include "bvar/variable.h"
+
+DECLARE_int32(bthread_elastic_interval_ms);
+DECLARE_int32(bthread_elastic_shrink_rounds);
+DECLARE_int32(bthread_elastic_grow_rounds);
+DECLARE_int32(bthread_elastic_min_workers);
+DECLARE_double(bthread_elastic_grow_usage);
 
 namespace bthread {
     extern TaskControl* g_task_control;
@@ -191,4 +198,71 @@ TEST(BthreadTest, min_concurrency) {
     ASSERT_EQ(conn + add_conn, bthread::g_task_control->concurrency());
 }
 
+static int get_parked_worker_count() {
+    return atoi(bvar::Variable::describe_exposed(
+                    "bthread_parked_worker_count").c_str());
+}
+
+static bool wait_parked_worker_count(bool (*pred)(int, int), int value) {
+    for (int i = 0; i < 1000; ++i) {
+        if (pred(get_parked_worker_count(), value)) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+static bool greater_equal(int a, int b) { return a >= b; }
+static bool less(int a, int b) { return a < b; }
+static bool equal(int a, int b) { return a == b; }
+
+static butil::atomic<bool> stop_spinning(false);
+
+static void* spin_proc(void*) {
+    while (!stop_spinning) {
+        bthread_yield();
+    }
+    return NULL;
+}
+
+TEST(BthreadTest, elastic_workers) {
+    FLAGS_bthread_elastic_interval_ms = 20;
+    FLAGS_bthread_elastic_shrink_rounds = 1;
+    FLAGS_bthread_elastic_grow_rounds = 1;
+    FLAGS_bthread_elastic_min_workers = 1;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, dummy, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, get_parked_worker_count());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_elastic_workers", "true").empty());
+
+    // Idle workers are parked one by one.
+    ASSERT_TRUE(wait_parked_worker_count(greater_equal, 3));
+    const int nparked = get_parked_worker_count();
+    ASSERT_LT(nparked, bthread_getconcurrency());
+
+    // Busy workers resume parked ones.
+    const double saved_grow_usage = FLAGS_bthread_elastic_grow_usage;
+    FLAGS_bthread_elastic_grow_usage = 0;
+    std::vector<bthread_t> tids;
+    for (int i = 0; i < 4; ++i) {
+        bthread_t tid;
+        ASSERT_EQ(0, bthread_start_background(&tid, NULL, spin_proc, NULL));
+        tids.push_back(tid);
+    }
+    ASSERT_TRUE(wait_parked_worker_count(less, nparked));
+    stop_spinning = true;
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    FLAGS_bthread_elastic_grow_usage = saved_grow_usage;
+
+    // All workers are resumed after turning off.
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_elastic_workers", "false").empty());
+    ASSERT_TRUE(wait_parked_worker_count(equal, 0));
+}
+
 } // namespace
@@ -0,0 +1,192 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "bthread/bthread.h"
+#include "bvar/variable.h"
+#include "brpc/server.h"
+
+DECLARE_int32(task_group_ntags);
+
+namespace {
+
+// Tags must be set before the first bthread is created.
+const int ALLOW_UNUSED set_ntags = (FLAGS_task_group_ntags = 3);
+
+void* get_tag(void* arg) {
+    *static_cast<bthread_tag_t*>(arg) = bthread_self_tag();
+    return NULL;
+}
+
+struct InheritArg {
+    bthread_tag_t tag;
+    bthread_tag_t child_tag;
+    bthread_tag_t tag_after_sleep;
+};
+
+void* start_child(void* void_arg) {
+    InheritArg* arg = static_cast<InheritArg*>(void_arg);
+    arg->tag = bthread_self_tag();
+    bthread_t th;
+    EXPECT_EQ(0, bthread_start_background(&th, NULL, get_tag, &arg->child_tag));
+    EXPECT_EQ(0, bthread_join(th, NULL));
+    bthread_usleep(10000);
+    arg->tag_after_sleep = bthread_self_tag();
+    return NULL;
+}
+
+TEST(BthreadTagTest, run_in_tag) {
+    ASSERT_EQ(BTHREAD_TAG_INVALID, bthread_self_tag());
+    for (bthread_tag_t tag = 0; tag < FLAGS_task_group_ntags; ++tag) {
+        bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+        attr.tag = tag;
+        InheritArg arg = { BTHREAD_TAG_INVALID, BTHREAD_TAG_INVALID,
+                           BTHREAD_TAG_INVALID };
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, &attr, start_child, &arg));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        ASSERT_EQ(tag, arg.tag);
+        ASSERT_EQ(tag, arg.child_tag);
+        ASSERT_EQ(tag, arg.tag_after_sleep);
+        ASSERT_EQ(3, bthread_getconcurrency_by_tag(tag));
+    }
+    bthread_tag_t tag = BTHREAD_TAG_INVALID;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, get_tag, &tag));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(BTHREAD_TAG_DEFAULT, tag);
+
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = FLAGS_task_group_ntags;
+    ASSERT_EQ(EINVAL, bthread_start_background(&th, &attr, get_tag, &tag));
+}
+
+void* join_other_tag(void* arg) {
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = 2;
+    bthread_tag_t other_tag = BTHREAD_TAG_INVALID;
+    bthread_t th;
+    EXPECT_EQ(0, bthread_start_urgent(&th, &attr, get_tag, &other_tag));
+    // Woken up by a worker of tag 2.
+    EXPECT_EQ(0, bthread_join(th, NULL));
+    EXPECT_EQ(2, other_tag);
+    *static_cast<bthread_tag_t*>(arg) = bthread_self_tag();
+    return NULL;
+}
+
+TEST(BthreadTagTest, wake_up_in_own_tag) {
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = 1;
+    for (int i = 0; i < 100; ++i) {
+        bthread_tag_t tag = BTHREAD_TAG_INVALID;
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, &attr, join_other_tag, &tag));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        ASSERT_EQ(1, tag);
+    }
+}
+
+butil::atomic<int> nspinning(0);
+
+void* spin(void* arg) {
+    nspinning.fetch_add(1);
+    const int64_t end_us = *static_cast<int64_t*>(arg);
+    while (butil::gettimeofday_us() < end_us) {}
+    return NULL;
+}
+
+void* get_start_time(void* arg) {
+    *static_cast<int64_t*>(arg) = butil::gettimeofday_us();
+    return NULL;
+}
+
+TEST(BthreadTagTest, tags_do_not_starve_each_other) {
+    // Occupy all workers of tag 1.
+    const int nworker = bthread_getconcurrency_by_tag(1);
+    ASSERT_GT(nworker, 0);
+    int64_t spin_end_us = butil::gettimeofday_us() + 300000;
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = 1;
+    std::vector<bthread_t> spinners(nworker);
+    for (int i = 0; i < nworker; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&spinners[i], &attr, spin,
+                                              &spin_end_us));
+    }
+    while (nspinning.load() != nworker) {
+        usleep(1000);
+    }
+    int64_t start_us_in_tag1 = 0;
+    bthread_t th1;
+    ASSERT_EQ(0, bthread_start_background(&th1, &attr, get_start_time,
+                                          &start_us_in_tag1));
+    int64_t start_us_in_tag2 = 0;
+    attr.tag = 2;
+    bthread_t th2;
+    ASSERT_EQ(0, bthread_start_background(&th2, &attr, get_start_time,
+                                          &start_us_in_tag2));
+    ASSERT_EQ(0, bthread_join(th2, NULL));
+    ASSERT_LT(start_us_in_tag2, spin_end_us);
+    ASSERT_EQ(0, bthread_join(th1, NULL));
+    ASSERT_GE(start_us_in_tag1, spin_end_us);
+    for (int i = 0; i < nworker; ++i) {
+        ASSERT_EQ(0, bthread_join(spinners[i], NULL));
+    }
+}
+
+TEST(BthreadTagTest, setconcurrency_by_tag) {
+    ASSERT_EQ(0, bthread_getconcurrency_by_tag(FLAGS_task_group_ntags));
+    ASSERT_EQ(EINVAL, bthread_setconcurrency_by_tag(4, BTHREAD_TAG_INVALID));
+    const int old_total = bthread_getconcurrency();
+    const int old_num = bthread_getconcurrency_by_tag(2);
+    ASSERT_EQ(0, bthread_setconcurrency_by_tag(old_num + 2, 2));
+    ASSERT_EQ(old_num + 2, bthread_getconcurrency_by_tag(2));
+    ASSERT_EQ(old_total + 2, bthread_getconcurrency());
+    ASSERT_EQ(EPERM, bthread_setconcurrency_by_tag(old_num, 2));
+    ASSERT_EQ(std::to_string(old_num + 2), bvar::Variable::describe_exposed(
+                  "bthread_worker_count_tag_2"));
+    ASSERT_FALSE(bvar::Variable::describe_exposed(
+                     "bthread_worker_usage_tag_1").empty());
+}
+
+TEST(BthreadTagTest, start_server_in_tag) {
+    const int nworker = bthread_getconcurrency_by_tag(1);
+    ASSERT_GT(nworker, 1);
+    brpc::ServerOptions options;
+    options.bthread_tag = 1;
+    // The tag already has more workers.
+    options.num_threads = nworker - 1;
+    brpc::Server server1;
+    ASSERT_EQ(0, server1.Start("127.0.0.1:0", &options));
+    ASSERT_EQ(nworker, bthread_getconcurrency_by_tag(1));
+    // Another server in the same tag adds workers.
+    options.num_threads = nworker + 1;
+    brpc::Server server2;
+    ASSERT_EQ(0, server2.Start("127.0.0.1:0", &options));
+    ASSERT_EQ(nworker + 1, bthread_getconcurrency_by_tag(1));
+    server1.Stop(0);
+    server2.Stop(0);
+    server1.Join();
+    server2.Join();
+}
+
+} // namespace
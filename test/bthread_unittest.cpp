@@ -17,6 +17,7 @@
 
 #include <execinfo.h>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/logging.h"
@@ -25,6 +26,16 @@
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 #include "bthread/task_meta.h"
+#include "bthread/stack.h"
+#include "bvar/variable.h"
+
+namespace bthread {
+DECLARE_bool(bthread_enable_cpu_accounting);
+DECLARE_int64(bthread_local_timer_max_us);
+}
+DECLARE_int32(stack_pool_high_watermark_mb);
+DECLARE_int32(stack_pool_low_watermark_mb);
+DECLARE_int32(stack_usage_sample_interval);
 
 namespace {
 class BthreadTest : public ::testing::Test{
@@ -423,6 +434,62 @@ TEST_F(BthreadTest, stop_sleep) {
     ASSERT_LE(labs(tm.m_elapsed() - 10), 10);
 }
 
+struct LocalSleepArg {
+    int first_rc;
+    int first_errno;
+    int64_t second_elapsed_us;
+};
+
+void* sleep_twice_locally(void* void_arg) {
+    LocalSleepArg* arg = (LocalSleepArg*)void_arg;
+    // Interrupted.
+    arg->first_rc = bthread_usleep(200000);
+    arg->first_errno = errno;
+    // The timer of the first sleep expires during this sleep, which should
+    // not wake up this sleep.
+    const int64_t start_us = butil::cpuwide_time_us();
+    bthread_usleep(400000);
+    arg->second_elapsed_us = butil::cpuwide_time_us() - start_us;
+    return NULL;
+}
+
+void* short_sleeps(void* arg) {
+    for (int i = 0; i < 100; ++i) {
+        bthread_usleep(100);
+    }
+    *(int64_t*)arg = butil::cpuwide_time_us();
+    return NULL;
+}
+
+TEST_F(BthreadTest, local_sleep) {
+    const int64_t saved_max_us = bthread::FLAGS_bthread_local_timer_max_us;
+    bthread::FLAGS_bthread_local_timer_max_us = 1000000;
+
+    int64_t end_us[4];
+    bthread_t ths[ARRAY_SIZE(end_us)];
+    const int64_t start_us = butil::cpuwide_time_us();
+    for (size_t i = 0; i < ARRAY_SIZE(ths); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&ths[i], NULL, short_sleeps,
+                                              &end_us[i]));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(ths); ++i) {
+        ASSERT_EQ(0, bthread_join(ths[i], NULL));
+        ASSERT_GE(end_us[i] - start_us, 100 * 100);
+    }
+
+    LocalSleepArg arg = { 0, 0, 0 };
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, sleep_twice_locally, &arg));
+    bthread_usleep(10000);
+    ASSERT_EQ(0, bthread_interrupt(th));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(-1, arg.first_rc);
+    ASSERT_EQ(EINTR, arg.first_errno);
+    ASSERT_GE(arg.second_elapsed_us, 400000);
+
+    bthread::FLAGS_bthread_local_timer_max_us = saved_max_us;
+}
+
 TEST_F(BthreadTest, bthread_exit) {
     bthread_t th1;
     bthread_t th2;
@@ -508,6 +575,49 @@ TEST_F(BthreadTest, bthread_usleep) {
     ASSERT_EQ(0, bthread_join(th2, NULL));
 }
 
+struct CpuUsageArg {
+    bool busy;
+    int64_t cpu_time_ns;
+};
+
+static void* measure_cpu_usage(void* void_arg) {
+    CpuUsageArg* arg = (CpuUsageArg*)void_arg;
+    int64_t begin_ns = -1;
+    EXPECT_EQ(0, bthread_get_cpu_usage(&begin_ns, NULL));
+    const int64_t deadline = butil::cpuwide_time_us() + 50000;
+    while (butil::cpuwide_time_us() < deadline) {
+        if (arg->busy) {
+            bthread_yield();
+        } else {
+            bthread_usleep(10000);
+        }
+    }
+    int64_t end_ns = -1;
+    EXPECT_EQ(0, bthread_get_cpu_usage(&end_ns, NULL));
+    arg->cpu_time_ns = end_ns - begin_ns;
+    return NULL;
+}
+
+TEST_F(BthreadTest, cpu_usage) {
+    ASSERT_EQ(EPERM, bthread_get_cpu_usage(NULL, NULL));
+    bthread::FLAGS_bthread_enable_cpu_accounting = true;
+    CpuUsageArg busy = { true, -1 };
+    bthread_t th1;
+    ASSERT_EQ(0, bthread_start_urgent(&th1, NULL, measure_cpu_usage, &busy));
+    ASSERT_EQ(0, bthread_join(th1, NULL));
+    CpuUsageArg idle = { false, -1 };
+    bthread_t th2;
+    ASSERT_EQ(0, bthread_start_urgent(&th2, NULL, measure_cpu_usage, &idle));
+    ASSERT_EQ(0, bthread_join(th2, NULL));
+    bthread::FLAGS_bthread_enable_cpu_accounting = false;
+    LOG(INFO) << "busy=" << busy.cpu_time_ns << "ns idle="
+              << idle.cpu_time_ns << "ns";
+    // The busy bthread may be preempted by other threads.
+    ASSERT_GT(busy.cpu_time_ns, 5000000);
+    ASSERT_GE(idle.cpu_time_ns, 0);
+    ASSERT_LT(idle.cpu_time_ns, 5000000);
+}
+
 void* dummy_thread(void*) {
     return NULL;
 }
@@ -531,4 +641,72 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+void dummy_stack_entry(intptr_t) {}
+
+static int64_t get_resident_bytes() {
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    long size = 0;
+    long resident = 0;
+    const int n = fscanf(fp, "%ld %ld", &size, &resident);
+    fclose(fp);
+    return n == 2 ? resident * (int64_t)getpagesize() : -1;
+}
+
+TEST_F(BthreadTest, stack_pool_releases_memory) {
+    const int saved_high_watermark = FLAGS_stack_pool_high_watermark_mb;
+    const int saved_low_watermark = FLAGS_stack_pool_low_watermark_mb;
+    const int saved_sample_interval = FLAGS_stack_usage_sample_interval;
+    FLAGS_stack_pool_high_watermark_mb = 0;
+    FLAGS_stack_pool_low_watermark_mb = 0;
+    FLAGS_stack_usage_sample_interval = 1;
+
+    const int used_size = 512 * 1024;
+    bthread::ContextualStack* stacks[8];
+    for (size_t i = 0; i < ARRAY_SIZE(stacks); ++i) {
+        stacks[i] = bthread::get_stack(bthread::STACK_TYPE_NORMAL,
+                                       dummy_stack_entry);
+        ASSERT_TRUE(stacks[i] != NULL);
+        ASSERT_GE(stacks[i]->storage.stacksize, used_size);
+        memset((char*)stacks[i]->storage.bottom - used_size, 1, used_size);
+    }
+    const int64_t resident_before = get_resident_bytes();
+    for (size_t i = 0; i < ARRAY_SIZE(stacks); ++i) {
+        bthread::return_stack(stacks[i]);
+    }
+    const int64_t resident_after = get_resident_bytes();
+    ASSERT_GT(resident_before, 0);
+    // Memory of at least half of the stacks goes back to the system.
+    ASSERT_GE(resident_before - resident_after,
+              (int64_t)ARRAY_SIZE(stacks) / 2 * used_size)
+        << "before=" << resident_before << " after=" << resident_after;
+    int nreleased = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(stacks); ++i) {
+        stacks[i] = bthread::get_stack(bthread::STACK_TYPE_NORMAL,
+                                       dummy_stack_entry);
+        ASSERT_TRUE(stacks[i] != NULL);
+        if (stacks[i]->storage.committed_size < used_size) {
+            ++nreleased;
+        }
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(stacks); ++i) {
+        bthread::return_stack(stacks[i]);
+    }
+    // Committed bytes are added to the global estimation in batches, at
+    // least the last stacks are released.
+    ASSERT_GT(nreleased, 0);
+    const std::string high_water =
+        bvar::Variable::describe_exposed("bthread_stack_high_water_bytes_normal");
+    ASSERT_GE(atoi(high_water.c_str()), used_size);
+    LOG(INFO) << "released=" << nreleased << " high_water=" << high_water
+              << " suggested=" << bvar::Variable::describe_exposed(
+                  "bthread_stack_size_normal_suggested");
+
+    FLAGS_stack_pool_high_watermark_mb = saved_high_watermark;
+    FLAGS_stack_pool_low_watermark_mb = saved_low_watermark;
+    FLAGS_stack_usage_sample_interval = saved_sample_interval;
+}
+
 } // namespace
@@ -0,0 +1,194 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <sstream>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "bvar/detail/histogram.h"
+#include "bvar/latency_recorder.h"
+#include <gtest/gtest.h>
+
+namespace bvar {
+DECLARE_bool(bvar_latency_recorder_use_histogram);
+}
+
+namespace {
+
+typedef bvar::detail::HistogramBuckets HistogramBuckets;
+
+class HistogramTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+TEST_F(HistogramTest, bucket_bounds) {
+    ASSERT_EQ(464UL, HistogramBuckets::NUM_BUCKETS);
+    for (uint32_t v = 0; v < HistogramBuckets::SUB_BUCKET_COUNT; ++v) {
+        ASSERT_EQ(v, HistogramBuckets::index_of(v));
+        ASSERT_EQ(v, HistogramBuckets::lower_bound(v));
+        ASSERT_EQ(v, HistogramBuckets::upper_bound(v));
+    }
+    // Buckets are contiguous and cover all uint32_t.
+    ASSERT_EQ(0U, HistogramBuckets::lower_bound(0));
+    for (size_t i = 1; i < HistogramBuckets::NUM_BUCKETS; ++i) {
+        const uint32_t lower = HistogramBuckets::lower_bound(i);
+        const uint32_t upper = HistogramBuckets::upper_bound(i);
+        ASSERT_EQ(HistogramBuckets::upper_bound(i - 1) + 1, lower) << i;
+        ASSERT_LE(lower, upper);
+        ASSERT_EQ(i, HistogramBuckets::index_of(lower));
+        ASSERT_EQ(i, HistogramBuckets::index_of(upper));
+        if (i >= HistogramBuckets::SUB_BUCKET_COUNT) {
+            // Width of a bucket is at most 1/16 of its lower bound.
+            ASSERT_LE((uint64_t)(upper - lower + 1) * 16, (uint64_t)lower) << i;
+        }
+    }
+    ASSERT_EQ(std::numeric_limits<uint32_t>::max(),
+              HistogramBuckets::upper_bound(HistogramBuckets::NUM_BUCKETS - 1));
+}
+
+TEST_F(HistogramTest, get_number) {
+    HistogramBuckets b;
+    ASSERT_EQ(0U, b.get_number(0.5));
+    for (uint32_t i = 1; i <= 100000; ++i) {
+        b.add(i);
+    }
+    ASSERT_EQ(100000UL, b.count());
+    ASSERT_EQ(5000050000UL, b.sum());
+    const double ratios[] = { 0.1, 0.5, 0.8, 0.9, 0.99, 0.999, 0.9999 };
+    for (size_t i = 0; i < arraysize(ratios); ++i) {
+        const double expected = ratios[i] * 100000;
+        const uint32_t value = b.get_number(ratios[i]);
+        ASSERT_LE(fabs(value - expected), expected / 16) << ratios[i];
+    }
+    ASSERT_EQ(HistogramBuckets::upper_bound(
+                  HistogramBuckets::index_of(100000)), b.get_number(1));
+}
+
+TEST_F(HistogramTest, merge_and_subtract) {
+    HistogramBuckets b1;
+    HistogramBuckets b2;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        b1.add(i);
+        b2.add(i * 1000);
+    }
+    HistogramBuckets merged = b1;
+    merged.merge(b2);
+    ASSERT_EQ(2000UL, merged.count());
+    ASSERT_EQ(b1.sum() + b2.sum(), merged.sum());
+    for (size_t i = 0; i < HistogramBuckets::NUM_BUCKETS; ++i) {
+        ASSERT_EQ(b1.count_at(i) + b2.count_at(i), merged.count_at(i));
+    }
+    merged.subtract(b1);
+    ASSERT_EQ(0, memcmp(&merged, &b2, sizeof(b2)));
+}
+
+static void* add_latencies(void* arg) {
+    bvar::detail::Histogram* h = (bvar::detail::Histogram*)arg;
+    for (int i = 0; i < 100000; ++i) {
+        *h << i % 100;
+    }
+    return NULL;
+}
+
+TEST_F(HistogramTest, multi_threaded) {
+    bvar::detail::Histogram h;
+    pthread_t th[4];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_latencies, &h));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_join(th[i], NULL));
+    }
+    // Buckets of exited threads are kept.
+    const HistogramBuckets b = h.get_value();
+    ASSERT_EQ(400000UL, b.count());
+    // Values below SUB_BUCKET_COUNT are counted exactly.
+    for (size_t i = 0; i < HistogramBuckets::SUB_BUCKET_COUNT; ++i) {
+        ASSERT_EQ(4000UL, b.count_at(i));
+    }
+    ASSERT_EQ(10U, b.get_number(0.11));
+    ASSERT_EQ(99U, b.get_number(1));
+}
+
+TEST_F(HistogramTest, latency_recorder) {
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    bvar::LatencyRecorder rec;
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = false;
+    ASSERT_TRUE(rec.use_histogram());
+    // Samples of Percentile are not needed.
+    ASSERT_TRUE(rec._latency_percentile == NULL);
+    ASSERT_TRUE(rec._latency_percentile_window == NULL);
+    ASSERT_TRUE(rec.latency_histogram_name().empty());
+    for (int i = 1; i <= 10000; ++i) {
+        rec << i;
+    }
+    // Wait for the sampler, which may take a sample in the middle of the
+    // writes above.
+    for (int i = 0; i < 50 &&
+             rec._latency_histogram_window->get_value().count() != 10000; ++i) {
+        usleep(100000);
+    }
+    const int64_t p50 = rec.latency_percentile(0.5);
+    ASSERT_LE(labs(p50 - 5000), 5000 / 16);
+    const int64_t p9999 = rec.latency_percentile(0.9999);
+    ASSERT_LE(labs(p9999 - 9999), 9999 / 16);
+    const bvar::Vector<int64_t, 4> ps = rec.latency_percentiles();
+    ASSERT_LE(labs(ps[3] - 9990), 9990 / 16);
+
+    ASSERT_EQ(0, rec.expose("histogram_test"));
+    ASSERT_EQ("histogram_test_latency_histogram", rec.latency_histogram_name());
+    std::string desc = bvar::Variable::describe_exposed(
+        "histogram_test_latency_histogram");
+    ASSERT_EQ(0U, desc.find("count=10000 sum=50005000 1:1 2:1 "));
+    std::ostringstream os;
+    ASSERT_EQ(0, bvar::Variable::describe_series_exposed(
+                  "histogram_test_latency_cdf", os, bvar::SeriesOptions()));
+    ASSERT_EQ(0U, os.str().find("{\"label\":\"cdf\",\"data\":[[10,"));
+
+    bvar::LatencyRecorder rec2;
+    ASSERT_FALSE(rec2.use_histogram());
+    ASSERT_TRUE(rec2._latency_percentile != NULL);
+    ASSERT_TRUE(rec2._latency_percentile_window != NULL);
+}
+
+TEST_F(HistogramTest, perf) {
+    const int N = 1000000;
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    bvar::LatencyRecorder hist_rec;
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = false;
+    bvar::LatencyRecorder rec;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        rec << i % 10000;
+    }
+    tm.stop();
+    const int64_t sampling_ns = tm.n_elapsed() / N;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        hist_rec << i % 10000;
+    }
+    tm.stop();
+    LOG(INFO) << "Each LatencyRecorder::operator<< takes " << sampling_ns
+              << "ns with percentile samples, " << tm.n_elapsed() / N
+              << "ns with histogram";
+}
+
+}  // namespace
@@ -0,0 +1,180 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/macros.h"
+#include "bvar/bvar.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+class MultiDimensionTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {
+        ASSERT_EQ(0UL, bvar::MVariable::count_exposed());
+    }
+};
+
+class StringDumper : public bvar::Dumper {
+public:
+    bool dump(const std::string& name,
+              const butil::StringPiece& description) {
+        result.append(name);
+        result.push_back(' ');
+        result.append(description.data(), description.size());
+        result.push_back('\n');
+        return true;
+    }
+
+    std::string result;
+};
+
+static std::vector<std::string> make_key(const char* a, const char* b) {
+    std::vector<std::string> key;
+    key.push_back(a);
+    key.push_back(b);
+    return key;
+}
+
+static std::vector<std::string> labels() {
+    return make_key("method", "status");
+}
+
+TEST_F(MultiDimensionTest, get_stats) {
+    bvar::MultiDimension<bvar::Adder<int> > md(labels());
+    ASSERT_EQ(2UL, md.labels().size());
+    ASSERT_EQ(0UL, md.count_stats());
+    ASSERT_FALSE(md.has_stats(make_key("Echo", "ok")));
+
+    bvar::Adder<int>* s1 = md.get_stats(make_key("Echo", "ok"));
+    ASSERT_TRUE(s1 != NULL);
+    ASSERT_EQ(s1, md.get_stats(make_key("Echo", "ok")));
+    bvar::Adder<int>* s2 = md.get_stats(make_key("Echo", "fail"));
+    ASSERT_TRUE(s2 != NULL);
+    ASSERT_NE(s1, s2);
+    ASSERT_EQ(2UL, md.count_stats());
+    ASSERT_TRUE(md.has_stats(make_key("Echo", "ok")));
+
+    // Number of values does not match.
+    std::vector<std::string> bad_key;
+    bad_key.push_back("Echo");
+    ASSERT_TRUE(md.get_stats(bad_key) == NULL);
+
+    *s1 << 1 << 2;
+    *s2 << 3;
+    ASSERT_EQ(3, md.get_stats(make_key("Echo", "ok"))->get_value());
+    ASSERT_EQ(3, md.get_stats(make_key("Echo", "fail"))->get_value());
+
+    std::vector<std::vector<std::string> > keys;
+    md.list_stats(&keys);
+    ASSERT_EQ(2UL, keys.size());
+
+    md.delete_stats(make_key("Echo", "ok"));
+    ASSERT_EQ(1UL, md.count_stats());
+    ASSERT_FALSE(md.has_stats(make_key("Echo", "ok")));
+    md.clear_stats();
+    ASSERT_EQ(0UL, md.count_stats());
+}
+
+static bvar::MultiDimension<bvar::Adder<int64_t> >* g_md = NULL;
+const int OPS_PER_THREAD = 10000;
+
+static void* add_stats(void* arg) {
+    const std::string method = (const char*)arg;
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        *g_md->get_stats(make_key(method.c_str(), (i % 2 ? "ok" : "fail")))
+            << 1;
+    }
+    return NULL;
+}
+
+TEST_F(MultiDimensionTest, multi_threaded) {
+    bvar::MultiDimension<bvar::Adder<int64_t> > md(labels());
+    g_md = &md;
+    const char* methods[] = { "Echo", "Echo", "Get", "Get", "Set", "Set" };
+    pthread_t th[arraysize(methods)];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_stats,
+                                    (void*)methods[i]));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(6UL, md.count_stats());
+    ASSERT_EQ(OPS_PER_THREAD,
+              md.get_stats(make_key("Echo", "ok"))->get_value());
+    ASSERT_EQ(OPS_PER_THREAD,
+              md.get_stats(make_key("Set", "fail"))->get_value());
+    g_md = NULL;
+}
+
+TEST_F(MultiDimensionTest, overflow) {
+    const int32_t saved = bvar::FLAGS_bvar_max_multi_dimension_stats_count;
+    bvar::FLAGS_bvar_max_multi_dimension_stats_count = 2;
+    bvar::MultiDimension<bvar::Adder<int> > md(labels());
+    bvar::Adder<int>* s1 = md.get_stats(make_key("a", "ok"));
+    bvar::Adder<int>* s2 = md.get_stats(make_key("b", "ok"));
+    bvar::Adder<int>* s3 = md.get_stats(make_key("c", "ok"));
+    bvar::Adder<int>* s4 = md.get_stats(make_key("d", "ok"));
+    ASSERT_NE(s1, s2);
+    ASSERT_NE(s2, s3);
+    ASSERT_EQ(s3, s4);
+    ASSERT_EQ(s3, md.get_stats(make_key("__overflow__", "__overflow__")));
+    ASSERT_EQ(3UL, md.count_stats());
+    // Existing stats are still accessible.
+    ASSERT_EQ(s1, md.get_stats(make_key("a", "ok")));
+    bvar::FLAGS_bvar_max_multi_dimension_stats_count = saved;
+}
+
+TEST_F(MultiDimensionTest, expose_and_dump) {
+    bvar::MultiDimension<bvar::Adder<int> > md("Foo", labels());
+    ASSERT_EQ("foo", md.name());
+    ASSERT_EQ(1UL, bvar::MVariable::count_exposed());
+    bvar::MultiDimension<bvar::Adder<int> > md2("foo", labels());
+    ASSERT_TRUE(md2.name().empty());
+    ASSERT_EQ(1UL, bvar::MVariable::count_exposed());
+
+    *md.get_stats(make_key("Get", "ok")) << 2;
+    *md.get_stats(make_key("Echo", "a\"b")) << 1;
+    StringDumper dumper;
+    ASSERT_EQ(2, bvar::MVariable::dump_exposed(&dumper, NULL));
+    ASSERT_EQ("foo{method=\"Echo\",status=\"a\\\"b\"} 1\n"
+              "foo{method=\"Get\",status=\"ok\"} 2\n", dumper.result);
+
+    bvar::MultiDimension<bvar::LatencyRecorder> md3("bar", labels());
+    *md3.get_stats(make_key("Get", "ok")) << 10;
+    StringDumper dumper2;
+    ASSERT_EQ(4, md3.dump(&dumper2, NULL));
+    ASSERT_EQ(0U, dumper2.result.find("bar_latency{method=\"Get\",status=\"ok\"} "));
+    ASSERT_NE(std::string::npos, dumper2.result.find(
+                  "bar_count{method=\"Get\",status=\"ok\"} 1\n"));
+
+    std::vector<std::string> names;
+    bvar::MVariable::list_exposed(&names);
+    ASSERT_EQ(2UL, names.size());
+    ASSERT_EQ("bar", names[0]);
+    ASSERT_EQ("foo", names[1]);
+    ASSERT_TRUE(md.hide());
+    ASSERT_FALSE(md.hide());
+    ASSERT_EQ(1UL, bvar::MVariable::count_exposed());
+}
+
+}  // namespace
@@ -136,4 +136,21 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+
+TEST(SamplerTest, sampling_interval) {
+    DebugSampler* s1 = new DebugSampler;
+    DebugSampler* s3 = new DebugSampler;
+    ASSERT_EQ(-1, s3->set_sampling_interval(0));
+    ASSERT_EQ(-1, s3->set_sampling_interval(
+                      bvar::detail::MAX_SAMPLING_INTERVAL + 1));
+    ASSERT_EQ(0, s3->set_sampling_interval(3));
+    s1->schedule();
+    s3->schedule();
+    usleep(3500000);
+    ASSERT_LE(3, s1->called_count());
+    ASSERT_LE(1, s3->called_count());
+    ASSERT_GE(2, s3->called_count());
+    s1->destroy();
+    s3->destroy();
+}
 } // namespace
@@ -311,6 +311,58 @@ TEST_F(VariableTest, dump) {
     ASSERT_EQ(0UL, d._list.size());
 }
 
+class MyNumericDumper : public bvar::NumericDumper {
+public:
+    bool dump(const std::string& name, double value) {
+        _list.push_back(std::make_pair(name, value));
+        return true;
+    }
+
+    std::vector<std::pair<std::string, double> > _list;
+};
+
+TEST_F(VariableTest, dump_numeric) {
+    MyNumericDumper d;
+    ASSERT_EQ(0, bvar::Variable::dump_exposed_numeric(&d, NULL));
+
+    bvar::Adder<int> v1("var1");
+    v1 << 2;
+    bvar::Status<double> v2("var2", 1.5);
+    bvar::Status<std::string> v3("var3", "hello");
+    bvar::BasicPassiveStatus<int> v4("var4", print_int, NULL);
+    bvar::IntRecorder v5;
+    v5 << 1 << 2;
+    ASSERT_EQ(0, v5.expose("var5"));
+    bvar::Adder<int64_t> v6("var6");
+    v6 << 6;
+    bvar::Window<bvar::Adder<int64_t> > v7("var7", &v6, 1);
+
+    double value = 0;
+    ASSERT_EQ(0, bvar::Variable::get_numeric_exposed("var1", &value));
+    ASSERT_EQ(2, value);
+    ASSERT_EQ(-1, bvar::Variable::get_numeric_exposed("var3", &value));
+    ASSERT_EQ(-1, bvar::Variable::get_numeric_exposed("not_exist", &value));
+
+    ASSERT_EQ(6, bvar::Variable::dump_exposed_numeric(&d, NULL));
+    ASSERT_EQ(6UL, d._list.size());
+    ASSERT_EQ("var1", d._list[0].first);
+    ASSERT_EQ(2, d._list[0].second);
+    ASSERT_EQ("var2", d._list[1].first);
+    ASSERT_EQ(1.5, d._list[1].second);
+    ASSERT_EQ("var4", d._list[2].first);
+    ASSERT_EQ(5, d._list[2].second);
+    ASSERT_EQ("var5", d._list[3].first);
+    ASSERT_EQ(1.5, d._list[3].second);
+    ASSERT_EQ("var6", d._list[4].first);
+    ASSERT_EQ(6, d._list[4].second);
+
+    d._list.clear();
+    bvar::DumpOptions opts;
+    opts.white_wildcards = "var7";
+    ASSERT_EQ(1, bvar::Variable::dump_exposed_numeric(&d, &opts));
+    ASSERT_EQ("var7", d._list[0].first);
+}
+
 TEST_F(VariableTest, latency_recorder) {
     bvar::LatencyRecorder rec;
     rec << 1 << 2 << 3;